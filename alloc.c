@@ -0,0 +1,123 @@
+#include "alloc.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef VAAT_COUNT_ALLOCATIONS
+
+// glibc's own entry points, so the overrides below can forward without dlsym (which allocates itself)
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * pointer, size_t size);
+extern void * __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void * pointer);
+
+// Initial-exec TLS in the executable, so touching it never allocates
+static __thread struct AllocCounts allocThreadCounts;
+static atomic_uint_fast64_t allocTotalAllocs;
+static atomic_uint_fast64_t allocTotalFrees;
+static atomic_uint_fast64_t allocTotalBytes;
+
+static inline void allocCountAlloc(size_t size)
+{
+    ++allocThreadCounts.allocs;
+    allocThreadCounts.bytes += size;
+    atomic_fetch_add_explicit(&allocTotalAllocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocTotalBytes, size, memory_order_relaxed);
+}
+
+static inline void allocCountFree(void * pointer)
+{
+    if (pointer) {
+        ++allocThreadCounts.frees;
+        atomic_fetch_add_explicit(&allocTotalFrees, 1, memory_order_relaxed);
+    }
+}
+
+void * malloc(size_t size)
+{
+    allocCountAlloc(size);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size)
+{
+    allocCountAlloc(count * size);
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * pointer, size_t size)
+{
+    allocCountAlloc(size);
+    return __libc_realloc(pointer, size);
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+    allocCountAlloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+    allocCountAlloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void ** pointer, size_t alignment, size_t size)
+{
+    if ((alignment < sizeof(void *)) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    allocCountAlloc(size);
+    void * result = __libc_memalign(alignment, size);
+    if (!result) {
+        return ENOMEM;
+    }
+    *pointer = result;
+    return 0;
+}
+
+void free(void * pointer)
+{
+    allocCountFree(pointer);
+    __libc_free(pointer);
+}
+
+int allocCountingEnabled(void)
+{
+    return 1;
+}
+
+void allocGetThreadCounts(struct AllocCounts * counts)
+{
+    *counts = allocThreadCounts;
+}
+
+void allocGetTotalCounts(struct AllocCounts * counts)
+{
+    counts->allocs = atomic_load_explicit(&allocTotalAllocs, memory_order_relaxed);
+    counts->frees = atomic_load_explicit(&allocTotalFrees, memory_order_relaxed);
+    counts->bytes = atomic_load_explicit(&allocTotalBytes, memory_order_relaxed);
+}
+
+#else
+
+int allocCountingEnabled(void)
+{
+    return 0;
+}
+
+void allocGetThreadCounts(struct AllocCounts * counts)
+{
+    memset(counts, 0, sizeof(struct AllocCounts));
+}
+
+void allocGetTotalCounts(struct AllocCounts * counts)
+{
+    memset(counts, 0, sizeof(struct AllocCounts));
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef VAAT_ALLOC_H
+#define VAAT_ALLOC_H
+
+#include <stdint.h>
+
+// Heap activity, counted by malloc/free overrides when built with VAAT_COUNT_ALLOCATIONS
+struct AllocCounts
+{
+    uint64_t allocs; // malloc, calloc, realloc and the aligned variants
+    uint64_t frees;
+    uint64_t bytes; // requested, not freed
+};
+
+// returns non-zero if the overrides are compiled in; otherwise every count stays 0
+int allocCountingEnabled(void);
+
+// counts for the calling thread only, so a frame path can be measured while other threads allocate
+void allocGetThreadCounts(struct AllocCounts * counts);
+void allocGetTotalCounts(struct AllocCounts * counts);
+
+#endif
@@ -1,14 +1,24 @@
 #include "app.h"
 
+#include "alloc.h"
+#include "capture.h"
+#include "control.h"
 #include "gfx.h"
+#include "log.h"
+#include "loop.h"
 #include "player.h"
+#include "shm.h"
+#include "stats.h"
 #include "util.h"
 
 #include <gst/gst.h>
 
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <wayland-client.h>
@@ -38,27 +48,64 @@ static const struct xdg_toplevel_listener xdgToplevelListener = {
     xdgToplevelWMCapabilities,
 };
 
+static int appHandleControl(void * userData, int argc, char ** argv, char * reply, size_t replySize);
+
 // --------------------------------------------------------------------------------------
 // app
 
+#define APP_MAX_SOURCES 64
+
+struct AppOptions
+{
+    int reactor; // run everything on one thread from an epoll loop instead of the gmain/dispatch threads
+    int quality; // fixed enum GfxQuality, or -1 for the adaptive governor
+    int benchmarkFrames; // present this many frames after warm-up, report and exit
+    const char * sources[APP_MAX_SOURCES]; // H.264 elementary streams played in order; none for the default test clip
+    int sourceCount;
+    int loop; // start over after the last source
+    int frameCacheMb; // converted frames of a looping clip kept to repeat without decoding, 0 for none
+    int gopCacheMb; // decoded frames kept by accurate seeks for scrubbing, 0 for none
+    const char * decoder; // NULL for the default hardware decoder
+    int queueDepth; // decoded frames that may wait for the renderer
+    int dropPolicy; // enum PlayerDropPolicy
+    int shm; // present through wl_shm even if EGL works
+    int headless; // no Wayland; render offscreen on EGL's surfaceless platform
+    struct CaptureConfig capture; // path is NULL when not capturing
+    const char * statsPath; // Unix socket serving metrics, NULL for none
+    const char * controlPath; // Unix socket taking commands, NULL for none
+
+    // Rendering and presentation stay on their own CPUs; everything else runs on the workers'
+    struct TaskConfig renderConfig;
+    struct TaskConfig workerConfig;
+};
+
 struct App
 {
+    struct AppOptions options;
+
     // Connection
     struct wl_display * display;
     struct wl_registry * registry;
 
     // Interfaces
     struct wl_compositor * interfaceCompositor;
+    struct wl_shm * interfaceShm;
     struct wp_viewporter * interfaceViewporter;
     struct xdg_wm_base * interfaceWmBase;
 
     // Objects
     struct wl_surface * surface;
+    struct wp_viewport * viewport;
     struct xdg_surface * xdgSurface;
     struct xdg_toplevel * xdgToplevel;
 
-    struct Gfx * gfx;
+    struct Gfx * gfx; // exactly one of gfx and shm
+    struct Shm * shm;
     struct Player * player;
+    struct TaskPool * workers; // background jobs
+    struct Capture * capture;
+    guint64 captureUntil; // frames presented when a capture started from the control socket stops, 0 for never
+    struct Control * control;
 
     int dispatchRunning;
     struct Task * dispatchThread;
@@ -66,29 +113,40 @@ struct App
     // state
     uint32_t width;
     uint32_t height;
+
+    // size requested by xdg_toplevel.configure, applied by the render loop
+    pthread_mutex_t configureMutex;
+    uint32_t configuredWidth;
+    uint32_t configuredHeight;
 };
 
 static void appDispatchThread(struct App * app)
 {
-    printf("appDispatchThread(): dispatch start\n");
+    LOG_DEBUG("appDispatchThread(): dispatch start");
 
     int ret = 0;
     while (app->dispatchRunning && (ret != -1)) {
         ret = wl_display_dispatch(app->display);
 
-        printf("appDispatchThread(): dispatch loop\n");
+        LOG_TRACE("appDispatchThread(): dispatch loop");
     }
 
-    printf("appDispatchThread(): dispatch end\n");
+    LOG_DEBUG("appDispatchThread(): dispatch end");
 }
 
-struct App * appCreate()
+// Same pipeline and renderer with nothing to present to, e.g. for benchmarking on a build machine
+static void appCreateHeadless(struct App * app)
 {
-    struct App * app = calloc(1, sizeof(struct App));
-
-    app->width = 3840;
-    app->height = 2160;
+    app->gfx = gfxCreate(NULL, NULL, NULL, app->width, app->height, app->player);
+    if (!app->gfx) {
+        fatal("EGL's surfaceless platform isn't available");
+    }
+    gfxSetQuality(app->gfx, app->options.quality);
+    gfxSetFrameCache(app->gfx, (size_t)app->options.frameCacheMb << 20);
+}
 
+static void appCreateWindow(struct App * app)
+{
     app->display = wl_display_connect(NULL);
     app->registry = wl_display_get_registry(app->display);
     wl_registry_add_listener(app->registry, &registryListener, app);
@@ -110,6 +168,8 @@ struct App * appCreate()
         fatal("wl_compositor_create_surface() failed");
     }
 
+    app->viewport = wp_viewporter_get_viewport(app->interfaceViewporter, app->surface);
+
     app->xdgSurface = xdg_wm_base_get_xdg_surface(app->interfaceWmBase, app->surface);
     xdg_surface_add_listener(app->xdgSurface, &xdgSurfaceListener, app);
     if (!app->xdgSurface) {
@@ -126,25 +186,314 @@ struct App * appCreate()
 
     wl_display_roundtrip(app->display);
 
-    app->player = playerCreate();
-    app->gfx = gfxCreate(app->display, app->surface, app->width, app->height, app->player);
+    if (!app->options.shm) {
+        app->gfx = gfxCreate(app->display, app->surface, app->viewport, app->width, app->height, app->player);
+    }
+    if (app->gfx) {
+        gfxSetQuality(app->gfx, app->options.quality);
+        gfxSetFrameCache(app->gfx, (size_t)app->options.frameCacheMb << 20);
+    } else {
+        if (!app->interfaceShm) {
+            fatal("Wayland didn't provide wl_shm, and EGL isn't available");
+        }
+        LOG_INFO("presenting through wl_shm");
+        if (app->options.frameCacheMb) {
+            LOG_WARN("frame cache: not supported when presenting through wl_shm");
+        }
+        app->shm = shmCreate(app->display, app->interfaceShm, app->surface, app->viewport, app->width, app->height, app->player, app->workers);
+    }
+}
+
+struct App * appCreate(const struct AppOptions * options)
+{
+    struct App * app = calloc(1, sizeof(struct App));
+    app->options = *options;
+
+    app->width = 3840;
+    app->height = 2160;
+    pthread_mutex_init(&app->configureMutex, NULL);
+
+    struct TaskConfig workerConfig = app->options.workerConfig;
+    workerConfig.name = "vaat-worker";
+    app->workers = taskPoolCreate(&workerConfig, 2, 64);
+
+    app->player = playerCreate(app->options.sources[0], app->options.decoder, app->workers);
+    playerSetStreamingConfig(app->player, &app->options.workerConfig);
+    playerSetQueue(app->player, app->options.queueDepth, app->options.dropPolicy);
+    playerSetGopCache(app->player, (size_t)app->options.gopCacheMb << 20);
+    if ((app->options.sourceCount > 1) || app->options.loop) {
+        static const char * const defaultSources[] = { PLAYER_DEFAULT_LOCATION };
+        int count = app->options.sourceCount;
+        playerSetPlaylist(app->player, count ? app->options.sources : defaultSources, count ? count : 1, app->options.loop, 0);
+    }
+
+    if (app->options.headless) {
+        appCreateHeadless(app);
+    } else {
+        appCreateWindow(app);
+    }
+
+    if (app->options.capture.path && !app->gfx) {
+        LOG_WARN("capture: not supported when presenting through wl_shm");
+    } else if (app->options.capture.path) {
+        app->capture = captureCreate(&app->options.capture, app->workers);
+        if (!app->capture) {
+            fatal("Can't open the capture output");
+        }
+        gfxSetCapture(app->gfx, app->capture);
+    }
+    if (!app->options.reactor) {
+        playerWatchBus(app->player); // dispatched by gmainThread
+    }
+    playerStart(app->player);
+
+    if (app->options.controlPath) {
+        app->control = controlCreate(app->options.controlPath, &app->options.workerConfig, appHandleControl, app);
+        if (!app->control) {
+            fatal("Can't listen on the control socket");
+        }
+    }
+
+    if (app->options.headless) {
+        return app;
+    }
 
     wl_surface_commit(app->surface);
 
-    app->dispatchRunning = 1;
-    app->dispatchThread = taskCreate((TaskFunc)appDispatchThread, app);
+    // The reactor reads the display itself
+    if (!app->options.reactor) {
+        app->dispatchRunning = 1;
+        struct TaskConfig dispatchConfig = app->options.renderConfig; // delivers presentation events
+        dispatchConfig.name = "vaat-wayland";
+        app->dispatchThread = taskCreateWithConfig(&dispatchConfig, (TaskFunc)appDispatchThread, app);
+    }
     return app;
 }
 
-void appDestroy(struct App * app)
+// Hands over the frames still being read back and waits for them to be written
+static void appStopCapture(struct App * app)
 {
-    // TODO: implement
+    if (!app->capture)
+        return;
+
+    gfxSetCapture(app->gfx, NULL);
+    captureDestroy(app->capture);
+    app->capture = NULL;
+    app->captureUntil = 0;
+}
 
+void appDestroy(struct App * app)
+{
+    // The renderer gives its sample back before the player goes
+    appStopCapture(app);
+    gfxDestroy(app->gfx);
+    app->gfx = NULL;
+    shmDestroy(app->shm);
+    app->shm = NULL;
+    playerDestroy(app->player);
+    app->player = NULL;
+    taskPoolDestroy(app->workers); // runs the pipeline teardowns still queued
+    app->workers = NULL;
+
+    // TODO: the Wayland objects, once the dispatch thread can be woken out of wl_display_dispatch()
     // app->dispatchRunning = 0;
     // taskDestroy(app->dispatchThread);
     // free(app);
 }
 
+// --------------------------------------------------------------------------------------
+// Control: commands from the control socket, run on the render thread between two frames
+
+static int appParseDropPolicy(const char * name)
+{
+    if (!strcmp(name, "oldest")) {
+        return PLAYER_DROP_OLDEST;
+    }
+    if (!strcmp(name, "none")) {
+        return PLAYER_DROP_NONE;
+    }
+    return -1;
+}
+
+static int appControlCapture(struct App * app, int argc, char ** argv, char * reply, size_t replySize)
+{
+    if (!app->gfx) {
+        snprintf(reply, replySize, "capture needs EGL");
+        return 0;
+    }
+    appStopCapture(app);
+    if (!strcmp(argv[1], "stop")) {
+        return 1;
+    }
+
+    struct CaptureConfig config = app->options.capture;
+    config.path = argv[1];
+    if ((argc > 2) && ((config.format = captureParseFormat(argv[2])) < 0)) {
+        snprintf(reply, replySize, "unknown format %s", argv[2]);
+        return 0;
+    }
+    int frames = (argc > 3) ? atoi(argv[3]) : 0;
+
+    app->capture = captureCreate(&config, app->workers);
+    if (!app->capture) {
+        snprintf(reply, replySize, "can't open %s", config.path);
+        return 0;
+    }
+    gfxSetCapture(app->gfx, app->capture);
+    if (frames > 0) {
+        struct PlayerStats stats;
+        playerGetStats(app->player, &stats);
+        app->captureUntil = stats.framesPresented + (guint64)frames;
+    }
+    return 1;
+}
+
+// seek FRAME|+N|-N [keyframe|accurate], relative to the frame on screen
+static int appControlSeek(struct App * app, int argc, char ** argv, char * reply, size_t replySize)
+{
+    int mode = PLAYER_SEEK_ACCURATE;
+    if ((argc > 2) && strcmp(argv[2], "accurate")) {
+        if (strcmp(argv[2], "keyframe")) {
+            snprintf(reply, replySize, "unknown seek mode %s", argv[2]);
+            return 0;
+        }
+        mode = PLAYER_SEEK_KEYFRAME;
+    }
+
+    long long frame = atoll(argv[1]);
+    if ((argv[1][0] == '+') || (argv[1][0] == '-')) {
+        uint32_t current = playerGetFrame(app->player);
+        if (current == PLAYER_FRAME_NONE) {
+            snprintf(reply, replySize, "the frame on screen isn't known, seek to a frame first");
+            return 0;
+        }
+        frame += current;
+    }
+    frame = (frame < 0) ? 0 : (frame > (long long)PLAYER_FRAME_NONE - 1) ? (long long)PLAYER_FRAME_NONE - 1 : frame;
+
+    if (!playerSeek(app->player, (uint32_t)frame, mode)) {
+        snprintf(reply, replySize, "can't seek");
+        return 0;
+    }
+    return 1;
+}
+
+static int appHandleControl(void * userData, int argc, char ** argv, char * reply, size_t replySize)
+{
+    struct App * app = (struct App *)userData;
+    const char * command = argv[0];
+
+    if ((!strcmp(command, "source") || !strcmp(command, "prepare")) && (argc == 2)) {
+        // prepare only prerolls it, for a later switch
+        int prepared;
+        if (!strcmp(command, "source")) {
+            prepared = playerSetSource(app->player, argv[1], NULL);
+        } else {
+            prepared = playerPrepare(app->player, argv[1], NULL);
+        }
+        if (!prepared) {
+            snprintf(reply, replySize, "can't play %s", argv[1]);
+            return 0;
+        }
+        // The swap waits for its first frame, so it hasn't happened yet
+        snprintf(reply, replySize, !strcmp(command, "source") ? "prepared, switching at its first frame" : "prepared");
+        return 1;
+    }
+    if (!strcmp(command, "playlist") && (argc >= 3) && (!strcmp(argv[1], "loop") || !strcmp(argv[1], "once"))) {
+        if (!playerSetPlaylist(app->player, (const char * const *)argv + 2, argc - 2, !strcmp(argv[1], "loop"), -1)) {
+            snprintf(reply, replySize, "can't play %s", argv[2]);
+            return 0;
+        }
+        snprintf(reply, replySize, "prepared, switching at its first frame");
+        return 1;
+    }
+    if (!strcmp(command, "switch") && (argc == 1)) {
+        if (!playerSwitch(app->player)) {
+            snprintf(reply, replySize, "nothing prepared");
+            return 0;
+        }
+        snprintf(reply, replySize, "switching at its first frame");
+        return 1;
+    }
+    if (!strcmp(command, "decoder") && (argc >= 2)) {
+        // The rest of the line, so it can be a whole element description
+        char decoder[512] = "";
+        for (int arg = 1; arg < argc; ++arg) {
+            size_t length = strlen(decoder);
+            snprintf(decoder + length, sizeof(decoder) - length, "%s%s", (arg > 1) ? " " : "", argv[arg]);
+        }
+        if (!playerSetSource(app->player, NULL, strcmp(decoder, "default") ? decoder : "")) {
+            snprintf(reply, replySize, "can't decode with %s", decoder);
+            return 0;
+        }
+        snprintf(reply, replySize, "prepared, switching at its first frame");
+        return 1;
+    }
+    if (!strcmp(command, "queue-depth") && (argc == 2) && (atoi(argv[1]) >= 1) && (atoi(argv[1]) <= PLAYER_MAX_QUEUE_DEPTH)) {
+        app->options.queueDepth = atoi(argv[1]);
+        playerSetQueue(app->player, app->options.queueDepth, app->options.dropPolicy);
+        return 1;
+    }
+    if (!strcmp(command, "drop-policy") && (argc == 2) && (appParseDropPolicy(argv[1]) >= 0)) {
+        app->options.dropPolicy = appParseDropPolicy(argv[1]);
+        playerSetQueue(app->player, app->options.queueDepth, app->options.dropPolicy);
+        return 1;
+    }
+    if (!strcmp(command, "stats") && (argc == 2) && (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+        statsSetEnabled(!strcmp(argv[1], "on"));
+        return 1;
+    }
+    if (!strcmp(command, "quality") && (argc == 2)) {
+        if (!app->gfx) {
+            snprintf(reply, replySize, "wl_shm has no quality levels");
+            return 0;
+        }
+        app->options.quality = strcmp(argv[1], "auto") ? atoi(argv[1]) : -1;
+        gfxSetQuality(app->gfx, app->options.quality);
+        return 1;
+    }
+    if (!strcmp(command, "frame-cache") && (argc == 2) && (!strcmp(argv[1], "off") || (atoi(argv[1]) > 0))) {
+        if (!app->gfx) {
+            snprintf(reply, replySize, "wl_shm has no frame cache");
+            return 0;
+        }
+        app->options.frameCacheMb = strcmp(argv[1], "off") ? atoi(argv[1]) : 0;
+        gfxSetFrameCache(app->gfx, (size_t)app->options.frameCacheMb << 20);
+        return 1;
+    }
+    if (!strcmp(command, "seek") && (argc >= 2) && (argc <= 3)) {
+        return appControlSeek(app, argc, argv, reply, replySize);
+    }
+    if (!strcmp(command, "gop-cache") && (argc == 2) && (!strcmp(argv[1], "off") || (atoi(argv[1]) > 0))) {
+        app->options.gopCacheMb = strcmp(argv[1], "off") ? atoi(argv[1]) : 0;
+        playerSetGopCache(app->player, (size_t)app->options.gopCacheMb << 20);
+        return 1;
+    }
+    if (!strcmp(command, "rate") && (argc == 2)) {
+        if (!playerSetRate(app->player, atof(argv[1]))) {
+            snprintf(reply, replySize, "can't play at rate %s", argv[1]);
+            return 0;
+        }
+        return 1;
+    }
+    if (!strcmp(command, "capture") && (argc >= 2) && (argc <= 4)) {
+        return appControlCapture(app, argc, argv, reply, replySize);
+    }
+    if (!strcmp(command, "help")) {
+        snprintf(reply,
+                 replySize,
+                 "source PATH | prepare PATH | switch | playlist loop|once PATH... | decoder NAME...|default | queue-depth 1-%d | drop-policy oldest|none | stats on|off | "
+                 "quality N|auto | frame-cache MB|off | seek FRAME|+N|-N [keyframe|accurate] | gop-cache MB|off | "
+                 "rate -%g..%g, negative backwards | capture PATH [FORMAT [FRAMES]] | capture stop",
+                 PLAYER_MAX_QUEUE_DEPTH,
+                 PLAYER_MAX_RATE,
+                 PLAYER_MAX_RATE);
+        return 1;
+    }
+    snprintf(reply, replySize, "unknown command or arguments, try help");
+    return 0;
+}
+
 // --------------------------------------------------------------------------------------
 // Listener: xdg_wm_base_listener
 
@@ -170,6 +519,15 @@ static void xdgSurfaceConfigure(void * data, struct xdg_surface * surface, uint3
 
 static void xdgToplevelConfigure(void * data, struct xdg_toplevel * toplevel, int32_t width, int32_t height, struct wl_array * states)
 {
+    struct App * app = (struct App *)data;
+
+    // 0x0 means the compositor leaves the size up to us
+    if ((width > 0) && (height > 0)) {
+        pthread_mutex_lock(&app->configureMutex);
+        app->configuredWidth = (uint32_t)width;
+        app->configuredHeight = (uint32_t)height;
+        pthread_mutex_unlock(&app->configureMutex);
+    }
 }
 
 static void xdgToplevelClose(void * data, struct xdg_toplevel * xdg_toplevel)
@@ -192,11 +550,13 @@ static void appRegisterGlobal(void * data, struct wl_registry * registry, uint32
 {
     struct App * app = (struct App *)data;
 
-    printf("appRegisterGlobal: %s [%u]\n", interface, version);
+    LOG_DEBUG("appRegisterGlobal: %s [%u]", interface, version);
 
     if (strcmp(interface, "wl_compositor") == 0) {
         app->interfaceCompositor = (struct wl_compositor *)wl_registry_bind(registry, name, &wl_compositor_interface, 4);
 
+    } else if (strcmp(interface, "wl_shm") == 0) {
+        app->interfaceShm = (struct wl_shm *)wl_registry_bind(registry, name, &wl_shm_interface, 1);
     } else if (strcmp(interface, "wp_viewporter") == 0) {
         app->interfaceViewporter = (struct wp_viewporter *)wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
     } else if (strcmp(interface, "xdg_wm_base") == 0) {
@@ -213,28 +573,399 @@ static void appRegisterRemove(void * data, struct wl_registry * registry, uint32
 
 static void gmainThread(void * ignored)
 {
-    printf("gmainThread begin\n");
+    LOG_DEBUG("gmainThread begin");
 
     GMainLoop * mainLoop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(mainLoop);
 
-    printf("gmainThread end\n");
+    LOG_DEBUG("gmainThread end");
+}
+
+// --------------------------------------------------------------------------------------
+
+static void appApplyConfigure(struct App * app)
+{
+    pthread_mutex_lock(&app->configureMutex);
+    uint32_t width = app->configuredWidth;
+    uint32_t height = app->configuredHeight;
+    pthread_mutex_unlock(&app->configureMutex);
+
+    if ((width == 0) || (height == 0) || ((width == app->width) && (height == app->height))) {
+        return;
+    }
+
+    LOG_INFO("resizing to %ux%u", width, height);
+    app->width = width;
+    app->height = height;
+    if (app->gfx) {
+        gfxResize(app->gfx, (int)width, (int)height);
+    } else {
+        shmResize(app->shm, (int)width, (int)height);
+    }
+}
+
+// returns non-zero if a frame was presented
+static int appRender(struct App * app)
+{
+    return app->gfx ? gfxRender(app->gfx) : shmRender(app->shm);
+}
+
+static void appRenderFrame(struct App * app)
+{
+    if (app->control) {
+        controlDispatch(app->control);
+    }
+    appApplyConfigure(app);
+    if (appRender(app)) {
+        LOG_TRACE("rendering graphics...");
+    }
+    if (app->captureUntil) {
+        struct PlayerStats stats;
+        playerGetStats(app->player, &stats);
+        if (stats.framesPresented >= app->captureUntil) {
+            appStopCapture(app);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------------------
+// Reactor: Wayland, the pipeline bus, new samples and a frame tick all multiplexed on this thread
+
+static void appRunReactor(struct App * app)
+{
+    struct Loop * loop = loopCreate();
+
+    int displayFd = wl_display_get_fd(app->display);
+    loopAddFd(loop, displayFd, NULL, NULL); // read between prepare_read/read_events below
+    loopAddFd(loop, playerGetSampleFd(app->player), (LoopFunc)appRenderFrame, app);
+    loopAddFd(loop, playerGetBusFd(app->player), (LoopFunc)playerDispatchBus, app->player);
+    if (app->control) {
+        loopAddFd(loop, controlGetFd(app->control), (LoopFunc)controlDispatch, app->control);
+    }
+    loopAddTimer(loop, 1000000000 / 60, (LoopFunc)appRenderFrame, app);
+
+    for (;;) {
+        // Flush anything already queued (e.g. read by EGL) before claiming the read
+        while (wl_display_prepare_read(app->display) != 0) {
+            wl_display_dispatch_pending(app->display);
+        }
+        wl_display_flush(app->display);
+
+        if (loopWait(loop, -1) < 0) {
+            wl_display_cancel_read(app->display);
+            break;
+        }
+
+        if (loopIsReady(loop, displayFd)) {
+            if (wl_display_read_events(app->display) < 0) {
+                LOG_ERROR("appRunReactor(): lost the Wayland connection");
+                break;
+            }
+        } else {
+            wl_display_cancel_read(app->display);
+        }
+        wl_display_dispatch_pending(app->display);
+
+        // The read is finished, so rendering (and EGL's own dispatching in eglSwapBuffers) is safe here
+        loopDispatch(loop);
+    }
+
+    loopDestroy(loop);
+}
+
+// --------------------------------------------------------------------------------------
+// Benchmark: the frame path must not touch the heap once warmed up
+
+#define APP_BENCHMARK_WARMUP_FRAMES 60 // caps, imports for the decoder's whole pool, governor settling
+#define APP_BENCHMARK_STALL_MS 5000
+
+// The shm backend fills in what it has; it has no quality levels, imports or swaps
+static void appGetRenderStats(struct App * app, struct GfxStats * stats)
+{
+    if (app->gfx) {
+        gfxGetStats(app->gfx, stats);
+        return;
+    }
+
+    struct ShmStats shmStats;
+    shmGetStats(app->shm, &shmStats);
+    memset(stats, 0, sizeof(*stats));
+    stats->framesPresented = shmStats.framesPresented;
+    stats->cpuFrameMs = shmStats.cpuFrameMs;
+}
+
+// CPU time of every thread in the process, decoding included
+static uint64_t appProcessCpuNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+// returns non-zero if the steady state didn't allocate
+static int appRunBenchmark(struct App * app, int frames)
+{
+    struct pollfd pollFd = { playerGetSampleFd(app->player), POLLIN, 0 };
+    struct GfxStats gfxBefore, gfxAfter;
+    struct PlayerStats playerBefore, playerAfter;
+    uint64_t startNs = 0;
+    uint64_t startCpuNs = 0;
+    uint64_t frameAllocs = 0;
+    int presented = 0;
+    int measured = 0;
+
+    // Per stage: waiting for the decoder, then rendering and presenting; a frame may take several rounds
+    uint64_t frameWaitNs = 0;
+    uint64_t frameRenderNs = 0;
+    uint64_t waitNs = 0;
+    uint64_t renderNs = 0;
+
+    while (measured < frames) {
+        uint64_t waitStartNs = timeNowNs();
+        if (poll(&pollFd, 1, APP_BENCHMARK_STALL_MS) <= 0) {
+            LOG_ERROR("benchmark: no frame for %dms after %d presented", APP_BENCHMARK_STALL_MS, presented);
+            return 0;
+        }
+
+        if (app->control) {
+            controlDispatch(app->control); // outside the measured frame path, it may well allocate
+        }
+
+        struct AllocCounts before, after;
+        uint64_t renderStartNs = timeNowNs();
+        allocGetThreadCounts(&before);
+        appApplyConfigure(app);
+        int frameDone = appRender(app);
+        allocGetThreadCounts(&after);
+        frameWaitNs += renderStartNs - waitStartNs;
+        frameRenderNs += timeNowNs() - renderStartNs;
+        if (!frameDone) {
+            continue;
+        }
+
+        if (++presented <= APP_BENCHMARK_WARMUP_FRAMES) {
+            if (presented == APP_BENCHMARK_WARMUP_FRAMES) {
+                appGetRenderStats(app, &gfxBefore);
+                playerGetStats(app->player, &playerBefore);
+                startNs = timeNowNs();
+                startCpuNs = appProcessCpuNs();
+            }
+        } else {
+            frameAllocs += after.allocs - before.allocs;
+            waitNs += frameWaitNs;
+            renderNs += frameRenderNs;
+            ++measured;
+        }
+        frameWaitNs = 0;
+        frameRenderNs = 0;
+    }
+
+    double seconds = (double)(timeNowNs() - startNs) / 1000000000.0;
+    double processCpuMs = (double)(appProcessCpuNs() - startCpuNs) / 1000000.0 / measured;
+    appGetRenderStats(app, &gfxAfter);
+    playerGetStats(app->player, &playerAfter);
+
+    // The driver's allocations inside the swap are reported, but they're not ours to fix
+    unsigned long long swapAllocs = gfxAfter.swapAllocations - gfxBefore.swapAllocations;
+    unsigned long long renderAllocs = frameAllocs - swapAllocs;
+    unsigned long long sampleAllocs = playerAfter.sampleAllocations - playerBefore.sampleAllocations;
+
+    printf("benchmark: frames=%d seconds=%.3f fps=%.2f cpu_ms=%.3f gpu_ms=%.3f wait_ms=%.3f render_ms=%.3f process_cpu_ms=%.3f "
+           "quality=%d dropped=%llu import_hits=%lu import_misses=%lu render_allocs=%llu sample_allocs=%llu swap_allocs=%llu\n",
+           measured,
+           seconds,
+           (seconds > 0.0) ? (double)measured / seconds : 0.0,
+           gfxAfter.cpuFrameMs,
+           gfxAfter.gpuFrameMs,
+           (double)waitNs / 1000000.0 / measured,
+           (double)renderNs / 1000000.0 / measured,
+           processCpuMs,
+           gfxAfter.quality,
+           (unsigned long long)(playerAfter.framesDropped - playerBefore.framesDropped),
+           gfxAfter.importCacheHits - gfxBefore.importCacheHits,
+           gfxAfter.importCacheMisses - gfxBefore.importCacheMisses,
+           renderAllocs,
+           sampleAllocs,
+           swapAllocs);
+
+    if (!allocCountingEnabled()) {
+        LOG_WARN("benchmark: built without VAAT_COUNT_ALLOCATIONS, so allocations weren't counted");
+    }
+    return (renderAllocs == 0) && (sampleAllocs == 0);
 }
 
 // --------------------------------------------------------------------------------------
 
+static void appUsage(const char * argv0)
+{
+    printf("usage: %s [--reactor] [--quality N] [--render-cpus LIST] [--render-priority N] [--worker-cpus LIST] [--benchmark N]\n"
+           "       [--decoder NAME] [--shm] [--headless] [--capture PATH] [--capture-format NAME] [--capture-every N] [--capture-window]\n"
+           "       [--stats PATH] [--source PATH]... [--loop] [--frame-cache MB] [--gop-cache MB]\n"
+           "       [--queue-depth N] [--drop-policy NAME] [--control PATH]\n",
+           argv0);
+    printf("  --reactor              single-threaded epoll event loop\n");
+    printf("  --quality N            fixed render quality, 0 (full) to 3 (compositor scaled); adaptive by default\n");
+    printf("  --render-cpus LIST     pin rendering and presentation to CPUs, e.g. 3 or 2-3\n");
+    printf("  --render-priority N    run rendering and presentation SCHED_FIFO at priority N (1-99)\n");
+    printf("  --worker-cpus LIST     CPUs for decoding and background work; defaults to all but the render CPUs\n");
+    printf("  --benchmark N          present N frames after warm-up, report, and fail if the frame path allocated\n");
+    printf("  --decoder NAME         H.264 decoder element, e.g. avdec_h264 (frames are uploaded from system memory)\n");
+    printf("  --shm                  convert on the CPU and present through wl_shm; the fallback when EGL is unavailable\n");
+    printf("  --headless             no window: render offscreen without a compositor (Mesa's surfaceless EGL)\n");
+    printf("  --capture PATH         read back presented frames and write them to PATH (a file name prefix for png)\n");
+    printf("  --capture-format NAME  raw (RGBA), png, crc32 or xxh64 (one digest line per frame); crc32 by default\n");
+    printf("  --capture-every N      capture every Nth video frame\n");
+    printf("  --capture-window       capture the whole window instead of the video at its own size\n");
+    printf("  --stats PATH           serve metrics over HTTP on a Unix socket: GET /metrics (Prometheus) or /metrics.json\n");
+    printf("  --source PATH          H.264 elementary stream to play; ../test.video.es by default. Repeat for a playlist\n");
+    printf("  --loop                 start over after the last source, seamlessly; a single one loops in its pipeline\n");
+    printf("  --frame-cache MB       repeat a single looping source from up to MB of converted frames, without decoding\n");
+    printf("  --gop-cache MB         keep up to MB of frames decoded by accurate seeks, so scrubbing back to them is instant\n");
+    printf("  --queue-depth N        decoded frames that may wait for the renderer, 1 to %d; 1 by default\n", PLAYER_MAX_QUEUE_DEPTH);
+    printf("  --drop-policy NAME     when that queue is full: oldest (drop it, the default) or none (hold the decoder back)\n");
+    printf("  --control PATH         take commands on a Unix socket, one per line; send help for the list\n");
+}
+
+// Every online CPU that isn't reserved for rendering
+static uint64_t appDefaultWorkerCpus(uint64_t renderCpus)
+{
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t online = (cpuCount >= 64) ? ~0ull : ((1ull << cpuCount) - 1);
+    return online & ~renderCpus; // 0 if nothing is left over, which doesn't restrict them
+}
+
+// SCHED_FIFO priority, 1 to 99
+// returns -1 unless |text| is one
+static int appParsePriority(const char * text)
+{
+    char * end;
+    long priority = strtol(text, &end, 10);
+    return ((end != text) && !*end && (priority >= 1) && (priority <= 99)) ? (int)priority : -1;
+}
+
 int main(int argc, char * argv[])
 {
+    struct AppOptions options = { 0 };
+    options.quality = -1;
+    options.capture.format = CAPTURE_FORMAT_CRC32;
+    options.capture.interval = 1;
+    options.queueDepth = 1;
+    options.dropPolicy = PLAYER_DROP_OLDEST;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--reactor")) {
+            options.reactor = 1;
+        } else if (!strcmp(argv[i], "--quality") && (i + 1 < argc)) {
+            options.quality = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--render-cpus") && (i + 1 < argc) && taskParseCpuList(argv[i + 1], &options.renderConfig.cpuMask)) {
+            ++i;
+        } else if (!strcmp(argv[i], "--render-priority") && (i + 1 < argc) && (appParsePriority(argv[i + 1]) >= 0)) {
+            options.renderConfig.policy = TASK_POLICY_FIFO;
+            options.renderConfig.priority = appParsePriority(argv[++i]);
+        } else if (!strcmp(argv[i], "--benchmark") && (i + 1 < argc)) {
+            options.benchmarkFrames = atoi(argv[++i]);
+            options.reactor = 0; // measures its own loop
+        } else if (!strcmp(argv[i], "--shm")) {
+            options.shm = 1;
+        } else if (!strcmp(argv[i], "--headless")) {
+            options.headless = 1;
+        } else if (!strcmp(argv[i], "--decoder") && (i + 1 < argc)) {
+            options.decoder = argv[++i];
+        } else if (!strcmp(argv[i], "--capture") && (i + 1 < argc)) {
+            options.capture.path = argv[++i];
+        } else if (!strcmp(argv[i], "--capture-format") && (i + 1 < argc) && (captureParseFormat(argv[i + 1]) >= 0)) {
+            options.capture.format = captureParseFormat(argv[++i]);
+        } else if (!strcmp(argv[i], "--capture-every") && (i + 1 < argc)) {
+            options.capture.interval = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--capture-window")) {
+            options.capture.source = CAPTURE_SOURCE_WINDOW;
+        } else if (!strcmp(argv[i], "--stats") && (i + 1 < argc)) {
+            options.statsPath = argv[++i];
+        } else if (!strcmp(argv[i], "--source") && (i + 1 < argc)) {
+            if (options.sourceCount == APP_MAX_SOURCES) {
+                appUsage(argv[0]);
+                return 1;
+            }
+            options.sources[options.sourceCount++] = argv[++i];
+        } else if (!strcmp(argv[i], "--loop")) {
+            options.loop = 1;
+        } else if (!strcmp(argv[i], "--frame-cache") && (i + 1 < argc)) {
+            options.frameCacheMb = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--gop-cache") && (i + 1 < argc)) {
+            options.gopCacheMb = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--queue-depth") && (i + 1 < argc)) {
+            options.queueDepth = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--drop-policy") && (i + 1 < argc) && (appParseDropPolicy(argv[i + 1]) >= 0)) {
+            options.dropPolicy = appParseDropPolicy(argv[++i]);
+        } else if (!strcmp(argv[i], "--control") && (i + 1 < argc)) {
+            options.controlPath = argv[++i];
+        } else if (!strcmp(argv[i], "--worker-cpus") && (i + 1 < argc) && taskParseCpuList(argv[i + 1], &options.workerConfig.cpuMask)) {
+            ++i;
+        } else {
+            appUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.headless) {
+        options.reactor = 0; // multiplexes the Wayland connection
+    }
+    if (options.controlPath && options.benchmarkFrames) {
+        LOG_WARN("control: commands during a benchmark skew its numbers");
+    }
+    if (options.frameCacheMb && options.benchmarkFrames) {
+        options.frameCacheMb = 0; // it measures decoded frames
+        LOG_WARN("frame cache: off while benchmarking");
+    }
+
+    if (options.renderConfig.cpuMask && !options.workerConfig.cpuMask) {
+        options.workerConfig.cpuMask = appDefaultWorkerCpus(options.renderConfig.cpuMask);
+    }
+
+    // Threads created from here on inherit the main thread's CPUs, so the workers' are set explicitly
+    options.renderConfig.name = "vaat-render";
+    taskConfigureCurrent(&options.renderConfig);
+
+    struct TaskConfig logConfig = options.workerConfig;
+    logConfig.name = "vaat-log";
+    logInit(&logConfig);
+
     gst_init(NULL, NULL);
-    taskCreate((TaskFunc)gmainThread, NULL);
+    if (!options.reactor) {
+        struct TaskConfig gmainConfig = options.workerConfig;
+        gmainConfig.name = "vaat-gmain";
+        taskCreateWithConfig(&gmainConfig, (TaskFunc)gmainThread, NULL);
+    }
 
-    struct App * app = appCreate();
-    for (;;) {
-        printf("rendering graphics...\n");
-        gfxRender(app->gfx);
-        usleep(1000000 / 60);
+    struct StatsServer * statsServer = NULL;
+    if (options.statsPath) {
+        statsServer = statsServerCreate(options.statsPath, &options.workerConfig);
+        if (!statsServer) {
+            fatal("Can't listen on the stats socket");
+        }
+    }
+
+    struct App * app = appCreate(&options);
+    if (options.benchmarkFrames > 0) {
+        int passed = appRunBenchmark(app, options.benchmarkFrames);
+        controlDestroy(app->control);
+        appDestroy(app);
+        statsServerDestroy(statsServer);
+        logShutdown();
+        return passed ? 0 : 1;
+    }
+
+    if (options.reactor) {
+        appRunReactor(app);
+    } else {
+        for (;;) {
+            appRenderFrame(app);
+            usleep(1000000 / 60);
+        }
     }
 
+    controlDestroy(app->control);
     appDestroy(app);
+    statsServerDestroy(statsServer);
+    logShutdown();
     return 0;
 }
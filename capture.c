@@ -0,0 +1,509 @@
+#include "capture.h"
+#include "log.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CAPTURE_MAX_PENDING 8 // frames queued or being written; more than that and new ones are dropped
+
+struct CaptureJob
+{
+    struct Capture * capture;
+    struct CaptureFrame * frame;
+    unsigned long sequence;
+};
+
+struct Capture
+{
+    struct CaptureConfig config;
+    char * path;
+    struct TaskPool * workers;
+    FILE * file; // every format but PNG writes into one file
+
+    // Jobs prepare their output in parallel, then take turns by sequence to write it
+    pthread_mutex_t mutex;
+    pthread_cond_t turn;
+    unsigned long submitted; // only touched by the submitting thread
+    unsigned long written;
+    int pending;
+    struct CaptureJob jobs[CAPTURE_MAX_PENDING];
+
+    atomic_ulong dropped;
+};
+
+static const char * captureFormatNames[CAPTURE_FORMAT_COUNT] = { "raw", "png", "crc32", "xxh64" };
+
+// --------------------------------------------------------------------------------------
+// CRC-32 (ISO-HDLC, as used by PNG and zlib)
+
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+static uint32_t crcTable[256];
+
+static void captureCrcInit(void)
+{
+    for (uint32_t index = 0; index < 256; ++index) {
+        uint32_t crc = index;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (0xedb88320u ^ (crc >> 1)) : (crc >> 1);
+        }
+        crcTable[index] = crc;
+    }
+}
+
+uint32_t captureCrc32(uint32_t crc, const uint8_t * data, size_t size)
+{
+    pthread_once(&crcOnce, captureCrcInit);
+    crc = ~crc;
+    for (size_t index = 0; index < size; ++index) {
+        crc = crcTable[(crc ^ data[index]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// --------------------------------------------------------------------------------------
+// XXH64
+
+#define XXH_PRIME64_1 0x9e3779b185ebca87ull
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME64_3 0x165667b19e3779f9ull
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ull
+
+static inline uint64_t captureRotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t captureRead64(const uint8_t * data)
+{
+    uint64_t value = 0;
+    for (int byte = 7; byte >= 0; --byte) {
+        value = (value << 8) | data[byte];
+    }
+    return value;
+}
+
+static inline uint32_t captureRead32(const uint8_t * data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static inline uint64_t captureXxh64Round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    return captureRotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t captureXxh64Merge(uint64_t hash, uint64_t acc)
+{
+    hash ^= captureXxh64Round(0, acc);
+    return (hash * XXH_PRIME64_1) + XXH_PRIME64_4;
+}
+
+void captureXxh64Init(struct CaptureXxh64 * state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->acc[1] = seed + XXH_PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - XXH_PRIME64_1;
+}
+
+static inline void captureXxh64Stripe(struct CaptureXxh64 * state, const uint8_t * stripe)
+{
+    for (int lane = 0; lane < 4; ++lane) {
+        state->acc[lane] = captureXxh64Round(state->acc[lane], captureRead64(stripe + (lane * 8)));
+    }
+}
+
+void captureXxh64Update(struct CaptureXxh64 * state, const uint8_t * data, size_t size)
+{
+    state->total += size;
+
+    if (state->buffered) {
+        size_t fill = 32 - state->buffered;
+        if (size < fill) {
+            memcpy(state->buffer + state->buffered, data, size);
+            state->buffered += (uint32_t)size;
+            return;
+        }
+        memcpy(state->buffer + state->buffered, data, fill);
+        captureXxh64Stripe(state, state->buffer);
+        data += fill;
+        size -= fill;
+        state->buffered = 0;
+    }
+
+    for (; size >= 32; data += 32, size -= 32) {
+        captureXxh64Stripe(state, data);
+    }
+    memcpy(state->buffer, data, size);
+    state->buffered = (uint32_t)size;
+}
+
+uint64_t captureXxh64Final(const struct CaptureXxh64 * state)
+{
+    uint64_t hash;
+    if (state->total >= 32) {
+        hash = captureRotl64(state->acc[0], 1) + captureRotl64(state->acc[1], 7) + captureRotl64(state->acc[2], 12)
+             + captureRotl64(state->acc[3], 18);
+        for (int lane = 0; lane < 4; ++lane) {
+            hash = captureXxh64Merge(hash, state->acc[lane]);
+        }
+    } else {
+        hash = state->acc[2] + XXH_PRIME64_5; // acc[2] is still the seed
+    }
+    hash += state->total;
+
+    const uint8_t * data = state->buffer;
+    uint32_t size = state->buffered;
+    for (; size >= 8; data += 8, size -= 8) {
+        hash ^= captureXxh64Round(0, captureRead64(data));
+        hash = (captureRotl64(hash, 27) * XXH_PRIME64_1) + XXH_PRIME64_4;
+    }
+    if (size >= 4) {
+        hash ^= (uint64_t)captureRead32(data) * XXH_PRIME64_1;
+        hash = (captureRotl64(hash, 23) * XXH_PRIME64_2) + XXH_PRIME64_3;
+        data += 4;
+        size -= 4;
+    }
+    for (; size > 0; ++data, --size) {
+        hash ^= (uint64_t)*data * XXH_PRIME64_5;
+        hash = captureRotl64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// --------------------------------------------------------------------------------------
+// PNG: stored (uncompressed) deflate blocks, so writing is as cheap as a copy and needs no zlib
+
+#define CAPTURE_DEFLATE_BLOCK 65535
+
+// Rows top down, whichever way round they are in memory
+static inline const uint8_t * captureRow(const struct CaptureFrame * frame, int row)
+{
+    int memoryRow = frame->bottomUp ? (frame->height - 1 - row) : row;
+    return frame->pixels + ((size_t)memoryRow * frame->stride);
+}
+
+struct CapturePngWriter
+{
+    FILE * file;
+    uint32_t crc; // of the current chunk
+    uint32_t adlerA;
+    uint32_t adlerB;
+    size_t blockRemaining; // bytes left in the current stored block
+    size_t dataRemaining; // uncompressed bytes left in the stream
+};
+
+static void capturePngPut(struct CapturePngWriter * writer, const uint8_t * data, size_t size)
+{
+    fwrite(data, 1, size, writer->file);
+    writer->crc = captureCrc32(writer->crc, data, size);
+}
+
+static void capturePngPutU32(struct CapturePngWriter * writer, uint32_t value)
+{
+    uint8_t bytes[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+    capturePngPut(writer, bytes, sizeof(bytes));
+}
+
+static void capturePngBeginChunk(struct CapturePngWriter * writer, const char * type, uint32_t size)
+{
+    uint8_t length[4] = { (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size };
+    fwrite(length, 1, sizeof(length), writer->file); // not part of the CRC
+    writer->crc = 0;
+    capturePngPut(writer, (const uint8_t *)type, 4);
+}
+
+static void capturePngEndChunk(struct CapturePngWriter * writer)
+{
+    uint32_t crc = writer->crc;
+    uint8_t bytes[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+    fwrite(bytes, 1, sizeof(bytes), writer->file);
+}
+
+// Appends image data to the zlib stream, starting a new stored block whenever one fills up
+static void capturePngDeflate(struct CapturePngWriter * writer, const uint8_t * data, size_t size)
+{
+    while (size > 0) {
+        if (writer->blockRemaining == 0) {
+            size_t blockSize = (writer->dataRemaining < CAPTURE_DEFLATE_BLOCK) ? writer->dataRemaining : CAPTURE_DEFLATE_BLOCK;
+            int final = (blockSize == writer->dataRemaining);
+            uint8_t header[5] = { (uint8_t)final,
+                                  (uint8_t)blockSize,
+                                  (uint8_t)(blockSize >> 8),
+                                  (uint8_t)~blockSize,
+                                  (uint8_t)(~blockSize >> 8) };
+            capturePngPut(writer, header, sizeof(header));
+            writer->blockRemaining = blockSize;
+        }
+
+        size_t count = (size < writer->blockRemaining) ? size : writer->blockRemaining;
+        capturePngPut(writer, data, count);
+
+        // Adler-32; 5552 bytes is the most that can be summed before the modulo must be taken
+        for (size_t done = 0; done < count;) {
+            size_t run = ((count - done) < 5552) ? (count - done) : 5552;
+            for (size_t index = 0; index < run; ++index) {
+                writer->adlerA += data[done + index];
+                writer->adlerB += writer->adlerA;
+            }
+            writer->adlerA %= 65521;
+            writer->adlerB %= 65521;
+            done += run;
+        }
+
+        writer->blockRemaining -= count;
+        writer->dataRemaining -= count;
+        data += count;
+        size -= count;
+    }
+}
+
+// returns non-zero on success
+static int captureWritePng(const char * path, const struct CaptureFrame * frame)
+{
+    FILE * file = fopen(path, "wb");
+    if (!file) {
+        return 0;
+    }
+
+    struct CapturePngWriter writer = { file, 0, 1, 0, 0, 0 };
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, sizeof(signature), file);
+
+    capturePngBeginChunk(&writer, "IHDR", 13);
+    capturePngPutU32(&writer, (uint32_t)frame->width);
+    capturePngPutU32(&writer, (uint32_t)frame->height);
+    static const uint8_t format[5] = { 8, 6, 0, 0, 0 }; // 8 bit RGBA, deflate, adaptive filtering, no interlace
+    capturePngPut(&writer, format, sizeof(format));
+    capturePngEndChunk(&writer);
+
+    size_t rowBytes = (size_t)frame->width * 4;
+    size_t dataSize = (rowBytes + 1) * frame->height; // every row starts with its filter type
+    size_t blocks = (dataSize + CAPTURE_DEFLATE_BLOCK - 1) / CAPTURE_DEFLATE_BLOCK;
+    capturePngBeginChunk(&writer, "IDAT", (uint32_t)(2 + (blocks * 5) + dataSize + 4));
+    static const uint8_t zlibHeader[2] = { 0x78, 0x01 };
+    capturePngPut(&writer, zlibHeader, sizeof(zlibHeader));
+    writer.dataRemaining = dataSize;
+    for (int row = 0; row < frame->height; ++row) {
+        static const uint8_t filterNone = 0;
+        capturePngDeflate(&writer, &filterNone, 1);
+        capturePngDeflate(&writer, captureRow(frame, row), rowBytes);
+    }
+    capturePngPutU32(&writer, (writer.adlerB << 16) | writer.adlerA);
+    capturePngEndChunk(&writer);
+
+    capturePngBeginChunk(&writer, "IEND", 0);
+    capturePngEndChunk(&writer);
+
+    int ok = !ferror(file);
+    return (fclose(file) == 0) && ok;
+}
+
+// --------------------------------------------------------------------------------------
+
+static void captureJob(void * userData)
+{
+    struct CaptureJob * job = (struct CaptureJob *)userData;
+    struct Capture * capture = job->capture;
+    struct CaptureFrame * frame = job->frame;
+    size_t rowBytes = (size_t)frame->width * 4;
+
+    // Parallel part: everything that doesn't depend on the order of the output
+    char line[192];
+    line[0] = '\0';
+    switch (capture->config.format) {
+        case CAPTURE_FORMAT_PNG: {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s%06lu.png", capture->path, frame->number);
+            if (!captureWritePng(path, frame)) {
+                LOG_ERROR_EVERY(1000, "capture: failed to write %s", path);
+            }
+            break;
+        }
+        case CAPTURE_FORMAT_CRC32:
+        case CAPTURE_FORMAT_XXH64: {
+            uint64_t digest;
+            if (capture->config.format == CAPTURE_FORMAT_CRC32) {
+                uint32_t crc = 0;
+                for (int row = 0; row < frame->height; ++row) {
+                    crc = captureCrc32(crc, captureRow(frame, row), rowBytes);
+                }
+                digest = crc;
+            } else {
+                struct CaptureXxh64 state;
+                captureXxh64Init(&state, 0);
+                for (int row = 0; row < frame->height; ++row) {
+                    captureXxh64Update(&state, captureRow(frame, row), rowBytes);
+                }
+                digest = captureXxh64Final(&state);
+            }
+            snprintf(line,
+                     sizeof(line),
+                     "frame=%lu pts=%.6f size=%dx%d %s=%0*llx\n",
+                     frame->number,
+                     (double)frame->ptsNs / 1000000000.0,
+                     frame->width,
+                     frame->height,
+                     captureFormatNames[capture->config.format],
+                     (capture->config.format == CAPTURE_FORMAT_CRC32) ? 8 : 16,
+                     (unsigned long long)digest);
+            break;
+        }
+        default:
+            break;
+    }
+
+    int rawFrame = (capture->config.format == CAPTURE_FORMAT_RAW);
+    if (!rawFrame) {
+        atomic_store_explicit(&frame->done, 1, memory_order_release);
+    }
+
+    // Ordered part
+    pthread_mutex_lock(&capture->mutex);
+    while (capture->written != job->sequence) {
+        pthread_cond_wait(&capture->turn, &capture->mutex);
+    }
+    pthread_mutex_unlock(&capture->mutex);
+
+    if (rawFrame) {
+        for (int row = 0; row < frame->height; ++row) {
+            fwrite(captureRow(frame, row), 1, rowBytes, capture->file);
+        }
+        atomic_store_explicit(&frame->done, 1, memory_order_release);
+    } else if (line[0]) {
+        fputs(line, capture->file);
+    }
+
+    pthread_mutex_lock(&capture->mutex);
+    ++capture->written;
+    --capture->pending;
+    pthread_cond_broadcast(&capture->turn);
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+struct Capture * captureCreate(const struct CaptureConfig * config, struct TaskPool * workers)
+{
+    if (!config->path || (config->format < 0) || (config->format >= CAPTURE_FORMAT_COUNT)) {
+        return NULL;
+    }
+
+    struct Capture * capture = calloc(1, sizeof(struct Capture));
+    capture->config = *config;
+    capture->path = strdup(config->path);
+    capture->config.path = capture->path;
+    if (capture->config.interval < 1) {
+        capture->config.interval = 1;
+    }
+    capture->workers = workers;
+    pthread_mutex_init(&capture->mutex, NULL);
+    pthread_cond_init(&capture->turn, NULL);
+
+    if (config->format != CAPTURE_FORMAT_PNG) {
+        capture->file = fopen(config->path, (config->format == CAPTURE_FORMAT_RAW) ? "wb" : "w");
+        if (!capture->file) {
+            LOG_ERROR("capture: can't open %s", config->path);
+            captureDestroy(capture);
+            return NULL;
+        }
+    }
+    return capture;
+}
+
+void captureDestroy(struct Capture * capture)
+{
+    if (!capture)
+        return;
+
+    captureFlush(capture);
+
+    unsigned long dropped = atomic_load(&capture->dropped);
+    if (dropped) {
+        LOG_WARN("capture: %lu frames dropped", dropped);
+    }
+    if (capture->file) {
+        fclose(capture->file);
+    }
+    pthread_cond_destroy(&capture->turn);
+    pthread_mutex_destroy(&capture->mutex);
+    free(capture->path);
+    free(capture);
+}
+
+void captureFlush(struct Capture * capture)
+{
+    // Jobs set their frame's done flag before they leave the count, and broadcast when they do
+    pthread_mutex_lock(&capture->mutex);
+    while (capture->pending > 0) {
+        pthread_cond_wait(&capture->turn, &capture->mutex);
+    }
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+const struct CaptureConfig * captureGetConfig(struct Capture * capture)
+{
+    return &capture->config;
+}
+
+int captureParseFormat(const char * name)
+{
+    for (int format = 0; format < CAPTURE_FORMAT_COUNT; ++format) {
+        if (!strcmp(name, captureFormatNames[format])) {
+            return format;
+        }
+    }
+    return -1;
+}
+
+int captureWants(struct Capture * capture, unsigned long number)
+{
+    return (number % (unsigned long)capture->config.interval) == 0;
+}
+
+int captureSubmit(struct Capture * capture, struct CaptureFrame * frame)
+{
+    atomic_store_explicit(&frame->done, 0, memory_order_relaxed);
+
+    pthread_mutex_lock(&capture->mutex);
+    int full = (capture->pending >= CAPTURE_MAX_PENDING);
+    if (!full) {
+        ++capture->pending;
+    }
+    pthread_mutex_unlock(&capture->mutex);
+
+    if (!full) {
+        // Sequences are only used up by queued jobs, so a drop never leaves a gap for the writers to wait on
+        struct CaptureJob * job = &capture->jobs[capture->submitted % CAPTURE_MAX_PENDING];
+        job->capture = capture;
+        job->frame = frame;
+        job->sequence = capture->submitted;
+        if (taskPoolSubmit(capture->workers, captureJob, job)) {
+            ++capture->submitted;
+            return 1;
+        }
+
+        pthread_mutex_lock(&capture->mutex);
+        --capture->pending;
+        pthread_mutex_unlock(&capture->mutex);
+    }
+
+    atomic_fetch_add(&capture->dropped, 1);
+    atomic_store_explicit(&frame->done, 1, memory_order_release);
+    return 0;
+}
+
+unsigned long captureGetDropped(struct Capture * capture)
+{
+    return atomic_load(&capture->dropped);
+}
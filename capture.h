@@ -0,0 +1,89 @@
+#ifndef VAAT_CAPTURE_H
+#define VAAT_CAPTURE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct TaskPool;
+
+// Writes rendered frames (or digests of them) out on worker threads, in the order they were submitted.
+// The renderer does the readback itself and only hands over memory it won't touch until the frame is done.
+
+enum CaptureFormat
+{
+    CAPTURE_FORMAT_RAW, // RGBA frames appended to one file, e.g. for ffmpeg -f rawvideo -pix_fmt rgba
+    CAPTURE_FORMAT_PNG, // one uncompressed PNG per frame, named <path>NNNNNN.png
+    CAPTURE_FORMAT_CRC32, // one line per frame with the CRC-32 of its pixels
+    CAPTURE_FORMAT_XXH64, // one line per frame with the XXH64 of its pixels
+    CAPTURE_FORMAT_COUNT
+};
+
+enum CaptureSource
+{
+    CAPTURE_SOURCE_VIDEO, // the converted video at its own size (the window if there is no intermediate)
+    CAPTURE_SOURCE_WINDOW, // the final framebuffer
+};
+
+struct CaptureConfig
+{
+    const char * path;
+    int format; // enum CaptureFormat
+    int source; // enum CaptureSource
+    int interval; // capture every Nth presented frame
+};
+
+// A frame on its way out; owned by the renderer
+struct CaptureFrame
+{
+    const uint8_t * pixels; // RGBA
+    int width;
+    int height;
+    int stride;
+    int bottomUp; // the first row in memory is the bottom one, as glReadPixels() returns them
+    unsigned long number; // presented frame count
+    uint64_t ptsNs;
+    atomic_int done; // set once |pixels| is no longer read
+};
+
+// returns NULL if the output can't be opened
+struct Capture * captureCreate(const struct CaptureConfig * config, struct TaskPool * workers);
+
+// waits for every submitted frame to be written
+void captureDestroy(struct Capture * capture);
+
+// waits until every frame submitted so far is written (and done)
+void captureFlush(struct Capture * capture);
+
+const struct CaptureConfig * captureGetConfig(struct Capture * capture);
+
+// "raw", "png", "crc32" or "xxh64"
+// returns the enum CaptureFormat, or -1 if unknown
+int captureParseFormat(const char * name);
+
+// returns non-zero if presented frame |number| should be captured
+int captureWants(struct Capture * capture, unsigned long number);
+
+// queues |frame| for writing; |frame->done| is set when that's finished, or right away if it was dropped
+// returns non-zero if queued
+int captureSubmit(struct Capture * capture, struct CaptureFrame * frame);
+
+// frames dropped because the workers were backed up
+unsigned long captureGetDropped(struct Capture * capture);
+
+// Digests, also usable for comparing frames directly
+uint32_t captureCrc32(uint32_t crc, const uint8_t * data, size_t size);
+
+struct CaptureXxh64
+{
+    uint64_t total;
+    uint64_t acc[4];
+    uint8_t buffer[32];
+    uint32_t buffered;
+};
+
+void captureXxh64Init(struct CaptureXxh64 * state, uint64_t seed);
+void captureXxh64Update(struct CaptureXxh64 * state, const uint8_t * data, size_t size);
+uint64_t captureXxh64Final(const struct CaptureXxh64 * state);
+
+#endif
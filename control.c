@@ -0,0 +1,209 @@
+#include "control.h"
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CONTROL_LINE_SIZE 1024
+#define CONTROL_REPLY_SIZE 1024
+#define CONTROL_IDLE_TIMEOUT_MS 10000
+
+struct Control
+{
+    struct SocketServer * socket;
+    int commandFd; // eventfd, readable while a command is pending
+    ControlHandler handler;
+    void * userData;
+
+    // The command handed to the main thread, guarded by mutex; pending is also read without it
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // signalled when the command is done or the thread should stop
+    atomic_int pending;
+    int done;
+    int stopping;
+    int ok;
+    int argc;
+    char * argv[CONTROL_MAX_ARGS + 1];
+    char reply[CONTROL_REPLY_SIZE];
+
+    char line[CONTROL_LINE_SIZE];
+};
+
+// Hands the tokenised line to the main thread and waits for it; returns zero if the control is going away
+static int controlRun(struct Control * control, int fd)
+{
+    pthread_mutex_lock(&control->mutex);
+    control->done = 0;
+    control->ok = 0;
+    control->reply[0] = '\0';
+    atomic_store_explicit(&control->pending, 1, memory_order_release);
+    uint64_t one = 1;
+    if (write(control->commandFd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_WARN("control: can't signal a command");
+    }
+    while (!control->done && !control->stopping) {
+        pthread_cond_wait(&control->cond, &control->mutex);
+    }
+    int stopping = !control->done;
+    char reply[CONTROL_REPLY_SIZE + 8];
+    int size = snprintf(reply,
+                        sizeof(reply),
+                        "%s%s%s\n",
+                        control->ok ? "ok" : "error",
+                        control->reply[0] ? " " : "",
+                        control->reply);
+    pthread_mutex_unlock(&control->mutex);
+
+    if (stopping) {
+        return 0;
+    }
+    socketSendAll(fd, reply, ((size_t)size < sizeof(reply)) ? (size_t)size : sizeof(reply) - 1);
+    return 1;
+}
+
+// Splits on blanks, in place; returns the argument count, or -1 if there are too many
+static int controlTokenise(struct Control * control, char * line)
+{
+    int argc = 0;
+    char * saved = NULL;
+    for (char * token = strtok_r(line, " \t\r", &saved); token; token = strtok_r(NULL, " \t\r", &saved)) {
+        if (argc == CONTROL_MAX_ARGS) {
+            return -1;
+        }
+        control->argv[argc++] = token;
+    }
+    control->argv[argc] = NULL;
+    return argc;
+}
+
+// One client at a time, for as many lines as it sends; returns zero if the control is going away
+static int controlServeConnection(struct Control * control, int fd, int stopFd)
+{
+    size_t length = 0;
+    for (;;) {
+        struct pollfd pollFds[2] = { { fd, POLLIN, 0 }, { stopFd, POLLIN, 0 } };
+        int ready = poll(pollFds, 2, CONTROL_IDLE_TIMEOUT_MS);
+        if ((ready < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (ready <= 0) {
+            // Nobody else gets in while it's connected
+            static const char idle[] = "error idle for too long\n";
+            socketSendAll(fd, idle, sizeof(idle) - 1);
+            return 1;
+        }
+        if (pollFds[1].revents) {
+            return 0;
+        }
+
+        ssize_t ret = recv(fd, control->line + length, sizeof(control->line) - 1 - length, 0);
+        if (ret <= 0) {
+            return 1;
+        }
+        length += (size_t)ret;
+        control->line[length] = '\0';
+
+        char * newline;
+        while ((newline = strchr(control->line, '\n'))) {
+            *newline = '\0';
+            size_t consumed = (size_t)(newline + 1 - control->line);
+            int argc = controlTokenise(control, control->line);
+            if (argc < 0) {
+                static const char tooMany[] = "error too many arguments\n";
+                socketSendAll(fd, tooMany, sizeof(tooMany) - 1);
+            } else if (argc > 0) {
+                control->argc = argc;
+                if (!controlRun(control, fd)) {
+                    return 0;
+                }
+            }
+            length -= consumed;
+            memmove(control->line, control->line + consumed, length + 1);
+        }
+        if (length == sizeof(control->line) - 1) {
+            static const char tooLong[] = "error line too long\n";
+            socketSendAll(fd, tooLong, sizeof(tooLong) - 1);
+            length = 0;
+        }
+    }
+}
+
+struct Control * controlCreate(const char * path, const struct TaskConfig * config, ControlHandler handler, void * userData)
+{
+    struct Control * control = calloc(1, sizeof(struct Control));
+    control->handler = handler;
+    control->userData = userData;
+    control->commandFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (control->commandFd < 0) {
+        fatal("eventfd() failed");
+    }
+    pthread_mutex_init(&control->mutex, NULL);
+    pthread_cond_init(&control->cond, NULL);
+
+    struct TaskConfig controlConfig = config ? *config : (struct TaskConfig) { 0 };
+    controlConfig.name = "vaat-control";
+    control->socket = socketServerCreate(path, "control", &controlConfig, (SocketServeFunc)controlServeConnection, control);
+    if (!control->socket) {
+        pthread_cond_destroy(&control->cond);
+        pthread_mutex_destroy(&control->mutex);
+        close(control->commandFd);
+        free(control);
+        return NULL;
+    }
+    LOG_INFO("control: listening on %s", path);
+    return control;
+}
+
+void controlDestroy(struct Control * control)
+{
+    if (!control)
+        return;
+
+    pthread_mutex_lock(&control->mutex);
+    control->stopping = 1;
+    pthread_cond_broadcast(&control->cond);
+    pthread_mutex_unlock(&control->mutex);
+
+    socketServerDestroy(control->socket);
+    pthread_cond_destroy(&control->cond);
+    pthread_mutex_destroy(&control->mutex);
+    close(control->commandFd);
+    free(control);
+}
+
+int controlGetFd(struct Control * control)
+{
+    return control->commandFd;
+}
+
+void controlDispatch(struct Control * control)
+{
+    if (!atomic_load_explicit(&control->pending, memory_order_acquire)) {
+        return;
+    }
+
+    pthread_mutex_lock(&control->mutex);
+    uint64_t count;
+    ssize_t drained = read(control->commandFd, &count, sizeof(count));
+    (void)drained;
+    atomic_store_explicit(&control->pending, 0, memory_order_relaxed);
+
+    uint64_t startNs = timeNowNs();
+    control->ok = control->handler(control->userData, control->argc, control->argv, control->reply, sizeof(control->reply));
+    LOG_INFO("control: %s %s in %.1fms",
+             control->argv[0],
+             control->ok ? "done" : "failed",
+             (double)(timeNowNs() - startNs) / 1000000.0);
+    control->done = 1;
+    pthread_cond_signal(&control->cond);
+    pthread_mutex_unlock(&control->mutex);
+}
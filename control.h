@@ -0,0 +1,30 @@
+#ifndef VAAT_CONTROL_H
+#define VAAT_CONTROL_H
+
+#include <stddef.h>
+
+struct TaskConfig;
+
+// Line based commands on a Unix domain socket, e.g. `socat - UNIX-CONNECT:PATH`. Each line is split on blanks and
+// handed to the main thread, which runs it between two frames; the reply is one line, "ok ..." or "error ...", sent
+// once it has. Switching streams waits for the new one's first frame, so source, decoder, playlist and switch reply
+// before the swap, with "switching at its first frame".
+// Clients are served one at a time, so one that sends nothing for 10 seconds is dropped.
+
+#define CONTROL_MAX_ARGS 16
+
+// Runs on the thread calling controlDispatch(); writes a NUL terminated detail for the reply into |reply|
+// returns non-zero on success
+typedef int (*ControlHandler)(void * userData, int argc, char ** argv, char * reply, size_t replySize);
+
+// returns NULL if it can't listen at |path|
+struct Control * controlCreate(const char * path, const struct TaskConfig * config, ControlHandler handler, void * userData);
+void controlDestroy(struct Control * control);
+
+// eventfd, readable while a command waits for controlDispatch()
+int controlGetFd(struct Control * control);
+
+// Runs the waiting command, if any; a single atomic load otherwise, so it's fine to call every frame
+void controlDispatch(struct Control * control);
+
+#endif
@@ -0,0 +1,557 @@
+#include "convert.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define CONVERT_INLINE static inline __attribute__((always_inline))
+
+// --------------------------------------------------------------------------------------
+// Colorimetry
+
+// Kr, Kb; Kg = 1 - Kr - Kb
+static const double convertLumaWeights[CONVERT_MATRIX_COUNT][2] = {
+    { 0.299, 0.114 }, // BT.601
+    { 0.2126, 0.0722 }, // BT.709
+    { 0.2627, 0.0593 }, // BT.2020 non-constant luminance
+};
+
+// Rows R, G, B by columns Y, Cb, Cr, for Y in [0, 1] and Cb / Cr in [-0.5, 0.5]
+static void convertGetYuvToRgb(int matrix, double m[3][3])
+{
+    if ((matrix < 0) || (matrix >= CONVERT_MATRIX_COUNT)) {
+        matrix = CONVERT_MATRIX_BT709;
+    }
+    double kr = convertLumaWeights[matrix][0];
+    double kb = convertLumaWeights[matrix][1];
+    double kg = 1.0 - kr - kb;
+
+    m[0][0] = 1.0;
+    m[0][1] = 0.0;
+    m[0][2] = 2.0 * (1.0 - kr);
+    m[1][0] = 1.0;
+    m[1][1] = -2.0 * (1.0 - kb) * kb / kg;
+    m[1][2] = -2.0 * (1.0 - kr) * kr / kg;
+    m[2][0] = 1.0;
+    m[2][1] = 2.0 * (1.0 - kb);
+    m[2][2] = 0.0;
+}
+
+// Code offsets and ranges of Y, Cb, Cr at |depth| bits, as GStreamer defines them
+static void convertGetRanges(const struct ConvertColorimetry * colorimetry, int depth, double offset[3], double range[3])
+{
+    double scale = (double)(1 << (depth - 8));
+    double chromaOffset = (double)(1 << (depth - 1));
+    if (colorimetry->fullRange) {
+        double max = (double)((1 << depth) - 1);
+        offset[0] = 0.0;
+        range[0] = max;
+        range[1] = range[2] = max;
+    } else {
+        offset[0] = 16.0 * scale;
+        range[0] = 219.0 * scale;
+        range[1] = range[2] = 224.0 * scale;
+    }
+    offset[1] = offset[2] = chromaOffset;
+}
+
+void convertGetColorMatrix(const struct ConvertColorimetry * colorimetry, int depth, float matrix[9], float offset[3])
+{
+    double m[3][3];
+    double codeOffset[3];
+    double range[3];
+    convertGetYuvToRgb(colorimetry->matrix, m);
+    convertGetRanges(colorimetry, depth, codeOffset, range);
+
+    double max = (double)((1 << depth) - 1);
+    for (int column = 0; column < 3; ++column) {
+        offset[column] = (float)(codeOffset[column] / max);
+        for (int row = 0; row < 3; ++row) {
+            matrix[(column * 3) + row] = (float)(m[row][column] * max / range[column]);
+        }
+    }
+}
+
+static int16_t convertFixed(double value, int shift)
+{
+    double scaled = value * (double)(1 << shift);
+    return (int16_t)(scaled + ((scaled < 0.0) ? -0.5 : 0.5));
+}
+
+// --------------------------------------------------------------------------------------
+// Scalar reference
+//
+// Per pixel: channel = clamp((yCoef * (Y - yOffset) + round + coef[0] * c0 + coef[1] * c1) >> shift), all in int32.
+// Coefficients are Q13 for 8 bit input and Q15 for 10 bit, which keeps them and the (Y, round) pair in int16.
+
+CONVERT_INLINE int32_t convertLoad(const uint8_t * row, int index, int p010)
+{
+    if (p010) {
+        return (int32_t)(row[index * 2] | (row[(index * 2) + 1] << 8)) >> 6;
+    }
+    return row[index];
+}
+
+CONVERT_INLINE uint8_t convertClamp(int32_t value)
+{
+    return (uint8_t)((value < 0) ? 0 : ((value > 255) ? 255 : value));
+}
+
+static void convertSpanScalar(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int begin, int end)
+{
+    int p010 = (params->format == CONVERT_FORMAT_P010);
+    int swap = (params->output == CONVERT_OUTPUT_XRGB8888);
+    for (int x = begin; x < end; ++x) {
+        int32_t y = convertLoad(yRow, x, p010) - params->yOffset;
+        int32_t c0 = convertLoad(uvRow, x & ~1, p010) - params->chromaOffset;
+        int32_t c1 = convertLoad(uvRow, (x & ~1) + 1, p010) - params->chromaOffset;
+        int32_t luma = (params->yCoef * y) + params->round;
+        uint8_t r = convertClamp((luma + (params->rCoef[0] * c0) + (params->rCoef[1] * c1)) >> params->shift);
+        uint8_t g = convertClamp((luma + (params->gCoef[0] * c0) + (params->gCoef[1] * c1)) >> params->shift);
+        uint8_t b = convertClamp((luma + (params->bCoef[0] * c0) + (params->bCoef[1] * c1)) >> params->shift);
+
+        uint8_t * pixel = dst + (x * 4);
+        pixel[0] = swap ? b : r;
+        pixel[1] = g;
+        pixel[2] = swap ? r : b;
+        pixel[3] = 255;
+    }
+}
+
+static void convertRowScalar(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width)
+{
+    convertSpanScalar(params, yRow, uvRow, dst, 0, width);
+}
+
+// --------------------------------------------------------------------------------------
+// SSE2 / AVX2
+//
+// _mm_madd_epi16 multiplies int16 pairs and adds them into int32, so (Y, 1) . (yCoef, round) and
+// (c0, c1) . (coef[0], coef[1]) give exactly the scalar sums. Saturating packs then do the clamp.
+
+#ifdef CONVERT_X86
+
+CONVERT_INLINE __m128i convertPairSse2(int16_t low, int16_t high)
+{
+    return _mm_set1_epi32((int32_t)(((uint32_t)(uint16_t)high << 16) | (uint16_t)low));
+}
+
+// Clamps 8 pixels' int16 channels to bytes and interleaves them into 32 bytes of output
+CONVERT_INLINE void convertStore8Sse2(int swap, __m128i r16, __m128i g16, __m128i b16, uint8_t * dst)
+{
+    __m128i r8 = _mm_packus_epi16(r16, r16);
+    __m128i g8 = _mm_packus_epi16(g16, g16);
+    __m128i b8 = _mm_packus_epi16(b16, b16);
+    __m128i first = _mm_unpacklo_epi8(swap ? b8 : r8, g8);
+    __m128i second = _mm_unpacklo_epi8(swap ? r8 : b8, _mm_set1_epi8((char)0xff));
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(first, second));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(first, second));
+}
+
+CONVERT_INLINE void convertRowSse2Impl(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width, int p010)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i yOffset = _mm_set1_epi16(params->yOffset);
+    const __m128i chromaOffset = _mm_set1_epi16(params->chromaOffset);
+    const __m128i lumaCoef = convertPairSse2(params->yCoef, (int16_t)params->round);
+    const __m128i rCoef = convertPairSse2(params->rCoef[0], params->rCoef[1]);
+    const __m128i gCoef = convertPairSse2(params->gCoef[0], params->gCoef[1]);
+    const __m128i bCoef = convertPairSse2(params->bCoef[0], params->bCoef[1]);
+    const __m128i shift = _mm_cvtsi32_si128(params->shift);
+    int swap = (params->output == CONVERT_OUTPUT_XRGB8888);
+
+    int x = 0;
+    for (; (x + 8) <= width; x += 8) {
+        __m128i y16, uv16; // 8 luma samples, 4 chroma pairs
+        if (p010) {
+            y16 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(yRow + (x * 2))), 6);
+            uv16 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(uvRow + (x * 2))), 6);
+        } else {
+            y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(yRow + x)), zero);
+            uv16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(uvRow + x)), zero);
+        }
+        y16 = _mm_sub_epi16(y16, yOffset);
+        uv16 = _mm_sub_epi16(uv16, chromaOffset);
+
+        // Each chroma pair is one int32 lane; doubling the lanes lines them up with their two pixels
+        __m128i lumaLo = _mm_madd_epi16(_mm_unpacklo_epi16(y16, ones), lumaCoef);
+        __m128i lumaHi = _mm_madd_epi16(_mm_unpackhi_epi16(y16, ones), lumaCoef);
+        __m128i uvLo = _mm_unpacklo_epi32(uv16, uv16);
+        __m128i uvHi = _mm_unpackhi_epi32(uv16, uv16);
+
+        __m128i r16 = _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(lumaLo, _mm_madd_epi16(uvLo, rCoef)), shift),
+                                      _mm_sra_epi32(_mm_add_epi32(lumaHi, _mm_madd_epi16(uvHi, rCoef)), shift));
+        __m128i g16 = _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(lumaLo, _mm_madd_epi16(uvLo, gCoef)), shift),
+                                      _mm_sra_epi32(_mm_add_epi32(lumaHi, _mm_madd_epi16(uvHi, gCoef)), shift));
+        __m128i b16 = _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(lumaLo, _mm_madd_epi16(uvLo, bCoef)), shift),
+                                      _mm_sra_epi32(_mm_add_epi32(lumaHi, _mm_madd_epi16(uvHi, bCoef)), shift));
+        convertStore8Sse2(swap, r16, g16, b16, dst + (x * 4));
+    }
+    convertSpanScalar(params, yRow, uvRow, dst, x, width);
+}
+
+static void convertRowSse2(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width)
+{
+    convertRowSse2Impl(params, yRow, uvRow, dst, width, 0);
+}
+
+static void convertRowSse2P010(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width)
+{
+    convertRowSse2Impl(params, yRow, uvRow, dst, width, 1);
+}
+
+// 16 pixels per iteration; luma is widened to int32 and multiplied directly, chroma pairs still go through madd
+__attribute__((target("avx2"))) CONVERT_INLINE void
+convertRowAvx2Impl(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width, int p010)
+{
+    const __m256i yOffset = _mm256_set1_epi32(params->yOffset);
+    const __m256i chromaOffset = _mm256_set1_epi16(params->chromaOffset);
+    const __m256i yCoef = _mm256_set1_epi32(params->yCoef);
+    const __m256i round = _mm256_set1_epi32(params->round);
+    const __m256i rCoef = _mm256_broadcastsi128_si256(convertPairSse2(params->rCoef[0], params->rCoef[1]));
+    const __m256i gCoef = _mm256_broadcastsi128_si256(convertPairSse2(params->gCoef[0], params->gCoef[1]));
+    const __m256i bCoef = _mm256_broadcastsi128_si256(convertPairSse2(params->bCoef[0], params->bCoef[1]));
+    const __m256i firstPairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i secondPairs = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+    const __m128i shift = _mm_cvtsi32_si128(params->shift);
+    int swap = (params->output == CONVERT_OUTPUT_XRGB8888);
+
+    int x = 0;
+    for (; (x + 16) <= width; x += 16) {
+        __m256i yLo, yHi, uv16; // 8 + 8 luma samples as int32, 8 chroma pairs
+        if (p010) {
+            __m256i y16 = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(yRow + (x * 2))), 6);
+            yLo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(y16));
+            yHi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(y16, 1));
+            uv16 = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(uvRow + (x * 2))), 6);
+        } else {
+            yLo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(yRow + x)));
+            yHi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(yRow + x + 8)));
+            uv16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(uvRow + x)));
+        }
+        uv16 = _mm256_sub_epi16(uv16, chromaOffset);
+        __m256i lumaLo = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(yLo, yOffset), yCoef), round);
+        __m256i lumaHi = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(yHi, yOffset), yCoef), round);
+        __m256i uvLo = _mm256_permutevar8x32_epi32(uv16, firstPairs);
+        __m256i uvHi = _mm256_permutevar8x32_epi32(uv16, secondPairs);
+
+        // packs works within 128 bit lanes; the permute puts the 16 pixels back in order
+        __m256i r16 = _mm256_permute4x64_epi64(
+            _mm256_packs_epi32(_mm256_sra_epi32(_mm256_add_epi32(lumaLo, _mm256_madd_epi16(uvLo, rCoef)), shift),
+                               _mm256_sra_epi32(_mm256_add_epi32(lumaHi, _mm256_madd_epi16(uvHi, rCoef)), shift)),
+            0xd8);
+        __m256i g16 = _mm256_permute4x64_epi64(
+            _mm256_packs_epi32(_mm256_sra_epi32(_mm256_add_epi32(lumaLo, _mm256_madd_epi16(uvLo, gCoef)), shift),
+                               _mm256_sra_epi32(_mm256_add_epi32(lumaHi, _mm256_madd_epi16(uvHi, gCoef)), shift)),
+            0xd8);
+        __m256i b16 = _mm256_permute4x64_epi64(
+            _mm256_packs_epi32(_mm256_sra_epi32(_mm256_add_epi32(lumaLo, _mm256_madd_epi16(uvLo, bCoef)), shift),
+                               _mm256_sra_epi32(_mm256_add_epi32(lumaHi, _mm256_madd_epi16(uvHi, bCoef)), shift)),
+            0xd8);
+        convertStore8Sse2(swap, _mm256_castsi256_si128(r16), _mm256_castsi256_si128(g16), _mm256_castsi256_si128(b16), dst + (x * 4));
+        convertStore8Sse2(swap,
+                          _mm256_extracti128_si256(r16, 1),
+                          _mm256_extracti128_si256(g16, 1),
+                          _mm256_extracti128_si256(b16, 1),
+                          dst + ((x + 8) * 4));
+    }
+    convertSpanScalar(params, yRow, uvRow, dst, x, width);
+}
+
+__attribute__((target("avx2"))) static void
+convertRowAvx2(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width)
+{
+    convertRowAvx2Impl(params, yRow, uvRow, dst, width, 0);
+}
+
+__attribute__((target("avx2"))) static void
+convertRowAvx2P010(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width)
+{
+    convertRowAvx2Impl(params, yRow, uvRow, dst, width, 1);
+}
+
+#endif
+
+// --------------------------------------------------------------------------------------
+// NEON
+//
+// vmlal_n_s16 accumulates int16 x int16 products into int32, the narrowing moves saturate like the clamp.
+
+#ifdef CONVERT_NEON
+
+CONVERT_INLINE int32x4_t convertChannelNeon(int32x4_t luma, int16x4_t c0, int16x4_t c1, const int16_t coef[2], int32x4_t shift)
+{
+    return vshlq_s32(vmlal_n_s16(vmlal_n_s16(luma, c0, coef[0]), c1, coef[1]), shift); // negative shift: arithmetic right
+}
+
+CONVERT_INLINE uint8x8_t convertNarrowNeon(int32x4_t low, int32x4_t high)
+{
+    return vqmovun_s16(vcombine_s16(vqmovn_s32(low), vqmovn_s32(high)));
+}
+
+// 8 pixels from their luma and per pixel chroma
+CONVERT_INLINE void convertStore8Neon(const struct ConvertParams * params, int16x8_t y, int16x8_t c0, int16x8_t c1, int32x4_t round, int32x4_t shift, uint8_t * dst)
+{
+    int32x4_t lumaLo = vmlal_n_s16(round, vget_low_s16(y), params->yCoef);
+    int32x4_t lumaHi = vmlal_n_s16(round, vget_high_s16(y), params->yCoef);
+    uint8x8_t r = convertNarrowNeon(convertChannelNeon(lumaLo, vget_low_s16(c0), vget_low_s16(c1), params->rCoef, shift),
+                                    convertChannelNeon(lumaHi, vget_high_s16(c0), vget_high_s16(c1), params->rCoef, shift));
+    uint8x8_t g = convertNarrowNeon(convertChannelNeon(lumaLo, vget_low_s16(c0), vget_low_s16(c1), params->gCoef, shift),
+                                    convertChannelNeon(lumaHi, vget_high_s16(c0), vget_high_s16(c1), params->gCoef, shift));
+    uint8x8_t b = convertNarrowNeon(convertChannelNeon(lumaLo, vget_low_s16(c0), vget_low_s16(c1), params->bCoef, shift),
+                                    convertChannelNeon(lumaHi, vget_high_s16(c0), vget_high_s16(c1), params->bCoef, shift));
+
+    uint8x8x4_t pixels;
+    int swap = (params->output == CONVERT_OUTPUT_XRGB8888);
+    pixels.val[0] = swap ? b : r;
+    pixels.val[1] = g;
+    pixels.val[2] = swap ? r : b;
+    pixels.val[3] = vdup_n_u8(255);
+    vst4_u8(dst, pixels);
+}
+
+CONVERT_INLINE void convertRowNeonImpl(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width, int p010)
+{
+    const int16x8_t yOffset = vdupq_n_s16(params->yOffset);
+    const int16x8_t chromaOffset = vdupq_n_s16(params->chromaOffset);
+    const int32x4_t round = vdupq_n_s32(params->round);
+    const int32x4_t shift = vdupq_n_s32(-params->shift);
+
+    int x = 0;
+    for (; (x + 16) <= width; x += 16) {
+        int16x8_t yLo, yHi, c0, c1; // 8 + 8 luma samples, 8 chroma pairs deinterleaved
+        if (p010) {
+            const uint16_t * y16 = (const uint16_t *)yRow + x;
+            uint16x8x2_t uv = vld2q_u16((const uint16_t *)uvRow + x);
+            yLo = vreinterpretq_s16_u16(vshrq_n_u16(vld1q_u16(y16), 6));
+            yHi = vreinterpretq_s16_u16(vshrq_n_u16(vld1q_u16(y16 + 8), 6));
+            c0 = vreinterpretq_s16_u16(vshrq_n_u16(uv.val[0], 6));
+            c1 = vreinterpretq_s16_u16(vshrq_n_u16(uv.val[1], 6));
+        } else {
+            uint8x16_t y8 = vld1q_u8(yRow + x);
+            uint8x8x2_t uv = vld2_u8(uvRow + x);
+            yLo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y8)));
+            yHi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y8)));
+            c0 = vreinterpretq_s16_u16(vmovl_u8(uv.val[0]));
+            c1 = vreinterpretq_s16_u16(vmovl_u8(uv.val[1]));
+        }
+        yLo = vsubq_s16(yLo, yOffset);
+        yHi = vsubq_s16(yHi, yOffset);
+
+        // Each chroma sample covers two pixels
+        int16x8x2_t c0Pixels = vzipq_s16(vsubq_s16(c0, chromaOffset), vsubq_s16(c0, chromaOffset));
+        int16x8x2_t c1Pixels = vzipq_s16(vsubq_s16(c1, chromaOffset), vsubq_s16(c1, chromaOffset));
+        convertStore8Neon(params, yLo, c0Pixels.val[0], c1Pixels.val[0], round, shift, dst + (x * 4));
+        convertStore8Neon(params, yHi, c0Pixels.val[1], c1Pixels.val[1], round, shift, dst + ((x + 8) * 4));
+    }
+    convertSpanScalar(params, yRow, uvRow, dst, x, width);
+}
+
+static void convertRowNeon(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width)
+{
+    convertRowNeonImpl(params, yRow, uvRow, dst, width, 0);
+}
+
+static void convertRowNeonP010(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width)
+{
+    convertRowNeonImpl(params, yRow, uvRow, dst, width, 1);
+}
+
+#endif
+
+// --------------------------------------------------------------------------------------
+
+static const char * convertIsaNames[CONVERT_ISA_COUNT] = { "scalar", "sse2", "avx2", "neon" };
+
+const char * convertIsaName(int isa)
+{
+    return ((isa >= 0) && (isa < CONVERT_ISA_COUNT)) ? convertIsaNames[isa] : "unknown";
+}
+
+int convertIsaSupported(int isa)
+{
+    switch (isa) {
+        case CONVERT_ISA_SCALAR:
+            return 1;
+#ifdef CONVERT_X86
+        case CONVERT_ISA_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case CONVERT_ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef CONVERT_NEON
+        case CONVERT_ISA_NEON:
+            return 1; // mandatory on aarch64
+#endif
+        default:
+            return 0;
+    }
+}
+
+static ConvertRowFunc convertGetRowFunc(int isa, int p010)
+{
+    switch (isa) {
+#ifdef CONVERT_X86
+    case CONVERT_ISA_SSE2:
+        return p010 ? convertRowSse2P010 : convertRowSse2;
+    case CONVERT_ISA_AVX2:
+        return p010 ? convertRowAvx2P010 : convertRowAvx2;
+#endif
+#ifdef CONVERT_NEON
+    case CONVERT_ISA_NEON:
+        return p010 ? convertRowNeonP010 : convertRowNeon;
+#endif
+    default:
+        return convertRowScalar;
+    }
+}
+
+int convertBestIsa(void)
+{
+    static const int preferred[] = { CONVERT_ISA_AVX2, CONVERT_ISA_NEON, CONVERT_ISA_SSE2 };
+    for (size_t index = 0; index < (sizeof(preferred) / sizeof(preferred[0])); ++index) {
+        if (convertIsaSupported(preferred[index])) {
+            return preferred[index];
+        }
+    }
+    return CONVERT_ISA_SCALAR;
+}
+
+int convertInitParams(struct ConvertParams * params, const struct ConvertColorimetry * colorimetry, int format, int output, int isa)
+{
+    if (isa == CONVERT_ISA_BEST) {
+        isa = convertBestIsa();
+    }
+    if (!convertIsaSupported(isa)) {
+        return 0;
+    }
+
+    int p010 = (format == CONVERT_FORMAT_P010);
+    int depth = p010 ? 10 : 8;
+    double m[3][3];
+    double offset[3];
+    double range[3];
+    convertGetYuvToRgb(colorimetry->matrix, m);
+    convertGetRanges(colorimetry, depth, offset, range);
+
+    memset(params, 0, sizeof(*params));
+    params->format = format;
+    params->output = output;
+    params->isa = isa;
+    params->row = convertGetRowFunc(isa, p010);
+    params->shift = 13 + (depth - 8); // 8 bit output
+    params->round = 1 << (params->shift - 1);
+    params->yOffset = (int16_t)offset[0];
+    params->chromaOffset = (int16_t)offset[1];
+    params->yCoef = convertFixed(m[0][0] * 255.0 / range[0], params->shift);
+
+    // NV21 stores Cr first
+    int cb = (format == CONVERT_FORMAT_NV21) ? 1 : 0;
+    int cr = 1 - cb;
+    params->rCoef[cb] = convertFixed(m[0][1] * 255.0 / range[1], params->shift);
+    params->rCoef[cr] = convertFixed(m[0][2] * 255.0 / range[2], params->shift);
+    params->gCoef[cb] = convertFixed(m[1][1] * 255.0 / range[1], params->shift);
+    params->gCoef[cr] = convertFixed(m[1][2] * 255.0 / range[2], params->shift);
+    params->bCoef[cb] = convertFixed(m[2][1] * 255.0 / range[1], params->shift);
+    params->bCoef[cr] = convertFixed(m[2][2] * 255.0 / range[2], params->shift);
+    return 1;
+}
+
+void convertRows(const struct ConvertParams * params, const struct ConvertFrame * frame, uint8_t * dst, int dstStride, int rowBegin, int rowEnd)
+{
+    for (int row = rowBegin; row < rowEnd; ++row) {
+        params->row(params,
+                    frame->planes[0] + ((size_t)row * frame->strides[0]),
+                    frame->planes[1] + ((size_t)(row / 2) * frame->strides[1]),
+                    dst + ((size_t)row * dstStride),
+                    frame->width);
+    }
+}
+
+// --------------------------------------------------------------------------------------
+// Tiling
+
+#define CONVERT_MAX_TILES 32
+
+struct ConvertJob
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    int remaining;
+};
+
+struct ConvertTile
+{
+    struct ConvertJob * job;
+    const struct ConvertParams * params;
+    const struct ConvertFrame * frame;
+    uint8_t * dst;
+    int dstStride;
+    int rowBegin;
+    int rowEnd;
+};
+
+static void convertTile(void * userData)
+{
+    struct ConvertTile * tile = (struct ConvertTile *)userData;
+    convertRows(tile->params, tile->frame, tile->dst, tile->dstStride, tile->rowBegin, tile->rowEnd);
+
+    struct ConvertJob * job = tile->job;
+    pthread_mutex_lock(&job->mutex);
+    if (--job->remaining == 0) {
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&job->mutex);
+}
+
+void convertFrameTiled(struct TaskPool * pool, int tiles, const struct ConvertParams * params, const struct ConvertFrame * frame, uint8_t * dst, int dstStride)
+{
+    if (tiles > CONVERT_MAX_TILES) {
+        tiles = CONVERT_MAX_TILES;
+    }
+    if (!pool || (tiles < 2) || (frame->height < (tiles * 2))) {
+        convertFrame(params, frame, dst, dstStride);
+        return;
+    }
+
+    // Everything lives on this stack frame, which outlives the tiles because we wait for them below
+    struct ConvertJob job = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+    struct ConvertTile tileData[CONVERT_MAX_TILES];
+    int rowsPerTile = (frame->height + tiles - 1) / tiles;
+
+    pthread_mutex_lock(&job.mutex);
+    job.remaining = tiles;
+    pthread_mutex_unlock(&job.mutex);
+
+    // The last band is the calling thread's
+    for (int tileIndex = 0; tileIndex < tiles; ++tileIndex) {
+        struct ConvertTile * tile = &tileData[tileIndex];
+        tile->job = &job;
+        tile->params = params;
+        tile->frame = frame;
+        tile->dst = dst;
+        tile->dstStride = dstStride;
+        tile->rowBegin = tileIndex * rowsPerTile;
+        tile->rowEnd = (tile->rowBegin + rowsPerTile < frame->height) ? (tile->rowBegin + rowsPerTile) : frame->height;
+        if ((tileIndex == (tiles - 1)) || !taskPoolSubmit(pool, convertTile, tile)) {
+            convertTile(tile);
+        }
+    }
+
+    pthread_mutex_lock(&job.mutex);
+    while (job.remaining > 0) {
+        pthread_cond_wait(&job.done, &job.mutex);
+    }
+    pthread_mutex_unlock(&job.mutex);
+}
@@ -0,0 +1,124 @@
+#ifndef VAAT_CONVERT_H
+#define VAAT_CONVERT_H
+
+#include <stdint.h>
+
+#include <gst/video/video.h>
+
+// CPU YCbCr 4:2:0 -> RGB conversion, for readback, reference images and GL-less output.
+// Every kernel computes the scalar one's fixed point arithmetic exactly, so results are bit identical across CPUs.
+
+enum ConvertMatrix
+{
+    CONVERT_MATRIX_BT601,
+    CONVERT_MATRIX_BT709,
+    CONVERT_MATRIX_BT2020,
+    CONVERT_MATRIX_COUNT
+};
+
+struct ConvertColorimetry
+{
+    int matrix; // enum ConvertMatrix
+    int fullRange; // else 16-235 luma / 16-240 chroma (scaled up for deeper formats)
+};
+
+// The matrix the GL shaders use too: rgb = matrix * (yuv - offset) for samples normalized from |depth| bit codes.
+// |matrix| is column major, as glUniformMatrix3fv() expects.
+void convertGetColorMatrix(const struct ConvertColorimetry * colorimetry, int depth, float matrix[9], float offset[3]);
+
+// From the caps' colorimetry; unknown is taken as BT.709 limited range. Inline, so nothing links GStreamer for it
+static inline void convertReadColorimetry(const GstVideoColorimetry * gstColorimetry, struct ConvertColorimetry * colorimetry)
+{
+    switch (gstColorimetry->matrix) {
+        case GST_VIDEO_COLOR_MATRIX_BT601:
+            colorimetry->matrix = CONVERT_MATRIX_BT601;
+            break;
+        case GST_VIDEO_COLOR_MATRIX_BT2020:
+            colorimetry->matrix = CONVERT_MATRIX_BT2020;
+            break;
+        default:
+            colorimetry->matrix = CONVERT_MATRIX_BT709;
+            break;
+    }
+    colorimetry->fullRange = (gstColorimetry->range == GST_VIDEO_COLOR_RANGE_0_255);
+}
+
+enum ConvertFormat
+{
+    CONVERT_FORMAT_NV12,
+    CONVERT_FORMAT_NV21,
+    CONVERT_FORMAT_P010 // 16 bit little endian samples, 10 significant bits at the top
+};
+
+enum ConvertOutput
+{
+    CONVERT_OUTPUT_RGBA, // bytes R, G, B, A
+    CONVERT_OUTPUT_XRGB8888 // DRM / wl_shm: little endian 32 bit words, so bytes B, G, R, X
+};
+
+enum ConvertIsa
+{
+    CONVERT_ISA_BEST = -1,
+    CONVERT_ISA_SCALAR,
+    CONVERT_ISA_SSE2,
+    CONVERT_ISA_AVX2,
+    CONVERT_ISA_NEON,
+    CONVERT_ISA_COUNT
+};
+
+const char * convertIsaName(int isa);
+
+// returns non-zero if this build and CPU can run |isa|
+int convertIsaSupported(int isa);
+
+// the fastest one supported here, what CONVERT_ISA_BEST stands for
+int convertBestIsa(void);
+
+struct ConvertParams;
+typedef void (*ConvertRowFunc)(const struct ConvertParams * params, const uint8_t * yRow, const uint8_t * uvRow, uint8_t * dst, int width);
+
+// Everything derived from the format, output and colorimetry, so converting a frame does no setup
+struct ConvertParams
+{
+    int format;
+    int output;
+    int isa;
+    ConvertRowFunc row;
+
+    int16_t yOffset;
+    int16_t chromaOffset;
+    int16_t yCoef;
+    int16_t rCoef[2]; // per chroma sample in memory order (Cb, Cr for NV12 / P010, Cr, Cb for NV21)
+    int16_t gCoef[2];
+    int16_t bCoef[2];
+    int32_t round;
+    int shift;
+};
+
+// returns non-zero on success, 0 if |isa| isn't supported
+int convertInitParams(struct ConvertParams * params, const struct ConvertColorimetry * colorimetry, int format, int output, int isa);
+
+// A frame's Y and interleaved chroma planes; strides in bytes
+struct ConvertFrame
+{
+    int width;
+    int height;
+    const uint8_t * planes[2];
+    int strides[2];
+};
+
+// converts rows [rowBegin, rowEnd) of |frame| into |dst|, 4 bytes per pixel
+void convertRows(const struct ConvertParams * params, const struct ConvertFrame * frame, uint8_t * dst, int dstStride, int rowBegin, int rowEnd);
+
+static inline void convertFrame(const struct ConvertParams * params, const struct ConvertFrame * frame, uint8_t * dst, int dstStride)
+{
+    convertRows(params, frame, dst, dstStride, 0, frame->height);
+}
+
+struct TaskPool;
+
+// Splits the frame into |tiles| horizontal bands, converted by |pool| and the calling thread; returns once all are done.
+// Bands that don't fit in the pool's queue are converted inline, so this never fails. |pool| may be NULL.
+void convertFrameTiled(struct TaskPool * pool, int tiles, const struct ConvertParams * params, const struct ConvertFrame * frame, uint8_t * dst, int dstStride);
+
+#endif
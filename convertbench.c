@@ -0,0 +1,139 @@
+#include "convert.h"
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Times every kernel this CPU supports against the scalar reference, and fails if any of them disagrees with it
+
+struct BenchOptions
+{
+    int width;
+    int height;
+    int iterations;
+    int threads;
+};
+
+static const char * formatNames[] = { "nv12", "nv21", "p010" };
+
+// Deterministic noise over gradients, so every code path and clamp gets exercised
+static void benchFillFrame(uint8_t * data, size_t size)
+{
+    uint32_t state = 0x12345678u;
+    for (size_t index = 0; index < size; ++index) {
+        state = (state * 1664525u) + 1013904223u;
+        data[index] = (uint8_t)((index & 0xff) ^ (state >> 24));
+    }
+}
+
+static double benchRun(struct TaskPool * pool,
+                       const struct BenchOptions * options,
+                       const struct ConvertParams * params,
+                       const struct ConvertFrame * frame,
+                       uint8_t * dst)
+{
+    int dstStride = options->width * 4;
+    convertFrameTiled(pool, options->threads, params, frame, dst, dstStride); // warm caches
+
+    uint64_t start = timeNowNs();
+    for (int iteration = 0; iteration < options->iterations; ++iteration) {
+        convertFrameTiled(pool, options->threads, params, frame, dst, dstStride);
+    }
+    return (double)(timeNowNs() - start) / 1000000.0 / options->iterations;
+}
+
+static void benchUsage(const char * argv0)
+{
+    printf("usage: %s [--size WxH] [--iterations N] [--threads N]\n", argv0);
+}
+
+int main(int argc, char * argv[])
+{
+    struct BenchOptions options = { 1920, 1080, 100, 1 };
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--size") && (i + 1 < argc) && (sscanf(argv[i + 1], "%dx%d", &options.width, &options.height) == 2)) {
+            ++i;
+        } else if (!strcmp(argv[i], "--iterations") && (i + 1 < argc)) {
+            options.iterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && (i + 1 < argc)) {
+            options.threads = atoi(argv[++i]);
+        } else {
+            benchUsage(argv[0]);
+            return 1;
+        }
+    }
+    if ((options.width < 2) || (options.height < 2) || (options.iterations < 1) || (options.threads < 1)) {
+        benchUsage(argv[0]);
+        return 1;
+    }
+
+    struct TaskPool * pool = NULL;
+    if (options.threads > 1) {
+        struct TaskConfig config = { "convert", 0, TASK_POLICY_DEFAULT, 0 };
+        pool = taskPoolCreate(&config, options.threads - 1, options.threads);
+    }
+
+    // Odd widths leave a scalar tail in every kernel; strides are padded like a decoder's would be
+    int chromaWidth = (options.width + 1) / 2;
+    int chromaHeight = (options.height + 1) / 2;
+    int lumaStride = ((options.width * 2) + 63) & ~63;
+    int chromaStride = ((chromaWidth * 4) + 63) & ~63;
+    size_t lumaSize = (size_t)lumaStride * options.height;
+    size_t chromaSize = (size_t)chromaStride * chromaHeight;
+    size_t dstSize = (size_t)options.width * 4 * options.height;
+
+    uint8_t * source = malloc(lumaSize + chromaSize);
+    uint8_t * reference = malloc(dstSize);
+    uint8_t * dst = malloc(dstSize);
+    if (!source || !reference || !dst) {
+        fatal("Out of memory");
+    }
+    benchFillFrame(source, lumaSize + chromaSize);
+
+    struct ConvertFrame frame = { options.width, options.height, { source, source + lumaSize }, { lumaStride, chromaStride } };
+    struct ConvertColorimetry colorimetry = { CONVERT_MATRIX_BT709, 0 };
+    double pixels = (double)options.width * options.height;
+    int failed = 0;
+
+    printf("convert: %dx%d, %d iterations, %d threads\n", options.width, options.height, options.iterations, options.threads);
+    for (int format = CONVERT_FORMAT_NV12; format <= CONVERT_FORMAT_P010; ++format) {
+        for (int output = CONVERT_OUTPUT_RGBA; output <= CONVERT_OUTPUT_XRGB8888; ++output) {
+            struct ConvertParams params;
+            convertInitParams(&params, &colorimetry, format, output, CONVERT_ISA_SCALAR);
+            convertFrame(&params, &frame, reference, options.width * 4);
+
+            for (int isa = CONVERT_ISA_SCALAR; isa < CONVERT_ISA_COUNT; ++isa) {
+                if (!convertInitParams(&params, &colorimetry, format, output, isa)) {
+                    continue;
+                }
+                memset(dst, 0, dstSize);
+                double ms = benchRun(pool, &options, &params, &frame, dst);
+
+                size_t mismatches = 0;
+                for (size_t index = 0; index < dstSize; ++index) {
+                    mismatches += (dst[index] != reference[index]);
+                }
+                failed |= (mismatches != 0);
+
+                printf("  %s -> %-8s %-6s %8.3f ms %8.1f Mpix/s%s\n",
+                       formatNames[format],
+                       (output == CONVERT_OUTPUT_RGBA) ? "rgba" : "xrgb8888",
+                       convertIsaName(isa),
+                       ms,
+                       pixels / ms / 1000.0,
+                       mismatches ? " MISMATCH" : "");
+            }
+        }
+    }
+
+    free(dst);
+    free(reference);
+    free(source);
+    if (pool) {
+        taskPoolDestroy(pool);
+    }
+    logShutdown();
+    return failed ? 1 : 0;
+}
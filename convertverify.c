@@ -0,0 +1,257 @@
+#include "convert.h"
+#include "gfx.h"
+#include "log.h"
+#include "util.h"
+
+#include <gst/app/gstappsink.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Feeds videotestsrc patterns through gfx.c's own upload and shader path on an offscreen context (llvmpipe is
+// enough), and compares the result with a float reference built on the CPU converter's colour matrices
+
+struct VerifyOptions
+{
+    int width;
+    int height;
+    int tolerance; // per channel, in 8 bit levels; 8 bit textures filter chroma at 8 bit precision, then the matrix doubles it
+    const char * formats; // comma separated GStreamer format names
+};
+
+struct VerifyColorimetry
+{
+    const char * name;
+    GstVideoColorimetry colorimetry;
+};
+
+static const struct VerifyColorimetry verifyColorimetries[] = {
+    { "bt601", { GST_VIDEO_COLOR_RANGE_16_235, GST_VIDEO_COLOR_MATRIX_BT601, GST_VIDEO_TRANSFER_BT601, GST_VIDEO_COLOR_PRIMARIES_SMPTE170M } },
+    { "bt709", { GST_VIDEO_COLOR_RANGE_16_235, GST_VIDEO_COLOR_MATRIX_BT709, GST_VIDEO_TRANSFER_BT709, GST_VIDEO_COLOR_PRIMARIES_BT709 } },
+    { "bt2020", { GST_VIDEO_COLOR_RANGE_16_235, GST_VIDEO_COLOR_MATRIX_BT2020, GST_VIDEO_TRANSFER_BT2020_10, GST_VIDEO_COLOR_PRIMARIES_BT2020 } },
+    { "bt601-full", { GST_VIDEO_COLOR_RANGE_0_255, GST_VIDEO_COLOR_MATRIX_BT601, GST_VIDEO_TRANSFER_SRGB, GST_VIDEO_COLOR_PRIMARIES_SMPTE170M } },
+    { "bt709-full", { GST_VIDEO_COLOR_RANGE_0_255, GST_VIDEO_COLOR_MATRIX_BT709, GST_VIDEO_TRANSFER_BT709, GST_VIDEO_COLOR_PRIMARIES_BT709 } },
+};
+
+// Flat areas, hard edges, noise and chroma sweeps
+static const char * verifyPatterns[] = { "smpte", "colors", "snow", "chroma-zone-plate", "gradient" };
+
+// --------------------------------------------------------------------------------------
+// Reference
+
+// One normalized sample of |plane|, |component| of |components| interleaved, clamped to the edge like GL_CLAMP_TO_EDGE
+static double verifySample(const GstVideoFrame * frame, int plane, int components, int component, int x, int y)
+{
+    int width = GST_VIDEO_FRAME_COMP_WIDTH(frame, plane);
+    int height = GST_VIDEO_FRAME_COMP_HEIGHT(frame, plane);
+    x = (x < 0) ? 0 : ((x >= width) ? (width - 1) : x);
+    y = (y < 0) ? 0 : ((y >= height) ? (height - 1) : y);
+
+    const guint8 * row = (const guint8 *)GST_VIDEO_FRAME_PLANE_DATA(frame, plane) + ((gsize)y * GST_VIDEO_FRAME_PLANE_STRIDE(frame, plane));
+    if (GST_VIDEO_FRAME_FORMAT(frame) == GST_VIDEO_FORMAT_P010_10LE) {
+        const guint8 * sample = row + ((((gsize)x * components) + component) * 2);
+        return (double)((sample[0] | (sample[1] << 8)) >> 6) / 1023.0; // the 10 bit code, not the 16 bit container
+    }
+    return (double)row[((gsize)x * components) + component] / 255.0;
+}
+
+// Chroma at luma pixel (x, y), filtered the way GL_LINEAR samples a half resolution texture at that pixel's centre
+static double verifyChroma(const GstVideoFrame * frame, int plane, int components, int component, int x, int y)
+{
+    double chromaX = (((x + 0.5) * GST_VIDEO_FRAME_COMP_WIDTH(frame, plane)) / GST_VIDEO_FRAME_WIDTH(frame)) - 0.5;
+    double chromaY = (((y + 0.5) * GST_VIDEO_FRAME_COMP_HEIGHT(frame, plane)) / GST_VIDEO_FRAME_HEIGHT(frame)) - 0.5;
+    int x0 = (int)floor(chromaX);
+    int y0 = (int)floor(chromaY);
+    double fx = chromaX - x0;
+    double fy = chromaY - y0;
+
+    double top = (verifySample(frame, plane, components, component, x0, y0) * (1.0 - fx))
+               + (verifySample(frame, plane, components, component, x0 + 1, y0) * fx);
+    double bottom = (verifySample(frame, plane, components, component, x0, y0 + 1) * (1.0 - fx))
+                  + (verifySample(frame, plane, components, component, x0 + 1, y0 + 1) * fx);
+    return (top * (1.0 - fy)) + (bottom * fy);
+}
+
+static void verifyReference(const GstVideoFrame * frame, const struct ConvertColorimetry * colorimetry, uint8_t * pixels)
+{
+    GstVideoFormat format = GST_VIDEO_FRAME_FORMAT(frame);
+    float matrix[9];
+    float offset[3];
+    convertGetColorMatrix(colorimetry, (format == GST_VIDEO_FORMAT_P010_10LE) ? 10 : 8, matrix, offset);
+
+    int width = GST_VIDEO_FRAME_WIDTH(frame);
+    int height = GST_VIDEO_FRAME_HEIGHT(frame);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            double yuv[3];
+            yuv[0] = verifySample(frame, 0, 1, 0, x, y);
+            if (format == GST_VIDEO_FORMAT_I420) {
+                yuv[1] = verifyChroma(frame, 1, 1, 0, x, y);
+                yuv[2] = verifyChroma(frame, 2, 1, 0, x, y);
+            } else {
+                int vFirst = (format == GST_VIDEO_FORMAT_NV21);
+                yuv[1] = verifyChroma(frame, 1, 2, vFirst ? 1 : 0, x, y);
+                yuv[2] = verifyChroma(frame, 1, 2, vFirst ? 0 : 1, x, y);
+            }
+
+            uint8_t * pixel = pixels + ((((gsize)y * width) + x) * 4);
+            for (int channel = 0; channel < 3; ++channel) {
+                double value = 0.0;
+                for (int column = 0; column < 3; ++column) {
+                    value += matrix[(column * 3) + channel] * (yuv[column] - offset[column]);
+                }
+                value = (value < 0.0) ? 0.0 : ((value > 1.0) ? 1.0 : value);
+                pixel[channel] = (uint8_t)lrint(value * 255.0);
+            }
+            pixel[3] = 255;
+        }
+    }
+}
+
+// --------------------------------------------------------------------------------------
+
+// returns a sample of one frame of |pattern|, or NULL if videotestsrc can't produce it
+static GstSample * verifyGenerate(const struct VerifyOptions * options, const char * format, const GstVideoColorimetry * colorimetry, const char * pattern)
+{
+    gchar * colorimetryString = gst_video_colorimetry_to_string(colorimetry);
+    gchar * description = g_strdup_printf("videotestsrc pattern=%s num-buffers=1 ! "
+                                          "video/x-raw,format=%s,width=%d,height=%d,framerate=30/1,colorimetry=%s ! "
+                                          "appsink name=sink sync=false",
+                                          pattern,
+                                          format,
+                                          options->width,
+                                          options->height,
+                                          colorimetryString);
+    g_free(colorimetryString);
+
+    GError * error = NULL;
+    GstElement * pipeline = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!pipeline) {
+        LOG_ERROR("verify: %s", error ? error->message : "can't build the pipeline");
+        g_clear_error(&error);
+        return NULL;
+    }
+
+    GstElement * sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstSample * sample = gst_app_sink_pull_sample(GST_APP_SINK(sink));
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(sink);
+    gst_object_unref(pipeline);
+    return sample;
+}
+
+// returns non-zero if the GL conversion matches the reference within the tolerance
+static int verifyCase(struct Gfx * gfx,
+                      const struct VerifyOptions * options,
+                      const char * format,
+                      const struct VerifyColorimetry * colorimetry,
+                      const char * pattern,
+                      uint8_t * actual,
+                      uint8_t * expected)
+{
+    printf("  %-10s %-10s %-18s ", format, colorimetry->name, pattern);
+
+    GstSample * sample = verifyGenerate(options, format, &colorimetry->colorimetry, pattern);
+    if (!sample) {
+        printf("FAILED: videotestsrc produced nothing\n");
+        return 0;
+    }
+
+    int passed = 0;
+    GstVideoInfo info;
+    GstVideoFrame frame;
+    if (!gst_video_info_from_caps(&info, gst_sample_get_caps(sample))
+        || !gst_video_frame_map(&frame, &info, gst_sample_get_buffer(sample), GST_MAP_READ)) {
+        printf("FAILED: can't map the frame\n");
+    } else {
+        struct ConvertColorimetry convertColorimetry;
+        convertReadColorimetry(&info.colorimetry, &convertColorimetry); // as negotiated, which is what gfx sees too
+        verifyReference(&frame, &convertColorimetry, expected);
+        gst_video_frame_unmap(&frame);
+
+        if (!gfxConvertSample(gfx, sample, actual)) {
+            printf("FAILED: not converted\n");
+        } else {
+            int maxDiff[3] = { 0, 0, 0 };
+            size_t over = 0;
+            size_t pixelCount = (size_t)options->width * options->height;
+            for (size_t index = 0; index < pixelCount; ++index) {
+                int pixelOver = 0;
+                for (int channel = 0; channel < 3; ++channel) {
+                    int diff = abs((int)actual[(index * 4) + channel] - (int)expected[(index * 4) + channel]);
+                    maxDiff[channel] = (diff > maxDiff[channel]) ? diff : maxDiff[channel];
+                    pixelOver |= (diff > options->tolerance);
+                }
+                over += pixelOver;
+            }
+            passed = (over == 0);
+            printf("max diff r=%d g=%d b=%d, %zu pixels over%s\n", maxDiff[0], maxDiff[1], maxDiff[2], over, passed ? "" : " MISMATCH");
+        }
+    }
+
+    gst_sample_unref(sample);
+    return passed;
+}
+
+static void verifyUsage(const char * argv0)
+{
+    printf("usage: %s [--size WxH] [--tolerance N] [--formats NV12,NV21,P010_10LE,I420]\n", argv0);
+}
+
+int main(int argc, char * argv[])
+{
+    struct VerifyOptions options = { 320, 180, 3, "NV12,NV21,P010_10LE,I420" };
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--size") && (i + 1 < argc) && (sscanf(argv[i + 1], "%dx%d", &options.width, &options.height) == 2)) {
+            ++i;
+        } else if (!strcmp(argv[i], "--tolerance") && (i + 1 < argc)) {
+            options.tolerance = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--formats") && (i + 1 < argc)) {
+            options.formats = argv[++i];
+        } else {
+            verifyUsage(argv[0]);
+            return 1;
+        }
+    }
+    if ((options.width < 2) || (options.height < 2) || (options.tolerance < 0)) {
+        verifyUsage(argv[0]);
+        return 1;
+    }
+
+    gst_init(NULL, NULL);
+    struct Gfx * gfx = gfxCreate(NULL, NULL, NULL, options.width, options.height, NULL);
+    if (!gfx) {
+        fatal("No offscreen EGL context; Mesa's surfaceless platform is needed");
+    }
+
+    size_t size = (size_t)options.width * options.height * 4;
+    uint8_t * actual = malloc(size);
+    uint8_t * expected = malloc(size);
+    if (!actual || !expected) {
+        fatal("Out of memory");
+    }
+
+    printf("verify: %dx%d, tolerance %d\n", options.width, options.height, options.tolerance);
+    int failed = 0;
+    gchar ** formats = g_strsplit(options.formats, ",", -1);
+    for (gchar ** format = formats; *format; ++format) {
+        for (size_t colorimetry = 0; colorimetry < G_N_ELEMENTS(verifyColorimetries); ++colorimetry) {
+            for (size_t pattern = 0; pattern < G_N_ELEMENTS(verifyPatterns); ++pattern) {
+                failed |= !verifyCase(gfx, &options, *format, &verifyColorimetries[colorimetry], verifyPatterns[pattern], actual, expected);
+            }
+        }
+    }
+    g_strfreev(formats);
+
+    free(expected);
+    free(actual);
+    gfxDestroy(gfx);
+    logShutdown();
+    return failed ? 1 : 0;
+}
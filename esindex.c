@@ -0,0 +1,411 @@
+#include "esindex.h"
+#include "convert.h"
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ES_INDEX_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define ES_INDEX_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define ES_INDEX_SIDECAR_SUFFIX ".vaatidx"
+#define ES_INDEX_PATH_SIZE 4096
+#define ES_INDEX_NONE UINT64_MAX
+
+// --------------------------------------------------------------------------------------
+// Start codes
+
+// Each returns the offset of the first 00 00 01 at or after |position|, or |size| if there's none. Emulation
+// prevention keeps that sequence out of NAL payloads, so every hit is a NAL boundary.
+typedef size_t (*EsIndexScanFunc)(const uint8_t * data, size_t position, size_t size);
+
+static size_t esIndexScanScalar(const uint8_t * data, size_t position, size_t size)
+{
+    while (position + 2 < size) {
+        uint8_t third = data[position + 2];
+        if (third > 1) {
+            position += 3; // no start code can begin at any of the three
+        } else if ((third == 1) && !data[position + 1] && !data[position]) {
+            return position;
+        } else {
+            ++position;
+        }
+    }
+    return size;
+}
+
+#ifdef ES_INDEX_X86
+
+__attribute__((target("sse2"))) static size_t esIndexScanSse2(const uint8_t * data, size_t position, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; position + 18 <= size; position += 16) {
+        __m128i first = _mm_loadu_si128((const __m128i *)(data + position));
+        __m128i second = _mm_loadu_si128((const __m128i *)(data + position + 1));
+        __m128i third = _mm_loadu_si128((const __m128i *)(data + position + 2));
+        __m128i match = _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(first, second), zero), _mm_cmpeq_epi8(third, one));
+        int mask = _mm_movemask_epi8(match);
+        if (mask) {
+            return position + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+    return esIndexScanScalar(data, position, size);
+}
+
+__attribute__((target("avx2"))) static size_t esIndexScanAvx2(const uint8_t * data, size_t position, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    for (; position + 34 <= size; position += 32) {
+        __m256i first = _mm256_loadu_si256((const __m256i *)(data + position));
+        __m256i second = _mm256_loadu_si256((const __m256i *)(data + position + 1));
+        __m256i third = _mm256_loadu_si256((const __m256i *)(data + position + 2));
+        __m256i match = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_or_si256(first, second), zero), _mm256_cmpeq_epi8(third, one));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(match);
+        if (mask) {
+            return position + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return esIndexScanScalar(data, position, size);
+}
+
+#endif
+
+#ifdef ES_INDEX_NEON
+
+static size_t esIndexScanNeon(const uint8_t * data, size_t position, size_t size)
+{
+    const uint8x16_t one = vdupq_n_u8(1);
+    for (; position + 18 <= size; position += 16) {
+        uint8x16_t first = vld1q_u8(data + position);
+        uint8x16_t second = vld1q_u8(data + position + 1);
+        uint8x16_t third = vld1q_u8(data + position + 2);
+        uint8x16_t match = vandq_u8(vceqzq_u8(vorrq_u8(first, second)), vceqq_u8(third, one));
+        if (vmaxvq_u8(match)) {
+            return esIndexScanScalar(data, position, position + 18); // no movemask; the block has one, find it
+        }
+    }
+    return esIndexScanScalar(data, position, size);
+}
+
+#endif
+
+static EsIndexScanFunc esIndexGetScanFunc(int isa)
+{
+    switch (isa) {
+#ifdef ES_INDEX_X86
+    case CONVERT_ISA_SSE2:
+        return esIndexScanSse2;
+    case CONVERT_ISA_AVX2:
+        return esIndexScanAvx2;
+#endif
+#ifdef ES_INDEX_NEON
+    case CONVERT_ISA_NEON:
+        return esIndexScanNeon;
+#endif
+    default:
+        return esIndexScanScalar;
+    }
+}
+
+// --------------------------------------------------------------------------------------
+// NAL units
+
+enum EsIndexNalType
+{
+    ES_INDEX_NAL_SLICE = 1,
+    ES_INDEX_NAL_PARTITION_A = 2,
+    ES_INDEX_NAL_IDR = 5,
+    ES_INDEX_NAL_SEI = 6,
+    ES_INDEX_NAL_SPS = 7,
+    ES_INDEX_NAL_PPS = 8,
+    ES_INDEX_NAL_AUD = 9,
+    ES_INDEX_NAL_PREFIX = 14,
+    ES_INDEX_NAL_RESERVED_18 = 18,
+};
+
+static void esIndexAddKeyframe(struct EsIndex * index, size_t * capacity, uint64_t offset, uint32_t flags)
+{
+    if (index->keyframeCount == *capacity) {
+        *capacity = *capacity ? (*capacity * 2) : 256;
+        index->keyframes = realloc(index->keyframes, *capacity * sizeof(struct EsIndexKeyframe));
+        if (!index->keyframes) {
+            fatal("out of memory");
+        }
+    }
+    struct EsIndexKeyframe * keyframe = &index->keyframes[index->keyframeCount++];
+    keyframe->offset = offset;
+    keyframe->frame = index->frameCount;
+    keyframe->flags = flags;
+}
+
+static void esIndexScan(struct EsIndex * index, const uint8_t * data, size_t size, EsIndexScanFunc scan)
+{
+    size_t capacity = 0;
+    uint64_t unitStart = ES_INDEX_NONE; // the first NAL since the last slice that may only open an access unit
+    uint32_t unitFlags = 0;
+    for (size_t position = scan(data, 0, size); position + 3 < size; position = scan(data, position + 3, size)) {
+        const uint8_t * nal = data + position + 3;
+        int type = nal[0] & 0x1f;
+        if ((type == ES_INDEX_NAL_SEI) || (type == ES_INDEX_NAL_SPS) || (type == ES_INDEX_NAL_PPS) || (type == ES_INDEX_NAL_AUD)
+            || ((type >= ES_INDEX_NAL_PREFIX) && (type <= ES_INDEX_NAL_RESERVED_18))) {
+            if (unitStart == ES_INDEX_NONE) {
+                unitStart = position;
+            }
+            unitFlags |= (type == ES_INDEX_NAL_SPS) ? ES_INDEX_KEYFRAME_SPS : 0;
+            unitFlags |= (type == ES_INDEX_NAL_PPS) ? ES_INDEX_KEYFRAME_PPS : 0;
+            continue;
+        }
+        if ((type < ES_INDEX_NAL_SLICE) || (type > ES_INDEX_NAL_IDR) || (type == 3) || (type == 4)) {
+            continue; // end of sequence / stream, filler and the like belong to no picture of their own
+        }
+
+        // first_mb_in_slice is the header's leading ue(v), so a set first bit means 0: the picture's first slice
+        if ((position + 4 < size) && (nal[1] & 0x80)) {
+            if (type == ES_INDEX_NAL_IDR) {
+                esIndexAddKeyframe(index, &capacity, (unitStart != ES_INDEX_NONE) ? unitStart : position, unitFlags);
+            }
+            ++index->frameCount;
+        }
+        unitStart = ES_INDEX_NONE;
+        unitFlags = 0;
+    }
+}
+
+// --------------------------------------------------------------------------------------
+// Sidecar
+
+#define ES_INDEX_MAGIC "VAATIDX"
+#define ES_INDEX_VERSION 1
+
+// Host byte order; it's a cache, anything that doesn't match is rebuilt
+struct EsIndexFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint64_t fileSize;
+    int64_t mtimeNs;
+    uint32_t frameCount;
+    uint32_t keyframeCount;
+};
+
+static int esIndexSidecarPath(const char * path, char * sidecar, size_t size)
+{
+    int length = snprintf(sidecar, size, "%s%s", path, ES_INDEX_SIDECAR_SUFFIX);
+    return (length > 0) && ((size_t)length < size);
+}
+
+// returns 0 if |path| can't be opened; fills in what the index is validated against
+static int esIndexStat(int fd, uint64_t * fileSize, int64_t * mtimeNs)
+{
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || !S_ISREG(info.st_mode)) {
+        return 0;
+    }
+    *fileSize = (uint64_t)info.st_size;
+    *mtimeNs = ((int64_t)info.st_mtim.tv_sec * 1000000000) + info.st_mtim.tv_nsec;
+    return 1;
+}
+
+// Entries come out of the scan in offset order, and the binary search relies on it
+static int esIndexEntriesValid(const struct EsIndex * index)
+{
+    for (uint32_t i = 0; i < index->keyframeCount; ++i) {
+        const struct EsIndexKeyframe * keyframe = &index->keyframes[i];
+        if ((keyframe->offset >= index->fileSize) || (keyframe->frame >= index->frameCount)) {
+            return 0;
+        }
+        if ((i > 0) && ((keyframe->offset <= keyframe[-1].offset) || (keyframe->frame <= keyframe[-1].frame))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+struct EsIndex * esIndexLoad(const char * path)
+{
+    char sidecar[ES_INDEX_PATH_SIZE];
+    if (!esIndexSidecarPath(path, sidecar, sizeof(sidecar))) {
+        return NULL;
+    }
+
+    uint64_t fileSize;
+    int64_t mtimeNs;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int current = (fd >= 0) && esIndexStat(fd, &fileSize, &mtimeNs);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!current) {
+        return NULL;
+    }
+
+    FILE * file = fopen(sidecar, "rbe");
+    if (!file) {
+        return NULL;
+    }
+    struct EsIndexFileHeader header;
+    struct EsIndex * index = NULL;
+    if ((fread(&header, sizeof(header), 1, file) != 1) || memcmp(header.magic, ES_INDEX_MAGIC, sizeof(ES_INDEX_MAGIC))
+        || (header.version != ES_INDEX_VERSION) || (header.entrySize != sizeof(struct EsIndexKeyframe))) {
+        LOG_INFO("esindex: %s isn't an index this build reads", sidecar);
+    } else if ((header.fileSize != fileSize) || (header.mtimeNs != mtimeNs)) {
+        LOG_INFO("esindex: %s is stale", sidecar);
+    } else {
+        index = calloc(1, sizeof(struct EsIndex));
+        index->fileSize = header.fileSize;
+        index->mtimeNs = header.mtimeNs;
+        index->frameCount = header.frameCount;
+        index->keyframeCount = header.keyframeCount;
+        index->keyframes = malloc(((size_t)header.keyframeCount + 1) * sizeof(struct EsIndexKeyframe));
+        if (!index->keyframes) {
+            fatal("out of memory");
+        }
+        // one entry too many must come back short, or the file has a tail it shouldn't
+        size_t read = fread(index->keyframes, sizeof(struct EsIndexKeyframe), (size_t)header.keyframeCount + 1, file);
+        if ((read != header.keyframeCount) || !esIndexEntriesValid(index)) {
+            LOG_WARN("esindex: %s is broken", sidecar);
+            esIndexDestroy(index);
+            index = NULL;
+        }
+    }
+    fclose(file);
+    return index;
+}
+
+int esIndexSave(const struct EsIndex * index, const char * path)
+{
+    char sidecar[ES_INDEX_PATH_SIZE];
+    char temporary[ES_INDEX_PATH_SIZE + 16];
+    if (!esIndexSidecarPath(path, sidecar, sizeof(sidecar))) {
+        return 0;
+    }
+    snprintf(temporary, sizeof(temporary), "%s.%d", sidecar, (int)getpid());
+
+    FILE * file = fopen(temporary, "wbe");
+    if (!file) {
+        LOG_WARN("esindex: can't write %s: %s", temporary, strerror(errno));
+        return 0;
+    }
+    struct EsIndexFileHeader header = { ES_INDEX_MAGIC,
+                                        ES_INDEX_VERSION,
+                                        sizeof(struct EsIndexKeyframe),
+                                        index->fileSize,
+                                        index->mtimeNs,
+                                        index->frameCount,
+                                        index->keyframeCount };
+    int ok = (fwrite(&header, sizeof(header), 1, file) == 1)
+             && (fwrite(index->keyframes, sizeof(struct EsIndexKeyframe), index->keyframeCount, file) == index->keyframeCount);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || (rename(temporary, sidecar) != 0)) {
+        LOG_WARN("esindex: can't write %s: %s", sidecar, strerror(errno));
+        unlink(temporary);
+        return 0;
+    }
+    return 1;
+}
+
+// --------------------------------------------------------------------------------------
+
+struct EsIndex * esIndexBuild(const char * path, int isa)
+{
+    if (isa == CONVERT_ISA_BEST) {
+        isa = convertBestIsa();
+    }
+    if (!convertIsaSupported(isa)) {
+        LOG_ERROR("esindex: %s isn't supported here", convertIsaName(isa));
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct EsIndex * index = calloc(1, sizeof(struct EsIndex));
+    if ((fd < 0) || !esIndexStat(fd, &index->fileSize, &index->mtimeNs)) {
+        LOG_ERROR("esindex: can't read %s", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(index);
+        return NULL;
+    }
+    if (index->fileSize == 0) {
+        close(fd);
+        return index;
+    }
+
+    size_t size = (size_t)index->fileSize;
+    void * data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_ERROR("esindex: can't map %s: %s", path, strerror(errno));
+        free(index);
+        return NULL;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    uint64_t startNs = timeNowNs();
+    esIndexScan(index, data, size, esIndexGetScanFunc(isa));
+    double ms = (double)(timeNowNs() - startNs) / 1000000.0;
+    munmap(data, size);
+
+    LOG_INFO("esindex: %s: %u frames, %u keyframes, scanned in %.1fms (%.0fMB/s, %s)",
+             path,
+             index->frameCount,
+             index->keyframeCount,
+             ms,
+             (ms > 0.0) ? ((double)size / 1000.0 / ms) : 0.0,
+             convertIsaName(isa));
+    return index;
+}
+
+struct EsIndex * esIndexOpen(const char * path)
+{
+    struct EsIndex * index = esIndexLoad(path);
+    if (index) {
+        return index;
+    }
+    index = esIndexBuild(path, CONVERT_ISA_BEST);
+    if (index) {
+        esIndexSave(index, path); // an index that only lives in memory still does its job
+    }
+    return index;
+}
+
+void esIndexDestroy(struct EsIndex * index)
+{
+    if (!index)
+        return;
+
+    free(index->keyframes);
+    free(index);
+}
+
+const struct EsIndexKeyframe * esIndexFindKeyframe(const struct EsIndex * index, uint32_t frame)
+{
+    uint32_t begin = 0;
+    uint32_t end = index->keyframeCount;
+    while (begin < end) {
+        uint32_t middle = begin + ((end - begin) / 2);
+        if (index->keyframes[middle].frame <= frame) {
+            begin = middle + 1;
+        } else {
+            end = middle;
+        }
+    }
+    return begin ? &index->keyframes[begin - 1] : NULL;
+}
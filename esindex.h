@@ -0,0 +1,49 @@
+#ifndef VAAT_ESINDEX_H
+#define VAAT_ESINDEX_H
+
+#include <stdint.h>
+
+// Keyframe index of a raw H.264 Annex B elementary stream, which has no container index to seek with.
+// Building one scans the whole file for start codes once; it's then kept next to the file as PATH.vaatidx and
+// reused for as long as the file's size and mtime match.
+
+enum EsIndexKeyframeFlags
+{
+    ES_INDEX_KEYFRAME_SPS = 1 << 0, // an SPS comes with it, so decoding can start there cold
+    ES_INDEX_KEYFRAME_PPS = 1 << 1,
+};
+
+struct EsIndexKeyframe
+{
+    uint64_t offset; // start code of its access unit's first NAL, so the SPS / PPS / SEI in front of the IDR slice
+    uint32_t frame; // pictures before it, in decode order
+    uint32_t flags; // enum EsIndexKeyframeFlags
+};
+
+struct EsIndex
+{
+    uint64_t fileSize;
+    int64_t mtimeNs;
+    uint32_t frameCount; // pictures, so a field coded stream counts each field
+    uint32_t keyframeCount;
+    struct EsIndexKeyframe * keyframes; // IDR access units, by offset
+};
+
+// Scans |path| with |isa| (enum ConvertIsa, CONVERT_ISA_BEST for the fastest); returns NULL if it can't be read
+struct EsIndex * esIndexBuild(const char * path, int isa);
+
+// returns NULL if there's no sidecar for |path|, or it's stale or broken
+struct EsIndex * esIndexLoad(const char * path);
+
+// Writes the sidecar for |path| (through a temporary file, so readers never see half of it); returns non-zero on success
+int esIndexSave(const struct EsIndex * index, const char * path);
+
+// The sidecar if it's current, else a fresh build, saved if the directory is writable; NULL if |path| can't be read
+struct EsIndex * esIndexOpen(const char * path);
+
+void esIndexDestroy(struct EsIndex * index);
+
+// the last keyframe at or before |frame|, NULL if the stream doesn't start with one and |frame| is before the first
+const struct EsIndexKeyframe * esIndexFindKeyframe(const struct EsIndex * index, uint32_t frame);
+
+#endif
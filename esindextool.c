@@ -0,0 +1,116 @@
+#include "convert.h"
+#include "esindex.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Builds or refreshes the sidecar index of H.264 elementary streams, e.g. ahead of time for an archive, and checks
+// every scanner this CPU supports against the scalar one
+
+static void esIndexToolUsage(const char * argv0)
+{
+    printf("usage: %s [--rebuild] [--verify] [--list] FILE...\n", argv0);
+}
+
+static void esIndexToolPrint(const char * path, const struct EsIndex * index, int list)
+{
+    uint32_t longest = 0;
+    for (uint32_t i = 0; i < index->keyframeCount; ++i) {
+        uint32_t end = (i + 1 < index->keyframeCount) ? index->keyframes[i + 1].frame : index->frameCount;
+        if (end - index->keyframes[i].frame > longest) {
+            longest = end - index->keyframes[i].frame;
+        }
+    }
+    printf("%s: %llu bytes, %u frames, %u keyframes, GOP %.1f average, %u longest%s\n",
+           path,
+           (unsigned long long)index->fileSize,
+           index->frameCount,
+           index->keyframeCount,
+           index->keyframeCount ? ((double)index->frameCount / index->keyframeCount) : 0.0,
+           longest,
+           (index->keyframeCount && index->keyframes[0].frame) ? ", doesn't start with one" : "");
+
+    for (uint32_t i = 0; list && (i < index->keyframeCount); ++i) {
+        const struct EsIndexKeyframe * keyframe = &index->keyframes[i];
+        printf("  frame %8u  offset %12llu%s%s\n",
+               keyframe->frame,
+               (unsigned long long)keyframe->offset,
+               (keyframe->flags & ES_INDEX_KEYFRAME_SPS) ? "  sps" : "",
+               (keyframe->flags & ES_INDEX_KEYFRAME_PPS) ? "  pps" : "");
+    }
+}
+
+// returns non-zero if every scanner finds the same keyframes as the scalar one
+static int esIndexToolVerify(const char * path)
+{
+    struct EsIndex * reference = esIndexBuild(path, CONVERT_ISA_SCALAR);
+    if (!reference) {
+        return 0;
+    }
+    int ok = 1;
+    for (int isa = CONVERT_ISA_SCALAR + 1; isa < CONVERT_ISA_COUNT; ++isa) {
+        if (!convertIsaSupported(isa)) {
+            continue;
+        }
+        struct EsIndex * index = esIndexBuild(path, isa);
+        int same = index && (index->frameCount == reference->frameCount) && (index->keyframeCount == reference->keyframeCount)
+                   && !memcmp(index->keyframes, reference->keyframes, reference->keyframeCount * sizeof(struct EsIndexKeyframe));
+        printf("%s: %s %s\n", path, convertIsaName(isa), same ? "matches" : "MISMATCH");
+        ok &= same;
+        esIndexDestroy(index);
+    }
+    esIndexDestroy(reference);
+    return ok;
+}
+
+int main(int argc, char * argv[])
+{
+    int rebuild = 0;
+    int verify = 0;
+    int list = 0;
+    int first = 1;
+    for (; (first < argc) && !strncmp(argv[first], "--", 2); ++first) {
+        if (!strcmp(argv[first], "--rebuild")) {
+            rebuild = 1;
+        } else if (!strcmp(argv[first], "--verify")) {
+            verify = 1;
+        } else if (!strcmp(argv[first], "--list")) {
+            list = 1;
+        } else {
+            esIndexToolUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (first == argc) {
+        esIndexToolUsage(argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = first; i < argc; ++i) {
+        struct EsIndex * index = NULL;
+        if (rebuild) {
+            index = esIndexBuild(argv[i], CONVERT_ISA_BEST);
+            if (index && !esIndexSave(index, argv[i])) {
+                failed = 1;
+            }
+        } else {
+            index = esIndexOpen(argv[i]);
+        }
+        if (!index) {
+            fprintf(stderr, "%s: can't read it\n", argv[i]);
+            failed = 1;
+            continue;
+        }
+        esIndexToolPrint(argv[i], index, list);
+        esIndexDestroy(index);
+
+        if (verify && !esIndexToolVerify(argv[i])) {
+            failed = 1;
+        }
+    }
+    logShutdown();
+    return failed ? 1 : 0;
+}
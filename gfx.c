@@ -1,5 +1,10 @@
 #include "gfx.h"
+#include "alloc.h"
+#include "capture.h"
+#include "convert.h"
+#include "log.h"
 #include "player.h"
+#include "stats.h"
 #include "util.h"
 
 #include <assert.h>
@@ -7,8 +12,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/stat.h>
+
 #include <wayland-egl.h>
 
+#include "viewporter-client-protocol.h"
+
 #include <gst/allocators/gstdmabuf.h>
 #include <gst/gl/egl/gsteglimage.h>
 #include <gst/gl/egl/gstgldisplay_egl.h>
@@ -19,6 +28,62 @@
 
 #include <drm/drm_fourcc.h>
 
+// GLES3 enums, for the ES3 context created through the ES2 headers
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+#ifndef GL_RED
+#define GL_RED 0x1903
+#endif
+#ifndef GL_RG
+#define GL_RG 0x8227
+#endif
+#ifndef GL_R8
+#define GL_R8 0x8229
+#endif
+#ifndef GL_RG8
+#define GL_RG8 0x822B
+#endif
+#ifndef GL_R16_EXT
+#define GL_R16_EXT 0x822A
+#endif
+#ifndef GL_RG16_EXT
+#define GL_RG16_EXT 0x822C
+#endif
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+#ifndef GL_MAP_READ_BIT
+#define GL_MAP_READ_BIT 0x0001
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_ALREADY_SIGNALED
+#define GL_ALREADY_SIGNALED 0x911A
+#endif
+#ifndef GL_CONDITION_SATISFIED
+#define GL_CONDITION_SATISFIED 0x911C
+#endif
+
 static const char * vertexShaderSource = "attribute vec2 position;\n"
                                          "attribute vec2 texCoord;\n"
                                          "varying vec2 v_texCoord;\n"
@@ -47,23 +112,43 @@ static const char * yuvFragmentShaderSource = "precision mediump float;\n"
                                               "uniform sampler2D u_textureY;\n"
                                               "uniform sampler2D u_textureUV;\n"
                                               "uniform int u_hasUV;\n"
+                                              "uniform mat3 u_yuvMatrix;\n"
+                                              "uniform vec3 u_yuvOffset;\n"
                                               "void main() {\n"
                                               "    vec2 yCoord = v_texCoord;\n"
                                               "    vec2 uvCoord = v_texCoord;\n"
                                               "    float y = texture2D(u_textureY, yCoord).r;\n"
                                               "    if (u_hasUV == 1) {\n"
-                                              "        vec2 uv_sample = texture2D(u_textureUV, uvCoord).rg - 0.5;\n"
-                                              "        float u = uv_sample.r;\n"
-                                              "        float v = uv_sample.g;\n"
-                                              "        float r = y + 1.5748 * v;\n"
-                                              "        float g = y - 0.1873 * u - 0.4681 * v;\n"
-                                              "        float b = y + 1.8556 * u;\n"
-                                              "        gl_FragColor = vec4(r, g, b, 1.0);\n"
+                                              "        vec3 yuv = vec3(y, texture2D(u_textureUV, uvCoord).rg) - u_yuvOffset;\n"
+                                              "        gl_FragColor = vec4(u_yuvMatrix * yuv, 1.0);\n"
                                               "    } else {\n"
                                               "        gl_FragColor = vec4(y, y, y, 1.0);\n"
                                               "    }\n"
                                               "}\n";
 
+// Three single channel planes (I420) uploaded from system memory
+static const char * planarFragmentShaderSource = "precision mediump float;\n"
+                                                 "varying vec2 v_texCoord;\n"
+                                                 "uniform sampler2D u_textureY;\n"
+                                                 "uniform sampler2D u_textureU;\n"
+                                                 "uniform sampler2D u_textureV;\n"
+                                                 "uniform mat3 u_yuvMatrix;\n"
+                                                 "uniform vec3 u_yuvOffset;\n"
+                                                 "void main() {\n"
+                                                 "    vec3 yuv = vec3(texture2D(u_textureY, v_texCoord).r,\n"
+                                                 "                    texture2D(u_textureU, v_texCoord).r,\n"
+                                                 "                    texture2D(u_textureV, v_texCoord).r);\n"
+                                                 "    gl_FragColor = vec4(u_yuvMatrix * (yuv - u_yuvOffset), 1.0);\n"
+                                                 "}\n";
+
+static const char * externalFragmentShaderSource = "#extension GL_OES_EGL_image_external : require\n"
+                                                   "precision mediump float;\n"
+                                                   "varying vec2 v_texCoord;\n"
+                                                   "uniform samplerExternalOES u_texture;\n"
+                                                   "void main() {\n"
+                                                   "    gl_FragColor = texture2D(u_texture, v_texCoord);\n"
+                                                   "}\n";
+
 // clang-format off
 static unsigned char debugTextureData[] = { 255,   0,   0, 255,
                                               0, 255,   0, 255,
@@ -86,6 +171,154 @@ static GLuint indices[] = { 0, 1, 2, 2, 3, 0 };
 static PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR = NULL;
 static PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR = NULL;
 static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES = NULL;
+static PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT = NULL;
+static PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC eglSwapBuffersWithDamageKHR = NULL; // KHR or EXT, same signature
+static PFNEGLSETDAMAGEREGIONKHRPROC eglSetDamageRegionKHR = NULL;
+static PFNGLGENQUERIESEXTPROC glGenQueriesEXT = NULL;
+static PFNGLDELETEQUERIESEXTPROC glDeleteQueriesEXT = NULL;
+static PFNGLBEGINQUERYEXTPROC glBeginQueryEXT = NULL;
+static PFNGLENDQUERYEXTPROC glEndQueryEXT = NULL;
+static PFNGLGETQUERYOBJECTUIVEXTPROC glGetQueryObjectuivEXT = NULL;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC glGetQueryObjectui64vEXT = NULL;
+static PFNGLMAPBUFFERRANGEEXTPROC glMapBufferRange = NULL; // ES3 core, same signature as the extension
+static PFNGLUNMAPBUFFEROESPROC glUnmapBuffer = NULL;
+static PFNGLFENCESYNCAPPLEPROC glFenceSync = NULL; // ES3 core, same signatures as GL_APPLE_sync
+static PFNGLCLIENTWAITSYNCAPPLEPROC glClientWaitSync = NULL;
+static PFNGLDELETESYNCAPPLEPROC glDeleteSync = NULL;
+
+// DRM formats the importer understands; both planes of these are sampled separately when linear
+static const guint32 importFormats[] = { DRM_FORMAT_NV12, DRM_FORMAT_NV21 };
+
+// clang-format off
+static const EGLint planeFdAttribs[]         = { EGL_DMA_BUF_PLANE0_FD_EXT,          EGL_DMA_BUF_PLANE1_FD_EXT };
+static const EGLint planeOffsetAttribs[]     = { EGL_DMA_BUF_PLANE0_OFFSET_EXT,      EGL_DMA_BUF_PLANE1_OFFSET_EXT };
+static const EGLint planePitchAttribs[]      = { EGL_DMA_BUF_PLANE0_PITCH_EXT,       EGL_DMA_BUF_PLANE1_PITCH_EXT };
+static const EGLint planeModifierLoAttribs[] = { EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT };
+static const EGLint planeModifierHiAttribs[] = { EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT };
+// clang-format on
+
+// GL window coordinates (origin bottom-left), which is also what the EGL damage APIs expect
+struct GfxRect
+{
+    EGLint x;
+    EGLint y;
+    EGLint width;
+    EGLint height;
+};
+
+struct GfxPlane
+{
+    gint fd;
+    gsize offset;
+    gint stride;
+};
+
+#define GFX_IMPORT_CACHE_SIZE 16 // enough for a decoder's whole buffer pool
+
+// Where a frame's planes live; decoders cycle through a fixed set of dmabufs, so keys repeat
+struct GfxImportKey
+{
+    dev_t dev[2];
+    ino_t ino[2];
+    gsize offset[2];
+    gint stride[2];
+    guint32 fourcc;
+    guint64 modifier;
+    gint width;
+    gint height;
+};
+
+// EGLImages and textures for one set of planes, reused whenever the decoder hands the same dmabuf back
+struct GfxImportEntry
+{
+    int used;
+    unsigned long lastUse;
+    struct GfxImportKey key;
+    int external; // sampled through externalTexture instead of the Y / UV pair
+    int planar; // Y / U / V in yTexture, uvTexture and vTexture
+    int swapUV; // NV21: uvTexture holds V first, which the matrix undoes
+    EGLImage yImage;
+    EGLImage uvImage;
+    EGLImage image;
+    GLuint yTexture;
+    GLuint uvTexture;
+    GLuint vTexture;
+    GLuint externalTexture;
+};
+
+#define GFX_UPLOAD_BUFFERS 2 // written alternately, so an upload never waits for the draw reading the previous frame
+
+// The current sample, kept until the next one arrives so that levels without an intermediate can redraw from it
+struct GfxImport
+{
+    struct GfxImportEntry * entry; // NULL if the sample couldn't be imported
+    gint width; // coded size
+    gint height;
+    gint cropX; // visible region
+    gint cropY;
+    gint cropWidth;
+    gint cropHeight;
+};
+
+// Governor tuning: step down quickly when over budget, step back up only after a long stretch of headroom
+#define GFX_GOVERNOR_DOWN_THRESHOLD 0.85
+#define GFX_GOVERNOR_DOWN_FRAMES 10
+#define GFX_GOVERNOR_UP_THRESHOLD 0.5
+#define GFX_GOVERNOR_UP_FRAMES 180
+
+#define GFX_TIMER_QUERIES 4 // results arrive a few frames late, so keep several in flight
+
+// GPU time is measured per pass; only one timer query can be active at a time, so they're sequential
+enum GfxPass
+{
+    GFX_PASS_CONVERT, // into the RGB intermediate, only when there's a new frame or quality
+    GFX_PASS_PRESENT, // everything drawn into the window
+    GFX_PASS_COUNT
+};
+
+#define GFX_READBACKS 3 // being read by the GPU, waiting for a worker, being written
+#define GFX_READBACK_DELAY 2 // presented frames an ES2 copy is left alone before reading it back
+
+enum GfxReadbackState
+{
+    GFX_READBACK_FREE,
+    GFX_READBACK_PENDING, // the GPU may still be working on it
+    GFX_READBACK_CAPTURING, // handed to the capture writer
+};
+
+// A presented frame on its way to the capture writer, read back without stalling the render thread
+struct GfxReadback
+{
+    int state; // enum GfxReadbackState
+    GLuint pbo; // ES3: glReadPixels() into here completes asynchronously, and a fence says when
+    GLsizeiptr pboSize;
+    GLsync fence;
+    int mapped;
+    GLuint texture; // ES2: a GPU side copy, read back once it has surely finished
+    GLuint framebuffer;
+    GLenum textureFormat;
+    int textureUsable; // complete as a framebuffer, so it can be read back
+    unsigned long startFrame; // framesPresented when the copy was made
+    uint8_t * pixels;
+    size_t pixelsSize;
+    struct CaptureFrame frame;
+};
+
+// A looping clip's converted frames, so that the passes after the one recorded need no decoding
+enum GfxFrameCacheState
+{
+    GFX_FRAME_CACHE_OFF,
+    GFX_FRAME_CACHE_WAITING, // for a pass of a looping clip to start
+    GFX_FRAME_CACHE_RECORDING,
+    GFX_FRAME_CACHE_PLAYING, // the player is held and frames come from here
+    GFX_FRAME_CACHE_FAILED, // a pass doesn't fit the budget; tried again with the next clip
+};
+
+struct GfxCachedFrame
+{
+    GLuint texture; // a copy of the intermediate
+    GstClockTime position; // within the pass
+};
 
 struct Gfx
 {
@@ -97,40 +330,329 @@ struct Gfx
 
     GLuint shaderProgram;
     GLuint yuvShaderProgram;
+    GLuint externalShaderProgram; // 0 if GL_OES_EGL_image_external is unavailable
+    GLuint planarShaderProgram;
     GLuint debugTexture;
-    GLuint videoTexture;
     GLuint rgbTexture;
     GLuint framebuffer;
+    int rgbWidth;
+    int rgbHeight;
+    int intermediateValid; // rgbTexture holds the current import at the current quality
 
-    int width;
+    int surfaceWidth; // logical size of the wl_surface
+    int surfaceHeight;
+    int width; // size of the EGL window, smaller than the surface at GFX_QUALITY_COMPOSITOR
     int height;
 
-    int videoWidth;
-    int videoHeight;
+    struct GfxImport import;
+    struct GfxImportEntry importCache[GFX_IMPORT_CACHE_SIZE];
+    unsigned long importSerial;
+    unsigned long importCacheHits;
+    unsigned long importCacheMisses;
+    GstVideoInfoDmaDrm videoInfo; // parsed from caps, which only happens when they change
+    float yuvMatrix[9]; // from the caps' colorimetry, shared with the CPU converter
+    float yuvMatrixSwapped[9]; // the same with the chroma columns exchanged, for NV21
+    float yuvOffset[3];
+
+    // System memory frames (software decoders) are uploaded instead of imported
+    int glesVersion;
+    int hasTextureRg; // R8 / RG8 textures: ES3 or GL_EXT_texture_rg
+    int hasTextureNorm16; // R16 / RG16 textures for P010: ES3 and GL_EXT_texture_norm16
+    int hasUnpackRowLength; // strided uploads: ES3 or GL_EXT_unpack_subimage
+    int hasPbo; // ES3
+    struct GfxImportEntry uploads[GFX_UPLOAD_BUFFERS];
+    GLuint uploadPbos[GFX_UPLOAD_BUFFERS];
+    gsize uploadPboSizes[GFX_UPLOAD_BUFFERS];
+    int uploadIndex;
+    GstVideoFormat uploadFormat;
+    gint uploadWidth;
+    gint uploadHeight;
+    guint8 * uploadStaging; // repacked rows when the GL can't skip stride padding itself
+    gsize uploadStagingSize;
+    int videoParN; // pixel aspect ratio from caps
+    int videoParD;
+
+    // Letterboxing: the bars only need painting when the layout changes
+    struct GfxRect videoRect;
+    int layoutAge; // swaps presented with the current layout
+    int hasBufferAge;
+
+    int hasDmaBufModifiers; // EGL_EXT_image_dma_buf_import_modifiers
+
+    struct wp_viewport * viewport; // NULL if the compositor can't scale for us
+
+    // Quality governor
+    int quality; // enum GfxQuality
+    int qualityLocked; // set with gfxSetQuality()
+    int qualityTransitions;
+    int overBudgetFrames;
+    int underBudgetFrames;
+    double frameBudgetMs; // one video frame
+    double cpuFrameMs; // smoothed
+    double gpuFrameMs; // smoothed, 0 without GL_EXT_disjoint_timer_query
+    int hasTimerQueries;
+    GLuint timerQueries[GFX_TIMER_QUERIES][GFX_PASS_COUNT];
+    int timerPasses[GFX_TIMER_QUERIES]; // bit per enum GfxPass measured in that frame
+    int timerQueryIndex; // next frame's queries to issue
+    int timerQueriesPending;
+    int timing; // this frame has a free set of queries
+    unsigned long timersSkipped; // every set of queries was still waiting for its results
+    unsigned long framesPresented;
+    unsigned long swapAllocations; // made by the driver inside eglSwapBuffers()
+
+    // Capture
+    struct Capture * capture; // NULL when not capturing
+    int hasFences; // asynchronous readback through PBOs: ES3
+    struct GfxReadback readbacks[GFX_READBACKS];
+    int readbackNext; // started in ring order, so they reach the writer in presentation order
+    unsigned long samplesPresented;
+    unsigned long capturesSkipped; // every readback was still busy
+
+    // Frame cache
+    size_t frameCacheBudget; // bytes, 0 when off
+    int frameCacheState; // enum GfxFrameCacheState
+    unsigned long frameCacheItem; // from playerGetLoopPosition()
+    GstClockTime frameCacheLastPosition; // of the last adopted sample, for spotting where a pass starts
+    struct GfxCachedFrame * frameCache; // in pass order
+    int frameCacheCapacity; // what the budget allows at the intermediate's size
+    int frameCacheCount;
+    int frameCacheWidth;
+    int frameCacheHeight;
+    GstClockTime frameCacheDuration; // of a pass
+    uint64_t frameCacheStartNs; // when the pass on screen started
+    int frameCacheIndex; // the frame on screen
 
     struct Player * player;
     GstSample * sample;
+    GstCaps * caps; // of the last imported sample, NULL if they couldn't be parsed
+
+    int dirty; // something on screen needs to change; cleared by the next swap
+    int samplePending; // gfx->sample hasn't been presented yet
 };
 
-struct Gfx * gfxCreate(struct wl_display * display, struct wl_surface * surface, int width, int height, struct Player * player)
+static int gfxHasExtension(const char * extensions, const char * name)
+{
+    if (!extensions) {
+        return 0;
+    }
+
+    size_t const nameLength = strlen(name);
+    const char * p = extensions;
+    while ((p = strstr(p, name)) != NULL) {
+        if (((p == extensions) || (p[-1] == ' ')) && ((p[nameLength] == ' ') || (p[nameLength] == '\0'))) {
+            return 1;
+        }
+        p += nameLength;
+    }
+    return 0;
+}
+
+static GLuint gfxCompileShader(const char * name, const char * stage, GLenum type, const char * source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        GLchar infoLog[512];
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        LOG_ERROR("%s %s shader compilation failed: %s", name, stage, infoLog);
+        fatal("Shader compilation failed");
+    }
+    return shader;
+}
+
+static GLuint gfxCreateProgram(const char * name, const char * vertexSource, const char * fragmentSource)
+{
+    GLuint vertexShader = gfxCompileShader(name, "vertex", GL_VERTEX_SHADER, vertexSource);
+    GLuint fragmentShader = gfxCompileShader(name, "fragment", GL_FRAGMENT_SHADER, fragmentSource);
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glLinkProgram(program);
+
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        GLchar infoLog[512];
+        glGetProgramInfoLog(program, 512, NULL, infoLog);
+        LOG_ERROR("%s shader program linking failed: %s", name, infoLog);
+        fatal("Shader program linking failed");
+    }
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    return program;
+}
+
+static void gfxAppendDrmFormat(GValue * list, guint32 fourcc, guint64 modifier)
+{
+    GValue value = G_VALUE_INIT;
+    g_value_init(&value, G_TYPE_STRING);
+    g_value_take_string(&value, gst_video_dma_drm_fourcc_to_string(fourcc, modifier));
+    gst_value_list_append_and_take_value(list, &value);
+}
+
+// Builds the caps the appsink accepts: every fourcc:modifier pair EGL can import, plus plain
+// linear DMABuf caps for decoders that predate DMA_DRM negotiation.
+static GstCaps * gfxCreateSinkCaps(struct Gfx * gfx)
+{
+    GValue drmFormats = G_VALUE_INIT;
+    g_value_init(&drmFormats, GST_TYPE_LIST);
+
+    for (size_t formatIndex = 0; formatIndex < G_N_ELEMENTS(importFormats); ++formatIndex) {
+        guint32 const fourcc = importFormats[formatIndex];
+
+        // Linear buffers always work through the per-plane R8/GR88 path
+        gfxAppendDrmFormat(&drmFormats, fourcc, DRM_FORMAT_MOD_LINEAR);
+
+        if (!gfx->hasDmaBufModifiers || !gfx->externalShaderProgram) {
+            continue;
+        }
+
+        EGLint modifierCount = 0;
+        if (!eglQueryDmaBufModifiersEXT(gfx->eglDisplay, (EGLint)fourcc, 0, NULL, NULL, &modifierCount) || (modifierCount <= 0)) {
+            continue;
+        }
+
+        EGLuint64KHR * modifiers = calloc(modifierCount, sizeof(EGLuint64KHR));
+        if (eglQueryDmaBufModifiersEXT(gfx->eglDisplay, (EGLint)fourcc, modifierCount, modifiers, NULL, &modifierCount)) {
+            for (EGLint modifierIndex = 0; modifierIndex < modifierCount; ++modifierIndex) {
+                guint64 const modifier = modifiers[modifierIndex];
+                if ((modifier == DRM_FORMAT_MOD_LINEAR) || (modifier == DRM_FORMAT_MOD_INVALID)) {
+                    continue;
+                }
+                gfxAppendDrmFormat(&drmFormats, fourcc, modifier);
+            }
+        }
+        free(modifiers);
+    }
+
+    GstCaps * caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "DMA_DRM", NULL);
+    gst_caps_set_value(caps, "drm-format", &drmFormats);
+    gst_caps_set_features_simple(caps, gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_DMABUF, NULL));
+    g_value_unset(&drmFormats);
+
+    gst_caps_append(caps, gst_caps_from_string("video/x-raw(memory:DMABuf), format=(string){ NV12, NV21 }"));
+
+    // Last, so decoders that can export DMA-BUFs still do; interleaved chroma needs a two channel texture
+    const char * uploadCaps = "video/x-raw, format=(string)I420";
+    if (gfx->hasTextureNorm16) {
+        uploadCaps = "video/x-raw, format=(string){ NV12, NV21, P010_10LE, I420 }";
+    } else if (gfx->hasTextureRg) {
+        uploadCaps = "video/x-raw, format=(string){ NV12, NV21, I420 }";
+    }
+    gst_caps_append(caps, gst_caps_from_string(uploadCaps));
+
+    gchar * capsString = gst_caps_to_string(caps);
+    LOG_INFO("sink caps: %s", capsString);
+    g_free(capsString);
+    return caps;
+}
+
+static void gfxReleaseImportEntry(struct Gfx * gfx, struct GfxImportEntry * entry)
+{
+    if (entry->yTexture)
+        glDeleteTextures(1, &entry->yTexture);
+    if (entry->uvTexture)
+        glDeleteTextures(1, &entry->uvTexture);
+    if (entry->vTexture)
+        glDeleteTextures(1, &entry->vTexture);
+    if (entry->externalTexture)
+        glDeleteTextures(1, &entry->externalTexture);
+    if (entry->yImage != EGL_NO_IMAGE)
+        eglDestroyImageKHR(gfx->eglDisplay, entry->yImage);
+    if (entry->uvImage != EGL_NO_IMAGE)
+        eglDestroyImageKHR(gfx->eglDisplay, entry->uvImage);
+    if (entry->image != EGL_NO_IMAGE)
+        eglDestroyImageKHR(gfx->eglDisplay, entry->image);
+
+    memset(entry, 0, sizeof(struct GfxImportEntry));
+    entry->yImage = EGL_NO_IMAGE;
+    entry->uvImage = EGL_NO_IMAGE;
+    entry->image = EGL_NO_IMAGE;
+}
+
+// Drops every cached import, e.g. when the decoder renegotiates and its old buffers are gone
+static void gfxFlushImportCache(struct Gfx * gfx)
+{
+    for (int entryIndex = 0; entryIndex < GFX_IMPORT_CACHE_SIZE; ++entryIndex) {
+        if (gfx->importCache[entryIndex].used) {
+            gfxReleaseImportEntry(gfx, &gfx->importCache[entryIndex]);
+        }
+    }
+    gfx->import.entry = NULL;
+}
+
+// Shader matrices for samples normalized from |depth| bit codes
+static void gfxSetColorimetry(struct Gfx * gfx, const struct ConvertColorimetry * colorimetry, int depth)
+{
+    convertGetColorMatrix(colorimetry, depth, gfx->yuvMatrix, gfx->yuvOffset);
+
+    // Both chroma offsets are the same, so only the columns need exchanging
+    memcpy(gfx->yuvMatrixSwapped, gfx->yuvMatrix, 3 * sizeof(float));
+    memcpy(gfx->yuvMatrixSwapped + 3, gfx->yuvMatrix + 6, 3 * sizeof(float));
+    memcpy(gfx->yuvMatrixSwapped + 6, gfx->yuvMatrix + 3, 3 * sizeof(float));
+}
+
+// Undoes a gfxCreate() that failed before any GL objects existed
+static struct Gfx * gfxCreateFailed(struct Gfx * gfx, const char * reason)
+{
+    LOG_ERROR("%s", reason);
+    if (gfx->eglDisplay != EGL_NO_DISPLAY) {
+        eglMakeCurrent(gfx->eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (gfx->eglContext != EGL_NO_CONTEXT) {
+            eglDestroyContext(gfx->eglDisplay, gfx->eglContext);
+        }
+        if (gfx->eglSurface != EGL_NO_SURFACE) {
+            eglDestroySurface(gfx->eglDisplay, gfx->eglSurface);
+        }
+        eglTerminate(gfx->eglDisplay);
+    }
+    if (gfx->eglNative) {
+        wl_egl_window_destroy(gfx->eglNative);
+    }
+    free(gfx);
+    return NULL;
+}
+
+struct Gfx * gfxCreate(struct wl_display * display,
+                       struct wl_surface * surface,
+                       struct wp_viewport * viewport,
+                       int width,
+                       int height,
+                       struct Player * player)
 {
     struct Gfx * gfx = calloc(1, sizeof(struct Gfx));
+    gfx->surfaceWidth = width;
+    gfx->surfaceHeight = height;
     gfx->width = width;
     gfx->height = height;
+    gfx->viewport = viewport;
     gfx->player = player;
-
-    gfx->eglNative = wl_egl_window_create(surface, width, height);
-    if (!gfx->eglNative) {
-        fatal("wl_egl_window_create() failed");
+    gfx->dirty = 1;
+    gfx->quality = GFX_QUALITY_FULL;
+    gfx->frameBudgetMs = 1000.0 / 60.0; // until the caps tell us the frame rate
+    struct ConvertColorimetry colorimetry = { CONVERT_MATRIX_BT709, 0 };
+    gfxSetColorimetry(gfx, &colorimetry, 8);
+
+    if (display) {
+        gfx->eglNative = wl_egl_window_create(surface, width, height);
+        if (!gfx->eglNative) {
+            return gfxCreateFailed(gfx, "wl_egl_window_create() failed");
+        }
     }
 
     EGLint numConfigs;
     EGLint majorVersion;
     EGLint minorVersion;
     EGLint fbAttribs[] = { EGL_SURFACE_TYPE,
-                           EGL_WINDOW_BIT,
+                           display ? EGL_WINDOW_BIT : EGL_PBUFFER_BIT,
                            EGL_RENDERABLE_TYPE,
-                           EGL_OPENGL_ES2_BIT,
+                           EGL_OPENGL_ES3_BIT_KHR,
                            EGL_RED_SIZE,
                            8,
                            EGL_GREEN_SIZE,
@@ -138,79 +660,64 @@ struct Gfx * gfxCreate(struct wl_display * display, struct wl_surface * surface,
                            EGL_BLUE_SIZE,
                            8,
                            EGL_NONE };
-    EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE, EGL_NONE };
-    gfx->eglDisplay = eglGetDisplay(display);
+    EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE, EGL_NONE };
+    if (display) {
+        gfx->eglDisplay = eglGetDisplay(display);
+    } else {
+        // Offscreen on Mesa's surfaceless platform, which needs neither a compositor nor a GPU (llvmpipe)
+        PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        gfx->eglDisplay = eglGetPlatformDisplayEXT ? eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL)
+                                                   : EGL_NO_DISPLAY;
+    }
     if (gfx->eglDisplay == EGL_NO_DISPLAY) {
-        fatal("eglGetDisplay() failed");
+        return gfxCreateFailed(gfx, "eglGetDisplay() failed");
     }
 
     if (!eglInitialize(gfx->eglDisplay, &majorVersion, &minorVersion)) {
-        fatal("eglInitialize() failed");
+        return gfxCreateFailed(gfx, "eglInitialize() failed");
     }
 
     if ((eglGetConfigs(gfx->eglDisplay, NULL, 0, &numConfigs) != EGL_TRUE) || (numConfigs == 0)) {
-        fatal("eglGetConfigs() failed");
+        return gfxCreateFailed(gfx, "eglGetConfigs() failed");
     }
 
+    // ES3 brings PBOs and strided uploads for system memory frames; everything else works on ES2
+    gfx->glesVersion = 3;
     if ((eglChooseConfig(gfx->eglDisplay, fbAttribs, &gfx->eglConfig, 1, &numConfigs) != EGL_TRUE) || (numConfigs != 1)) {
-        fatal("eglChooseConfig() failed");
+        fbAttribs[3] = EGL_OPENGL_ES2_BIT;
+        contextAttribs[1] = 2;
+        gfx->glesVersion = 2;
+        if ((eglChooseConfig(gfx->eglDisplay, fbAttribs, &gfx->eglConfig, 1, &numConfigs) != EGL_TRUE) || (numConfigs != 1)) {
+            return gfxCreateFailed(gfx, "eglChooseConfig() failed");
+        }
     }
 
-    gfx->eglSurface = eglCreateWindowSurface(gfx->eglDisplay, gfx->eglConfig, (EGLNativeWindowType)gfx->eglNative, NULL);
+    if (display) {
+        gfx->eglSurface = eglCreateWindowSurface(gfx->eglDisplay, gfx->eglConfig, (EGLNativeWindowType)gfx->eglNative, NULL);
+    } else {
+        EGLint pbufferAttribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+        gfx->eglSurface = eglCreatePbufferSurface(gfx->eglDisplay, gfx->eglConfig, pbufferAttribs);
+    }
     if (gfx->eglSurface == EGL_NO_SURFACE) {
-        fatal("eglCreateWindowSurface() failed");
+        return gfxCreateFailed(gfx, display ? "eglCreateWindowSurface() failed" : "eglCreatePbufferSurface() failed");
     }
 
     gfx->eglContext = eglCreateContext(gfx->eglDisplay, gfx->eglConfig, EGL_NO_CONTEXT, contextAttribs);
+    if ((gfx->eglContext == EGL_NO_CONTEXT) && (gfx->glesVersion == 3)) {
+        contextAttribs[1] = 2; // an ES3 capable config doesn't guarantee an ES3 context
+        gfx->glesVersion = 2;
+        gfx->eglContext = eglCreateContext(gfx->eglDisplay, gfx->eglConfig, EGL_NO_CONTEXT, contextAttribs);
+    }
     if (gfx->eglContext == EGL_NO_CONTEXT) {
-        fatal("eglCreateContext() failed");
+        return gfxCreateFailed(gfx, "eglCreateContext() failed");
     }
 
     // Make the context current
     if (!eglMakeCurrent(gfx->eglDisplay, gfx->eglSurface, gfx->eglSurface, gfx->eglContext)) {
-        fatal("eglMakeCurrent() failed");
-    }
-
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-
-    GLint success;
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLchar infoLog[512];
-        glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-        printf("Vertex shader compilation failed: %s\n", infoLog);
-        fatal("Vertex shader compilation failed");
-    }
-
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLchar infoLog[512];
-        glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-        printf("Fragment shader compilation failed: %s\n", infoLog);
-        fatal("Fragment shader compilation failed");
-    }
-
-    gfx->shaderProgram = glCreateProgram();
-    glAttachShader(gfx->shaderProgram, vertexShader);
-    glAttachShader(gfx->shaderProgram, fragmentShader);
-    glLinkProgram(gfx->shaderProgram);
-
-    glGetProgramiv(gfx->shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        GLchar infoLog[512];
-        glGetProgramInfoLog(gfx->shaderProgram, 512, NULL, infoLog);
-        printf("Shader program linking failed: %s\n", infoLog);
-        fatal("Shader program linking failed");
+        return gfxCreateFailed(gfx, "eglMakeCurrent() failed");
     }
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    gfx->shaderProgram = gfxCreateProgram("Render", vertexShaderSource, fragmentShaderSource);
 
     glGenTextures(1, &gfx->debugTexture);
     glBindTexture(GL_TEXTURE_2D, gfx->debugTexture);
@@ -222,58 +729,268 @@ struct Gfx * gfxCreate(struct wl_display * display, struct wl_surface * surface,
     eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
     glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
 
-    GLuint yuvVertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(yuvVertexShader, 1, &yuvVertexShaderSource, NULL);
-    glCompileShader(yuvVertexShader);
+    gfx->yuvShaderProgram = gfxCreateProgram("YUV", yuvVertexShaderSource, yuvFragmentShaderSource);
 
-    glGetShaderiv(yuvVertexShader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLchar infoLog[512];
-        glGetShaderInfoLog(yuvVertexShader, 512, NULL, infoLog);
-        printf("YUV vertex shader compilation failed: %s\n", infoLog);
-        fatal("YUV vertex shader compilation failed");
+    const char * eglExtensions = eglQueryString(gfx->eglDisplay, EGL_EXTENSIONS);
+
+    // Damage tracking: tell the compositor (and partial-update capable drivers) what actually changed
+    if (gfxHasExtension(eglExtensions, "EGL_KHR_swap_buffers_with_damage")) {
+        eglSwapBuffersWithDamageKHR = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    } else if (gfxHasExtension(eglExtensions, "EGL_EXT_swap_buffers_with_damage")) {
+        eglSwapBuffersWithDamageKHR = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+    }
+    if (gfxHasExtension(eglExtensions, "EGL_KHR_partial_update")) {
+        eglSetDamageRegionKHR = (PFNEGLSETDAMAGEREGIONKHRPROC)eglGetProcAddress("eglSetDamageRegionKHR");
+    }
+    gfx->hasBufferAge = gfxHasExtension(eglExtensions, "EGL_EXT_buffer_age") || (eglSetDamageRegionKHR != NULL);
+    LOG_INFO("Damage: swap with damage %s, partial update %s, buffer age %s",
+             eglSwapBuffersWithDamageKHR ? "yes" : "no",
+             eglSetDamageRegionKHR ? "yes" : "no",
+             gfx->hasBufferAge ? "yes" : "no");
+
+    // Tiled / compressed layouts can only be imported as a whole image and sampled through the external target
+    if (gfxHasExtension(eglExtensions, "EGL_EXT_image_dma_buf_import_modifiers")) {
+        eglQueryDmaBufModifiersEXT = (PFNEGLQUERYDMABUFMODIFIERSEXTPROC)eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+        gfx->hasDmaBufModifiers = (eglQueryDmaBufModifiersEXT != NULL);
+    }
+    const char * glExtensions = (const char *)glGetString(GL_EXTENSIONS);
+    if (gfxHasExtension(glExtensions, "GL_OES_EGL_image_external")) {
+        gfx->externalShaderProgram = gfxCreateProgram("External", yuvVertexShaderSource, externalFragmentShaderSource);
+    }
+    // System memory uploads
+    gfx->planarShaderProgram = gfxCreateProgram("Planar", yuvVertexShaderSource, planarFragmentShaderSource);
+    gfx->hasTextureRg = (gfx->glesVersion >= 3) || gfxHasExtension(glExtensions, "GL_EXT_texture_rg");
+    gfx->hasUnpackRowLength = (gfx->glesVersion >= 3) || gfxHasExtension(glExtensions, "GL_EXT_unpack_subimage");
+    gfx->hasTextureNorm16 = (gfx->glesVersion >= 3) && gfxHasExtension(glExtensions, "GL_EXT_texture_norm16");
+    if (gfx->glesVersion >= 3) {
+        glMapBufferRange = (PFNGLMAPBUFFERRANGEEXTPROC)eglGetProcAddress("glMapBufferRange");
+        glUnmapBuffer = (PFNGLUNMAPBUFFEROESPROC)eglGetProcAddress("glUnmapBuffer");
+        gfx->hasPbo = (glMapBufferRange != NULL) && (glUnmapBuffer != NULL);
+        glFenceSync = (PFNGLFENCESYNCAPPLEPROC)eglGetProcAddress("glFenceSync");
+        glClientWaitSync = (PFNGLCLIENTWAITSYNCAPPLEPROC)eglGetProcAddress("glClientWaitSync");
+        glDeleteSync = (PFNGLDELETESYNCAPPLEPROC)eglGetProcAddress("glDeleteSync");
+        gfx->hasFences = gfx->hasPbo && (glFenceSync != NULL) && (glClientWaitSync != NULL) && (glDeleteSync != NULL);
+    }
+    if (gfx->hasPbo) {
+        glGenBuffers(GFX_UPLOAD_BUFFERS, gfx->uploadPbos);
+    }
+    LOG_INFO("Upload: GLES %d, RG textures %s, 16 bit textures %s, row length %s, PBOs %s",
+             gfx->glesVersion,
+             gfx->hasTextureRg ? "yes" : "no",
+             gfx->hasTextureNorm16 ? "yes" : "no",
+             gfx->hasUnpackRowLength ? "yes" : "no",
+             gfx->hasPbo ? "yes" : "no");
+
+    LOG_INFO("DMA-BUF import: modifiers %s, external images %s",
+             gfx->hasDmaBufModifiers ? "yes" : "no",
+             gfx->externalShaderProgram ? "yes" : "no");
+
+    // GPU frame time for the quality governor; without it only CPU time is governed
+    if (gfxHasExtension(glExtensions, "GL_EXT_disjoint_timer_query")) {
+        glGenQueriesEXT = (PFNGLGENQUERIESEXTPROC)eglGetProcAddress("glGenQueriesEXT");
+        glDeleteQueriesEXT = (PFNGLDELETEQUERIESEXTPROC)eglGetProcAddress("glDeleteQueriesEXT");
+        glBeginQueryEXT = (PFNGLBEGINQUERYEXTPROC)eglGetProcAddress("glBeginQueryEXT");
+        glEndQueryEXT = (PFNGLENDQUERYEXTPROC)eglGetProcAddress("glEndQueryEXT");
+        glGetQueryObjectuivEXT = (PFNGLGETQUERYOBJECTUIVEXTPROC)eglGetProcAddress("glGetQueryObjectuivEXT");
+        glGetQueryObjectui64vEXT = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+        if (glGenQueriesEXT && glDeleteQueriesEXT && glBeginQueryEXT && glEndQueryEXT && glGetQueryObjectuivEXT
+            && glGetQueryObjectui64vEXT) {
+            glGenQueriesEXT(GFX_TIMER_QUERIES * GFX_PASS_COUNT, &gfx->timerQueries[0][0]);
+            gfx->hasTimerQueries = 1;
+        }
+    }
+    LOG_INFO("Quality governor: gpu timer %s, compositor scaling %s",
+             gfx->hasTimerQueries ? "yes" : "no",
+             gfx->viewport ? "yes" : "no");
+
+    if (gfx->player) {
+        GstCaps * sinkCaps = gfxCreateSinkCaps(gfx);
+        playerSetCaps(gfx->player, sinkCaps);
+        gst_caps_unref(sinkCaps);
     }
 
-    GLuint yuvFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(yuvFragmentShader, 1, &yuvFragmentShaderSource, NULL);
-    glCompileShader(yuvFragmentShader);
+    return gfx;
+}
 
-    glGetShaderiv(yuvFragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        GLchar infoLog[512];
-        glGetShaderInfoLog(yuvFragmentShader, 512, NULL, infoLog);
-        printf("YUV fragment shader compilation failed: %s\n", infoLog);
-        fatal("YUV fragment shader compilation failed");
+// --------------------------------------------------------------------------------------
+// Frame cache: one pass of a single looping clip is recorded as it plays, then repeated from here while the
+// player's pipeline is paused, so the decoder and the conversion sit idle
+
+static void gfxFreeFrameCache(struct Gfx * gfx)
+{
+    for (int frameIndex = 0; frameIndex < gfx->frameCacheCount; ++frameIndex) {
+        glDeleteTextures(1, &gfx->frameCache[frameIndex].texture);
     }
+    free(gfx->frameCache);
+    gfx->frameCache = NULL;
+    gfx->frameCacheCapacity = 0;
+    gfx->frameCacheCount = 0;
+}
 
-    gfx->yuvShaderProgram = glCreateProgram();
-    glAttachShader(gfx->yuvShaderProgram, yuvVertexShader);
-    glAttachShader(gfx->yuvShaderProgram, yuvFragmentShader);
-    glLinkProgram(gfx->yuvShaderProgram);
+// Drops the frames, and has the player decode again if it was held for them
+static void gfxResetFrameCache(struct Gfx * gfx, int state)
+{
+    if (gfx->frameCacheState == GFX_FRAME_CACHE_PLAYING) {
+        playerHoldLoop(gfx->player, 0);
+    }
+    gfxFreeFrameCache(gfx);
+    gfx->frameCacheState = state;
+    gfx->frameCacheLastPosition = GST_CLOCK_TIME_NONE;
+}
 
-    glGetProgramiv(gfx->yuvShaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        GLchar infoLog[512];
-        glGetProgramInfoLog(gfx->yuvShaderProgram, 512, NULL, infoLog);
-        printf("YUV shader program linking failed: %s\n", infoLog);
-        fatal("YUV shader program linking failed");
+// The recorded pass is complete now that the next one started at |position|
+static void gfxCompleteFrameCache(struct Gfx * gfx, GstClockTime position)
+{
+    const struct GfxCachedFrame * first = &gfx->frameCache[0];
+    const struct GfxCachedFrame * last = &gfx->frameCache[gfx->frameCacheCount - 1];
+    if ((gfx->frameCacheCount < 2) || (last->position <= first->position)) {
+        gfxResetFrameCache(gfx, GFX_FRAME_CACHE_WAITING); // nothing to pace the frames by
+        return;
+    }
+    gfx->frameCacheDuration = last->position + (last->position - first->position) / (GstClockTime)(gfx->frameCacheCount - 1);
+    gfx->frameCacheStartNs = timeNowNs() - position;
+    gfx->frameCacheIndex = -1;
+    gfx->frameCacheState = GFX_FRAME_CACHE_PLAYING;
+    playerHoldLoop(gfx->player, 1);
+
+    LOG_INFO("frame cache: %d frames, %.2fs, %zuMB; repeating them without decoding",
+             gfx->frameCacheCount,
+             (double)gfx->frameCacheDuration / 1000000000.0,
+             ((size_t)gfx->frameCacheCount * gfx->frameCacheWidth * gfx->frameCacheHeight * 4) >> 20);
+}
+
+// returns non-zero if |sample| should be shown; while the cache plays it only goes back to the decoder
+static int gfxFrameCacheAdopt(struct Gfx * gfx, GstSample * sample)
+{
+    if (gfx->frameCacheState == GFX_FRAME_CACHE_OFF) {
+        return 1;
+    }
+
+    GstClockTime position;
+    unsigned long item;
+    if (!playerGetLoopPosition(gfx->player, sample, &position, &item)) {
+        if (gfx->frameCacheState != GFX_FRAME_CACHE_WAITING) {
+            gfxResetFrameCache(gfx, GFX_FRAME_CACHE_WAITING); // not a looping clip any more
+        }
+        return 1;
+    }
+    if (item != gfx->frameCacheItem) {
+        gfxResetFrameCache(gfx, GFX_FRAME_CACHE_WAITING);
+        gfx->frameCacheItem = item;
     }
 
-    glDeleteShader(yuvVertexShader);
-    glDeleteShader(yuvFragmentShader);
+    int passStarted = GST_CLOCK_TIME_IS_VALID(gfx->frameCacheLastPosition) && (position < gfx->frameCacheLastPosition);
+    gfx->frameCacheLastPosition = position;
+    if (!passStarted) {
+        return gfx->frameCacheState != GFX_FRAME_CACHE_PLAYING; // the rest of what was decoded before the hold
+    }
 
-    return gfx;
+    if (gfx->frameCacheState == GFX_FRAME_CACHE_WAITING) {
+        gfx->frameCacheState = GFX_FRAME_CACHE_RECORDING;
+    } else if (gfx->frameCacheState == GFX_FRAME_CACHE_RECORDING) {
+        gfxCompleteFrameCache(gfx, position);
+    }
+    return gfx->frameCacheState != GFX_FRAME_CACHE_PLAYING;
+}
+
+// Keeps a GPU side copy of the intermediate, just converted from the adopted sample
+static void gfxRecordFrame(struct Gfx * gfx)
+{
+    // The direct levels have no intermediate to keep, and frames of another size don't belong with the others
+    if (!gfx->intermediateValid
+        || (gfx->frameCache && ((gfx->rgbWidth != gfx->frameCacheWidth) || (gfx->rgbHeight != gfx->frameCacheHeight)))) {
+        gfxResetFrameCache(gfx, GFX_FRAME_CACHE_WAITING);
+        return;
+    }
+
+    if (!gfx->frameCache) {
+        gfx->frameCacheWidth = gfx->rgbWidth;
+        gfx->frameCacheHeight = gfx->rgbHeight;
+        gfx->frameCacheCapacity = (int)(gfx->frameCacheBudget / ((size_t)gfx->rgbWidth * gfx->rgbHeight * 4));
+        gfx->frameCache = calloc((size_t)gfx->frameCacheCapacity + 1, sizeof(struct GfxCachedFrame));
+    }
+    if (gfx->frameCacheCount == gfx->frameCacheCapacity) {
+        LOG_INFO("frame cache: a pass needs more than %zuMB, decoding every one", gfx->frameCacheBudget >> 20);
+        gfxResetFrameCache(gfx, GFX_FRAME_CACHE_FAILED);
+        return;
+    }
+
+    struct GfxCachedFrame * frame = &gfx->frameCache[gfx->frameCacheCount];
+    glGenTextures(1, &frame->texture);
+    glBindTexture(GL_TEXTURE_2D, frame->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindFramebuffer(GL_FRAMEBUFFER, gfx->framebuffer);
+    glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, gfx->rgbWidth, gfx->rgbHeight, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    ++gfx->frameCacheCount; // so a failed one is deleted with the rest
+
+    if (glGetError() != GL_NO_ERROR) {
+        LOG_WARN("frame cache: out of texture memory after %d frames", gfx->frameCacheCount - 1);
+        gfxResetFrameCache(gfx, GFX_FRAME_CACHE_FAILED);
+        return;
+    }
+    frame->position = gfx->frameCacheLastPosition;
+}
+
+// The cached frame due now; marks the frame dirty when that's another one
+static GLuint gfxFrameCacheTexture(struct Gfx * gfx)
+{
+    GstClockTime position = (timeNowNs() - gfx->frameCacheStartNs) % gfx->frameCacheDuration;
+
+    // The last frame at or before |position|
+    int low = 0;
+    int high = gfx->frameCacheCount - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (gfx->frameCache[middle].position <= position) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    if (low != gfx->frameCacheIndex) {
+        gfx->frameCacheIndex = low;
+        gfx->dirty = 1;
+    }
+    return gfx->frameCache[low].texture;
+}
+
+void gfxSetFrameCache(struct Gfx * gfx, size_t budget)
+{
+    gfx->frameCacheBudget = budget;
+    gfxResetFrameCache(gfx, budget ? GFX_FRAME_CACHE_WAITING : GFX_FRAME_CACHE_OFF);
+    gfx->dirty = 1;
 }
 
+// --------------------------------------------------------------------------------------
+
 void gfxDestroy(struct Gfx * gfx)
 {
     if (!gfx)
         return;
 
+    gfxSetCapture(gfx, NULL);
+    gfxFreeFrameCache(gfx);
+    gfxFlushImportCache(gfx);
+    for (int uploadIndex = 0; uploadIndex < GFX_UPLOAD_BUFFERS; ++uploadIndex) {
+        gfxReleaseImportEntry(gfx, &gfx->uploads[uploadIndex]);
+    }
+    if (gfx->hasPbo) {
+        glDeleteBuffers(GFX_UPLOAD_BUFFERS, gfx->uploadPbos);
+    }
+    free(gfx->uploadStaging);
+    gst_caps_replace(&gfx->caps, NULL);
     if (gfx->sample) {
-        gst_sample_unref(gfx->sample);
+        playerReleaseSample(gfx->player, gfx->sample);
     }
 
+    if (gfx->hasTimerQueries) {
+        glDeleteQueriesEXT(GFX_TIMER_QUERIES * GFX_PASS_COUNT, &gfx->timerQueries[0][0]);
+    }
     if (gfx->debugTexture) {
         glDeleteTextures(1, &gfx->debugTexture);
     }
@@ -290,6 +1007,12 @@ void gfxDestroy(struct Gfx * gfx)
     if (gfx->yuvShaderProgram) {
         glDeleteProgram(gfx->yuvShaderProgram);
     }
+    if (gfx->externalShaderProgram) {
+        glDeleteProgram(gfx->externalShaderProgram);
+    }
+    if (gfx->planarShaderProgram) {
+        glDeleteProgram(gfx->planarShaderProgram);
+    }
 
     if (gfx->eglContext != EGL_NO_CONTEXT) {
         eglDestroyContext(gfx->eglDisplay, gfx->eglContext);
@@ -307,194 +1030,640 @@ void gfxDestroy(struct Gfx * gfx)
     free(gfx);
 }
 
-// returns non-zero on success
-static int gfxConvertSample(struct Gfx * gfx)
+static EGLImage gfxCreateDmaBufImage(struct Gfx * gfx,
+                                     gint width,
+                                     gint height,
+                                     guint32 drmFormat,
+                                     guint64 modifier,
+                                     const struct GfxPlane * planes,
+                                     int planeCount,
+                                     const EGLint * hints)
 {
-    GstBuffer * buffer = gst_sample_get_buffer(gfx->sample);
-    gint64 const pts = (gint64)GST_BUFFER_PTS(buffer);
-    GstCaps * caps = gst_sample_get_caps(gfx->sample);
-
-    // debug dump some info about the sample
-    gchar * capsString = gst_caps_to_string(caps);
-    printf("adopted [%3.3f]: %s\n", (double)pts / 1000000000.0, capsString);
-    g_free(capsString);
-
-    if (!eglCreateImageKHR || !eglDestroyImageKHR || !glEGLImageTargetTexture2DOES) {
-        printf("EGL extensions not available\n");
-        return 0;
+    EGLint attribs[48];
+    int count = 0;
+
+    attribs[count++] = EGL_WIDTH;
+    attribs[count++] = width;
+    attribs[count++] = EGL_HEIGHT;
+    attribs[count++] = height;
+    attribs[count++] = EGL_LINUX_DRM_FOURCC_EXT;
+    attribs[count++] = (EGLint)drmFormat;
+
+    for (int planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+        attribs[count++] = planeFdAttribs[planeIndex];
+        attribs[count++] = planes[planeIndex].fd;
+        attribs[count++] = planeOffsetAttribs[planeIndex];
+        attribs[count++] = (EGLint)planes[planeIndex].offset;
+        attribs[count++] = planePitchAttribs[planeIndex];
+        attribs[count++] = planes[planeIndex].stride;
+
+        // Without the modifiers extension the driver assumes its implicit (usually linear) layout
+        if (gfx->hasDmaBufModifiers && (modifier != DRM_FORMAT_MOD_INVALID)) {
+            attribs[count++] = planeModifierLoAttribs[planeIndex];
+            attribs[count++] = (EGLint)(modifier & 0xffffffff);
+            attribs[count++] = planeModifierHiAttribs[planeIndex];
+            attribs[count++] = (EGLint)(modifier >> 32);
+        }
     }
 
-    GstVideoInfoDmaDrm dma_info;
-    if (!gst_video_info_dma_drm_from_caps(&dma_info, caps)) {
-        printf("Failed to get DMA DRM video info from caps\n");
-        return 0;
+    if (hints) {
+        for (int hintIndex = 0; hints[hintIndex] != EGL_NONE; ++hintIndex) {
+            attribs[count++] = hints[hintIndex];
+        }
     }
+    attribs[count++] = EGL_NONE;
 
-    gint width = GST_VIDEO_INFO_WIDTH(&dma_info.vinfo);
-    gint height = GST_VIDEO_INFO_HEIGHT(&dma_info.vinfo);
-    guint32 fourcc = dma_info.drm_fourcc;
+    return eglCreateImageKHR(gfx->eglDisplay, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+}
 
-    if (fourcc != DRM_FORMAT_NV12 && fourcc != DRM_FORMAT_NV21) {
-        printf("Unsupported DRM fourcc: 0x%08x\n", fourcc);
+// Resolves the fd holding the plane at |bufferOffset| and the plane's offset within that fd
+// returns non-zero on success
+static int gfxFindPlane(GstBuffer * buffer, gsize bufferOffset, gint stride, struct GfxPlane * plane)
+{
+    guint memoryIndex, memoryCount;
+    gsize skip;
+    if (!gst_buffer_find_memory(buffer, bufferOffset, 1, &memoryIndex, &memoryCount, &skip)) {
         return 0;
     }
 
-    // Get DMA-BUF fd from first memory block
-    GstMemory * mem = gst_buffer_peek_memory(buffer, 0);
+    GstMemory * mem = gst_buffer_peek_memory(buffer, memoryIndex);
     if (!mem || !gst_is_dmabuf_memory(mem)) {
-        printf("Buffer is not DMA-BUF memory\n");
         return 0;
     }
 
-    gint fd = gst_dmabuf_memory_get_fd(mem);
-    if (fd < 0) {
-        printf("Failed to get DMA-BUF fd\n");
+    plane->fd = gst_dmabuf_memory_get_fd(mem);
+    plane->offset = mem->offset + skip; // the memory may itself be a window into a larger dmabuf
+    plane->stride = stride;
+    return (plane->fd >= 0);
+}
+
+static void gfxBindImportedTexture(GLenum target, GLuint texture, EGLImage image)
+{
+    glBindTexture(target, texture);
+    glEGLImageTargetTexture2DOES(target, image);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+// Fills |key| with the identity of |plane|'s dmabuf
+// returns non-zero on success
+static int gfxIdentifyPlane(const struct GfxPlane * plane, int planeIndex, struct GfxImportKey * key)
+{
+    struct stat info;
+    if (fstat(plane->fd, &info) != 0) {
         return 0;
     }
+    key->dev[planeIndex] = info.st_dev;
+    key->ino[planeIndex] = info.st_ino;
+    key->offset[planeIndex] = plane->offset;
+    key->stride[planeIndex] = plane->stride;
+    return 1;
+}
 
-    // Try to get stride/offset from VideoMeta first, fall back to VideoInfo
-    gsize y_offset, uv_offset;
-    gint y_stride, uv_stride;
+// The least recently used entry, after releasing whatever it held
+static struct GfxImportEntry * gfxEvictImportEntry(struct Gfx * gfx)
+{
+    struct GfxImportEntry * victim = &gfx->importCache[0];
+    for (int entryIndex = 0; entryIndex < GFX_IMPORT_CACHE_SIZE; ++entryIndex) {
+        struct GfxImportEntry * entry = &gfx->importCache[entryIndex];
+        if (!entry->used) {
+            return entry;
+        }
+        if (entry->lastUse < victim->lastUse) {
+            victim = entry;
+        }
+    }
+    gfxReleaseImportEntry(gfx, victim);
+    return victim;
+}
 
-    GstVideoMeta * video_meta = gst_buffer_get_video_meta(buffer);
-    if (video_meta) {
-        y_offset = video_meta->offset[0];
-        y_stride = video_meta->stride[0];
-        uv_offset = video_meta->offset[1];
+// Creates the EGLImages and textures for |entry->key|
+// returns non-zero on success
+static int gfxCreateImportEntry(struct Gfx * gfx, struct GfxImportEntry * entry, const struct GfxPlane * planes)
+{
+    const struct GfxImportKey * key = &entry->key;
+    const GstVideoInfo * vinfo = &gfx->videoInfo.vinfo;
+
+    entry->external = (key->modifier != DRM_FORMAT_MOD_LINEAR) && (key->modifier != DRM_FORMAT_MOD_INVALID);
+    if (entry->external) {
+        // Non-linear layouts are only meaningful as a whole; the driver samples and converts them itself
+        EGLint colorSpace = EGL_ITU_REC709_EXT;
+        switch (vinfo->colorimetry.matrix) {
+            case GST_VIDEO_COLOR_MATRIX_BT601:
+                colorSpace = EGL_ITU_REC601_EXT;
+                break;
+            case GST_VIDEO_COLOR_MATRIX_BT2020:
+                colorSpace = EGL_ITU_REC2020_EXT;
+                break;
+            default:
+                break;
+        }
+        EGLint sampleRange = (vinfo->colorimetry.range == GST_VIDEO_COLOR_RANGE_0_255) ? EGL_YUV_FULL_RANGE_EXT : EGL_YUV_NARROW_RANGE_EXT;
+        EGLint hints[] = { EGL_YUV_COLOR_SPACE_HINT_EXT, colorSpace, EGL_SAMPLE_RANGE_HINT_EXT, sampleRange, EGL_NONE };
+
+        entry->image = gfxCreateDmaBufImage(gfx, key->width, key->height, key->fourcc, key->modifier, planes, 2, hints);
+        if (entry->image == EGL_NO_IMAGE) {
+            LOG_ERROR_EVERY(1000,
+                            "Failed to create %s image with modifier 0x%016llx",
+                            (key->fourcc == DRM_FORMAT_NV12) ? "NV12" : "NV21",
+                            (unsigned long long)key->modifier);
+            return 0;
+        }
+
+        glGenTextures(1, &entry->externalTexture);
+        gfxBindImportedTexture(GL_TEXTURE_EXTERNAL_OES, entry->externalTexture, entry->image);
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+    } else {
+        // Create Y plane texture
+        entry->yImage = gfxCreateDmaBufImage(gfx, key->width, key->height, DRM_FORMAT_R8, key->modifier, &planes[0], 1, NULL);
+        if (entry->yImage == EGL_NO_IMAGE) {
+            LOG_ERROR_EVERY(1000, "Failed to create Y plane image");
+            return 0;
+        }
+
+        glGenTextures(1, &entry->yTexture);
+        gfxBindImportedTexture(GL_TEXTURE_2D, entry->yTexture, entry->yImage);
+
+        // NV21 chroma is imported the same way; its swapped channels are undone by the matrix
+        entry->swapUV = (key->fourcc == DRM_FORMAT_NV21);
+        entry->uvImage = gfxCreateDmaBufImage(gfx, key->width / 2, key->height / 2, DRM_FORMAT_GR88, key->modifier, &planes[1], 1, NULL);
+        if (entry->uvImage == EGL_NO_IMAGE) {
+            LOG_ERROR_EVERY(1000, "Failed to create UV plane image with GR88");
+        } else {
+            glGenTextures(1, &entry->uvTexture);
+            gfxBindImportedTexture(GL_TEXTURE_2D, entry->uvTexture, entry->uvImage);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    return 1;
+}
+
+// Picks the YCbCr -> RGB matrix for the caps
+static void gfxReadColorimetry(struct Gfx * gfx, const GstVideoInfo * vinfo)
+{
+    struct ConvertColorimetry colorimetry;
+    convertReadColorimetry(&GST_VIDEO_INFO_COLORIMETRY(vinfo), &colorimetry);
+
+    // P010 keeps its 10 bits at the top of 16, so it samples like a 16 bit format
+    gfxSetColorimetry(gfx, &colorimetry, (GST_VIDEO_INFO_FORMAT(vinfo) == GST_VIDEO_FORMAT_P010_10LE) ? 16 : 8);
+}
+
+// Parses |caps| into gfx->videoInfo; formatting and parsing caps allocates, so only when they change
+// returns non-zero if the current caps are usable
+static int gfxUpdateVideoInfo(struct Gfx * gfx, GstCaps * caps)
+{
+    // New caps also mean new buffers
+    if (!gfx->caps || !gst_caps_is_equal(caps, gfx->caps)) {
+        gchar * capsString = gst_caps_to_string(caps);
+        LOG_INFO("video caps: %s", capsString);
+        statsSetCaps(capsString);
+        g_free(capsString);
+
+        gfxFlushImportCache(gfx);
+        gst_caps_replace(&gfx->caps, NULL);
+
+        GstVideoInfoDmaDrm * dma_info = &gfx->videoInfo;
+        if (gst_video_is_dma_drm_caps(caps)) {
+            if (!gst_video_info_dma_drm_from_caps(dma_info, caps)) {
+                LOG_ERROR("Failed to get DMA DRM video info from caps");
+                return 0;
+            }
+        } else {
+            // Plain DMABuf and system memory caps carry no modifier, so the layout is linear by definition
+            GstVideoInfo info;
+            if (!gst_video_info_from_caps(&info, caps) || !gst_video_info_dma_drm_from_video_info(dma_info, &info, DRM_FORMAT_MOD_LINEAR)) {
+                LOG_ERROR("Failed to get DMA DRM video info from caps");
+                return 0;
+            }
+        }
+        gst_caps_replace(&gfx->caps, caps);
+
+        gfxReadColorimetry(gfx, &dma_info->vinfo);
+        gfx->videoParN = GST_VIDEO_INFO_PAR_N(&dma_info->vinfo);
+        gfx->videoParD = GST_VIDEO_INFO_PAR_D(&dma_info->vinfo);
+        if ((GST_VIDEO_INFO_FPS_N(&dma_info->vinfo) > 0) && (GST_VIDEO_INFO_FPS_D(&dma_info->vinfo) > 0)) {
+            gfx->frameBudgetMs = (1000.0 * GST_VIDEO_INFO_FPS_D(&dma_info->vinfo)) / GST_VIDEO_INFO_FPS_N(&dma_info->vinfo);
+        }
+    }
+
+    return gfx->caps != NULL; // NULL: same caps as the ones that failed to parse
+}
+
+// Some decoders put the visible size in the caps and the coded one, padding included, in the video meta; that's
+// the size the planes have and the one crop meta is relative to
+static void gfxReadCodedSize(GstBuffer * buffer, gint * width, gint * height)
+{
+    GstVideoMeta * video_meta = gst_buffer_get_video_meta(buffer);
+    if (video_meta && (video_meta->width > 0) && (video_meta->height > 0)) {
+        *width = (gint)video_meta->width;
+        *height = (gint)video_meta->height;
+    }
+}
+
+// Decoders signal the visible region of padded frames (e.g. 1920x1088) with crop meta; |width| and |height| are
+// the coded size
+static void gfxReadCrop(GstBuffer * buffer, gint width, gint height, struct GfxImport * import)
+{
+    import->width = width;
+    import->height = height;
+    import->cropX = 0;
+    import->cropY = 0;
+    import->cropWidth = width;
+    import->cropHeight = height;
+    GstVideoCropMeta * crop_meta = gst_buffer_get_video_crop_meta(buffer);
+    if (crop_meta && (crop_meta->width > 0) && (crop_meta->height > 0) && ((gint)(crop_meta->x + crop_meta->width) <= width)
+        && ((gint)(crop_meta->y + crop_meta->height) <= height)) {
+        import->cropX = (gint)crop_meta->x;
+        import->cropY = (gint)crop_meta->y;
+        import->cropWidth = (gint)crop_meta->width;
+        import->cropHeight = (gint)crop_meta->height;
+    }
+}
+
+// Points |import| at textures wrapping the sample's DMA-BUF planes, creating them only for dmabufs not seen before
+// returns non-zero on success
+static int gfxImportSample(struct Gfx * gfx, GstBuffer * buffer, struct GfxImport * import)
+{
+    if (!eglCreateImageKHR || !eglDestroyImageKHR || !glEGLImageTargetTexture2DOES) {
+        LOG_ERROR_EVERY(1000, "EGL extensions not available");
+        return 0;
+    }
+
+    const GstVideoInfoDmaDrm * dma_info = &gfx->videoInfo;
+    gint width = GST_VIDEO_INFO_WIDTH(&dma_info->vinfo);
+    gint height = GST_VIDEO_INFO_HEIGHT(&dma_info->vinfo);
+    guint32 fourcc = dma_info->drm_fourcc;
+    guint64 modifier = dma_info->drm_modifier;
+    int external = (modifier != DRM_FORMAT_MOD_LINEAR) && (modifier != DRM_FORMAT_MOD_INVALID);
+
+    if (fourcc != DRM_FORMAT_NV12 && fourcc != DRM_FORMAT_NV21) {
+        LOG_ERROR_EVERY(1000, "Unsupported DRM fourcc: 0x%08x", fourcc);
+        return 0;
+    }
+    if (external && !gfx->externalShaderProgram) {
+        LOG_ERROR_EVERY(1000, "Can't import modifier 0x%016llx without GL_OES_EGL_image_external", (unsigned long long)modifier);
+        return 0;
+    }
+
+    // Try to get stride/offset from VideoMeta first, fall back to VideoInfo
+    gsize y_offset, uv_offset;
+    gint y_stride, uv_stride;
+
+    GstVideoMeta * video_meta = gst_buffer_get_video_meta(buffer);
+    gfxReadCodedSize(buffer, &width, &height);
+    if (video_meta && (video_meta->n_planes >= 2)) {
+        y_offset = video_meta->offset[0];
+        y_stride = video_meta->stride[0];
+        uv_offset = video_meta->offset[1];
         uv_stride = video_meta->stride[1];
-        // printf("Using VideoMeta: Y stride=%d offset=%zu, UV stride=%d offset=%zu\n", y_stride, y_offset, uv_stride, uv_offset);
     } else {
         // Fall back to GstVideoInfo plane offsets
-        y_offset = GST_VIDEO_INFO_PLANE_OFFSET(&dma_info.vinfo, 0);
-        y_stride = GST_VIDEO_INFO_PLANE_STRIDE(&dma_info.vinfo, 0);
-        uv_offset = GST_VIDEO_INFO_PLANE_OFFSET(&dma_info.vinfo, 1);
-        uv_stride = GST_VIDEO_INFO_PLANE_STRIDE(&dma_info.vinfo, 1);
-        // printf("Using VideoInfo: Y stride=%d offset=%zu, UV stride=%d offset=%zu\n", y_stride, y_offset, uv_stride, uv_offset);
-    }
-
-    // printf("DMA-BUF fd=%d, Y: offset=%zu stride=%d, UV: offset=%zu stride=%d, fourcc=0x%08x, %dx%d\n",
-    //        fd,
-    //        y_offset,
-    //        y_stride,
-    //        uv_offset,
-    //        uv_stride,
-    //        fourcc,
-    //        width,
-    //        height);
+        y_offset = GST_VIDEO_INFO_PLANE_OFFSET(&dma_info->vinfo, 0);
+        y_stride = GST_VIDEO_INFO_PLANE_STRIDE(&dma_info->vinfo, 0);
+        uv_offset = GST_VIDEO_INFO_PLANE_OFFSET(&dma_info->vinfo, 1);
+        uv_stride = GST_VIDEO_INFO_PLANE_STRIDE(&dma_info->vinfo, 1);
+    }
 
-    GLuint externalTexture;
-    glGenTextures(1, &externalTexture);
-    glBindTexture(GL_TEXTURE_EXTERNAL_OES, externalTexture);
+    // The offsets above are relative to the whole buffer; each plane may sit in its own memory / fd
+    struct GfxPlane planes[2];
+    if (!gfxFindPlane(buffer, y_offset, y_stride, &planes[0]) || !gfxFindPlane(buffer, uv_offset, uv_stride, &planes[1])) {
+        LOG_ERROR_EVERY(1000, "Buffer is not DMA-BUF memory");
+        return 0;
+    }
 
-    EGLImage image = EGL_NO_IMAGE;
+    gfxReadCrop(buffer, width, height, import);
+
+    LOG_TRACE("dmabuf Y: fd=%d offset=%zu stride=%d, UV: fd=%d offset=%zu stride=%d, fourcc=0x%08x, modifier=0x%016llx, %dx%d",
+              planes[0].fd,
+              planes[0].offset,
+              planes[0].stride,
+              planes[1].fd,
+              planes[1].offset,
+              planes[1].stride,
+              fourcc,
+              (unsigned long long)modifier,
+              width,
+              height);
+
+    // fds are per-process handles that may be reused; the inode identifies the dmabuf itself
+    struct GfxImportKey key;
+    memset(&key, 0, sizeof(key)); // compared with memcmp, padding included
+    key.fourcc = fourcc;
+    key.modifier = modifier;
+    key.width = width;
+    key.height = height;
+    if (!gfxIdentifyPlane(&planes[0], 0, &key) || !gfxIdentifyPlane(&planes[1], 1, &key)) {
+        LOG_ERROR_EVERY(1000, "Can't identify DMA-BUF planes");
+        return 0;
+    }
 
-    if (gfx->videoWidth != width || gfx->videoHeight != height) {
-        if (gfx->rgbTexture) {
-            glDeleteTextures(1, &gfx->rgbTexture);
+    ++gfx->importSerial;
+    for (int entryIndex = 0; entryIndex < GFX_IMPORT_CACHE_SIZE; ++entryIndex) {
+        struct GfxImportEntry * entry = &gfx->importCache[entryIndex];
+        if (entry->used && (memcmp(&entry->key, &key, sizeof(key)) == 0)) {
+            entry->lastUse = gfx->importSerial;
+            import->entry = entry;
+            ++gfx->importCacheHits;
+            statsAdd(STATS_IMPORT_CACHE_HITS, 1);
+            return 1;
         }
-        if (gfx->framebuffer) {
-            glDeleteFramebuffers(1, &gfx->framebuffer);
+    }
+
+    ++gfx->importCacheMisses;
+    statsAdd(STATS_IMPORT_CACHE_MISSES, 1);
+    struct GfxImportEntry * entry = gfxEvictImportEntry(gfx);
+    entry->key = key;
+    if (!gfxCreateImportEntry(gfx, entry, planes)) {
+        gfxReleaseImportEntry(gfx, entry);
+        return 0;
+    }
+    entry->used = 1;
+    entry->lastUse = gfx->importSerial;
+    import->entry = entry;
+    return 1;
+}
+
+// --------------------------------------------------------------------------------------
+// System memory upload
+
+// Texture formats for a plane of |components| channels, |bytes| wide each
+static void gfxUploadFormat(const struct Gfx * gfx, int components, int bytes, GLint * internalFormat, GLenum * format, GLenum * type)
+{
+    *type = (bytes == 2) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    if (gfx->glesVersion >= 3) {
+        if (bytes == 2) {
+            *internalFormat = (components == 2) ? GL_RG16_EXT : GL_R16_EXT;
+        } else {
+            *internalFormat = (components == 2) ? GL_RG8 : GL_R8;
         }
+        *format = (components == 2) ? GL_RG : GL_RED;
+    } else if (gfx->hasTextureRg) {
+        *format = (components == 2) ? GL_RG_EXT : GL_RED_EXT;
+        *internalFormat = (GLint)*format;
+    } else {
+        *format = GL_LUMINANCE; // only I420 is advertised, so never two channels
+        *internalFormat = GL_LUMINANCE;
+    }
+}
 
-        glGenTextures(1, &gfx->rgbTexture);
-        glBindTexture(GL_TEXTURE_2D, gfx->rgbTexture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+static GLuint gfxCreatePlaneTexture(const struct Gfx * gfx, int components, int bytes, gint width, gint height)
+{
+    GLint internalFormat;
+    GLenum format;
+    GLenum type;
+    gfxUploadFormat(gfx, components, bytes, &internalFormat, &format, &type);
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return texture;
+}
 
-        // printf("Created RGB texture %d (%dx%d)\n", gfx->rgbTexture, width, height);
+// (Re)creates the upload texture sets if the format or size changed
+static void gfxEnsureUploadTextures(struct Gfx * gfx, GstVideoFormat format, gint width, gint height)
+{
+    if (gfx->uploads[0].yTexture && (gfx->uploadFormat == format) && (gfx->uploadWidth == width) && (gfx->uploadHeight == height)) {
+        return;
+    }
 
-        glGenFramebuffers(1, &gfx->framebuffer);
-        glBindFramebuffer(GL_FRAMEBUFFER, gfx->framebuffer);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gfx->rgbTexture, 0);
+    gint chromaWidth = (width + 1) / 2;
+    gint chromaHeight = (height + 1) / 2;
+    int bytes = (format == GST_VIDEO_FORMAT_P010_10LE) ? 2 : 1;
+    for (int uploadIndex = 0; uploadIndex < GFX_UPLOAD_BUFFERS; ++uploadIndex) {
+        struct GfxImportEntry * entry = &gfx->uploads[uploadIndex];
+        gfxReleaseImportEntry(gfx, entry);
+        entry->yTexture = gfxCreatePlaneTexture(gfx, 1, bytes, width, height);
+        if (format == GST_VIDEO_FORMAT_I420) {
+            entry->planar = 1;
+            entry->uvTexture = gfxCreatePlaneTexture(gfx, 1, bytes, chromaWidth, chromaHeight);
+            entry->vTexture = gfxCreatePlaneTexture(gfx, 1, bytes, chromaWidth, chromaHeight);
+        } else {
+            entry->swapUV = (format == GST_VIDEO_FORMAT_NV21);
+            entry->uvTexture = gfxCreatePlaneTexture(gfx, 2, bytes, chromaWidth, chromaHeight);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-        // printf("Framebuffer status: 0x%x (complete=0x%x)\n", status, GL_FRAMEBUFFER_COMPLETE);
-        if (status != GL_FRAMEBUFFER_COMPLETE) {
-            printf("Framebuffer is not complete\n");
-            glDeleteTextures(1, &externalTexture);
-            eglDestroyImageKHR(gfx->eglDisplay, image);
-            return 0;
+    gfx->uploadFormat = format;
+    gfx->uploadWidth = width;
+    gfx->uploadHeight = height;
+    LOG_INFO("Upload textures: %s %dx%d", gst_video_format_to_string(format), width, height);
+}
+
+struct GfxUploadPlane
+{
+    const guint8 * data;
+    gint stride;
+    gint width;
+    gint height;
+    int components;
+    int bytes; // per component
+    GLuint texture;
+    gsize pboOffset;
+};
+
+// Uploads one plane into the bound texture from |pixels| (client memory, or an offset into the bound PBO)
+static void gfxUploadPlane(struct Gfx * gfx, const struct GfxUploadPlane * plane, const guint8 * pixels)
+{
+    GLint internalFormat;
+    GLenum format;
+    GLenum type;
+    gfxUploadFormat(gfx, plane->components, plane->bytes, &internalFormat, &format, &type);
+
+    gint pixelBytes = plane->components * plane->bytes;
+    gint rowBytes = plane->width * pixelBytes;
+    gint rowLength = 0;
+    if (plane->stride != rowBytes) {
+        if (gfx->hasUnpackRowLength && ((plane->stride % pixelBytes) == 0)) {
+            rowLength = plane->stride / pixelBytes;
+        } else {
+            // Without GL_UNPACK_ROW_LENGTH the rows have to be made contiguous first
+            gsize size = (gsize)rowBytes * (gsize)plane->height;
+            if (gfx->uploadStagingSize < size) {
+                guint8 * staging = realloc(gfx->uploadStaging, size);
+                if (!staging) {
+                    LOG_ERROR_EVERY(1000, "Failed to allocate upload staging buffer");
+                    return;
+                }
+                gfx->uploadStaging = staging;
+                gfx->uploadStagingSize = size;
+            }
+            for (gint row = 0; row < plane->height; ++row) {
+                memcpy(gfx->uploadStaging + ((gsize)row * rowBytes), pixels + ((gsize)row * plane->stride), rowBytes);
+            }
+            pixels = gfx->uploadStaging;
         }
+    }
 
-        gfx->videoWidth = width;
-        gfx->videoHeight = height;
+    glBindTexture(GL_TEXTURE_2D, plane->texture);
+    if (rowLength) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+    }
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, plane->width, plane->height, format, type, pixels);
+    if (rowLength) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     }
+}
 
-    // Let's try just filling the RGB texture with a solid color to test
-    glBindFramebuffer(GL_FRAMEBUFFER, gfx->framebuffer);
-    glViewport(0, 0, width, height);
-    glClearColor(1.0, 0.0, 0.0, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0); // Unbind framebuffer
-
-    // Create Y plane texture
-    EGLint yAttribs[] = { EGL_WIDTH,
-                          width,
-                          EGL_HEIGHT,
-                          height,
-                          EGL_LINUX_DRM_FOURCC_EXT,
-                          DRM_FORMAT_R8,
-                          EGL_DMA_BUF_PLANE0_FD_EXT,
-                          fd,
-                          EGL_DMA_BUF_PLANE0_OFFSET_EXT,
-                          y_offset,
-                          EGL_DMA_BUF_PLANE0_PITCH_EXT,
-                          y_stride,
-                          EGL_NONE };
-
-    EGLImage yImage = eglCreateImageKHR(gfx->eglDisplay, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, yAttribs);
-    if (yImage == EGL_NO_IMAGE) {
-        printf("Failed to create Y plane image\n");
-        glDeleteTextures(1, &externalTexture);
+// Copies the sample's system memory planes into the next set of upload textures and points |import| at it
+// returns non-zero on success
+static int gfxUploadSample(struct Gfx * gfx, GstBuffer * buffer, struct GfxImport * import)
+{
+    GstVideoInfo * vinfo = &gfx->videoInfo.vinfo;
+    GstVideoFormat format = GST_VIDEO_INFO_FORMAT(vinfo);
+    int supported = (format == GST_VIDEO_FORMAT_I420);
+    supported |= ((format == GST_VIDEO_FORMAT_NV12) || (format == GST_VIDEO_FORMAT_NV21)) && gfx->hasTextureRg;
+    supported |= (format == GST_VIDEO_FORMAT_P010_10LE) && gfx->hasTextureNorm16;
+    if (!supported) {
+        LOG_ERROR_EVERY(1000, "Can't upload %s frames", gst_video_format_to_string(format));
         return 0;
     }
 
-    GLuint yTexture;
-    glGenTextures(1, &yTexture);
-    glBindTexture(GL_TEXTURE_2D, yTexture);
-    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, yImage);
+    gint width = GST_VIDEO_INFO_WIDTH(vinfo);
+    gint height = GST_VIDEO_INFO_HEIGHT(vinfo);
+    gfxReadCodedSize(buffer, &width, &height);
+    gfxEnsureUploadTextures(gfx, format, width, height);
+
+    // Mapping honours the buffer's video meta, so decoder padding shows up as stride and the frame has its coded size
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, vinfo, buffer, GST_MAP_READ)) {
+        LOG_ERROR_EVERY(1000, "Failed to map video frame");
+        return 0;
+    }
+
+    gfx->uploadIndex = (gfx->uploadIndex + 1) % GFX_UPLOAD_BUFFERS;
+    struct GfxImportEntry * entry = &gfx->uploads[gfx->uploadIndex];
+    GLuint textures[3] = { entry->yTexture, entry->uvTexture, entry->vTexture };
+
+    struct GfxUploadPlane planes[3];
+    int planeCount = (int)GST_VIDEO_FRAME_N_PLANES(&frame);
+    gsize pboSize = 0;
+    int usePbo = gfx->hasPbo;
+    for (int planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+        struct GfxUploadPlane * plane = &planes[planeIndex];
+        plane->data = GST_VIDEO_FRAME_PLANE_DATA(&frame, planeIndex);
+        plane->stride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, planeIndex);
+        plane->width = GST_VIDEO_FRAME_COMP_WIDTH(&frame, planeIndex);
+        plane->height = GST_VIDEO_FRAME_COMP_HEIGHT(&frame, planeIndex);
+        plane->components = ((format != GST_VIDEO_FORMAT_I420) && (planeIndex == 1)) ? 2 : 1;
+        plane->bytes = (format == GST_VIDEO_FORMAT_P010_10LE) ? 2 : 1;
+        plane->texture = textures[planeIndex];
+        plane->pboOffset = pboSize;
+        usePbo = usePbo && ((plane->stride % (plane->components * plane->bytes)) == 0); // else the rows get repacked in client memory
+        pboSize += ((gsize)plane->stride * (gsize)plane->height + 15) & ~(gsize)15;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    // ES3: one copy per plane into a PBO the driver can DMA from, stride kept for GL_UNPACK_ROW_LENGTH
+    guint8 * mapped = NULL;
+    if (usePbo) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gfx->uploadPbos[gfx->uploadIndex]);
+        if (gfx->uploadPboSizes[gfx->uploadIndex] < pboSize) {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)pboSize, NULL, GL_STREAM_DRAW);
+            gfx->uploadPboSizes[gfx->uploadIndex] = pboSize;
+        }
+        mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr)pboSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (mapped) {
+            for (int planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+                const struct GfxUploadPlane * plane = &planes[planeIndex];
+                memcpy(mapped + plane->pboOffset, plane->data, (gsize)plane->stride * (gsize)plane->height);
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        } else {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    }
+
+    for (int planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+        const struct GfxUploadPlane * plane = &planes[planeIndex];
+        gfxUploadPlane(gfx, plane, mapped ? (const guint8 *)(uintptr_t)plane->pboOffset : plane->data);
+    }
+
+    if (mapped) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    gst_video_frame_unmap(&frame);
+
+    gfxReadCrop(buffer, width, height, import);
+    import->entry = entry;
+    return 1;
+}
+
+// Imports DMA-BUF samples, uploads system memory ones
+// returns non-zero on success
+static int gfxLoadSample(struct Gfx * gfx, GstSample * sample, struct GfxImport * import)
+{
+    GstBuffer * buffer = gst_sample_get_buffer(sample);
+    LOG_TRACE("adopted [%3.3f]", (double)GST_BUFFER_PTS(buffer) / 1000000000.0);
+
+    if (!gfxUpdateVideoInfo(gfx, gst_sample_get_caps(sample))) {
+        return 0;
+    }
+
+    GstMemory * memory = gst_buffer_peek_memory(buffer, 0);
+    if (memory && gst_is_dmabuf_memory(memory)) {
+        return gfxImportSample(gfx, buffer, import);
+    }
+    return gfxUploadSample(gfx, buffer, import);
+}
+
+// (Re)creates the RGB intermediate if its size changed
+// returns non-zero on success
+static int gfxEnsureIntermediate(struct Gfx * gfx, int width, int height)
+{
+    if (gfx->rgbTexture && (gfx->rgbWidth == width) && (gfx->rgbHeight == height)) {
+        return 1;
+    }
+
+    if (gfx->rgbTexture) {
+        glDeleteTextures(1, &gfx->rgbTexture);
+        gfx->rgbTexture = 0;
+    }
+    if (gfx->framebuffer) {
+        glDeleteFramebuffers(1, &gfx->framebuffer);
+        gfx->framebuffer = 0;
+    }
+
+    glGenTextures(1, &gfx->rgbTexture);
+    glBindTexture(GL_TEXTURE_2D, gfx->rgbTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    GLuint uvTexture = 0;
-    EGLImage uvImage = EGL_NO_IMAGE;
-
-    if (fourcc == DRM_FORMAT_NV12) {
-        EGLint uvAttribs[] = { EGL_WIDTH,
-                               width / 2,
-                               EGL_HEIGHT,
-                               height / 2,
-                               EGL_LINUX_DRM_FOURCC_EXT,
-                               DRM_FORMAT_GR88,
-                               EGL_DMA_BUF_PLANE0_FD_EXT,
-                               fd,
-                               EGL_DMA_BUF_PLANE0_OFFSET_EXT,
-                               uv_offset,
-                               EGL_DMA_BUF_PLANE0_PITCH_EXT,
-                               uv_stride,
-                               EGL_NONE };
-
-        uvImage = eglCreateImageKHR(gfx->eglDisplay, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, uvAttribs);
-        if (uvImage == EGL_NO_IMAGE) {
-            printf("Failed to create UV plane image with GR88\n");
-            uvTexture = 0;
-        } else {
-            // printf("GR88 format worked!\n");
-            glGenTextures(1, &uvTexture);
-            glBindTexture(GL_TEXTURE_2D, uvTexture);
-            glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, uvImage);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        }
+    LOG_DEBUG("created RGB texture %u (%dx%d)", gfx->rgbTexture, width, height);
+
+    glGenFramebuffers(1, &gfx->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, gfx->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gfx->rgbTexture, 0);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        LOG_ERROR("Framebuffer is not complete: status 0x%x", status);
+        return 0;
     }
 
+    gfx->rgbWidth = width;
+    gfx->rgbHeight = height;
+    return 1;
+}
+
+// Converts the imported YUV planes to RGB into |viewport| of |framebuffer|
+// |flip| puts the first image row at the top, as wanted when drawing straight to the window
+static void gfxDrawImport(struct Gfx * gfx, const struct GfxImport * import, GLuint framebuffer, const struct GfxRect * viewport, int flip)
+{
     // Render YUV to RGB
     GLint oldViewport[4];
     glGetIntegerv(GL_VIEWPORT, oldViewport);
@@ -504,42 +1673,75 @@ static int gfxConvertSample(struct Gfx * gfx)
     glGetIntegerv(GL_CURRENT_PROGRAM, &oldProgram);
     GLint oldActiveTexture;
     glGetIntegerv(GL_ACTIVE_TEXTURE, &oldActiveTexture);
-    GLint oldTexture0, oldTexture1;
+    GLint oldTexture0, oldTexture1, oldTexture2;
     glActiveTexture(GL_TEXTURE0);
     glGetIntegerv(GL_TEXTURE_BINDING_2D, &oldTexture0);
     glActiveTexture(GL_TEXTURE1);
     glGetIntegerv(GL_TEXTURE_BINDING_2D, &oldTexture1);
+    glActiveTexture(GL_TEXTURE2);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &oldTexture2);
 
     // Save vertex attribute array state
     GLint oldArrayBuffer;
     glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &oldArrayBuffer);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, gfx->framebuffer);
-    glViewport(0, 0, width, height);
-    glUseProgram(gfx->yuvShaderProgram);
+    const struct GfxImportEntry * entry = import->entry;
+    GLuint program = entry->external ? gfx->externalShaderProgram : (entry->planar ? gfx->planarShaderProgram : gfx->yuvShaderProgram);
+
+    // Only the visible region is converted, sampled straight out of the coded frame
+    GLfloat vertices[16];
+    memcpy(vertices, flip ? renderVertices : convertVertices, sizeof(vertices));
+    for (int vertexIndex = 0; vertexIndex < 4; ++vertexIndex) {
+        GLfloat * texCoord = &vertices[(vertexIndex * 4) + 2];
+        texCoord[0] = ((GLfloat)import->cropX + (texCoord[0] * (GLfloat)import->cropWidth)) / (GLfloat)import->width;
+        texCoord[1] = ((GLfloat)import->cropY + (texCoord[1] * (GLfloat)import->cropHeight)) / (GLfloat)import->height;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(viewport->x, viewport->y, viewport->width, viewport->height);
+    glUseProgram(program);
 
-    GLint positionAttrib = glGetAttribLocation(gfx->yuvShaderProgram, "position");
-    GLint texCoordAttrib = glGetAttribLocation(gfx->yuvShaderProgram, "texCoord");
-    GLint yTextureUniform = glGetUniformLocation(gfx->yuvShaderProgram, "u_textureY");
-    GLint uvTextureUniform = glGetUniformLocation(gfx->yuvShaderProgram, "u_textureUV");
-    GLint hasUVUniform = glGetUniformLocation(gfx->yuvShaderProgram, "u_hasUV");
+    GLint positionAttrib = glGetAttribLocation(program, "position");
+    GLint texCoordAttrib = glGetAttribLocation(program, "texCoord");
 
     glEnableVertexAttribArray(positionAttrib);
-    glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), convertVertices);
+    glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), vertices);
     glEnableVertexAttribArray(texCoordAttrib);
-    glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), convertVertices + 2);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, yTexture);
-    glUniform1i(yTextureUniform, 0);
-
-    if (uvTexture != 0) {
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, uvTexture);
-        glUniform1i(uvTextureUniform, 1);
-        glUniform1i(hasUVUniform, 1);
+    glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), vertices + 2);
+
+    if (entry->external) {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, entry->externalTexture);
+        glUniform1i(glGetUniformLocation(program, "u_texture"), 0);
+    } else if (entry->planar) {
+        glUniformMatrix3fv(glGetUniformLocation(program, "u_yuvMatrix"), 1, GL_FALSE, gfx->yuvMatrix);
+        glUniform3fv(glGetUniformLocation(program, "u_yuvOffset"), 1, gfx->yuvOffset);
+        GLuint planeTextures[3] = { entry->yTexture, entry->uvTexture, entry->vTexture };
+        static const char * planeUniforms[3] = { "u_textureY", "u_textureU", "u_textureV" };
+        for (int planeIndex = 0; planeIndex < 3; ++planeIndex) {
+            glActiveTexture(GL_TEXTURE0 + planeIndex);
+            glBindTexture(GL_TEXTURE_2D, planeTextures[planeIndex]);
+            glUniform1i(glGetUniformLocation(program, planeUniforms[planeIndex]), planeIndex);
+        }
     } else {
-        glUniform1i(hasUVUniform, 0);
+        GLint yTextureUniform = glGetUniformLocation(program, "u_textureY");
+        GLint uvTextureUniform = glGetUniformLocation(program, "u_textureUV");
+        GLint hasUVUniform = glGetUniformLocation(program, "u_hasUV");
+        glUniformMatrix3fv(glGetUniformLocation(program, "u_yuvMatrix"), 1, GL_FALSE, entry->swapUV ? gfx->yuvMatrixSwapped : gfx->yuvMatrix);
+        glUniform3fv(glGetUniformLocation(program, "u_yuvOffset"), 1, gfx->yuvOffset);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, entry->yTexture);
+        glUniform1i(yTextureUniform, 0);
+
+        if (entry->uvTexture != 0) {
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, entry->uvTexture);
+            glUniform1i(uvTextureUniform, 1);
+            glUniform1i(hasUVUniform, 1);
+        } else {
+            glUniform1i(hasUVUniform, 0);
+        }
     }
 
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, indices);
@@ -549,74 +1751,637 @@ static int gfxConvertSample(struct Gfx * gfx)
     glViewport(oldViewport[0], oldViewport[1], oldViewport[2], oldViewport[3]);
     glUseProgram(oldProgram);
     glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
     glBindTexture(GL_TEXTURE_2D, oldTexture0);
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_2D, oldTexture1);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, oldTexture2);
     glActiveTexture(oldActiveTexture);
     glBindBuffer(GL_ARRAY_BUFFER, oldArrayBuffer);
     glDisableVertexAttribArray(positionAttrib);
     glDisableVertexAttribArray(texCoordAttrib);
+}
 
-    // Cleanup
-    glDeleteTextures(1, &yTexture);
-    if (uvTexture)
-        glDeleteTextures(1, &uvTexture);
-    eglDestroyImageKHR(gfx->eglDisplay, yImage);
-    if (uvImage != EGL_NO_IMAGE)
-        eglDestroyImageKHR(gfx->eglDisplay, uvImage);
-
-    // printf("Rendered YUV planes to RGB texture\n");
+// returns non-zero on success
+static int gfxConvertImport(struct Gfx * gfx)
+{
+    // Reduced quality converts at half resolution and lets the final pass upscale
+    int reduce = (gfx->quality == GFX_QUALITY_REDUCED) ? 2 : 1;
+    int width = (gfx->import.cropWidth + reduce - 1) / reduce;
+    int height = (gfx->import.cropHeight + reduce - 1) / reduce;
+    if (!gfxEnsureIntermediate(gfx, width, height)) {
+        return 0;
+    }
 
-    glDeleteTextures(1, &externalTexture);
-    eglDestroyImageKHR(gfx->eglDisplay, image);
+    struct GfxRect viewport = { 0, 0, width, height };
+    gfxDrawImport(gfx, &gfx->import, gfx->framebuffer, &viewport, 0);
     return 1;
 }
 
-void gfxRender(struct Gfx * gfx)
+// --------------------------------------------------------------------------------------
+// Quality governor
+
+static const char * qualityNames[GFX_QUALITY_COUNT] = { "full", "reduced", "direct", "compositor" };
+
+// Matches the EGL window to the quality level; the compositor level renders at half size and lets wp_viewporter scale
+static void gfxApplyBufferSize(struct Gfx * gfx)
+{
+    int compositor = (gfx->quality == GFX_QUALITY_COMPOSITOR);
+    int width = compositor ? ((gfx->surfaceWidth + 1) / 2) : gfx->surfaceWidth;
+    int height = compositor ? ((gfx->surfaceHeight + 1) / 2) : gfx->surfaceHeight;
+
+    if ((width != gfx->width) || (height != gfx->height)) {
+        if (gfx->eglNative) {
+            wl_egl_window_resize(gfx->eglNative, width, height, 0, 0);
+        }
+        gfx->width = width;
+        gfx->height = height;
+        gfx->layoutAge = 0;
+    }
+
+    if (gfx->viewport) {
+        if (compositor) {
+            wp_viewport_set_destination(gfx->viewport, gfx->surfaceWidth, gfx->surfaceHeight);
+        } else {
+            wp_viewport_set_destination(gfx->viewport, -1, -1);
+        }
+    }
+}
+
+static void gfxSetQualityLevel(struct Gfx * gfx, int quality)
+{
+    if (quality == gfx->quality) {
+        return;
+    }
+
+    LOG_INFO("quality: %s -> %s (cpu %.2fms, gpu %.2fms, budget %.2fms)",
+             qualityNames[gfx->quality],
+             qualityNames[quality],
+             gfx->cpuFrameMs,
+             gfx->gpuFrameMs,
+             gfx->frameBudgetMs);
+
+    gfx->quality = quality;
+    statsSetGauge(STATS_GAUGE_QUALITY, quality);
+    ++gfx->qualityTransitions;
+    gfx->overBudgetFrames = 0;
+    gfx->underBudgetFrames = 0;
+    gfx->intermediateValid = 0;
+    gfx->dirty = 1;
+    gfxApplyBufferSize(gfx);
+}
+
+void gfxSetQuality(struct Gfx * gfx, int quality)
+{
+    if ((quality < 0) || (quality >= GFX_QUALITY_COUNT)) {
+        gfx->qualityLocked = 0;
+        return;
+    }
+    if ((quality == GFX_QUALITY_COMPOSITOR) && !gfx->viewport) {
+        quality = GFX_QUALITY_DIRECT;
+    }
+
+    gfx->qualityLocked = 1;
+    gfxSetQualityLevel(gfx, quality);
+}
+
+static void gfxBeginTimer(struct Gfx * gfx, int pass)
+{
+    if (gfx->timing) {
+        glBeginQueryEXT(GL_TIME_ELAPSED_EXT, gfx->timerQueries[gfx->timerQueryIndex][pass]);
+        gfx->timerPasses[gfx->timerQueryIndex] |= 1 << pass;
+    }
+}
+
+static void gfxEndTimer(struct Gfx * gfx)
 {
+    if (gfx->timing) {
+        glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+    }
+}
+
+// Collects the oldest frames' GPU timer results, if the GPU is done with them
+static void gfxReadTimerQueries(struct Gfx * gfx)
+{
+    static const int passHistograms[GFX_PASS_COUNT] = { STATS_GPU_CONVERT, STATS_GPU_PRESENT };
+
+    while (gfx->timerQueriesPending > 0) {
+        int oldest = (gfx->timerQueryIndex + GFX_TIMER_QUERIES - gfx->timerQueriesPending) % GFX_TIMER_QUERIES;
+        GLuint available = 0;
+        glGetQueryObjectuivEXT(gfx->timerQueries[oldest][GFX_PASS_PRESENT], GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+        if (!available) {
+            break; // the frame's last pass, so the others are done too
+        }
+
+        GLuint64 passNs[GFX_PASS_COUNT] = { 0 };
+        GLuint64 elapsedNs = 0;
+        for (int pass = 0; pass < GFX_PASS_COUNT; ++pass) {
+            if (gfx->timerPasses[oldest] & (1 << pass)) {
+                glGetQueryObjectui64vEXT(gfx->timerQueries[oldest][pass], GL_QUERY_RESULT_EXT, &passNs[pass]);
+                elapsedNs += passNs[pass];
+            }
+        }
+        --gfx->timerQueriesPending;
+
+        // A disjoint operation (e.g. a frequency change) makes the result meaningless
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        if (!disjoint) {
+            double elapsedMs = (double)elapsedNs / 1000000.0;
+            gfx->gpuFrameMs = (gfx->gpuFrameMs > 0.0) ? ((gfx->gpuFrameMs * 7.0) + elapsedMs) / 8.0 : elapsedMs;
+            for (int pass = 0; pass < GFX_PASS_COUNT; ++pass) {
+                if (gfx->timerPasses[oldest] & (1 << pass)) {
+                    statsObserve(passHistograms[pass], passNs[pass]);
+                }
+            }
+        }
+    }
+}
+
+// Steps quality down quickly when a frame's CPU or GPU cost eats the budget, and back up slowly once there's headroom
+static void gfxGovern(struct Gfx * gfx, double cpuMs)
+{
+    gfx->cpuFrameMs = (gfx->cpuFrameMs > 0.0) ? ((gfx->cpuFrameMs * 7.0) + cpuMs) / 8.0 : cpuMs;
+    if (gfx->qualityLocked) {
+        return;
+    }
+
+    double cost = (gfx->cpuFrameMs > gfx->gpuFrameMs) ? gfx->cpuFrameMs : gfx->gpuFrameMs;
+    int lowest = gfx->viewport ? GFX_QUALITY_COMPOSITOR : GFX_QUALITY_DIRECT;
+
+    if (cost > (gfx->frameBudgetMs * GFX_GOVERNOR_DOWN_THRESHOLD)) {
+        gfx->underBudgetFrames = 0;
+        if ((++gfx->overBudgetFrames >= GFX_GOVERNOR_DOWN_FRAMES) && (gfx->quality < lowest)) {
+            gfxSetQualityLevel(gfx, gfx->quality + 1);
+        }
+    } else if (cost < (gfx->frameBudgetMs * GFX_GOVERNOR_UP_THRESHOLD)) {
+        gfx->overBudgetFrames = 0;
+        if ((++gfx->underBudgetFrames >= GFX_GOVERNOR_UP_FRAMES) && (gfx->quality > GFX_QUALITY_FULL)) {
+            gfxSetQualityLevel(gfx, gfx->quality - 1);
+        }
+    } else {
+        gfx->overBudgetFrames = 0;
+        gfx->underBudgetFrames = 0;
+    }
+}
+
+void gfxGetStats(struct Gfx * gfx, struct GfxStats * stats)
+{
+    stats->quality = gfx->quality;
+    stats->qualityLocked = gfx->qualityLocked;
+    stats->qualityTransitions = gfx->qualityTransitions;
+    stats->framesPresented = gfx->framesPresented;
+    stats->cpuFrameMs = gfx->cpuFrameMs;
+    stats->gpuFrameMs = gfx->gpuFrameMs;
+    stats->frameBudgetMs = gfx->frameBudgetMs;
+    stats->importCacheHits = gfx->importCacheHits;
+    stats->importCacheMisses = gfx->importCacheMisses;
+    stats->swapAllocations = gfx->swapAllocations;
+}
+
+int gfxConvertSample(struct Gfx * gfx, GstSample * sample, uint8_t * pixels)
+{
+    // Never reduced: this is about the conversion, not the frame budget
+    int quality = gfx->quality;
+    gfx->quality = GFX_QUALITY_FULL;
+    gfx->import.entry = NULL;
+    int converted = gfxLoadSample(gfx, sample, &gfx->import) && gfxConvertImport(gfx);
+    gfx->quality = quality;
+    gfx->intermediateValid = 0; // no longer the sample gfxRender() holds
+    if (!converted) {
+        return 0;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gfx->framebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, gfx->rgbWidth, gfx->rgbHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return glGetError() == GL_NO_ERROR;
+}
+
+// --------------------------------------------------------------------------------------
+// Capture
+
+static void gfxSubmitReadback(struct Gfx * gfx, struct GfxReadback * readback, const uint8_t * pixels)
+{
+    readback->frame.pixels = pixels;
+    readback->frame.stride = readback->frame.width * 4;
+    readback->state = GFX_READBACK_CAPTURING;
+    captureSubmit(gfx->capture, &readback->frame);
+}
+
+// Hands pending readbacks to the writer once the GPU is done with them, and recycles the ones it has written
+// |wait| blocks until every pending readback could be handed over
+// returns the number of readbacks still in use
+static int gfxPollReadbacks(struct Gfx * gfx, int wait)
+{
+    int busy = 0;
+    int blocked = 0; // an earlier readback isn't ready, so later ones must wait to keep the frames in order
+    for (int offset = 0; offset < GFX_READBACKS; ++offset) {
+        struct GfxReadback * readback = &gfx->readbacks[(gfx->readbackNext + offset) % GFX_READBACKS];
+
+        if ((readback->state == GFX_READBACK_PENDING) && !blocked) {
+            if (readback->fence) {
+                GLenum status = glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000ull : 0);
+                if (wait || (status == GL_ALREADY_SIGNALED) || (status == GL_CONDITION_SATISFIED)) {
+                    glDeleteSync(readback->fence);
+                    readback->fence = NULL;
+
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+                    const uint8_t * pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback->pboSize, GL_MAP_READ_BIT);
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                    if (pixels) {
+                        readback->mapped = 1;
+                        gfxSubmitReadback(gfx, readback, pixels);
+                    } else {
+                        LOG_ERROR_EVERY(1000, "Capture: glMapBufferRange() failed");
+                        readback->state = GFX_READBACK_FREE;
+                    }
+                }
+            } else if (wait || ((gfx->framesPresented - readback->startFrame) >= GFX_READBACK_DELAY)) {
+                glBindFramebuffer(GL_FRAMEBUFFER, readback->framebuffer);
+                glReadPixels(0, 0, readback->frame.width, readback->frame.height, GL_RGBA, GL_UNSIGNED_BYTE, readback->pixels);
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                gfxSubmitReadback(gfx, readback, readback->pixels);
+            }
+            blocked = (readback->state == GFX_READBACK_PENDING);
+        }
+
+        if ((readback->state == GFX_READBACK_CAPTURING) && atomic_load_explicit(&readback->frame.done, memory_order_acquire)) {
+            if (readback->mapped) {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                readback->mapped = 0;
+            }
+            readback->state = GFX_READBACK_FREE;
+        }
+        busy += (readback->state != GFX_READBACK_FREE);
+    }
+    return busy;
+}
+
+// returns non-zero if |readback| has a texture and framebuffer of this format and size
+static int gfxEnsureReadbackTexture(struct GfxReadback * readback, GLenum format, int width, int height)
+{
+    if (readback->texture && (readback->textureFormat == format) && (readback->frame.width == width)
+        && (readback->frame.height == height)) {
+        return readback->textureUsable;
+    }
+
+    if (!readback->texture) {
+        glGenTextures(1, &readback->texture);
+        glGenFramebuffers(1, &readback->framebuffer);
+    }
+    glBindTexture(GL_TEXTURE_2D, readback->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, (GLint)format, width, height, 0, format, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, readback->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, readback->texture, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    readback->textureFormat = format;
+    readback->textureUsable = (status == GL_FRAMEBUFFER_COMPLETE);
+    return readback->textureUsable;
+}
+
+// Starts reading back the frame just drawn; it reaches the writer a frame or two later
+// |fromIntermediate| reads the converted video out of the intermediate, otherwise |rect| of the window
+static void gfxStartReadback(struct Gfx * gfx, int fromIntermediate, const struct GfxRect * rect)
+{
+    struct GfxReadback * readback = &gfx->readbacks[gfx->readbackNext];
+    if (readback->state != GFX_READBACK_FREE) {
+        ++gfx->capturesSkipped;
+        LOG_WARN_EVERY(1000, "Capture: readbacks backed up, skipping frames");
+        return;
+    }
+
+    GLuint framebuffer = fromIntermediate ? gfx->framebuffer : 0;
+    int x = fromIntermediate ? 0 : rect->x;
+    int y = fromIntermediate ? 0 : rect->y;
+    int width = fromIntermediate ? gfx->rgbWidth : rect->width;
+    int height = fromIntermediate ? gfx->rgbHeight : rect->height;
+    if ((width <= 0) || (height <= 0)) {
+        return;
+    }
+
+    GstBuffer * buffer = gst_sample_get_buffer(gfx->sample);
+    readback->frame.number = gfx->samplesPresented + 1;
+    readback->frame.ptsNs = (buffer && GST_BUFFER_PTS_IS_VALID(buffer)) ? GST_BUFFER_PTS(buffer) : 0;
+    readback->frame.bottomUp = !fromIntermediate; // the intermediate is drawn top row first, the window bottom row first
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    if (gfx->hasFences) {
+        GLsizeiptr size = (GLsizeiptr)width * height * 4;
+        if (!readback->pbo) {
+            glGenBuffers(1, &readback->pbo);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+        if (readback->pboSize != size) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+            readback->pboSize = size;
+        }
+        glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        readback->frame.width = width;
+        readback->frame.height = height;
+        readback->state = GFX_READBACK_PENDING;
+    } else {
+        size_t size = (size_t)width * height * 4;
+        if (readback->pixelsSize < size) {
+            free(readback->pixels);
+            readback->pixels = malloc(size);
+            readback->pixelsSize = readback->pixels ? size : 0;
+            if (!readback->pixels) {
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                return;
+            }
+        }
+
+        // The window may have no alpha, which a copy can't add, and RGB may not be renderable; then read it right away
+        GLenum format = fromIntermediate ? GL_RGBA : GL_RGB;
+        if (gfxEnsureReadbackTexture(readback, format, width, height)) {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+            glBindTexture(GL_TEXTURE_2D, readback->texture);
+            glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, x, y, width, height);
+            readback->frame.width = width;
+            readback->frame.height = height;
+            readback->startFrame = gfx->framesPresented;
+            readback->state = GFX_READBACK_PENDING;
+        } else {
+            LOG_WARN_EVERY(10000, "Capture: no deferred readback for this format, reading back synchronously");
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+            glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, readback->pixels);
+            readback->frame.width = width;
+            readback->frame.height = height;
+            gfxSubmitReadback(gfx, readback, readback->pixels);
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    gfx->readbackNext = (gfx->readbackNext + 1) % GFX_READBACKS;
+}
+
+static void gfxReleaseReadbacks(struct Gfx * gfx)
+{
+    for (int index = 0; index < GFX_READBACKS; ++index) {
+        struct GfxReadback * readback = &gfx->readbacks[index];
+        if (readback->pbo) {
+            glDeleteBuffers(1, &readback->pbo);
+        }
+        if (readback->texture) {
+            glDeleteTextures(1, &readback->texture);
+        }
+        if (readback->framebuffer) {
+            glDeleteFramebuffers(1, &readback->framebuffer);
+        }
+        free(readback->pixels);
+        memset(readback, 0, sizeof(*readback));
+    }
+    gfx->readbackNext = 0;
+}
+
+void gfxSetCapture(struct Gfx * gfx, struct Capture * capture)
+{
+    if (capture == gfx->capture) {
+        return;
+    }
+
+    // Whatever was read back for the old capture still goes to it: waiting hands every pending readback over, then
+    // the writer is done with all of them once it's flushed, and they can be unmapped
+    if (gfx->capture) {
+        gfxPollReadbacks(gfx, 1);
+        captureFlush(gfx->capture);
+        gfxPollReadbacks(gfx, 0);
+        gfxReleaseReadbacks(gfx);
+        if (gfx->capturesSkipped) {
+            LOG_WARN("Capture: %lu frames skipped waiting for readbacks", gfx->capturesSkipped);
+        }
+    }
+
+    gfx->capture = capture;
+    gfx->capturesSkipped = 0;
+    if (capture) {
+        LOG_INFO("Capture: %s readback", gfx->hasFences ? "asynchronous PBO" : "deferred copy");
+    }
+}
+
+// --------------------------------------------------------------------------------------
+
+void gfxResize(struct Gfx * gfx, int width, int height)
+{
+    if ((width == gfx->surfaceWidth) && (height == gfx->surfaceHeight)) {
+        return;
+    }
+
+    gfx->surfaceWidth = width;
+    gfx->surfaceHeight = height;
+    gfxApplyBufferSize(gfx);
+    gfx->layoutAge = 0;
+    gfx->dirty = 1;
+}
+
+void gfxInvalidate(struct Gfx * gfx)
+{
+    gfx->dirty = 1;
+}
+
+// Fits the video into the surface preserving its display aspect ratio
+static void gfxComputeVideoRect(struct Gfx * gfx, struct GfxRect * rect)
+{
+    rect->x = 0;
+    rect->y = 0;
+    rect->width = gfx->width;
+    rect->height = gfx->height;
+
+    if (!gfx->import.entry) {
+        return; // the debug texture just fills the surface
+    }
+
+    int parN = (gfx->videoParN > 0) ? gfx->videoParN : 1;
+    int parD = (gfx->videoParD > 0) ? gfx->videoParD : 1;
+    double videoAspect = ((double)gfx->import.cropWidth * parN) / ((double)gfx->import.cropHeight * parD);
+    double surfaceAspect = (double)gfx->width / (double)gfx->height;
+
+    if (videoAspect > surfaceAspect) {
+        rect->height = (EGLint)(((double)gfx->width / videoAspect) + 0.5);
+    } else {
+        rect->width = (EGLint)(((double)gfx->height * videoAspect) + 0.5);
+    }
+    rect->x = (gfx->width - rect->width) / 2;
+    rect->y = (gfx->height - rect->height) / 2;
+}
+
+int gfxRender(struct Gfx * gfx)
+{
+    uint64_t const frameStart = timeNowNs();
+
+    if (gfx->capture) {
+        gfxPollReadbacks(gfx, 0);
+    }
+
     GstSample * sample = playerAdoptSample(gfx->player);
+    if (sample && !gfxFrameCacheAdopt(gfx, sample)) {
+        playerReleaseSample(gfx->player, sample);
+        sample = NULL;
+    }
 
     if (sample) {
+        gfx->dirty = 1;
+        gfx->samplePending = 1;
+
+        // The cache keeps the previous frame's textures; only the sample goes back to the decoder
+        gfx->import.entry = NULL;
         if (gfx->sample) {
-            gst_sample_unref(gfx->sample);
+            playerReleaseSample(gfx->player, gfx->sample);
         }
         gfx->sample = sample;
 
-        if (gfxConvertSample(gfx)) {
-            if (gfx->videoTexture && gfx->videoTexture != gfx->rgbTexture) {
-                glDeleteTextures(1, &gfx->videoTexture);
-            }
-            gfx->videoTexture = gfx->rgbTexture;
+        gfxLoadSample(gfx, gfx->sample, &gfx->import);
+        gfx->intermediateValid = 0;
+    }
+
+    GLuint cachedTexture = (gfx->frameCacheState == GFX_FRAME_CACHE_PLAYING) ? gfxFrameCacheTexture(gfx) : 0;
+
+    // Nothing changed since the last swap, so the committed buffer is still correct
+    if (!gfx->dirty) {
+        return 0;
+    }
+
+    // Reissuing queries whose results haven't been read would lose them, so a frame goes untimed instead
+    if (gfx->hasTimerQueries) {
+        gfxReadTimerQueries(gfx);
+        gfx->timing = (gfx->timerQueriesPending < GFX_TIMER_QUERIES);
+        if (gfx->timing) {
+            gfx->timerPasses[gfx->timerQueryIndex] = 0;
         } else {
-            gfx->videoTexture = 0;
+            ++gfx->timersSkipped;
+            LOG_DEBUG_EVERY(1000, "GPU timer results backed up, %lu frames untimed", gfx->timersSkipped);
         }
     }
 
-    GLint positionAttrib = glGetAttribLocation(gfx->shaderProgram, "position");
-    GLint texCoordAttrib = glGetAttribLocation(gfx->shaderProgram, "texCoord");
-    GLint textureUniform = glGetUniformLocation(gfx->shaderProgram, "u_texture");
+    // The direct levels skip the RGB intermediate and convert straight into the window
+    int direct = (gfx->quality >= GFX_QUALITY_DIRECT) && !cachedTexture;
+    GLuint videoTexture = cachedTexture;
+    if (gfx->import.entry && !direct && !cachedTexture) {
+        if (!gfx->intermediateValid) {
+            gfxBeginTimer(gfx, GFX_PASS_CONVERT);
+            gfx->intermediateValid = gfxConvertImport(gfx);
+            gfxEndTimer(gfx);
+        }
+        if (gfx->intermediateValid) {
+            videoTexture = gfx->rgbTexture;
+        }
+    }
+    if (sample && (gfx->frameCacheState == GFX_FRAME_CACHE_RECORDING)) {
+        gfxRecordFrame(gfx);
+    }
 
-    glViewport(0, 0, gfx->width, gfx->height);
-    glClearColor(0.0, 0.0, 0.5, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glUseProgram(gfx->shaderProgram);
+    struct GfxRect videoRect;
+    gfxComputeVideoRect(gfx, &videoRect);
+    if (memcmp(&videoRect, &gfx->videoRect, sizeof(videoRect)) != 0) {
+        gfx->videoRect = videoRect;
+        gfx->layoutAge = 0;
+    }
 
-    glEnableVertexAttribArray(positionAttrib);
-    glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), renderVertices);
+    // A back buffer last drawn after the current layout settled already has the right bars
+    EGLint bufferAge = 0;
+    if (gfx->hasBufferAge && !eglQuerySurface(gfx->eglDisplay, gfx->eglSurface, EGL_BUFFER_AGE_EXT, &bufferAge)) {
+        bufferAge = 0;
+    }
+    int paintBars = (bufferAge <= 0) || (bufferAge > gfx->layoutAge);
 
-    glEnableVertexAttribArray(texCoordAttrib);
-    glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), renderVertices + 2);
+    gfxBeginTimer(gfx, GFX_PASS_PRESENT);
 
-    glActiveTexture(GL_TEXTURE0);
-    if (gfx->videoTexture) {
-        // printf("Using video texture %d\n", gfx->videoTexture);
-        glBindTexture(GL_TEXTURE_2D, gfx->videoTexture);
+    struct GfxRect surfaceRect = { 0, 0, gfx->width, gfx->height };
+    if (eglSetDamageRegionKHR) {
+        eglSetDamageRegionKHR(gfx->eglDisplay, gfx->eglSurface, paintBars ? &surfaceRect.x : &videoRect.x, 1);
+    }
+
+    if (paintBars) {
+        glViewport(0, 0, gfx->width, gfx->height);
+        glClearColor(0.0, 0.0, 0.5, 1.0);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    // The quad covers the whole video rect, so it needs no clear of its own
+    glScissor(videoRect.x, videoRect.y, videoRect.width, videoRect.height);
+    glEnable(GL_SCISSOR_TEST);
+
+    if (direct && gfx->import.entry) {
+        gfxDrawImport(gfx, &gfx->import, 0, &videoRect, 1);
     } else {
-        // printf("Using debug texture %d\n", gfx->debugTexture);
-        glBindTexture(GL_TEXTURE_2D, gfx->debugTexture);
+        GLint positionAttrib = glGetAttribLocation(gfx->shaderProgram, "position");
+        GLint texCoordAttrib = glGetAttribLocation(gfx->shaderProgram, "texCoord");
+        GLint textureUniform = glGetUniformLocation(gfx->shaderProgram, "u_texture");
+
+        glViewport(videoRect.x, videoRect.y, videoRect.width, videoRect.height);
+        glUseProgram(gfx->shaderProgram);
+
+        glEnableVertexAttribArray(positionAttrib);
+        glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), renderVertices);
+
+        glEnableVertexAttribArray(texCoordAttrib);
+        glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), renderVertices + 2);
+
+        glActiveTexture(GL_TEXTURE0);
+        if (videoTexture) {
+            glBindTexture(GL_TEXTURE_2D, videoTexture);
+        } else {
+            glBindTexture(GL_TEXTURE_2D, gfx->debugTexture);
+        }
+        glUniform1i(textureUniform, 0);
+
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, indices);
     }
-    glUniform1i(textureUniform, 0);
+    glDisable(GL_SCISSOR_TEST);
 
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, indices);
-    eglSwapBuffers(gfx->eglDisplay, gfx->eglSurface);
+    if (gfx->timing) {
+        gfxEndTimer(gfx);
+        gfx->timerQueryIndex = (gfx->timerQueryIndex + 1) % GFX_TIMER_QUERIES;
+        ++gfx->timerQueriesPending;
+        gfx->timing = 0;
+    }
+
+    // Read back before the swap, while the back buffer still holds this frame
+    if (gfx->capture && gfx->samplePending && captureWants(gfx->capture, gfx->samplesPresented + 1)) {
+        int wholeWindow = (captureGetConfig(gfx->capture)->source == CAPTURE_SOURCE_WINDOW);
+        gfxStartReadback(gfx, videoTexture && !wholeWindow, wholeWindow ? &surfaceRect : &videoRect);
+    }
+
+    // Everything up to here is our own work; the swap may block on the compositor
+    uint64_t const swapStart = timeNowNs();
+    double const cpuMs = (double)(swapStart - frameStart) / 1000000.0;
+    statsObserve(STATS_LATENCY_RENDER, swapStart - frameStart);
+
+    // Relative to the previously presented frame, only the video changed unless the layout did
+    struct AllocCounts allocsBeforeSwap;
+    allocGetThreadCounts(&allocsBeforeSwap);
+    if (eglSwapBuffersWithDamageKHR) {
+        eglSwapBuffersWithDamageKHR(gfx->eglDisplay, gfx->eglSurface, (gfx->layoutAge == 0) ? &surfaceRect.x : &videoRect.x, 1);
+    } else {
+        eglSwapBuffers(gfx->eglDisplay, gfx->eglSurface);
+    }
+
+    // Out of our hands, so counted separately from the rest of the frame
+    struct AllocCounts allocsAfterSwap;
+    allocGetThreadCounts(&allocsAfterSwap);
+    gfx->swapAllocations += allocsAfterSwap.allocs - allocsBeforeSwap.allocs;
+    statsObserve(STATS_LATENCY_SWAP, timeNowNs() - swapStart);
+
+    gfx->layoutAge++;
+    gfx->dirty = 0;
+    ++gfx->framesPresented;
+
+    if (gfx->samplePending) {
+        playerReportPresented(gfx->player, gfx->sample);
+        gfx->samplePending = 0;
+        ++gfx->samplesPresented;
+    }
+
+    gfxGovern(gfx, cpuMs);
+    return 1;
 }
@@ -6,13 +6,72 @@
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 
+#include <gst/gst.h>
+
 struct wl_display;
 struct wl_surface;
+struct wp_viewport;
 struct Player;
+struct Capture;
+
+// Render quality, from best to cheapest; the governor steps through these to stay within the frame budget
+enum GfxQuality
+{
+    GFX_QUALITY_FULL, // convert to a full size RGB intermediate, then scale to the window
+    GFX_QUALITY_REDUCED, // convert to a half size intermediate
+    GFX_QUALITY_DIRECT, // convert straight into the window in a single pass
+    GFX_QUALITY_COMPOSITOR, // single pass into a half size buffer scaled up by wp_viewporter
+    GFX_QUALITY_COUNT
+};
+
+struct GfxStats
+{
+    int quality; // enum GfxQuality
+    int qualityLocked;
+    int qualityTransitions;
+    unsigned long framesPresented;
+    double cpuFrameMs; // smoothed render time up to the swap
+    double gpuFrameMs; // smoothed, 0 if unavailable
+    double frameBudgetMs;
+    unsigned long importCacheHits; // samples whose dmabufs already had EGLImages
+    unsigned long importCacheMisses;
+    unsigned long swapAllocations; // heap allocations the driver made inside eglSwapBuffers()
+};
 
-struct Gfx * gfxCreate(struct wl_display * display, struct wl_surface * surface, int width, int height, struct Player * player);
+// |viewport| is optional; without it the governor never goes below GFX_QUALITY_DIRECT
+// A NULL |display| renders offscreen into a pbuffer on Mesa's surfaceless platform; |player| may then be NULL too
+// returns NULL if EGL / GLES isn't usable, so the caller can fall back to another backend
+struct Gfx * gfxCreate(struct wl_display * display,
+                       struct wl_surface * surface,
+                       struct wp_viewport * viewport,
+                       int width,
+                       int height,
+                       struct Player * player);
 void gfxDestroy(struct Gfx * gfx);
 
-void gfxRender(struct Gfx * gfx);
+void gfxResize(struct Gfx * gfx, int width, int height);
+
+// forces the next gfxRender() to redraw, e.g. when anything drawn on top of the video changes
+void gfxInvalidate(struct Gfx * gfx);
+
+// redraws and swaps only if there is a new frame or something was invalidated
+// returns non-zero if a frame was presented
+int gfxRender(struct Gfx * gfx);
+
+// converts |sample| the way gfxRender() would and reads back its visible region as top-down RGBA rows
+// into |pixels|, which must hold width * height * 4 bytes; for checking conversions on an offscreen Gfx
+// returns non-zero on success
+int gfxConvertSample(struct Gfx * gfx, GstSample * sample, uint8_t * pixels);
+
+// pins the render quality; pass -1 to hand control back to the governor
+void gfxSetQuality(struct Gfx * gfx, int quality);
+void gfxGetStats(struct Gfx * gfx, struct GfxStats * stats);
+
+// keeps up to |budget| bytes of converted frames of a single looping clip (see playerSetPlaylist()); once a whole
+// pass fits, the player stops decoding and the passes are repeated from them. 0 turns it off
+void gfxSetFrameCache(struct Gfx * gfx, size_t budget);
+
+// reads back every presented video frame |capture| wants and submits it; NULL stops, after handing over what's in flight
+void gfxSetCapture(struct Gfx * gfx, struct Capture * capture);
 
 #endif
@@ -0,0 +1,276 @@
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------------
+// Per-thread ring: the owning thread is the only producer, whoever holds flushMutex the only consumer
+
+#define LOG_RING_ENTRIES 256 // power of two, so the free running indices wrap cleanly
+#define LOG_MESSAGE_SIZE 240
+#define LOG_FLUSH_INTERVAL_NS 10000000 // 10ms
+#define LOG_OUTPUT_SIZE 65536
+
+struct LogEntry
+{
+    uint64_t timeNs;
+    int level;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+struct LogRing
+{
+    struct LogRing * next;
+    pid_t tid;
+    atomic_uint head; // next entry to write, only advanced by the owner
+    atomic_uint tail; // next entry to read, only advanced by the consumer
+    atomic_uint dropped; // messages lost to a full ring since the last drain
+    atomic_int exited; // the owner is gone; freed once drained
+    struct LogEntry entries[LOG_RING_ENTRIES];
+};
+
+static struct
+{
+    pthread_once_t once;
+    pthread_key_t threadKey;
+    uint64_t startNs;
+
+    pthread_mutex_t ringsMutex; // guards the list, not the rings' contents
+    struct LogRing * rings;
+
+    pthread_mutex_t flushMutex; // one consumer at a time
+    char output[LOG_OUTPUT_SIZE];
+    size_t outputSize;
+
+    atomic_int running;
+    struct Task * flusher;
+} logState = {
+    .once = PTHREAD_ONCE_INIT,
+    .ringsMutex = PTHREAD_MUTEX_INITIALIZER,
+    .flushMutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct LogRing * logThreadRing;
+
+static const char logLevelNames[] = { 'E', 'W', 'I', 'D', 'T' };
+
+static void logThreadExit(void * userData)
+{
+    struct LogRing * ring = (struct LogRing *)userData;
+    atomic_store_explicit(&ring->exited, 1, memory_order_release);
+}
+
+static void logOnce(void)
+{
+    pthread_key_create(&logState.threadKey, logThreadExit);
+    logState.startNs = timeNowNs();
+}
+
+// The one allocation a thread makes for logging, on its first message
+static struct LogRing * logRegisterThread(void)
+{
+    pthread_once(&logState.once, logOnce);
+
+    struct LogRing * ring = calloc(1, sizeof(struct LogRing));
+    if (!ring) {
+        return NULL;
+    }
+    ring->tid = (pid_t)syscall(SYS_gettid);
+    pthread_setspecific(logState.threadKey, ring);
+
+    pthread_mutex_lock(&logState.ringsMutex);
+    ring->next = logState.rings;
+    logState.rings = ring;
+    pthread_mutex_unlock(&logState.ringsMutex);
+
+    logThreadRing = ring;
+    return ring;
+}
+
+void logWrite(int level, const char * format, ...)
+{
+    struct LogRing * ring = logThreadRing ? logThreadRing : logRegisterThread();
+    if (!ring) {
+        return;
+    }
+
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if ((head - tail) >= LOG_RING_ENTRIES) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct LogEntry * entry = &ring->entries[head % LOG_RING_ENTRIES];
+    entry->timeNs = timeNowNs();
+    entry->level = level;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->text, sizeof(entry->text), format, args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int logRateLimit(struct LogRateLimit * limit, uint64_t intervalNs)
+{
+    uint64_t now = timeNowNs();
+    uint64_t last = __atomic_load_n(&limit->lastNs, __ATOMIC_RELAXED);
+
+    // Several threads may share a call site; only the one that moves lastNs gets to log
+    if ((last && ((now - last) < intervalNs)) || !__atomic_compare_exchange_n(&limit->lastNs, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return 1 + (int)__atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+// --------------------------------------------------------------------------------------
+// Consumer
+
+// Blocking is fine here, this never runs on a thread that logs from a hot path
+static void logWriteOutput(void)
+{
+    size_t written = 0;
+    while (written < logState.outputSize) {
+        ssize_t ret = write(STDOUT_FILENO, logState.output + written, logState.outputSize - written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // nowhere to report it
+        }
+        written += (size_t)ret;
+    }
+    logState.outputSize = 0;
+}
+
+static void logAppend(uint64_t timeNs, int level, pid_t tid, const char * text)
+{
+    if ((LOG_OUTPUT_SIZE - logState.outputSize) < (LOG_MESSAGE_SIZE + 64)) {
+        logWriteOutput();
+    }
+
+    uint64_t elapsedNs = (timeNs > logState.startNs) ? (timeNs - logState.startNs) : 0;
+    char levelName = ((level >= 0) && (level < (int)sizeof(logLevelNames))) ? logLevelNames[level] : '?';
+    int ret = snprintf(logState.output + logState.outputSize,
+                       LOG_OUTPUT_SIZE - logState.outputSize,
+                       "%5llu.%06llu %c %6d %s\n",
+                       (unsigned long long)(elapsedNs / 1000000000ull),
+                       (unsigned long long)((elapsedNs % 1000000000ull) / 1000ull),
+                       levelName,
+                       (int)tid,
+                       text);
+    if (ret > 0) {
+        logState.outputSize += (size_t)ret;
+    }
+}
+
+// Merges all rings by timestamp and writes them out; call with flushMutex held
+static void logDrain(void)
+{
+    pthread_mutex_lock(&logState.ringsMutex);
+    struct LogRing * rings = logState.rings;
+    pthread_mutex_unlock(&logState.ringsMutex);
+
+    // Rings are only ever added at the head, so the snapshot stays valid while we walk it
+    for (;;) {
+        struct LogRing * oldest = NULL;
+        struct LogEntry * oldestEntry = NULL;
+        for (struct LogRing * ring = rings; ring; ring = ring->next) {
+            unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (head == tail) {
+                continue;
+            }
+            struct LogEntry * entry = &ring->entries[tail % LOG_RING_ENTRIES];
+            if (!oldestEntry || (entry->timeNs < oldestEntry->timeNs)) {
+                oldest = ring;
+                oldestEntry = entry;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+
+        logAppend(oldestEntry->timeNs, oldestEntry->level, oldest->tid, oldestEntry->text);
+        atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+    }
+
+    for (struct LogRing * ring = rings; ring; ring = ring->next) {
+        unsigned dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped) {
+            char text[64];
+            snprintf(text, sizeof(text), "(log ring full, %u messages dropped)", dropped);
+            logAppend(timeNowNs(), LOG_LEVEL_WARN, ring->tid, text);
+        }
+    }
+    logWriteOutput();
+
+    // Free the rings of threads that have exited, now that nothing is left in them
+    pthread_mutex_lock(&logState.ringsMutex);
+    struct LogRing ** link = &logState.rings;
+    while (*link) {
+        struct LogRing * ring = *link;
+        if (atomic_load_explicit(&ring->exited, memory_order_acquire)
+            && (atomic_load_explicit(&ring->head, memory_order_acquire) == atomic_load_explicit(&ring->tail, memory_order_relaxed))) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&logState.ringsMutex);
+}
+
+static void logFlusherThread(void * ignored)
+{
+    (void)ignored;
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_NS };
+    while (atomic_load_explicit(&logState.running, memory_order_acquire)) {
+        pthread_mutex_lock(&logState.flushMutex);
+        logDrain();
+        pthread_mutex_unlock(&logState.flushMutex);
+        nanosleep(&interval, NULL);
+    }
+}
+
+void logInit(const struct TaskConfig * config)
+{
+    pthread_once(&logState.once, logOnce);
+    if (logState.flusher) {
+        return;
+    }
+
+    atomic_store_explicit(&logState.running, 1, memory_order_release);
+    logState.flusher = taskCreateWithConfig(config, logFlusherThread, NULL);
+}
+
+void logFlush(void)
+{
+    pthread_once(&logState.once, logOnce);
+    pthread_mutex_lock(&logState.flushMutex);
+    logDrain();
+    pthread_mutex_unlock(&logState.flushMutex);
+}
+
+void logShutdown(void)
+{
+    if (logState.flusher) {
+        atomic_store_explicit(&logState.running, 0, memory_order_release);
+        taskDestroy(logState.flusher);
+        logState.flusher = NULL;
+    }
+    logFlush();
+}
@@ -0,0 +1,94 @@
+#ifndef VAAT_LOG_H
+#define VAAT_LOG_H
+
+#include <stdint.h>
+
+// Levels above VAAT_LOG_LEVEL (more verbose ones) compile to nothing, arguments included
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+#ifndef VAAT_LOG_LEVEL
+#define VAAT_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Formats into the calling thread's ring and returns; never allocates (after the thread's first message) or blocks.
+// A background task writes the rings out. If a ring is full the message is dropped and counted.
+void logWrite(int level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+struct TaskConfig;
+
+// starts the flusher task with |config| (may be NULL); messages logged before this are kept until it runs
+void logInit(const struct TaskConfig * config);
+
+// writes out everything logged so far, on the calling thread and from every thread's ring, e.g. before exiting
+void logFlush(void);
+
+// flushes and stops the flusher task
+void logShutdown(void);
+
+// Per call site state for LOG_*_EVERY()
+struct LogRateLimit
+{
+    uint64_t lastNs;
+    uint32_t suppressed;
+};
+
+// returns 0 if the call site must stay quiet, else 1 + the number of messages suppressed since it last logged
+int logRateLimit(struct LogRateLimit * limit, uint64_t intervalNs);
+
+#define LOG_EVERY(level, intervalMs, ...)                                                    \
+    do {                                                                                     \
+        static struct LogRateLimit logLimit_;                                                \
+        int logCount_ = logRateLimit(&logLimit_, (uint64_t)(intervalMs) * 1000000ull);       \
+        if (logCount_ > 0) {                                                                 \
+            logWrite(level, __VA_ARGS__);                                                    \
+            if (logCount_ > 1) {                                                             \
+                logWrite(level, "  (%d similar messages suppressed)", logCount_ - 1);        \
+            }                                                                                \
+        }                                                                                    \
+    } while (0)
+
+#if VAAT_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_ERROR_EVERY(intervalMs, ...) LOG_EVERY(LOG_LEVEL_ERROR, intervalMs, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#define LOG_ERROR_EVERY(intervalMs, ...) ((void)0)
+#endif
+
+#if VAAT_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_WARN_EVERY(intervalMs, ...) LOG_EVERY(LOG_LEVEL_WARN, intervalMs, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#define LOG_WARN_EVERY(intervalMs, ...) ((void)0)
+#endif
+
+#if VAAT_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_INFO_EVERY(intervalMs, ...) LOG_EVERY(LOG_LEVEL_INFO, intervalMs, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#define LOG_INFO_EVERY(intervalMs, ...) ((void)0)
+#endif
+
+#if VAAT_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_DEBUG_EVERY(intervalMs, ...) LOG_EVERY(LOG_LEVEL_DEBUG, intervalMs, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#define LOG_DEBUG_EVERY(intervalMs, ...) ((void)0)
+#endif
+
+#if VAAT_LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) logWrite(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_TRACE_EVERY(intervalMs, ...) LOG_EVERY(LOG_LEVEL_TRACE, intervalMs, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void)0)
+#define LOG_TRACE_EVERY(intervalMs, ...) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,192 @@
+#include "log.h"
+#include "loop.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define LOOP_MAX_SOURCES 16
+
+struct LoopSource
+{
+    int fd;
+    LoopFunc func;
+    void * userData;
+    int timer;
+};
+
+struct Loop
+{
+    int epollFd;
+
+    struct LoopSource sources[LOOP_MAX_SOURCES];
+    int sourceCount;
+
+    struct epoll_event events[LOOP_MAX_SOURCES];
+    int eventCount;
+};
+
+struct Loop * loopCreate()
+{
+    struct Loop * loop = calloc(1, sizeof(struct Loop));
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollFd < 0) {
+        fatal("epoll_create1() failed");
+    }
+    return loop;
+}
+
+void loopDestroy(struct Loop * loop)
+{
+    if (!loop)
+        return;
+
+    for (int i = 0; i < loop->sourceCount; ++i) {
+        if (loop->sources[i].timer) {
+            close(loop->sources[i].fd);
+        }
+    }
+    close(loop->epollFd);
+    free(loop);
+}
+
+static struct LoopSource * loopAddSource(struct Loop * loop, int fd, LoopFunc func, void * userData, int timer)
+{
+    if (loop->sourceCount >= LOOP_MAX_SOURCES) {
+        fatal("loopAddSource(): too many sources");
+    }
+
+    struct LoopSource * source = &loop->sources[loop->sourceCount++];
+    source->fd = fd;
+    source->func = func;
+    source->userData = userData;
+    source->timer = timer;
+
+    // Events carry the fd rather than a pointer, so removing sources can compact the array
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        fatal("epoll_ctl() failed");
+    }
+    return source;
+}
+
+static struct LoopSource * loopFindSource(struct Loop * loop, int fd)
+{
+    for (int i = 0; i < loop->sourceCount; ++i) {
+        if (loop->sources[i].fd == fd) {
+            return &loop->sources[i];
+        }
+    }
+    return NULL;
+}
+
+void loopAddFd(struct Loop * loop, int fd, LoopFunc func, void * userData)
+{
+    loopAddSource(loop, fd, func, userData, 0);
+}
+
+void loopRemoveFd(struct Loop * loop, int fd)
+{
+    struct LoopSource * source = loopFindSource(loop, fd);
+    if (!source) {
+        return;
+    }
+
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    if (source->timer) {
+        close(source->fd);
+    }
+
+    int index = (int)(source - loop->sources);
+    memmove(&loop->sources[index], &loop->sources[index + 1], (loop->sourceCount - index - 1) * sizeof(struct LoopSource));
+    --loop->sourceCount;
+
+    // Don't dispatch an event for an fd that is gone
+    for (int i = 0; i < loop->eventCount; ++i) {
+        if (loop->events[i].data.fd == fd) {
+            loop->events[i].events = 0;
+        }
+    }
+}
+
+int loopAddTimer(struct Loop * loop, uint64_t intervalNs, LoopFunc func, void * userData)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        fatal("timerfd_create() failed");
+    }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = (time_t)(intervalNs / 1000000000);
+    spec.it_interval.tv_nsec = (long)(intervalNs % 1000000000);
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+        fatal("timerfd_settime() failed");
+    }
+
+    loopAddSource(loop, fd, func, userData, 1);
+    return fd;
+}
+
+int loopWait(struct Loop * loop, int timeoutMs)
+{
+    loop->eventCount = 0;
+
+    int count = epoll_wait(loop->epollFd, loop->events, LOOP_MAX_SOURCES, timeoutMs);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        LOG_ERROR("loopWait(): epoll_wait() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    loop->eventCount = count;
+    return count;
+}
+
+int loopIsReady(struct Loop * loop, int fd)
+{
+    for (int i = 0; i < loop->eventCount; ++i) {
+        if ((loop->events[i].data.fd == fd) && loop->events[i].events) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void loopDispatch(struct Loop * loop)
+{
+    for (int i = 0; i < loop->eventCount; ++i) {
+        if (!loop->events[i].events) {
+            continue;
+        }
+
+        // Look the source up every time, a callback may have removed sources
+        struct LoopSource * source = loopFindSource(loop, loop->events[i].data.fd);
+        if (!source) {
+            continue;
+        }
+
+        if (source->timer) {
+            uint64_t expirations;
+            if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                continue;
+            }
+        }
+
+        if (source->func) {
+            source->func(source->userData);
+        }
+    }
+    loop->eventCount = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef VAAT_LOOP_H
+#define VAAT_LOOP_H
+
+#include <stdint.h>
+
+// Single-threaded epoll reactor
+
+typedef void (*LoopFunc)(void * userData);
+
+struct Loop * loopCreate();
+void loopDestroy(struct Loop * loop);
+
+// watches |fd| for readability; |func| may be NULL for fds the caller handles itself via loopIsReady()
+void loopAddFd(struct Loop * loop, int fd, LoopFunc func, void * userData);
+void loopRemoveFd(struct Loop * loop, int fd);
+
+// periodic timerfd, returns the timer's fd
+int loopAddTimer(struct Loop * loop, uint64_t intervalNs, LoopFunc func, void * userData);
+
+// blocks until at least one fd is ready (or |timeoutMs| passes, -1 waits forever)
+// returns the number of ready fds, or -1 on error
+int loopWait(struct Loop * loop, int timeoutMs);
+
+// returns non-zero if |fd| became ready in the last loopWait()
+int loopIsReady(struct Loop * loop, int fd);
+
+// calls the funcs of every fd that became ready in the last loopWait()
+void loopDispatch(struct Loop * loop);
+
+#endif
@@ -0,0 +1,434 @@
+#include "log.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs the vaat benchmark several times and fails if it got slower than a stored baseline by more than the
+// run to run noise explains. A missing baseline fails too; --update writes one from this run, to be checked in.
+
+#define GATE_MAX_RUNS 64
+#define GATE_MAX_ARGS 64
+
+struct GateOptions
+{
+    const char * vaat;
+    const char * baseline;
+    int runs;
+    double threshold; // relative change tolerated even if it's significant
+    int update; // rewrite the baseline from this run instead of comparing
+    char * args[GATE_MAX_ARGS]; // for execvp(), vaat first and NULL terminated
+};
+
+struct GateMetric
+{
+    const char * name; // key in vaat's "benchmark:" line and the baseline
+    int higherIsBetter;
+    int gated; // otherwise only reported
+};
+
+static const struct GateMetric gateMetrics[] = {
+    { "fps", 1, 1 },
+    { "cpu_ms", 0, 1 }, // render up to the swap, smoothed
+    { "gpu_ms", 0, 1 }, // 0 without timer queries, then not compared
+    { "render_ms", 0, 1 }, // render and present
+    { "wait_ms", 0, 0 }, // waiting for the decoder, which goes up whenever rendering gets faster
+    { "process_cpu_ms", 0, 1 }, // every thread, decoding included
+};
+#define GATE_METRIC_COUNT (sizeof(gateMetrics) / sizeof(gateMetrics[0]))
+
+static char * gateDefaultArgs[] = { "--headless", "--quality", "0", "--benchmark", "600" };
+
+struct GateSummary
+{
+    double mean;
+    double stddev;
+    int runs;
+};
+
+// --------------------------------------------------------------------------------------
+// Statistics
+
+// two sided 95% quantile of Student's t
+static double gateStudentT(double df)
+{
+    static const double table[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                    2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                    2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+    int whole = (int)df; // rounding down errs on the wide side
+    if (whole < 1) {
+        return INFINITY;
+    }
+    if (whole <= 30) {
+        return table[whole - 1];
+    }
+    return 1.96 + (2.4 / whole);
+}
+
+static void gateSummarize(const double * values, int count, struct GateSummary * summary)
+{
+    double sum = 0.0;
+    for (int index = 0; index < count; ++index) {
+        sum += values[index];
+    }
+    summary->mean = sum / count;
+
+    double squares = 0.0;
+    for (int index = 0; index < count; ++index) {
+        squares += (values[index] - summary->mean) * (values[index] - summary->mean);
+    }
+    summary->stddev = (count > 1) ? sqrt(squares / (count - 1)) : 0.0;
+    summary->runs = count;
+}
+
+// half width of the 95% confidence interval of the mean
+static double gateConfidence(const struct GateSummary * summary)
+{
+    if (summary->runs < 2) {
+        return INFINITY;
+    }
+    return gateStudentT(summary->runs - 1) * summary->stddev / sqrt(summary->runs);
+}
+
+// half width of the 95% confidence interval of the difference of the means (Welch)
+static double gateDifferenceConfidence(const struct GateSummary * current, const struct GateSummary * baseline)
+{
+    if ((current->runs < 2) || (baseline->runs < 2)) {
+        return INFINITY;
+    }
+    double currentVariance = current->stddev * current->stddev / current->runs;
+    double baselineVariance = baseline->stddev * baseline->stddev / baseline->runs;
+    double variance = currentVariance + baselineVariance;
+    double df = current->runs + baseline->runs - 2;
+    double denominator = (currentVariance * currentVariance / (current->runs - 1)) + (baselineVariance * baselineVariance / (baseline->runs - 1));
+    if (denominator > 0.0) {
+        df = variance * variance / denominator;
+    }
+    return gateStudentT(df) * sqrt(variance);
+}
+
+// --------------------------------------------------------------------------------------
+// Running vaat
+
+// returns non-zero if vaat succeeded and reported every metric
+static int gateRun(const struct GateOptions * options, double * values)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        // Its log goes to stderr and stays visible
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(options->vaat, options->args);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    int reported = 0;
+    char line[1024];
+    FILE * output = fdopen(fds[0], "r");
+    while (fgets(line, sizeof(line), output)) {
+        if (strncmp(line, "benchmark: ", 11) != 0) {
+            continue;
+        }
+        reported = 1;
+        for (size_t metric = 0; metric < GATE_METRIC_COUNT; ++metric) {
+            char key[64];
+            snprintf(key, sizeof(key), " %s=", gateMetrics[metric].name);
+            const char * found = strstr(line, key);
+            if (!found || (sscanf(found + strlen(key), "%lf", &values[metric]) != 1)) {
+                printf("  no %s in: %s", gateMetrics[metric].name, line);
+                reported = 0;
+            }
+        }
+    }
+    fclose(output);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+        printf("  %s failed (status %d)\n", options->vaat, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return 0;
+    }
+    return reported;
+}
+
+// --------------------------------------------------------------------------------------
+// Baseline: {"command": "...", "metrics": {"fps": {"mean": M, "stddev": S, "runs": N}, ...}}
+
+// vaat's arguments, which must match the baseline's for the numbers to be comparable
+static void gateFormatCommand(const struct GateOptions * options, char * command, size_t size)
+{
+    command[0] = '\0';
+    for (int arg = 1; options->args[arg]; ++arg) {
+        size_t used = strlen(command);
+        snprintf(command + used, size - used, "%s%s", (arg > 1) ? " " : "", options->args[arg]);
+    }
+}
+
+static void gateWriteJsonString(FILE * file, const char * string)
+{
+    fputc('"', file);
+    for (; *string; ++string) {
+        if ((*string == '"') || (*string == '\\')) {
+            fputc('\\', file);
+        }
+        fputc(*string, file);
+    }
+    fputc('"', file);
+}
+
+// returns non-zero on success
+static int gateWriteBaseline(const char * path, const char * command, const struct GateSummary * summaries)
+{
+    FILE * file = fopen(path, "w");
+    if (!file) {
+        return 0;
+    }
+    fprintf(file, "{\n  \"command\": ");
+    gateWriteJsonString(file, command);
+    fprintf(file, ",\n  \"metrics\": {\n");
+    for (size_t metric = 0; metric < GATE_METRIC_COUNT; ++metric) {
+        fprintf(file,
+                "    \"%s\": { \"mean\": %.6f, \"stddev\": %.6f, \"runs\": %d }%s\n",
+                gateMetrics[metric].name,
+                summaries[metric].mean,
+                summaries[metric].stddev,
+                summaries[metric].runs,
+                (metric + 1 < GATE_METRIC_COUNT) ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+    return fclose(file) == 0;
+}
+
+// returns the file's contents NUL terminated, or NULL if it can't be read
+static char * gateReadFile(const char * path)
+{
+    FILE * file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char * text = (size >= 0) ? malloc((size_t)size + 1) : NULL;
+    if (text && (fread(text, 1, (size_t)size, file) != (size_t)size)) {
+        free(text);
+        text = NULL;
+    }
+    if (text) {
+        text[size] = '\0';
+    }
+    fclose(file);
+    return text;
+}
+
+// Only reads what gateWriteBaseline() writes, which is all it has to
+
+// returns a pointer just past the ':' following "key" at or after |from|, or NULL
+static const char * gateFindKey(const char * from, const char * key)
+{
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char * found = strstr(from, quoted);
+    if (!found) {
+        return NULL;
+    }
+    const char * colon = strchr(found + strlen(quoted), ':');
+    return colon ? colon + 1 : NULL;
+}
+
+static void gateReadJsonString(const char * from, char * string, size_t size)
+{
+    const char * quote = from ? strchr(from, '"') : NULL;
+    size_t used = 0;
+    for (const char * at = quote ? quote + 1 : ""; *at && (*at != '"') && (used + 1 < size); ++at) {
+        if ((*at == '\\') && at[1]) {
+            ++at;
+        }
+        string[used++] = *at;
+    }
+    string[used] = '\0';
+}
+
+// returns non-zero if the baseline has |name|
+static int gateReadSummary(const char * json, const char * name, struct GateSummary * summary)
+{
+    const char * metrics = gateFindKey(json, "metrics");
+    const char * object = metrics ? gateFindKey(metrics, name) : NULL;
+    const char * end = object ? strchr(object, '}') : NULL;
+    if (!end) {
+        return 0;
+    }
+
+    const char * mean = gateFindKey(object, "mean");
+    const char * stddev = gateFindKey(object, "stddev");
+    const char * runs = gateFindKey(object, "runs");
+    if (!mean || !stddev || !runs || (mean > end) || (stddev > end) || (runs > end)) {
+        return 0;
+    }
+    return (sscanf(mean, "%lf", &summary->mean) == 1) && (sscanf(stddev, "%lf", &summary->stddev) == 1)
+           && (sscanf(runs, "%d", &summary->runs) == 1);
+}
+
+// --------------------------------------------------------------------------------------
+
+// returns non-zero if |metric| regressed
+static int gateCompare(const struct GateMetric * metric, const struct GateSummary * current, const struct GateSummary * baseline, double threshold)
+{
+    double change = (baseline->mean != 0.0) ? (current->mean - baseline->mean) / fabs(baseline->mean) : 0.0;
+    double worse = metric->higherIsBetter ? baseline->mean - current->mean : current->mean - baseline->mean;
+    double margin = gateDifferenceConfidence(current, baseline);
+    double worseChange = metric->higherIsBetter ? -change : change;
+
+    // Significant: the difference's confidence interval excludes zero. Relevant: it's beyond the threshold.
+    const char * verdict = "ok";
+    int regressed = 0;
+    if (!metric->gated || (baseline->mean == 0.0)) {
+        verdict = "not compared";
+    } else if ((worse > margin) && (worseChange > threshold)) {
+        verdict = "REGRESSION";
+        regressed = 1;
+    } else if ((-worse > margin) && (-worseChange > threshold)) {
+        verdict = "improved";
+    }
+
+    printf("  %-15s %10.3f +- %-8.3f baseline %10.3f +- %-8.3f %+7.1f%%  %s\n",
+           metric->name,
+           current->mean,
+           gateConfidence(current),
+           baseline->mean,
+           gateConfidence(baseline),
+           change * 100.0,
+           verdict);
+    return regressed;
+}
+
+static void gateUsage(const char * argv0)
+{
+    printf("usage: %s [--vaat PATH] [--baseline FILE] [--runs N] [--threshold PERCENT] [--update] [-- VAAT_ARGS...]\n", argv0);
+    printf("  --vaat PATH          the vaat to benchmark; ./vaat by default\n");
+    printf("  --baseline FILE      perf-baseline.json by default; the gate fails without it\n");
+    printf("  --runs N             benchmark runs, at least 2; 5 by default\n");
+    printf("  --threshold PERCENT  significant changes smaller than this still pass; 3 by default\n");
+    printf("  --update             write the baseline from this run instead of comparing\n");
+    printf("  VAAT_ARGS            the workload; --headless --quality 0 --benchmark 600 by default\n");
+}
+
+int main(int argc, char * argv[])
+{
+    struct GateOptions options = { "./vaat", "perf-baseline.json", 5, 0.03, 0, { NULL } };
+    int argCount = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--vaat") && (i + 1 < argc)) {
+            options.vaat = argv[++i];
+        } else if (!strcmp(argv[i], "--baseline") && (i + 1 < argc)) {
+            options.baseline = argv[++i];
+        } else if (!strcmp(argv[i], "--runs") && (i + 1 < argc)) {
+            options.runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threshold") && (i + 1 < argc)) {
+            options.threshold = atof(argv[++i]) / 100.0;
+        } else if (!strcmp(argv[i], "--update")) {
+            options.update = 1;
+        } else if (!strcmp(argv[i], "--") && (argc - i - 1 < GATE_MAX_ARGS - 1)) {
+            for (++i; i < argc; ++i) {
+                options.args[1 + argCount++] = argv[i];
+            }
+        } else {
+            gateUsage(argv[0]);
+            return 1;
+        }
+    }
+    if ((options.runs < 2) || (options.runs > GATE_MAX_RUNS) || (options.threshold < 0.0)) {
+        gateUsage(argv[0]);
+        return 1;
+    }
+    options.args[0] = (char *)options.vaat;
+    if (argCount == 0) {
+        for (size_t arg = 0; arg < sizeof(gateDefaultArgs) / sizeof(gateDefaultArgs[0]); ++arg) {
+            options.args[1 + argCount++] = gateDefaultArgs[arg];
+        }
+    }
+
+    char command[1024];
+    gateFormatCommand(&options, command, sizeof(command));
+
+    char * baseline = options.update ? NULL : gateReadFile(options.baseline);
+    if (baseline) {
+        char baselineCommand[1024];
+        gateReadJsonString(gateFindKey(baseline, "command"), baselineCommand, sizeof(baselineCommand));
+        if (strcmp(baselineCommand, command) != 0) {
+            printf("perfgate: the baseline was recorded with \"%s\"; rerun with those arguments or --update\n", baselineCommand);
+            free(baseline);
+            logShutdown();
+            return 1;
+        }
+    } else if (!options.update) {
+        // A gate that passes for want of something to compare against would pass on every fresh checkout
+        printf("perfgate: no baseline in %s; record one with --update and check it in\n", options.baseline);
+        logShutdown();
+        return 1;
+    }
+
+    // values[metric][run]
+    static double values[GATE_METRIC_COUNT][GATE_MAX_RUNS];
+    printf("perfgate: %d runs of %s %s\n", options.runs, options.vaat, command);
+    for (int run = 0; run < options.runs; ++run) {
+        double runValues[GATE_METRIC_COUNT];
+        if (!gateRun(&options, runValues)) {
+            printf("perfgate: run %d failed\n", run + 1);
+            free(baseline);
+            logShutdown();
+            return 1;
+        }
+        printf("  run %d: fps %.2f, render %.3f ms, cpu %.3f ms/frame\n", run + 1, runValues[0], runValues[3], runValues[5]);
+        for (size_t metric = 0; metric < GATE_METRIC_COUNT; ++metric) {
+            values[metric][run] = runValues[metric];
+        }
+    }
+
+    struct GateSummary summaries[GATE_METRIC_COUNT];
+    for (size_t metric = 0; metric < GATE_METRIC_COUNT; ++metric) {
+        gateSummarize(values[metric], options.runs, &summaries[metric]);
+    }
+
+    if (!baseline) {
+        int written = gateWriteBaseline(options.baseline, command, summaries);
+        printf("perfgate: %s %s from this run\n", written ? "wrote" : "can't write", options.baseline);
+        logShutdown();
+        return written ? 0 : 1;
+    }
+
+    int regressions = 0;
+    for (size_t metric = 0; metric < GATE_METRIC_COUNT; ++metric) {
+        struct GateSummary baselineSummary;
+        if (!gateReadSummary(baseline, gateMetrics[metric].name, &baselineSummary)) {
+            printf("  %-15s %10.3f +- %-8.3f not in the baseline%s\n",
+                   gateMetrics[metric].name,
+                   summaries[metric].mean,
+                   gateConfidence(&summaries[metric]),
+                   gateMetrics[metric].gated ? ", FAILED" : "");
+            regressions += gateMetrics[metric].gated; // an older baseline; --update records it
+            continue;
+        }
+        regressions += gateCompare(&gateMetrics[metric], &summaries[metric], &baselineSummary, options.threshold);
+    }
+    free(baseline);
+
+    printf("perfgate: %s\n", regressions ? "FAILED" : "passed");
+    logShutdown();
+    return regressions ? 1 : 0;
+}
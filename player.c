@@ -1,24 +1,192 @@
+#include "alloc.h"
+#include "esindex.h"
+#include "log.h"
 #include "player.h"
+#include "stats.h"
 #include "util.h"
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
 #include <gst/app/gstappsink.h>
+#include <gst/video/video-info-dma.h>
 #include <gst/video/videooverlay.h>
 
-struct Player
+#include <drm/drm_fourcc.h>
+
+// The queue, the adopted sample, and one being filled while another is on its way back
+#define PLAYER_SAMPLE_POOL_SIZE (PLAYER_MAX_QUEUE_DEPTH + 3)
+
+#define PLAYER_DEFAULT_DECODER "v4l2slh264dec"
+
+// Proportion changes smaller than this aren't worth an event (and its allocation) per presented frame
+#define PLAYER_QOS_PROPORTION_STEP 0.05
+
+// GOPs kept for scrubbing, within the byte budget
+#define PLAYER_GOP_CACHE_SIZE 4
+
+// From this rate on, either way, only keyframes are decoded; see playerSetRate()
+#define PLAYER_TRICK_KEYFRAME_RATE 2.0
+
+// A keyframe step whose frame never shows up holds up the next one no longer than this, and a GOP decoded for playing
+// backwards that stops short of its frame count waits no longer than this for the next one
+#define PLAYER_STEP_TIMEOUT_NS 1000000000ull
+
+// Pacing before any buffer told us the frame duration
+#define PLAYER_DEFAULT_FRAME_NS (1000000000.0 / 30.0)
+
+// How the active stream plays at the rate given to playerSetRate()
+enum PlayerTrickMode
+{
+    PLAYER_TRICK_NONE, // 1.0: the appsink syncs to the pipeline clock
+    PLAYER_TRICK_PACED, // forward below PLAYER_TRICK_KEYFRAME_RATE: every frame, shown when its turn comes
+    PLAYER_TRICK_KEYFRAMES, // fast forward and rewind: from keyframe to keyframe, nothing else decoded
+    PLAYER_TRICK_REVERSE, // backwards below PLAYER_TRICK_KEYFRAME_RATE: GOPs decoded forward into the cache, shown backwards
+};
+
+// filesrc ! h264parse ! decoder ! appsink; the active one feeds the renderer, a standby one waits prerolled
+struct PlayerPipeline
 {
+    struct Player * player;
     GstElement * pipeline;
     GstElement * sink;
+    GstPad * sinkPad;
+    char * location;
+    char * decoder;
+    atomic_int prerolled; // the appsink holds the first decoded frame
+
+    // Playlists; see playerUpdatePipelines()
+    int playlistIndex; // the item it plays, -1 if it isn't from the playlist
+    int loop; // repeats through segment seeks instead of ending
+    int segmentArmed; // the flushing segment seek that makes the first pass a segment was made
+    int held; // paused by playerHoldLoop(): the renderer repeats the passes from its cache
+    atomic_int segmentDone; // the source finished a pass, the next one should be queued
+    atomic_int ended; // EOS, so time for the next item
+    atomic_int failed; // an element posted an error; a standby that failed never prerolls
+    atomic_int keyUnitsOnly; // the parser hands the decoder nothing but keyframes; read by its streaming threads
+};
+
+// Decoded frames of one GOP, copied out of the decoder's buffers by accurate seeks; see playerSeek()
+struct PlayerGop
+{
+    GstSample ** frames; // [count], the first |filled| of them; NULL for an unused slot
+    uint32_t first; // the keyframe's frame number
+    uint32_t count; // frames up to the next keyframe
+    uint32_t filled; // decoded so far, from the keyframe on
+    size_t bytes;
+    uint64_t usedNs; // the least recently used one goes first
+};
+
+// A QoS event decided on with sampleMutex held and pushed once it's released: upstream is arbitrary decoder code,
+// which may well wait for the streaming thread that waits for the lock. Only streaming threads push them
+struct PlayerQos
+{
+    GstPad * pad; // the active pipeline's appsink's, filled in by the streaming thread pushing it
+    GstQOSType type;
+    double proportion;
+    GstClockTimeDiff lateness;
+    GstClockTime runningTime;
+};
+
+struct Player
+{
+    struct PlayerPipeline * active; // written by the render thread with sampleMutex held
+    struct PlayerPipeline * standby; // render thread only
+    int switchPending; // swap in the standby once it's prerolled; render thread only
+    uint64_t switchNs; // when the last swap happened, until its first frame is presented
+    unsigned long swaps;
 
+    // Render thread only
+    char ** playlist;
+    int playlistCount;
+    int playlistLoop; // starts over after the last item
+    int nextPending; // the next item should be prepared once the current one is on screen
+    GstBus * bus; // every pipeline's messages are forwarded here, so the fd stays the same across swaps
+    struct EsIndex * index; // of indexLocation, loaded by the first seek into it
+    char * indexLocation;
+    GstCaps * caps; // for the appsink of every pipeline, NULL for any
+    struct TaskPool * workers; // tears down replaced pipelines, NULL to do it in place
+
+    // Decoded samples waiting for the renderer, oldest first; guarded by sampleMutex like everything below
     pthread_mutex_t sampleMutex;
-    GstSample * sample;
+    pthread_cond_t queueCond; // signalled when the queue has room or the active pipeline changed
+    GstSample * queue[PLAYER_MAX_QUEUE_DEPTH];
+    uint64_t queueDecodedNs[PLAYER_MAX_QUEUE_DEPTH]; // when they came out of the decoder
+    int queueHead;
+    int queueCount;
+    int queueDepth;
+    int dropPolicy; // enum PlayerDropPolicy
+    int sampleFd; // eventfd, readable while a sample is waiting to be adopted
+
+    // Samples we fill from the appsink's, so the steady state allocates nothing; guarded by sampleMutex
+    GstSample * samplePool[PLAYER_SAMPLE_POOL_SIZE];
+    GstSample * sampleFree[PLAYER_SAMPLE_POOL_SIZE];
+    int sampleFreeCount;
+    int samplesHeld; // the decoder's buffers we hold on to, pooled or not
+    guint64 sampleAllocations; // heap allocations made while taking samples from the appsink
+    GstBufferPool * decoderPool; // last seen, only compared against
+
+    uint64_t adoptedDecodedNs; // latency of the adopted sample
+    int adoptedActive; // the adopted sample came from the active pipeline, not one swapped out since
+    uint32_t adoptedFrame;
+
+    // Seeks, guarded by sampleMutex
+    uint32_t queueFrame[PLAYER_MAX_QUEUE_DEPTH]; // frame numbers of the queued samples
+    uint32_t decodeFrame; // of the active pipeline's next sample, in presentation order
+    uint32_t seekFrame; // what decodeFrame starts over from once the seek's flush is through
+    int seekFlushing; // everything is dropped until the seek's flush reaches the appsink
+    uint32_t skipFrames; // decoded on the way to the seek target, dropped unseen
+    unsigned seekSerial; // changes with every seek and swap, so a frame copied outside the lock can tell it's stale
+    struct PlayerGop gops[PLAYER_GOP_CACHE_SIZE];
+    size_t gopCacheBudget;
+    size_t gopCacheBytes;
+    struct PlayerGop * recordGop; // filled from the decoder until it's complete
+    struct PlayerGop * serveGop; // handed to the renderer ahead of anything decoded
+    uint32_t serveNext;
+    uint32_t serveEnd;
+    int serveReverse; // from serveNext down to the GOP's first frame instead
+    int gopCacheFull; // recording gave up for lack of room since the last rate change
 
-    struct Task * sampleThread;
+    // Trick play, written by the render thread with sampleMutex held
+    double rate;
+    int trickMode; // enum PlayerTrickMode
+    int pacing; // frames are shown by their number at |rate|, not as they come, and the decoder waits for them
+    uint32_t paceFrame; // due at paceNs, the frames around it one frame duration apart at |rate|
+    uint64_t paceNs;
+    double frameNs; // at 1.0
+    int stepWanted; // the next frame is the keyframe stepped to, anything after it is refused
+    int stepPending; // it isn't adopted yet, so there's no other step
+    uint32_t stepFrame; // the keyframe stepped to last
+    uint64_t stepNs;
+    uint32_t reverseFrame; // next to be shown backwards, PLAYER_FRAME_NONE once at the start
+    uint64_t reverseRecordNs; // when the GOP decoded for playing backwards last got a frame, or was asked for
+    uint32_t reverseRecordFilled;
+
+    // QoS, guarded by sampleMutex
+    GstClockTime lastPresentTime;
+    double avgPresentInterval; // ns, running average
+    double avgFrameDuration;   // ns, running average
+    guint64 framesPresented;
+    guint64 framesDropped;         // decoded but replaced before the renderer got to them
+    guint64 framesDroppedUpstream; // reported by QoS messages from the decoder
+    double lastQosProportion;
+    struct PlayerQos pendingQos; // the renderer's latest, for the active pipeline's streaming thread to push
+    int qosPending;
+
+    // Applied by each GStreamer streaming thread as it starts
+    int hasStreamingConfig;
+    struct TaskConfig streamingConfig;
 };
 
+// Marks the samples of the GOP cache, which the decoder never saw
+static GQuark playerGopQuark;
+
 static GstPadProbeReturn sinkQuery(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
     GstQuery * query = (GstQuery *)info->data;
@@ -28,76 +196,1635 @@ static GstPadProbeReturn sinkQuery(GstPad * pad, GstPadProbeInfo * info, gpointe
     }
 
     gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+    gst_query_add_allocation_meta(query, GST_VIDEO_CROP_META_API_TYPE, NULL); // we crop while converting, no copy needed
     return GST_PAD_PROBE_HANDLED;
 }
 
-static void sampleThread(struct Player * player)
+// --------------------------------------------------------------------------------------
+// QoS
+
+// The clock's running time right now; takes the pipeline's object lock, so not with sampleMutex held
+// returns non-zero if it's known
+static int playerClockNow(struct PlayerPipeline * pipeline, GstClockTime * now)
 {
-    printf("sampleThread begin\n");
+    GstClock * clock = gst_element_get_clock(pipeline->pipeline);
+    if (!clock) {
+        return 0; // not playing yet
+    }
+    *now = gst_clock_get_time(clock) - gst_element_get_base_time(pipeline->pipeline);
+    gst_object_unref(clock);
+    return 1;
+}
 
-    for (;;) {
-        usleep(5 * 1000);
+// returns non-zero if the running time of |sample| is known
+static int playerRunningTime(GstSample * sample, GstClockTime * runningTime)
+{
+    GstBuffer * buffer = gst_sample_get_buffer(sample);
+    GstSegment * segment = gst_sample_get_segment(sample);
+    if (!buffer || !segment || !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer))) {
+        return 0;
+    }
 
-        GstSample * sample = gst_app_sink_try_pull_sample(GST_APP_SINK(player->sink), 1);
-        if (sample) {
-            // GstCaps * caps = gst_sample_get_caps(sample);
-            // gchar * capsString = gst_caps_to_string(caps);
-            // printf("color caps: %s\n", capsString);
-            // g_free(capsString);
+    *runningTime = gst_segment_to_running_time(segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+    return GST_CLOCK_TIME_IS_VALID(*runningTime);
+}
 
-            pthread_mutex_lock(&player->sampleMutex);
-            if (player->sample) {
-                gst_sample_unref(player->sample);
-            }
-            player->sample = sample;
-            pthread_mutex_unlock(&player->sampleMutex);
+static void playerPushQos(const struct PlayerQos * qos)
+{
+    gst_pad_push_event(qos->pad, gst_event_new_qos(qos->type, qos->proportion, qos->lateness, qos->runningTime));
+}
+
+// Works out how late |sample| is, for upstream to hear through playerPushQos(), so decoders can skip frames that
+// would be late too. sampleMutex must be held
+// returns non-zero if |qos| should be pushed
+static int playerUpdateQos(struct Player * player, GstSample * sample, GstClockTime now, GstClockTime runningTime, struct PlayerQos * qos)
+{
+    GstBuffer * buffer = gst_sample_get_buffer(sample);
+    GstClockTimeDiff lateness = (GstClockTimeDiff)(now - runningTime);
+
+    if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_DURATION(buffer))) {
+        double duration = (double)GST_BUFFER_DURATION(buffer);
+        player->avgFrameDuration = (player->avgFrameDuration > 0.0) ? ((player->avgFrameDuration * 7.0) + duration) / 8.0 : duration;
+    }
+
+    // > 1.0 means we present slower than the stream's frame rate
+    double proportion = 1.0;
+    if ((player->avgFrameDuration > 0.0) && (player->avgPresentInterval > 0.0)) {
+        proportion = player->avgPresentInterval / player->avgFrameDuration;
+    }
+    if (lateness > 0) {
+        proportion = (proportion < 1.0) ? 1.0 : proportion;
+    }
+
+    // On time at an unchanged rate is what upstream already assumes
+    double change = (proportion > player->lastQosProportion) ? (proportion - player->lastQosProportion)
+                                                             : (player->lastQosProportion - proportion);
+    if ((lateness <= 0) && (change < PLAYER_QOS_PROPORTION_STEP)) {
+        return 0;
+    }
+    player->lastQosProportion = proportion;
+
+    qos->type = (lateness > 0) ? GST_QOS_TYPE_OVERFLOW : GST_QOS_TYPE_UNDERFLOW;
+    qos->proportion = proportion;
+    qos->lateness = lateness;
+    qos->runningTime = runningTime;
+    return 1;
+}
+
+// Returns |sample| to the pool, dropping its buffer so the decoder can reuse it
+// sampleMutex must be held
+static void playerRecycleSample(struct Player * player, GstSample * sample)
+{
+    for (int poolIndex = 0; poolIndex < PLAYER_SAMPLE_POOL_SIZE; ++poolIndex) {
+        if (player->samplePool[poolIndex] == sample) {
+            statsSetGauge(STATS_GAUGE_DECODER_BUFFERS_HELD, --player->samplesHeld);
+            gst_sample_set_buffer(sample, NULL);
+            player->sampleFree[player->sampleFreeCount++] = sample;
+            return;
         }
     }
+    if (!gst_mini_object_get_qdata(GST_MINI_OBJECT(sample), playerGopQuark)) {
+        statsSetGauge(STATS_GAUGE_DECODER_BUFFERS_HELD, --player->samplesHeld); // not a copy from the GOP cache
+    }
+    gst_sample_unref(sample); // the appsink's own, handed out while the pool was empty, or a cached copy
+}
 
-    printf("sampleThread end\n");
+void playerReleaseSample(struct Player * player, GstSample * sample)
+{
+    pthread_mutex_lock(&player->sampleMutex);
+    playerRecycleSample(player, sample);
+    pthread_mutex_unlock(&player->sampleMutex);
 }
 
-struct Player * playerCreate()
+void playerGetStats(struct Player * player, struct PlayerStats * stats)
 {
-    struct Player * player = calloc(1, sizeof(struct Player));
-    pthread_mutex_init(&player->sampleMutex, NULL);
+    pthread_mutex_lock(&player->sampleMutex);
+    stats->framesPresented = player->framesPresented;
+    stats->framesDropped = player->framesDropped;
+    stats->framesDroppedUpstream = player->framesDroppedUpstream;
+    stats->sampleAllocations = player->sampleAllocations;
+    pthread_mutex_unlock(&player->sampleMutex);
+}
+
+void playerReportPresented(struct Player * player, GstSample * sample)
+{
+    GstClockTime runningTime, now;
+
+    // The render thread is the one that swaps pipelines, so the active one stays put until it returns
+    int timed = playerClockNow(player->active, &now);
+
+    pthread_mutex_lock(&player->sampleMutex);
+    ++player->framesPresented;
+    statsAdd(STATS_FRAMES_PRESENTED, 1);
+    if (!player->adoptedActive) {
+        // Still the last frame of a pipeline swapped out; its timing means nothing to the new one
+        pthread_mutex_unlock(&player->sampleMutex);
+        return;
+    }
+    uint64_t nowNs = timeNowNs();
+    statsObserve(STATS_LATENCY_PRESENT, nowNs - player->adoptedDecodedNs);
+    if (player->switchNs) {
+        LOG_INFO("switched: first frame on screen %.1fms after the swap", (double)(nowNs - player->switchNs) / 1000000.0);
+        player->switchNs = 0;
+    }
+    if (player->pacing) {
+        // Shown at the player's pace, not the clock's: being late means nothing upstream could act on
+        pthread_mutex_unlock(&player->sampleMutex);
+        return;
+    }
+    if (timed && playerRunningTime(sample, &runningTime)) {
+        if (GST_CLOCK_TIME_IS_VALID(player->lastPresentTime) && (now > player->lastPresentTime)) {
+            double interval = (double)(now - player->lastPresentTime);
+            player->avgPresentInterval = (player->avgPresentInterval > 0.0) ? ((player->avgPresentInterval * 7.0) + interval) / 8.0
+                                                                            : interval;
+        }
+        player->lastPresentTime = now;
+        // An event is an allocation, which the frame path can't afford for every late frame: the streaming thread
+        // pushes it with its next sample, by when upstream can act on it anyway, and newer ones replace it until then
+        player->qosPending |= playerUpdateQos(player, sample, now, runningTime, &player->pendingQos);
+    }
+    pthread_mutex_unlock(&player->sampleMutex);
+}
+
+// --------------------------------------------------------------------------------------
+
+// Reports the size of the pool |buffer| came from; reading a pool's config allocates, so only when the pool changes
+static void playerReadDecoderPool(struct Player * player, GstBuffer * buffer)
+{
+    GstBufferPool * pool = buffer ? buffer->pool : NULL;
+    if (pool == player->decoderPool) {
+        return;
+    }
+    player->decoderPool = pool;
+
+    guint minBuffers = 0;
+    guint maxBuffers = 0;
+    if (pool) {
+        GstStructure * config = gst_buffer_pool_get_config(pool);
+        gst_buffer_pool_config_get_params(config, NULL, NULL, &minBuffers, &maxBuffers);
+        gst_structure_free(config);
+    }
+    statsSetGauge(STATS_GAUGE_DECODER_POOL_SIZE, maxBuffers ? maxBuffers : minBuffers); // 0 max means it grows on demand
+}
+
+// sampleMutex must be held
+static GstSample * playerPopSample(struct Player * player, uint64_t * decodedNs)
+{
+    GstSample * sample = player->queue[player->queueHead];
+    *decodedNs = player->queueDecodedNs[player->queueHead];
+    player->queueHead = (player->queueHead + 1) % PLAYER_MAX_QUEUE_DEPTH;
+    --player->queueCount;
+    return sample;
+}
+
+// sampleMutex must be held
+static void playerFlushQueue(struct Player * player)
+{
+    while (player->queueCount > 0) {
+        uint64_t decodedNs;
+        playerRecycleSample(player, playerPopSample(player, &decodedNs));
+    }
+    uint64_t count;
+    ssize_t drained = read(player->sampleFd, &count, sizeof(count));
+    (void)drained;
+}
+
+// --------------------------------------------------------------------------------------
+// GOP cache: frames decoded by accurate seeks, kept in system memory for scrubbing back into them
+
+// Tiled layouts would need the GPU to read them back, so only linear ones are copied
+static int playerCanCopy(GstCaps * caps)
+{
+    if (!caps || !gst_video_is_dma_drm_caps(caps)) {
+        return caps != NULL;
+    }
+    GstVideoInfoDmaDrm info;
+    return gst_video_info_dma_drm_from_caps(&info, caps) && (info.drm_modifier == DRM_FORMAT_MOD_LINEAR);
+}
+
+// A copy of |sample| that holds none of the decoder's buffers; NULL if it can't be made
+static GstSample * playerCopySample(GstSample * sample)
+{
+    GstBuffer * buffer = gst_sample_get_buffer(sample);
+    if (!buffer || !playerCanCopy(gst_sample_get_caps(sample))) {
+        return NULL;
+    }
+    GstBuffer * copy = gst_buffer_copy_deep(buffer); // video and crop meta included
+    if (!copy) {
+        return NULL;
+    }
+    GstSample * cached = gst_sample_new(copy, gst_sample_get_caps(sample), gst_sample_get_segment(sample), NULL);
+    gst_buffer_unref(copy);
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(cached), playerGopQuark, GINT_TO_POINTER(1), NULL);
+    return cached;
+}
+
+// Samples the renderer still holds stay valid, they're references
+// sampleMutex must be held
+static void playerFreeGop(struct Player * player, struct PlayerGop * gop)
+{
+    for (uint32_t index = 0; index < gop->filled; ++index) {
+        gst_sample_unref(gop->frames[index]);
+    }
+    free(gop->frames);
+    player->gopCacheBytes -= gop->bytes;
+    if (player->recordGop == gop) {
+        player->recordGop = NULL;
+    }
+    if (player->serveGop == gop) {
+        player->serveGop = NULL;
+    }
+    memset(gop, 0, sizeof(*gop));
+}
+
+// sampleMutex must be held
+static void playerClearGops(struct Player * player)
+{
+    for (int index = 0; index < PLAYER_GOP_CACHE_SIZE; ++index) {
+        if (player->gops[index].frames) {
+            playerFreeGop(player, &player->gops[index]);
+        }
+    }
+}
+
+// sampleMutex must be held
+static struct PlayerGop * playerFindGop(struct Player * player, uint32_t first)
+{
+    for (int index = 0; index < PLAYER_GOP_CACHE_SIZE; ++index) {
+        if (player->gops[index].frames && (player->gops[index].first == first)) {
+            return &player->gops[index];
+        }
+    }
+    return NULL;
+}
+
+// The one filled and the one shown right now stay; returns NULL if there's nothing else to let go of
+// sampleMutex must be held
+static struct PlayerGop * playerLeastRecentGop(struct Player * player, int unused)
+{
+    struct PlayerGop * oldest = NULL;
+    for (int index = 0; index < PLAYER_GOP_CACHE_SIZE; ++index) {
+        struct PlayerGop * gop = &player->gops[index];
+        if (unused && !gop->frames) {
+            return gop;
+        }
+        if (gop->frames && (gop != player->recordGop) && (gop != player->serveGop) && (!oldest || (gop->usedNs < oldest->usedNs))) {
+            oldest = gop;
+        }
+    }
+    return oldest;
+}
+
+// Makes room for |bytes| more, least recently used first; returns non-zero if there is
+// sampleMutex must be held
+static int playerEvictGops(struct Player * player, size_t bytes)
+{
+    while (player->gopCacheBytes + bytes > player->gopCacheBudget) {
+        struct PlayerGop * oldest = playerLeastRecentGop(player, 0);
+        if (!oldest) {
+            return 0;
+        }
+        playerFreeGop(player, oldest);
+    }
+    return 1;
+}
+
+// A slot for the GOP from keyframe |first|, |count| frames long; an unused one, else the least recently used
+// sampleMutex must be held
+static struct PlayerGop * playerCreateGop(struct Player * player, uint32_t first, uint32_t count)
+{
+    struct PlayerGop * gop = playerLeastRecentGop(player, 1);
+    if (!gop) {
+        return NULL;
+    }
+    if (gop->frames) {
+        playerFreeGop(player, gop);
+    }
+    gop->frames = calloc(count, sizeof(GstSample *));
+    gop->first = first;
+    gop->count = count;
+    gop->usedNs = timeNowNs();
+    return gop;
+}
+
+// Keeps a copy of |sample|, frame |frame|, if it's the next one the GOP being recorded lacks. Copying a 4K frame
+// takes a few milliseconds, so it's done without the mutex
+// sampleMutex must be held, and is dropped on the way
+static void playerRecordFrame(struct Player * player, GstSample * sample, uint32_t frame)
+{
+    struct PlayerGop * gop = player->recordGop;
+    if (!gop || (frame != gop->first + gop->filled)) {
+        return;
+    }
+
+    unsigned serial = player->seekSerial;
+    pthread_mutex_unlock(&player->sampleMutex);
+    GstSample * copy = playerCopySample(sample);
+    size_t bytes = copy ? gst_buffer_get_size(gst_sample_get_buffer(copy)) : 0;
+    pthread_mutex_lock(&player->sampleMutex);
+
+    if ((serial != player->seekSerial) || (gop != player->recordGop)) {
+        if (copy) {
+            gst_sample_unref(copy); // another seek came first
+        }
+        return;
+    }
+    if (!copy || !playerEvictGops(player, bytes)) {
+        LOG_INFO("GOP cache: keeping %u of frames %u-%u, %s",
+                 gop->filled,
+                 gop->first,
+                 gop->first + gop->count - 1,
+                 copy ? "the rest doesn't fit" : "they can't be copied");
+        if (copy) {
+            gst_sample_unref(copy);
+        }
+        player->recordGop = NULL;
+        player->gopCacheFull = 1;
+        return;
+    }
+    gop->frames[gop->filled++] = copy;
+    gop->bytes += bytes;
+    player->gopCacheBytes += bytes;
+    if (gop->filled == gop->count) {
+        player->recordGop = NULL;
+    }
+}
+
+// --------------------------------------------------------------------------------------
+// Pacing: frames due by their number rather than shown as they come, for trick modes and for cached frames going
+// ahead of the decoder's
+
+// ns between two frames at the current rate
+// sampleMutex must be held
+static double playerFrameInterval(struct Player * player)
+{
+    return player->frameNs / ((player->rate < 0.0) ? -player->rate : player->rate);
+}
+
+// Frame |frame| is due now, the ones either side of it a frame interval apart per frame
+// sampleMutex must be held
+static void playerPaceFrom(struct Player * player, uint32_t frame)
+{
+    player->paceFrame = frame;
+    player->paceNs = timeNowNs();
+}
+
+// returns non-zero if frame |frame| may be shown now
+// sampleMutex must be held
+static int playerFrameDue(struct Player * player, uint32_t frame)
+{
+    if (!player->pacing || (frame == PLAYER_FRAME_NONE)) {
+        return 1;
+    }
+    double interval = playerFrameInterval(player);
+    uint32_t distance = (frame > player->paceFrame) ? (frame - player->paceFrame) : (player->paceFrame - frame);
+    uint64_t dueNs = player->paceNs + (uint64_t)(distance * interval);
+    uint64_t nowNs = timeNowNs();
+    if (nowNs < dueNs) {
+        return 0;
+    }
+    if (nowNs - dueNs > (uint64_t)interval) {
+        // The decoder fell behind; carry on from here rather than rush through what's overdue
+        playerPaceFrom(player, frame);
+    }
+    return 1;
+}
+
+// --------------------------------------------------------------------------------------
+
+// Called on the streaming thread as soon as the appsink has a sample, no polling required
+static GstFlowReturn sinkNewSample(GstAppSink * appsink, gpointer user_data)
+{
+    struct PlayerPipeline * pipeline = (struct PlayerPipeline *)user_data;
+    struct Player * player = pipeline->player;
+
+    struct AllocCounts allocsBefore;
+    allocGetThreadCounts(&allocsBefore);
+
+    // The appsink reuses its sample for the next pull as long as nobody else holds it
+    GstSample * pulled = gst_app_sink_pull_sample(appsink);
+    if (!pulled) {
+        return GST_FLOW_EOS;
+    }
+
+    playerReadDecoderPool(player, gst_sample_get_buffer(pulled));
+
+    // For the QoS of a frame dropped below; the clock can't be asked with sampleMutex held
+    GstClockTime now;
+    int timed = playerClockNow(pipeline, &now);
+    struct PlayerQos qos;
+    int sendQos = 0;
+
+    pthread_mutex_lock(&player->sampleMutex);
+    unsigned serial = player->seekSerial;
+    uint32_t frame = PLAYER_FRAME_NONE;
+    int skip = 0;
+    if ((pipeline == player->active) && !player->seekFlushing) {
+        frame = player->decodeFrame++;
+        skip = (player->skipFrames > 0);
+        player->skipFrames -= skip;
+        playerRecordFrame(player, pulled, frame);
+    }
+    if ((pipeline == player->active) && (player->seekFlushing || skip || (serial != player->seekSerial))) {
+        // From before a seek, or on the way to its target: never converted, never shown
+        if (skip) {
+            statsAdd(STATS_FRAMES_SKIPPED, 1);
+        }
+        pthread_mutex_unlock(&player->sampleMutex);
+        gst_sample_unref(pulled);
+        return GST_FLOW_OK;
+    }
+    if ((pipeline == player->active)
+        && ((player->trickMode == PLAYER_TRICK_REVERSE) || ((player->trickMode == PLAYER_TRICK_KEYFRAMES) && !player->stepWanted))) {
+        // Backwards, frames only go to the GOP cache; stepping, only the keyframe stepped to is shown. Once there's
+        // nothing left to keep, refusing frames pauses the streaming threads until the next flushing seek
+        GstFlowReturn result = player->recordGop ? GST_FLOW_OK : GST_FLOW_FLUSHING;
+        pthread_mutex_unlock(&player->sampleMutex);
+        gst_sample_unref(pulled);
+        return result;
+    }
+    if (pipeline == player->active) {
+        player->stepWanted = 0;
+    }
+
+    // Frames served from the GOP cache go first, so the decoder waits behind them whatever the drop policy, and
+    // paced ones are all shown in turn
+    while (((player->dropPolicy == PLAYER_DROP_NONE) || player->serveGop || player->pacing) && (player->queueCount >= player->queueDepth)
+           && (pipeline == player->active) && (serial == player->seekSerial)) {
+        pthread_cond_wait(&player->queueCond, &player->sampleMutex);
+    }
+    if (pipeline != player->active) {
+        // Swapped out, and on its way down
+        pthread_mutex_unlock(&player->sampleMutex);
+        gst_sample_unref(pulled);
+        return GST_FLOW_FLUSHING;
+    }
+    if (serial != player->seekSerial) {
+        // A seek came while it waited; its flush is on its way
+        pthread_mutex_unlock(&player->sampleMutex);
+        gst_sample_unref(pulled);
+        return GST_FLOW_OK;
+    }
+
+    statsAdd(STATS_FRAMES_DECODED, 1);
+    statsSetGauge(STATS_GAUGE_DECODER_BUFFERS_HELD, ++player->samplesHeld);
+    GstSample * sample = pulled;
+    if (player->sampleFreeCount > 0) {
+        sample = player->sampleFree[--player->sampleFreeCount];
+        gst_sample_set_buffer(sample, gst_sample_get_buffer(pulled));
+        gst_sample_set_caps(sample, gst_sample_get_caps(pulled));
+        gst_sample_set_segment(sample, gst_sample_get_segment(pulled));
+    } else {
+        gst_sample_ref(pulled); // pool exhausted; hand out the appsink's own instead
+    }
+
+    while (player->queueCount >= player->queueDepth) {
+        // The renderer never got to the oldest; it was decoded for nothing, so tell upstream
+        GstClockTime runningTime;
+        uint64_t decodedNs;
+        GstSample * dropped = playerPopSample(player, &decodedNs);
+        ++player->framesDropped;
+        statsAdd(STATS_FRAMES_DROPPED, 1);
+        if (timed && playerRunningTime(dropped, &runningTime)) {
+            sendQos |= playerUpdateQos(player, dropped, now, runningTime, &qos);
+        }
+        playerRecycleSample(player, dropped);
+    }
+    int tail = (player->queueHead + player->queueCount) % PLAYER_MAX_QUEUE_DEPTH;
+    player->queue[tail] = sample;
+    player->queueDecodedNs[tail] = timeNowNs();
+    player->queueFrame[tail] = frame;
+    ++player->queueCount;
+
+    uint64_t one = 1;
+    if (write(player->sampleFd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_WARN_EVERY(1000, "sinkNewSample(): failed to signal sample");
+    }
+
+    gst_sample_unref(pulled);
+
+    struct AllocCounts allocsAfter;
+    allocGetThreadCounts(&allocsAfter);
+    player->sampleAllocations += allocsAfter.allocs - allocsBefore.allocs;
+    if (player->qosPending && !sendQos) {
+        qos = player->pendingQos; // what the renderer saw, unless a drop here is newer
+        sendQos = 1;
+    }
+    player->qosPending = 0;
+    pthread_mutex_unlock(&player->sampleMutex);
 
-    char pipelineDesc[4096];
-    sprintf(pipelineDesc,
-            "filesrc location=../test.video.es ! h264parse ! v4l2slh264dec ! video/x-raw(memory:DMABuf) ! appsink name=samplesink");
+    if (sendQos) {
+        qos.pad = pipeline->sinkPad;
+        playerPushQos(&qos); // the last one decided on, if the loop dropped more than one
+    }
+    return GST_FLOW_OK;
+}
+
+// The flush of a seek is through once it gets here, so whatever comes next starts at the keyframe it seeked to
+static GstPadProbeReturn sinkFlushProbe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    struct PlayerPipeline * pipeline = (struct PlayerPipeline *)user_data;
+    struct Player * player = pipeline->player;
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_FLUSH_STOP) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    pthread_mutex_lock(&player->sampleMutex);
+    if ((pipeline == player->active) && player->seekFlushing) {
+        player->seekFlushing = 0;
+        player->decodeFrame = player->seekFrame;
+    }
+    pthread_mutex_unlock(&player->sampleMutex);
+    return GST_PAD_PROBE_OK;
+}
+
+// Stepping through keyframes, the decoder never sees a delta unit: GST_SEEK_FLAG_TRICKMODE_KEY_UNITS asks the same
+// of it, but not every decoder skips them itself
+static GstPadProbeReturn parserKeyUnitsProbe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    // Per pipeline: a standby prerolling meanwhile needs its delta units
+    struct PlayerPipeline * pipeline = (struct PlayerPipeline *)user_data;
+    if (atomic_load_explicit(&pipeline->keyUnitsOnly, memory_order_relaxed)
+        && GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER(info), GST_BUFFER_FLAG_DELTA_UNIT)) {
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Runs on the thread that posted |message|, which is how streaming threads get to configure themselves
+static GstBusSyncReply playerBusSync(GstBus * bus, GstMessage * message, gpointer user_data)
+{
+    struct Player * player = ((struct PlayerPipeline *)user_data)->player;
+
+    // Acted upon by the render thread, which owns the pipelines; this one may outlive them
+    struct PlayerPipeline * pipeline = (struct PlayerPipeline *)user_data;
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_SEGMENT_DONE) {
+        atomic_store_explicit(&pipeline->segmentDone, 1, memory_order_release);
+    } else if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_EOS) {
+        atomic_store_explicit(&pipeline->ended, 1, memory_order_release);
+    } else if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+        atomic_store_explicit(&pipeline->failed, 1, memory_order_release);
+    }
+
+    if ((GST_MESSAGE_TYPE(message) == GST_MESSAGE_STREAM_STATUS) && player->hasStreamingConfig) {
+        GstStreamStatusType type;
+        GstElement * owner;
+        gst_message_parse_stream_status(message, &type, &owner);
+        if (type == GST_STREAM_STATUS_TYPE_ENTER) {
+            taskConfigureCurrent(&player->streamingConfig);
+        }
+    }
+
+    // Onto the player's own bus, which the application watches whichever pipeline is active
+    gst_bus_post(player->bus, gst_message_ref(message));
+    return GST_BUS_DROP;
+}
 
-    printf("pipelineDesc: %s\n", pipelineDesc);
+// filesrc ! h264parse ! decoder as one bin, with a ghost pad for the decoder's output
+// returns NULL if it can't be built
+static GstElement * playerCreateSource(const char * location, const char * decoder)
+{
+    if (access(location, R_OK) != 0) {
+        LOG_ERROR("Can't read %s", location);
+        return NULL;
+    }
+
+    // No capsfilter: the appsink's caps (playerSetCaps) pick DMA-BUF or system memory output
+    gchar * description = g_strdup_printf("filesrc location=\"%s\" ! h264parse name=parser ! %s", location, decoder[0] ? decoder : PLAYER_DEFAULT_DECODER);
+    LOG_INFO("source: %s", description);
 
     GError * error = NULL;
-    player->pipeline = gst_parse_launch(pipelineDesc, &error);
+    GstElement * source = gst_parse_bin_from_description(description, TRUE, &error);
+    g_free(description);
     if (error) {
-        fatal(error->message);
-    } else {
-        printf("Successfully created pipeline.\n");
-        gst_element_set_state(player->pipeline, GST_STATE_PLAYING);
+        LOG_ERROR("Can't create the source: %s", error->message);
+        g_error_free(error);
+        if (source) {
+            gst_object_unref(source);
+        }
+        return NULL;
     }
+    return source;
+}
 
-    player->sink = gst_bin_get_by_name(GST_BIN(player->pipeline), "samplesink");
-    GstPad * sinkPad = gst_element_get_static_pad(player->sink, "sink");
-    gst_pad_add_probe(sinkPad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM, sinkQuery, NULL, NULL);
-    gst_object_unref(sinkPad);
+// Only called while the appsink waits in PAUSED with the first frame
+static GstFlowReturn sinkNewPreroll(GstAppSink * appsink, gpointer user_data)
+{
+    atomic_store_explicit(&((struct PlayerPipeline *)user_data)->prerolled, 1, memory_order_release);
+    return GST_FLOW_OK;
+}
 
-    player->sampleThread = taskCreate((TaskFunc)sampleThread, player);
+// returns NULL if it can't be built
+static struct PlayerPipeline * playerCreatePipeline(struct Player * player, const char * location, const char * decoder)
+{
+    GstElement * source = playerCreateSource(location, decoder);
+    if (!source) {
+        return NULL;
+    }
+
+    struct PlayerPipeline * pipeline = calloc(1, sizeof(struct PlayerPipeline));
+    pipeline->player = player;
+    pipeline->playlistIndex = -1;
+    pipeline->location = g_strdup(location);
+    pipeline->decoder = g_strdup(decoder);
+    pipeline->pipeline = gst_pipeline_new(NULL);
+    pipeline->sink = gst_element_factory_make("appsink", NULL);
+    gst_bin_add_many(GST_BIN(pipeline->pipeline), source, pipeline->sink, NULL);
+    if (!gst_element_link(source, pipeline->sink)) {
+        LOG_ERROR("Can't link the decoder to the appsink");
+        gst_object_unref(pipeline->pipeline);
+        g_free(pipeline->location);
+        g_free(pipeline->decoder);
+        free(pipeline);
+        return NULL;
+    }
+    if (player->caps) {
+        gst_app_sink_set_caps(GST_APP_SINK(pipeline->sink), player->caps);
+    }
+
+    GstBus * bus = gst_element_get_bus(pipeline->pipeline);
+    gst_bus_set_sync_handler(bus, playerBusSync, pipeline, NULL);
+    gst_object_unref(bus);
+
+    pipeline->sinkPad = gst_element_get_static_pad(pipeline->sink, "sink");
+    gst_pad_add_probe(pipeline->sinkPad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM, sinkQuery, NULL, NULL);
+    gst_pad_add_probe(pipeline->sinkPad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH, sinkFlushProbe, pipeline, NULL);
+
+    GstElement * parser = gst_bin_get_by_name(GST_BIN(source), "parser");
+    if (parser) {
+        GstPad * parserPad = gst_element_get_static_pad(parser, "src");
+        gst_pad_add_probe(parserPad, GST_PAD_PROBE_TYPE_BUFFER, parserKeyUnitsProbe, pipeline, NULL);
+        gst_object_unref(parserPad);
+        gst_object_unref(parser);
+    }
+
+    GstAppSinkCallbacks callbacks = { 0 };
+    callbacks.new_preroll = sinkNewPreroll;
+    callbacks.new_sample = sinkNewSample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(pipeline->sink), &callbacks, pipeline, NULL);
+    return pipeline;
+}
+
+// Stopping a decoder can take a while (V4L2 buffers, threads to join), hence on a worker
+static void playerDestroyPipeline(struct PlayerPipeline * pipeline)
+{
+    uint64_t startNs = timeNowNs();
+    gst_element_set_state(pipeline->pipeline, GST_STATE_NULL);
+
+    GstBus * bus = gst_element_get_bus(pipeline->pipeline);
+    gst_bus_set_sync_handler(bus, NULL, NULL, NULL);
+    gst_object_unref(bus);
+    gst_object_unref(pipeline->sinkPad);
+    gst_object_unref(pipeline->pipeline);
+    LOG_INFO("%s torn down in %.1fms", pipeline->location, (double)(timeNowNs() - startNs) / 1000000.0);
+    g_free(pipeline->location);
+    g_free(pipeline->decoder);
+    free(pipeline);
+}
 
+static void playerRetirePipeline(struct Player * player, struct PlayerPipeline * pipeline)
+{
+    if (!player->workers || !taskPoolSubmit(player->workers, (TaskFunc)playerDestroyPipeline, pipeline)) {
+        playerDestroyPipeline(pipeline);
+    }
+}
+
+struct Player * playerCreate(const char * location, const char * decoder, struct TaskPool * workers)
+{
+    struct Player * player = calloc(1, sizeof(struct Player));
+    pthread_mutex_init(&player->sampleMutex, NULL);
+    pthread_cond_init(&player->queueCond, NULL);
+    player->workers = workers;
+    player->queueDepth = 1;
+    player->dropPolicy = PLAYER_DROP_OLDEST;
+    player->lastPresentTime = GST_CLOCK_TIME_NONE;
+    player->adoptedFrame = PLAYER_FRAME_NONE;
+    player->rate = 1.0;
+    player->frameNs = PLAYER_DEFAULT_FRAME_NS;
+    player->stepFrame = PLAYER_FRAME_NONE;
+    player->reverseFrame = PLAYER_FRAME_NONE;
+    playerGopQuark = g_quark_from_static_string("vaat-gop-cache");
+
+    player->lastQosProportion = 1.0;
+    for (int poolIndex = 0; poolIndex < PLAYER_SAMPLE_POOL_SIZE; ++poolIndex) {
+        player->samplePool[poolIndex] = gst_sample_new(NULL, NULL, NULL, NULL);
+        player->sampleFree[player->sampleFreeCount++] = player->samplePool[poolIndex];
+    }
+
+    player->sampleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (player->sampleFd < 0) {
+        fatal("eventfd() failed");
+    }
+
+    player->bus = gst_bus_new();
+    player->active = playerCreatePipeline(player, location ? location : PLAYER_DEFAULT_LOCATION, decoder ? decoder : "");
+    if (!player->active) {
+        fatal("Can't create the pipeline");
+    }
     return player;
 }
 
+void playerSetCaps(struct Player * player, GstCaps * caps)
+{
+    gst_caps_replace(&player->caps, caps);
+    gst_app_sink_set_caps(GST_APP_SINK(player->active->sink), caps);
+    if (player->standby) {
+        gst_app_sink_set_caps(GST_APP_SINK(player->standby->sink), caps);
+    }
+}
+
+void playerSetStreamingConfig(struct Player * player, const struct TaskConfig * config)
+{
+    player->streamingConfig = *config;
+    player->streamingConfig.name = NULL; // GStreamer's own thread names are more telling
+    player->hasStreamingConfig = 1;
+}
+
+// The segment starts at the beginning and runs to the end; |flags| adds GST_SEEK_FLAG_FLUSH for the first pass
+// returns non-zero if the pipeline took it
+static int playerSeekSegment(struct PlayerPipeline * pipeline, GstSeekFlags flags)
+{
+    if (!gst_element_seek(pipeline->pipeline,
+                          1.0,
+                          GST_FORMAT_TIME,
+                          flags | GST_SEEK_FLAG_SEGMENT,
+                          GST_SEEK_TYPE_SET,
+                          0,
+                          GST_SEEK_TYPE_NONE,
+                          (gint64)GST_CLOCK_TIME_NONE)) {
+        LOG_WARN("%s can't loop through segment seeks, restarting it at the end instead", pipeline->location);
+        return 0;
+    }
+    return 1;
+}
+
+void playerStart(struct Player * player)
+{
+    struct PlayerPipeline * active = player->active;
+    if (active->loop) {
+        // A cold start anyway, so waiting for the preroll here is fine
+        gst_element_set_state(active->pipeline, GST_STATE_PAUSED);
+        gst_element_get_state(active->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+        playerSeekSegment(active, GST_SEEK_FLAG_FLUSH);
+        active->segmentArmed = 1;
+    }
+    gst_element_set_state(active->pipeline, GST_STATE_PLAYING);
+}
+
+int playerPrepare(struct Player * player, const char * location, const char * decoder)
+{
+    struct PlayerPipeline * standby = playerCreatePipeline(player,
+                                                           location ? location : player->active->location,
+                                                           decoder ? decoder : player->active->decoder);
+    if (!standby) {
+        return 0;
+    }
+    if (gst_element_set_state(standby->pipeline, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE) {
+        LOG_ERROR("The standby pipeline won't preroll");
+        playerRetirePipeline(player, standby);
+        return 0;
+    }
+
+    if (player->standby) {
+        playerRetirePipeline(player, player->standby);
+    }
+    player->standby = standby;
+    player->switchPending = 0;
+    return 1;
+}
+
+int playerSwitch(struct Player * player)
+{
+    if (!player->standby) {
+        return 0;
+    }
+    player->switchPending = 1;
+    return 1;
+}
+
+int playerSetSource(struct Player * player, const char * location, const char * decoder)
+{
+    return playerPrepare(player, location, decoder) && playerSwitch(player);
+}
+
+// Asks the kernel to read the whole item ahead, so slow storage can't stall it halfway through
+static void playerPrefetch(const char * location)
+{
+    int fd = open(location, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+static int playerPrepareItem(struct Player * player, int index)
+{
+    playerPrefetch(player->playlist[index]);
+    if (!playerPrepare(player, player->playlist[index], NULL)) {
+        return 0;
+    }
+    player->standby->playlistIndex = index;
+    player->standby->loop = (player->playlistCount == 1) && player->playlistLoop;
+    return 1;
+}
+
+// Prerolls the first item from |first| on that can be built, wrapping around if the playlist loops; the ones that
+// can't be are skipped. |playing| is the active pipeline's item, which isn't tried again, or -1
+// returns non-zero if one was
+static int playerPrepareFrom(struct Player * player, int first, int playing)
+{
+    int index = first;
+    for (int tried = 0; tried < player->playlistCount; ++tried, ++index) {
+        if (index >= player->playlistCount) {
+            if (!player->playlistLoop) {
+                return 0;
+            }
+            index = 0;
+        }
+        if (index == playing) {
+            return 0;
+        }
+        if (playerPrepareItem(player, index)) {
+            return 1;
+        }
+        LOG_WARN("playlist: skipping %s", player->playlist[index]);
+    }
+    return 0;
+}
+
+// Prerolls the item after the active one, to be swapped in when the active one ends
+static void playerPrepareNext(struct Player * player)
+{
+    player->nextPending = 0;
+    int playing = player->active->playlistIndex;
+    if ((player->playlistCount == 1) || (!player->playlistLoop && (playing + 1 >= player->playlistCount))) {
+        return; // loops in its own pipeline, or the last item
+    }
+    if (!playerPrepareFrom(player, playing + 1, playing)) {
+        LOG_ERROR("playlist: nothing after %s can be played, it stops there", player->active->location);
+    }
+}
+
+int playerSetPlaylist(struct Player * player, const char * const * locations, int count, int loop, int current)
+{
+    if (count < 1) {
+        return 0;
+    }
+    g_strfreev(player->playlist);
+    player->playlist = g_new0(char *, count + 1);
+    for (int index = 0; index < count; ++index) {
+        player->playlist[index] = g_strdup(locations[index]);
+    }
+    player->playlistCount = count;
+    player->playlistLoop = loop;
+
+    if (current >= 0) {
+        player->active->playlistIndex = current;
+        player->active->loop = (count == 1) && loop;
+        player->nextPending = 1;
+        return 1;
+    }
+    if (!playerPrepareFrom(player, 0, -1)) {
+        LOG_ERROR("playlist: none of the items can be played");
+        return 0;
+    }
+    return playerSwitch(player);
+}
+
+// Makes the prerolled standby the active pipeline; its first frame is already decoded, so it's on its way as
+// soon as the pipeline plays. Render thread, between two adopted samples
+static void playerSwap(struct Player * player)
+{
+    struct PlayerPipeline * retired = player->active;
+
+    pthread_mutex_lock(&player->sampleMutex);
+    player->active = player->standby;
+    playerFlushQueue(player);
+    playerClearGops(player); // frame numbers of another stream
+    ++player->seekSerial;
+    player->decodeFrame = 0;
+    player->seekFlushing = 0;
+    player->skipFrames = 0;
+    player->serveReverse = 0;
+    player->rate = 1.0; // the new stream's appsink syncs to the clock as usual
+    player->trickMode = PLAYER_TRICK_NONE;
+    player->pacing = 0;
+    player->stepWanted = 0;
+    player->stepPending = 0;
+    player->adoptedActive = 0;
+    player->lastPresentTime = GST_CLOCK_TIME_NONE; // running time starts over
+    player->qosPending = 0;
+    player->switchNs = timeNowNs();
+    pthread_cond_broadcast(&player->queueCond); // a held back streaming thread of the retired one gives up
+    pthread_mutex_unlock(&player->sampleMutex);
+
+    player->standby = NULL;
+    player->switchPending = 0;
+    ++player->swaps;
+    player->nextPending = (player->active->playlistIndex >= 0);
+    gst_element_set_state(player->active->pipeline, GST_STATE_PLAYING);
+    LOG_INFO("switched to %s", player->active->location);
+    playerRetirePipeline(player, retired);
+}
+
+// Everything the bus asked of the pipelines since the last frame; render thread
+static void playerUpdatePipelines(struct Player * player)
+{
+    struct PlayerPipeline * active = player->active;
+    struct PlayerPipeline * standby = player->standby;
+
+    // Whatever went wrong, it won't preroll now: a switch waiting for it would wait forever
+    if (standby && atomic_load_explicit(&standby->failed, memory_order_acquire)) {
+        LOG_ERROR("%s failed before it could take over, dropped", standby->location);
+        int item = standby->playlistIndex;
+        int switchPending = player->switchPending;
+        player->standby = NULL;
+        player->switchPending = 0;
+        playerRetirePipeline(player, standby);
+        standby = NULL;
+
+        // A playlist goes on with the item after it, and takes over where that one would have
+        if ((item >= 0) && (item != active->playlistIndex)) {
+            if (playerPrepareFrom(player, item + 1, active->playlistIndex)) {
+                standby = player->standby;
+                player->switchPending = switchPending;
+            } else {
+                LOG_ERROR("playlist: nothing after %s can be played, it stops there", active->location);
+            }
+        }
+    }
+
+    if (standby && standby->loop && !standby->segmentArmed && atomic_load_explicit(&standby->prerolled, memory_order_acquire)) {
+        // Without a segment the first pass would end in EOS; it prerolls again from the start
+        atomic_store_explicit(&standby->prerolled, 0, memory_order_relaxed);
+        standby->segmentArmed = 1;
+        if (!playerSeekSegment(standby, GST_SEEK_FLAG_FLUSH)) {
+            atomic_store_explicit(&standby->prerolled, 1, memory_order_relaxed); // nothing was flushed
+        }
+    }
+
+    // The source is done but the decoder and appsink still hold the last frames, so the next pass is queued
+    // behind them without a flush: no gap, no black frame
+    if (atomic_exchange_explicit(&active->segmentDone, 0, memory_order_acquire) && !active->held) {
+        playerSeekSegment(active, GST_SEEK_FLAG_NONE);
+    }
+
+    // Stepping and playing backwards run into the end on their way, which doesn't make it the next item's turn
+    if (atomic_exchange_explicit(&active->ended, 0, memory_order_acquire)
+        && (player->trickMode != PLAYER_TRICK_KEYFRAMES) && (player->trickMode != PLAYER_TRICK_REVERSE)) {
+        if (!standby && active->loop) {
+            playerPrepareItem(player, active->playlistIndex); // it couldn't seek, so a fresh pipeline it is
+            standby = player->standby;
+        }
+        if (standby) {
+            player->switchPending = 1;
+        }
+    }
+
+    if (player->switchPending && (!standby->loop || standby->segmentArmed)
+        && atomic_load_explicit(&standby->prerolled, memory_order_acquire)) {
+        playerSwap(player);
+    }
+
+    // Not while the swap's first frame is on its way, building a pipeline takes a few milliseconds
+    if (player->nextPending && player->adoptedActive && !player->switchNs && !player->standby) {
+        playerPrepareNext(player);
+    }
+}
+
+int playerGetLoopPosition(struct Player * player, GstSample * sample, GstClockTime * position, unsigned long * item)
+{
+    struct PlayerPipeline * active = player->active;
+    if (!player->adoptedActive || !active->loop || !active->segmentArmed) {
+        return 0;
+    }
+
+    GstBuffer * buffer = gst_sample_get_buffer(sample);
+    GstSegment * segment = gst_sample_get_segment(sample);
+    if (!buffer || !segment || !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer))) {
+        return 0;
+    }
+    // Every pass is a segment from the start, so stream time starts over with each
+    *position = gst_segment_to_stream_time(segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+    *item = player->swaps;
+    return GST_CLOCK_TIME_IS_VALID(*position);
+}
+
+void playerHoldLoop(struct Player * player, int hold)
+{
+    struct PlayerPipeline * active = player->active;
+    if (!active->loop || (!hold == !active->held)) {
+        return;
+    }
+    active->held = hold;
+
+    if (hold) {
+        // The appsink blocks once it has a frame, and the decoder soon after, once its buffers are used up
+        LOG_INFO("%s: decoding paused, the renderer repeats it", active->location);
+        gst_element_set_state(active->pipeline, GST_STATE_PAUSED);
+        return;
+    }
+
+    // The renderer was somewhere in a pass the decoder never got to, so from the start
+    LOG_INFO("%s: decoding again", active->location);
+    pthread_mutex_lock(&player->sampleMutex);
+    player->lastPresentTime = GST_CLOCK_TIME_NONE;
+    pthread_mutex_unlock(&player->sampleMutex);
+    playerSeekSegment(active, GST_SEEK_FLAG_FLUSH);
+    gst_element_set_state(active->pipeline, GST_STATE_PLAYING);
+}
+
+// --------------------------------------------------------------------------------------
+// Seeking
+
+// The active stream's index, loaded or built by the first seek into it; NULL if it can't be read
+static const struct EsIndex * playerGetIndex(struct Player * player)
+{
+    const char * location = player->active->location;
+    if (player->index && !strcmp(player->indexLocation, location)) {
+        return player->index;
+    }
+    esIndexDestroy(player->index);
+    g_free(player->indexLocation);
+    player->index = esIndexOpen(location);
+    player->indexLocation = player->index ? g_strdup(location) : NULL;
+    return player->index;
+}
+
+// frames from |keyframe| up to the next one
+static uint32_t playerGopLength(const struct EsIndex * index, const struct EsIndexKeyframe * keyframe)
+{
+    uint32_t next = (keyframe + 1 < index->keyframes + index->keyframeCount) ? keyframe[1].frame : index->frameCount;
+    return next - keyframe->frame;
+}
+
+// Drops what's queued and what the cache was serving, and makes whatever the streaming threads hold stale, ahead of
+// a flushing seek
+// sampleMutex must be held
+static void playerBeginSeek(struct Player * player)
+{
+    ++player->seekSerial; // a streaming thread holding a frame from before lets go of it
+    playerFlushQueue(player);
+    player->serveGop = NULL;
+    player->serveReverse = 0;
+    player->recordGop = NULL;
+    player->skipFrames = 0;
+    player->stepWanted = 0;
+    player->adoptedActive = 0;
+    player->lastPresentTime = GST_CLOCK_TIME_NONE; // the flush starts running time over
+    player->qosPending = 0;
+    pthread_cond_broadcast(&player->queueCond);
+}
+
+// Flushes the active pipeline and has it go on from byte |offset|, with |flags| on top of GST_SEEK_FLAG_FLUSH.
+// h264parse passes byte seeks up to filesrc and picks the stream up at the next start code; the parser and the
+// decoder keep the SPS / PPS they've seen, so keyframes without their own still decode. At the file's size the
+// seek ends the stream.
+// returns non-zero if the pipeline took it
+static int playerSeekBytes(struct Player * player, uint64_t offset, GstSeekFlags flags)
+{
+    struct PlayerPipeline * active = player->active;
+    if (gst_element_seek(active->pipeline,
+                         1.0,
+                         GST_FORMAT_BYTES,
+                         GST_SEEK_FLAG_FLUSH | flags,
+                         GST_SEEK_TYPE_SET,
+                         (gint64)offset,
+                         GST_SEEK_TYPE_NONE,
+                         -1)) {
+        return 1;
+    }
+    LOG_WARN_EVERY(1000, "%s won't seek to byte %llu", active->location, (unsigned long long)offset);
+    pthread_mutex_lock(&player->sampleMutex);
+    player->seekFlushing = 0;
+    player->skipFrames = 0;
+    player->recordGop = NULL;
+    player->stepWanted = 0;
+    pthread_mutex_unlock(&player->sampleMutex);
+    return 0;
+}
+
+int playerSeek(struct Player * player, uint32_t frame, int mode)
+{
+    struct PlayerPipeline * active = player->active;
+    if (active->loop) {
+        LOG_WARN("%s loops, it can't seek", active->location);
+        return 0;
+    }
+    const struct EsIndex * index = playerGetIndex(player);
+    if (!index || !index->keyframeCount) {
+        LOG_WARN("%s has no keyframes to seek to", active->location);
+        return 0;
+    }
+    if (frame >= index->frameCount) {
+        frame = index->frameCount - 1;
+    }
+    const struct EsIndexKeyframe * keyframe = esIndexFindKeyframe(index, frame);
+    if (!keyframe) {
+        keyframe = &index->keyframes[0]; // before the first keyframe, nothing can be decoded on its own
+        frame = keyframe->frame;
+    }
+    uint32_t target = (mode == PLAYER_SEEK_KEYFRAME) ? keyframe->frame : frame;
+
+    pthread_mutex_lock(&player->sampleMutex);
+    playerBeginSeek(player);
+    if ((player->trickMode == PLAYER_TRICK_KEYFRAMES) || (player->trickMode == PLAYER_TRICK_REVERSE)) {
+        // Stepping or playing backwards just carries on from there; see playerUpdateTrick()
+        playerPaceFrom(player, target);
+        player->stepFrame = PLAYER_FRAME_NONE;
+        player->stepPending = 0;
+        player->reverseFrame = target;
+        pthread_mutex_unlock(&player->sampleMutex);
+        LOG_INFO("seek to frame %u at rate %g", target, player->rate);
+        return 1;
+    }
+
+    // What the cache has of the target's GOP is shown right away; the decoder takes over where it ends
+    uint32_t resume = target;
+    struct PlayerGop * gop = playerFindGop(player, keyframe->frame);
+    if (gop && (target < gop->first + gop->filled)) {
+        gop->usedNs = timeNowNs();
+        player->serveGop = gop;
+        player->serveNext = target - gop->first;
+        player->serveEnd = gop->filled;
+        resume = gop->first + gop->filled;
+        uint64_t one = 1;
+        if (write(player->sampleFd, &one, sizeof(one)) != sizeof(one)) {
+            LOG_WARN("playerSeek(): failed to signal sample");
+        }
+    }
+    // The decoder's frames come after the cached ones, late by the clock by then, so they're paced too
+    player->pacing = (player->trickMode == PLAYER_TRICK_PACED) || (player->serveGop != NULL);
+    playerPaceFrom(player, target);
+
+    const struct EsIndexKeyframe * from = (resume < index->frameCount) ? esIndexFindKeyframe(index, resume) : NULL;
+    uint32_t seekFrame = from ? from->frame : index->frameCount; // for the log, after the lock is released
+    player->seekFlushing = 1;
+    player->seekFrame = seekFrame;
+    player->skipFrames = from ? (resume - from->frame) : 0;
+    if (from && (mode == PLAYER_SEEK_ACCURATE) && player->gopCacheBudget) {
+        struct PlayerGop * record = playerFindGop(player, from->frame);
+        if (!record) {
+            record = playerCreateGop(player, from->frame, playerGopLength(index, from));
+        }
+        if (record && (record->filled < record->count)) {
+            record->usedNs = timeNowNs();
+            player->recordGop = record;
+        }
+    }
+    pthread_mutex_unlock(&player->sampleMutex);
+
+    uint64_t startNs = timeNowNs();
+    if (!playerSeekBytes(player, from ? from->offset : index->fileSize, GST_SEEK_FLAG_NONE)) {
+        return 0;
+    }
+    LOG_INFO("seek to frame %u: %u from the GOP cache, decoding from frame %u with %u to skip, flushed in %.1fms",
+             target,
+             resume - target,
+             seekFrame,
+             resume - seekFrame,
+             (double)(timeNowNs() - startNs) / 1000000.0);
+    return 1;
+}
+
+void playerSetGopCache(struct Player * player, size_t budget)
+{
+    pthread_mutex_lock(&player->sampleMutex);
+    player->gopCacheBudget = budget;
+    player->gopCacheFull = 0;
+    if (!budget) {
+        player->serveGop = NULL; // what it already handed out stays valid
+        player->serveReverse = 0;
+        playerClearGops(player);
+        pthread_cond_broadcast(&player->queueCond);
+    } else {
+        playerEvictGops(player, 0);
+    }
+    pthread_mutex_unlock(&player->sampleMutex);
+}
+
+uint32_t playerGetFrame(struct Player * player)
+{
+    pthread_mutex_lock(&player->sampleMutex);
+    uint32_t frame = player->adoptedFrame;
+    pthread_mutex_unlock(&player->sampleMutex);
+    return frame;
+}
+
+// --------------------------------------------------------------------------------------
+// Trick play
+
+// Fast forward and rewind: a seek to the keyframe at or before where the rate has got to by now, for that one frame.
+// The parser drops the delta units after it, and once it's queued the appsink refuses the rest until the next step.
+// Render thread
+static void playerUpdateKeyframes(struct Player * player, const struct EsIndex * index)
+{
+    pthread_mutex_lock(&player->sampleMutex);
+    uint64_t nowNs = timeNowNs();
+    if (player->stepPending && (nowNs - player->stepNs < PLAYER_STEP_TIMEOUT_NS)) {
+        // One step at a time: the decoder is what limits the rate, so keyframes it can't keep up with are left out
+        pthread_mutex_unlock(&player->sampleMutex);
+        return;
+    }
+    double moved = (double)(nowNs - player->paceNs) / playerFrameInterval(player);
+    double wanted = (player->rate > 0.0) ? (player->paceFrame + moved) : (player->paceFrame - moved);
+    uint32_t frame = (wanted <= 0.0) ? 0 : (wanted >= index->frameCount - 1) ? (index->frameCount - 1) : (uint32_t)wanted;
+    const struct EsIndexKeyframe * keyframe = esIndexFindKeyframe(index, frame);
+    keyframe = keyframe ? keyframe : &index->keyframes[0];
+    int passed = (player->rate > 0.0) ? (keyframe->frame <= player->stepFrame) : (keyframe->frame >= player->stepFrame);
+    if ((player->stepFrame != PLAYER_FRAME_NONE) && passed) {
+        pthread_mutex_unlock(&player->sampleMutex);
+        return;
+    }
+
+    playerBeginSeek(player);
+    player->seekFlushing = 1;
+    player->seekFrame = keyframe->frame;
+    player->stepWanted = 1;
+    player->stepPending = 1;
+    player->stepFrame = keyframe->frame;
+    player->stepNs = nowNs;
+    pthread_mutex_unlock(&player->sampleMutex);
+
+    // The segment stays at 1.0: the steps are the pacing, and raw H.264 has no timestamps a scaled one could go by
+    playerSeekBytes(player, keyframe->offset, GST_SEEK_FLAG_TRICKMODE | GST_SEEK_FLAG_TRICKMODE_KEY_UNITS);
+}
+
+// Backwards: the GOP of the next frame is shown backwards from the cache once it's there, while the one before it
+// is decoded forward into the cache. Render thread
+static void playerUpdateReverse(struct Player * player, const struct EsIndex * index)
+{
+    pthread_mutex_lock(&player->sampleMutex);
+    uint32_t frame = player->reverseFrame;
+    const struct EsIndexKeyframe * keyframe = (frame != PLAYER_FRAME_NONE) ? esIndexFindKeyframe(index, frame) : NULL;
+    if (!keyframe) {
+        // At the start, or before the first keyframe where there's nothing to decode from
+        pthread_mutex_unlock(&player->sampleMutex);
+        return;
+    }
+    if (player->gopCacheFull) {
+        player->trickMode = PLAYER_TRICK_KEYFRAMES;
+        player->pacing = 0;
+        player->stepFrame = PLAYER_FRAME_NONE;
+        player->stepPending = 0;
+        playerPaceFrom(player, frame);
+        pthread_mutex_unlock(&player->sampleMutex);
+        atomic_store_explicit(&player->active->keyUnitsOnly, 1, memory_order_relaxed);
+        LOG_WARN("The GOP cache can't hold a GOP and the one before it, stepping backwards through keyframes instead");
+        return;
+    }
+
+    // A GOP that decodes to fewer frames than the index counts never completes; once they stop coming, what came
+    // is all of it
+    struct PlayerGop * record = player->recordGop;
+    uint64_t nowNs = timeNowNs();
+    if (record && (record->filled != player->reverseRecordFilled)) {
+        player->reverseRecordFilled = record->filled;
+        player->reverseRecordNs = nowNs;
+    } else if (record && (nowNs - player->reverseRecordNs >= PLAYER_STEP_TIMEOUT_NS)) {
+        LOG_WARN_EVERY(1000,
+                       "GOP at frame %u: %u of %u frames decoded, going on without the rest",
+                       record->first,
+                       record->filled,
+                       record->count);
+        record->count = record->filled;
+        player->recordGop = NULL;
+    }
+
+    struct PlayerGop * gop = playerFindGop(player, keyframe->frame);
+    if (gop && (gop->filled == gop->count) && (frame - gop->first >= gop->filled)) {
+        // Cut short like that: backwards from its last frame, or from the GOP before if it has none
+        player->reverseFrame = gop->filled ? (gop->first + gop->filled - 1) : gop->first ? (gop->first - 1) : PLAYER_FRAME_NONE;
+        pthread_mutex_unlock(&player->sampleMutex);
+        return;
+    }
+    int ready = gop && (gop->filled > frame - keyframe->frame);
+    if (ready && !player->serveGop) {
+        gop->usedNs = timeNowNs();
+        player->serveGop = gop;
+        player->serveNext = frame - gop->first;
+        player->serveReverse = 1;
+        uint64_t one = 1;
+        if (write(player->sampleFd, &one, sizeof(one)) != sizeof(one)) {
+            LOG_WARN_EVERY(1000, "playerUpdateReverse(): failed to signal sample");
+        }
+    }
+
+    // One GOP at a time: the one shown next if it isn't cached yet, else the one before it
+    const struct EsIndexKeyframe * decode = NULL;
+    if (!ready) {
+        decode = keyframe;
+    } else if (keyframe > index->keyframes) {
+        struct PlayerGop * before = playerFindGop(player, keyframe[-1].frame);
+        decode = (!before || (before->filled < before->count)) ? (keyframe - 1) : NULL;
+    }
+    record = NULL;
+    if (decode && !player->recordGop) {
+        record = playerFindGop(player, decode->frame);
+        record = record ? record : playerCreateGop(player, decode->frame, playerGopLength(index, decode));
+    }
+    if (!record) {
+        pthread_mutex_unlock(&player->sampleMutex);
+        return;
+    }
+    record->usedNs = timeNowNs();
+    ++player->seekSerial; // a copy still on its way from the last GOP goes nowhere
+    player->recordGop = record;
+    player->reverseRecordNs = record->usedNs;
+    player->reverseRecordFilled = record->filled;
+    player->seekFlushing = 1;
+    player->seekFrame = decode->frame;
+    player->skipFrames = 0;
+    pthread_cond_broadcast(&player->queueCond);
+    pthread_mutex_unlock(&player->sampleMutex);
+
+    playerSeekBytes(player, decode->offset, GST_SEEK_FLAG_NONE);
+}
+
+// Render thread, before every adoption
+static void playerUpdateTrick(struct Player * player)
+{
+    if ((player->trickMode != PLAYER_TRICK_KEYFRAMES) && (player->trickMode != PLAYER_TRICK_REVERSE)) {
+        return;
+    }
+    const struct EsIndex * index = playerGetIndex(player);
+    if (!index || !index->keyframeCount) {
+        return;
+    }
+    if (player->trickMode == PLAYER_TRICK_KEYFRAMES) {
+        playerUpdateKeyframes(player, index);
+    } else {
+        playerUpdateReverse(player, index);
+    }
+}
+
+int playerSetRate(struct Player * player, double rate)
+{
+    static const char * const modeNames[] = { "normal", "paced", "keyframes only", "GOPs backwards" };
+
+    struct PlayerPipeline * active = player->active;
+    if (!((rate >= -PLAYER_MAX_RATE) && (rate <= PLAYER_MAX_RATE)) || (rate == 0.0)) {
+        return 0;
+    }
+    if (active->loop) {
+        LOG_WARN("%s loops, it only plays at 1.0", active->location);
+        return 0;
+    }
+    int mode = (rate == 1.0)                                                                 ? PLAYER_TRICK_NONE
+               : ((rate >= PLAYER_TRICK_KEYFRAME_RATE) || (rate <= -PLAYER_TRICK_KEYFRAME_RATE)) ? PLAYER_TRICK_KEYFRAMES
+               : (rate > 0.0)                                                                ? PLAYER_TRICK_PACED
+                                                                                             : PLAYER_TRICK_REVERSE;
+    if ((mode == PLAYER_TRICK_REVERSE) && !player->gopCacheBudget) {
+        LOG_WARN("Playing backwards frame by frame needs the GOP cache, stepping through keyframes instead");
+        mode = PLAYER_TRICK_KEYFRAMES;
+    }
+    if ((mode == PLAYER_TRICK_KEYFRAMES) || (mode == PLAYER_TRICK_REVERSE)) {
+        const struct EsIndex * index = playerGetIndex(player);
+        if (!index || !index->keyframeCount) {
+            LOG_WARN("%s has no keyframes to step through", active->location);
+            return 0;
+        }
+    }
+
+    uint32_t frame = playerGetFrame(player);
+    frame = (frame == PLAYER_FRAME_NONE) ? 0 : frame;
+    int previous = player->trickMode;
+
+    pthread_mutex_lock(&player->sampleMutex);
+    player->rate = rate;
+    player->trickMode = mode;
+    if (player->avgFrameDuration > 0.0) {
+        player->frameNs = player->avgFrameDuration;
+    }
+    player->gopCacheFull = 0;
+    player->pacing = (mode == PLAYER_TRICK_PACED) || (mode == PLAYER_TRICK_REVERSE);
+    playerPaceFrom(player, frame);
+    player->stepFrame = frame;
+    player->stepPending = 0;
+    player->reverseFrame = frame ? (frame - 1) : PLAYER_FRAME_NONE;
+    if ((mode == PLAYER_TRICK_KEYFRAMES) || (mode == PLAYER_TRICK_REVERSE)) {
+        playerBeginSeek(player); // the decoder stops at its next frame, until the first step or GOP is due
+    }
+    pthread_mutex_unlock(&player->sampleMutex);
+
+    atomic_store_explicit(&active->keyUnitsOnly, mode == PLAYER_TRICK_KEYFRAMES, memory_order_relaxed);
+    g_object_set(active->sink, "sync", (gboolean)(mode == PLAYER_TRICK_NONE), NULL);
+    LOG_INFO("rate %g from frame %u: %s", rate, frame, modeNames[mode]);
+
+    // Forward through every frame again, the decoder goes on after the frame on screen; through a flush, so running
+    // time starts over for the clock. From one paced rate to another it's on its way there already
+    if (((mode == PLAYER_TRICK_NONE) && (previous != PLAYER_TRICK_NONE))
+        || ((mode == PLAYER_TRICK_PACED) && (previous != PLAYER_TRICK_NONE) && (previous != PLAYER_TRICK_PACED))) {
+        return playerSeek(player, frame + 1, PLAYER_SEEK_ACCURATE);
+    }
+    return 1;
+}
+
+void playerSetQueue(struct Player * player, int depth, int dropPolicy)
+{
+    pthread_mutex_lock(&player->sampleMutex);
+    player->queueDepth = (depth < 1) ? 1 : (depth > PLAYER_MAX_QUEUE_DEPTH) ? PLAYER_MAX_QUEUE_DEPTH : depth;
+    player->dropPolicy = dropPolicy;
+    pthread_cond_broadcast(&player->queueCond); // a decoder held back may go on now
+    pthread_mutex_unlock(&player->sampleMutex);
+}
+
 GstSample * playerAdoptSample(struct Player * player)
 {
+    playerUpdatePipelines(player);
+    playerUpdateTrick(player);
+
     GstSample * sample = NULL;
     pthread_mutex_lock(&player->sampleMutex);
-    sample = player->sample;
-    player->sample = NULL;
+    struct PlayerGop * gop = player->serveGop;
+    if (gop && playerFrameDue(player, gop->first + player->serveNext)) {
+        // Decoded before the seek, so it has no latency to speak of, and QoS nothing to learn from it
+        sample = gst_sample_ref(gop->frames[player->serveNext]);
+        statsAdd(STATS_FRAMES_ADOPTED, 1);
+        player->adoptedFrame = gop->first + player->serveNext;
+        player->adoptedActive = 0;
+        if (player->serveReverse) {
+            player->reverseFrame = player->adoptedFrame ? (player->adoptedFrame - 1) : PLAYER_FRAME_NONE;
+            if (player->serveNext-- == 0) {
+                player->serveGop = NULL; // the GOP before it should be cached by now
+                player->serveReverse = 0;
+            }
+            if (player->reverseFrame == PLAYER_FRAME_NONE) {
+                LOG_INFO("backwards at the first frame");
+            }
+        } else if (++player->serveNext == player->serveEnd) {
+            player->serveGop = NULL;
+            pthread_cond_broadcast(&player->queueCond); // the decoder's frames are next
+        }
+        if (!player->serveGop && (player->queueCount == 0)) {
+            uint64_t count;
+            ssize_t drained = read(player->sampleFd, &count, sizeof(count));
+            (void)drained;
+        }
+    } else if (!gop && (player->queueCount > 0) && playerFrameDue(player, player->queueFrame[player->queueHead])) {
+        uint64_t decodedNs;
+        player->adoptedFrame = player->queueFrame[player->queueHead];
+        sample = playerPopSample(player, &decodedNs);
+        statsAdd(STATS_FRAMES_ADOPTED, 1);
+        statsObserve(STATS_LATENCY_QUEUE, timeNowNs() - decodedNs);
+        player->adoptedDecodedNs = decodedNs;
+        player->adoptedActive = 1;
+        if (player->stepPending && (player->adoptedFrame == player->stepFrame)) {
+            player->stepPending = 0;
+        }
+
+        // Stays readable while there are more
+        if (player->queueCount == 0) {
+            uint64_t count;
+            ssize_t drained = read(player->sampleFd, &count, sizeof(count));
+            (void)drained;
+        }
+        pthread_cond_signal(&player->queueCond);
+    } else if (player->pacing) {
+        // Not due yet: the renderer's next tick comes back for it, rather than spinning on a readable fd
+        uint64_t count;
+        ssize_t drained = read(player->sampleFd, &count, sizeof(count));
+        (void)drained;
+    }
     pthread_mutex_unlock(&player->sampleMutex);
     return sample;
 }
 
+int playerGetSampleFd(struct Player * player)
+{
+    return player->sampleFd;
+}
+
+int playerGetBusFd(struct Player * player)
+{
+    GPollFD pollFd;
+    gst_bus_get_pollfd(player->bus, &pollFd);
+    return pollFd.fd;
+}
+
+// --------------------------------------------------------------------------------------
+// Bus
+
+static void playerHandleMessage(struct Player * player, GstMessage * message)
+{
+    switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_ERROR: {
+            GError * error = NULL;
+            gchar * debug = NULL;
+            gst_message_parse_error(message, &error, &debug);
+            LOG_ERROR("Pipeline error from %s: %s (%s)", GST_MESSAGE_SRC_NAME(message), error->message, debug ? debug : "");
+            g_error_free(error);
+            g_free(debug);
+            break;
+        }
+        case GST_MESSAGE_WARNING: {
+            GError * error = NULL;
+            gchar * debug = NULL;
+            gst_message_parse_warning(message, &error, &debug);
+            LOG_WARN("Pipeline warning from %s: %s (%s)", GST_MESSAGE_SRC_NAME(message), error->message, debug ? debug : "");
+            g_error_free(error);
+            g_free(debug);
+            break;
+        }
+        case GST_MESSAGE_EOS:
+            LOG_INFO("Pipeline reached EOS");
+            break;
+        case GST_MESSAGE_LATENCY: {
+            // An element's latency changed (e.g. the decoder's reorder depth); redistribute it in its own pipeline
+            GstObject * pipeline = gst_object_ref(GST_MESSAGE_SRC(message));
+            GstObject * parent;
+            while ((parent = gst_object_get_parent(pipeline)) != NULL) {
+                gst_object_unref(pipeline);
+                pipeline = parent;
+            }
+            gst_bin_recalculate_latency(GST_BIN(pipeline));
+            gst_object_unref(pipeline);
+            break;
+        }
+        case GST_MESSAGE_STATE_CHANGED:
+            if (!GST_OBJECT_PARENT(GST_MESSAGE_SRC(message))) {
+                GstState oldState, newState, pendingState;
+                gst_message_parse_state_changed(message, &oldState, &newState, &pendingState);
+                LOG_DEBUG("Pipeline %s state: %s -> %s",
+                          GST_MESSAGE_SRC_NAME(message),
+                          gst_element_state_get_name(oldState),
+                          gst_element_state_get_name(newState));
+            }
+            break;
+        case GST_MESSAGE_QOS: {
+            GstFormat format;
+            guint64 processed, dropped;
+            gst_message_parse_qos_stats(message, &format, &processed, &dropped);
+            if ((format == GST_FORMAT_BUFFERS) || (format == GST_FORMAT_DEFAULT)) {
+                pthread_mutex_lock(&player->sampleMutex);
+                player->framesDroppedUpstream = dropped;
+                statsSetGauge(STATS_GAUGE_FRAMES_DROPPED_UPSTREAM, (int64_t)dropped);
+                pthread_mutex_unlock(&player->sampleMutex);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static gboolean playerBusWatch(GstBus * bus, GstMessage * message, gpointer user_data)
+{
+    playerHandleMessage((struct Player *)user_data, message);
+    return G_SOURCE_CONTINUE;
+}
+
+void playerWatchBus(struct Player * player)
+{
+    gst_bus_add_watch(player->bus, playerBusWatch, player);
+}
+
+void playerDispatchBus(struct Player * player)
+{
+    GstMessage * message;
+    while ((message = gst_bus_pop(player->bus)) != NULL) {
+        playerHandleMessage(player, message);
+        gst_message_unref(message);
+    }
+}
+
 void playerDestroy(struct Player * player)
 {
-    // TODO: implement
+    if (!player)
+        return;
+
+    struct PlayerPipeline * active = player->active;
+    pthread_mutex_lock(&player->sampleMutex);
+    player->active = NULL; // every streaming thread gives up
+    pthread_cond_broadcast(&player->queueCond);
+    pthread_mutex_unlock(&player->sampleMutex);
+
+    if (player->standby) {
+        playerDestroyPipeline(player->standby);
+    }
+    playerDestroyPipeline(active);
+    if (player->workers) {
+        taskPoolWait(player->workers); // pipelines retired earlier still forward to our bus
+    }
+
+    while (player->queueCount > 0) {
+        uint64_t decodedNs;
+        playerRecycleSample(player, playerPopSample(player, &decodedNs));
+    }
+    playerClearGops(player);
+    esIndexDestroy(player->index);
+    g_free(player->indexLocation);
+    // Samples still adopted by the renderer must have been released by now
+    for (int poolIndex = 0; poolIndex < PLAYER_SAMPLE_POOL_SIZE; ++poolIndex) {
+        gst_sample_unref(player->samplePool[poolIndex]);
+    }
+    gst_caps_replace(&player->caps, NULL);
+    g_strfreev(player->playlist);
+    gst_bus_remove_watch(player->bus);
+    gst_bus_set_flushing(player->bus, TRUE);
+    gst_object_unref(player->bus);
+    close(player->sampleFd);
+    pthread_cond_destroy(&player->queueCond);
+    pthread_mutex_destroy(&player->sampleMutex);
+    free(player);
 }
@@ -2,11 +2,128 @@
 #define VAAT_PLAYER_H
 
 #include <gst/gst.h>
+#include <stdint.h>
 
-struct Player * playerCreate();
+struct TaskConfig;
+struct TaskPool;
+
+struct PlayerStats
+{
+    guint64 framesPresented;
+    guint64 framesDropped; // decoded but replaced before they were adopted
+    guint64 framesDroppedUpstream; // reported by the decoder's QoS messages
+    guint64 sampleAllocations; // heap allocations on the streaming thread while handing over samples
+};
+
+#define PLAYER_MAX_QUEUE_DEPTH 4
+#define PLAYER_DEFAULT_LOCATION "../test.video.es"
+
+// What a full queue of decoded samples does with the next one
+enum PlayerDropPolicy
+{
+    PLAYER_DROP_OLDEST, // drops the oldest waiting sample: the lowest latency
+    PLAYER_DROP_NONE, // holds the decoder back until the renderer catches up: every frame is shown
+};
+
+// |location| is an H.264 elementary stream, NULL for PLAYER_DEFAULT_LOCATION
+// |decoder| is a gst-launch element description, NULL or "" for the V4L2 stateless decoder
+// |workers| tear down pipelines that were switched away from; NULL to do it on the calling thread
+struct Player * playerCreate(const char * location, const char * decoder, struct TaskPool * workers);
+
+// Samples adopted by the renderer must have been released
 void playerDestroy(struct Player * player);
 
-// returns NULL if there isn't one to adopt
+// Builds a standby pipeline and prerolls it in the background: PAUSED, with its first frame decoded and waiting
+// in its appsink. Replaces an earlier standby. NULL keeps the active pipeline's location or decoder.
+// Call from the render thread. returns non-zero unless it can't be built
+int playerPrepare(struct Player * player, const char * location, const char * decoder);
+
+// Swaps the standby in at the next frame boundary once it's prerolled: playerAdoptSample() starts it and drops
+// whatever the active one queued, which is torn down on the workers. Call from the render thread
+// returns non-zero unless there's no standby
+int playerSwitch(struct Player * player);
+
+// playerPrepare() and playerSwitch(); the current stream plays until the new one has its first frame
+int playerSetSource(struct Player * player, const char * location, const char * decoder);
+
+// Plays |locations| one after the other, each prerolled while the one before plays and swapped in at its EOS,
+// so there's no gap between them; with |loop| it starts over after the last. A single looping item never ends:
+// it repeats through segment seeks in the same pipeline and decoder.
+// |current| is the item the active pipeline already plays (only before playerStart), or -1 to switch to the
+// first. playerSetSource() and playerPrepare() leave the playlist. Call from the render thread
+// returns non-zero unless the first item can't be built
+int playerSetPlaylist(struct Player * player, const char * const * locations, int count, int loop, int current);
+
+// decoded samples that may wait for the renderer (1 to PLAYER_MAX_QUEUE_DEPTH), and the enum PlayerDropPolicy when full
+void playerSetQueue(struct Player * player, int depth, int dropPolicy);
+
+// For a sample just adopted from a single looping item (see playerSetPlaylist()): its position within the pass, and
+// |item|, which changes whenever another pipeline takes over
+// returns non-zero if |sample| is one
+int playerGetLoopPosition(struct Player * player, GstSample * sample, GstClockTime * position, unsigned long * item);
+
+// Pauses a single looping item's decoding while the renderer repeats it from frames it kept, or resumes it from
+// the start. Call from the render thread
+void playerHoldLoop(struct Player * player, int hold);
+
+#define PLAYER_FRAME_NONE UINT32_MAX
+
+enum PlayerSeekMode
+{
+    PLAYER_SEEK_KEYFRAME, // to the keyframe at or before the frame: nothing is decoded for nothing
+    PLAYER_SEEK_ACCURATE, // to the frame itself: decoded from that keyframe, what comes before it dropped unseen
+};
+
+// Jumps the active stream to |frame|, counted from 0 in presentation order, and plays on from there. The first seek
+// into a stream loads its index (esindex.h), or builds it, which reads the whole file once.
+// Not for a single looping item. Call from the render thread
+// returns non-zero unless the stream can't seek
+int playerSeek(struct Player * player, uint32_t frame, int mode);
+
+// Accurate seeks keep copies of the GOP they decode in up to |budget| bytes of system memory, so scrubbing back
+// into it shows frames without decoding; 0 turns it off. Call from the render thread
+void playerSetGopCache(struct Player * player, size_t budget);
+
+// the frame number of the sample adopted last, PLAYER_FRAME_NONE if it isn't known
+uint32_t playerGetFrame(struct Player * player);
+
+#define PLAYER_MAX_RATE 64.0
+
+// Plays the active stream at |rate| times its speed from the frame on screen on, backwards if negative, with
+// playerAdoptSample() handing out frames as they come due. Below 2x either way every frame is shown, backwards by
+// decoding a GOP at a time into the GOP cache (playerSetGopCache()), which must hold two of them; from 2x on the
+// decoder gets nothing but keyframes and they're shown one after the other, as fast as it keeps up. The renderer
+// should adopt on a timer as well as on the sample fd, which doesn't stay readable for frames that aren't due yet.
+// Not for a single looping item; a switch to another stream goes back to 1.0. Call from the render thread
+// returns non-zero unless the stream can't play at |rate| (up to PLAYER_MAX_RATE either way, not 0)
+int playerSetRate(struct Player * player, double rate);
+
+// restricts what the appsinks accept, standby ones included (call before playerStart)
+void playerSetCaps(struct Player * player, GstCaps * caps);
+
+// scheduling for the decoder's streaming threads, e.g. to keep them off the render CPU (call before playerStart)
+void playerSetStreamingConfig(struct Player * player, const struct TaskConfig * config);
+
+// moves the pipeline to PLAYING once the renderer has advertised its caps
+void playerStart(struct Player * player);
+
+// returns NULL if there isn't one to adopt; give it back with playerReleaseSample() rather than unreffing it
 GstSample * playerAdoptSample(struct Player * player);
+void playerReleaseSample(struct Player * player, GstSample * sample);
+
+// fd that is readable while a sample is waiting in playerAdoptSample()
+int playerGetSampleFd(struct Player * player);
+
+// call once an adopted sample is on screen; feeds QoS upstream so decoders can drop late frames early
+void playerReportPresented(struct Player * player, GstSample * sample);
+
+void playerGetStats(struct Player * player, struct PlayerStats * stats);
+
+// handle bus messages from the default GMainContext (threaded mode)
+void playerWatchBus(struct Player * player);
+
+// fd that is readable while the pipeline bus has messages; drain it with playerDispatchBus() (reactor mode)
+int playerGetBusFd(struct Player * player);
+void playerDispatchBus(struct Player * player);
 
 #endif
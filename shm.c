@@ -0,0 +1,420 @@
+#define _GNU_SOURCE // memfd_create
+
+#include "shm.h"
+#include "convert.h"
+#include "log.h"
+#include "player.h"
+#include "stats.h"
+#include "util.h"
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+
+#include "viewporter-client-protocol.h"
+
+#define SHM_BUFFERS 3 // one on screen, one queued in the compositor, one being converted
+#define SHM_CONVERT_TILES 4
+
+struct ShmBuffer
+{
+    struct wl_buffer * buffer;
+    uint8_t * data;
+    atomic_int busy; // attached and not yet released; cleared on the Wayland dispatch thread
+};
+
+struct Shm
+{
+    struct wl_display * display;
+    struct wl_shm * shm;
+    struct wl_surface * surface;
+    struct wp_viewport * viewport;
+    struct Player * player;
+    struct TaskPool * workers;
+
+    int surfaceWidth;
+    int surfaceHeight;
+
+    // One memfd holds every buffer; it's only replaced when the video size changes
+    int poolFd;
+    struct wl_shm_pool * pool;
+    uint8_t * poolData;
+    size_t poolSize;
+    struct ShmBuffer buffers[SHM_BUFFERS];
+    int bufferWidth;
+    int bufferHeight;
+    int bufferStride;
+
+    GstCaps * caps;
+    GstVideoInfo videoInfo;
+    struct ConvertParams convertParams;
+    int convertFormat; // enum ConvertFormat, -1 if the caps can't be converted
+
+    int destinationWidth; // last wp_viewport destination, -1 before the first
+    int destinationHeight;
+
+    GstSample * sample;
+    int samplePending; // not presented yet, e.g. because every buffer was busy
+    int sampleUnreported; // adopted but not yet reported to the player's QoS
+
+    unsigned long framesPresented;
+    unsigned long framesBlocked;
+    double cpuFrameMs;
+};
+
+static void shmBufferRelease(void * data, struct wl_buffer * buffer)
+{
+    struct ShmBuffer * shmBuffer = (struct ShmBuffer *)data;
+    atomic_store_explicit(&shmBuffer->busy, 0, memory_order_release);
+}
+
+static const struct wl_buffer_listener shmBufferListener = { shmBufferRelease };
+
+static void shmDestroyBuffers(struct Shm * shm)
+{
+    // The compositor keeps its own mapping, so buffers it still shows stay valid on its side
+    for (int bufferIndex = 0; bufferIndex < SHM_BUFFERS; ++bufferIndex) {
+        struct ShmBuffer * buffer = &shm->buffers[bufferIndex];
+        if (buffer->buffer) {
+            wl_buffer_destroy(buffer->buffer);
+        }
+        buffer->buffer = NULL;
+        buffer->data = NULL;
+        atomic_store_explicit(&buffer->busy, 0, memory_order_relaxed);
+    }
+    if (shm->pool) {
+        wl_shm_pool_destroy(shm->pool);
+        shm->pool = NULL;
+    }
+    if (shm->poolData) {
+        munmap(shm->poolData, shm->poolSize);
+        shm->poolData = NULL;
+    }
+    if (shm->poolFd >= 0) {
+        close(shm->poolFd);
+        shm->poolFd = -1;
+    }
+    shm->poolSize = 0;
+    shm->bufferWidth = 0;
+    shm->bufferHeight = 0;
+}
+
+// (Re)creates the buffers if the video size changed
+// returns non-zero on success
+static int shmEnsureBuffers(struct Shm * shm, int width, int height)
+{
+    if (shm->pool && (shm->bufferWidth == width) && (shm->bufferHeight == height)) {
+        return 1;
+    }
+    shmDestroyBuffers(shm);
+
+    int stride = width * 4;
+    size_t bufferSize = (size_t)stride * height;
+    size_t poolSize = bufferSize * SHM_BUFFERS;
+    if (poolSize > INT32_MAX) {
+        LOG_ERROR("shm: %dx%d buffers are too large", width, height);
+        return 0;
+    }
+
+    shm->poolFd = memfd_create("vaat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm->poolFd < 0) {
+        LOG_ERROR("shm: memfd_create() failed");
+        return 0;
+    }
+    if (ftruncate(shm->poolFd, (off_t)poolSize) < 0) {
+        LOG_ERROR("shm: ftruncate() failed");
+        shmDestroyBuffers(shm);
+        return 0;
+    }
+    fcntl(shm->poolFd, F_ADD_SEALS, F_SEAL_SHRINK); // the compositor may rely on the size never going down
+
+    void * data = mmap(NULL, poolSize, PROT_READ | PROT_WRITE, MAP_SHARED, shm->poolFd, 0);
+    if (data == MAP_FAILED) {
+        LOG_ERROR("shm: mmap() failed");
+        shmDestroyBuffers(shm);
+        return 0;
+    }
+    shm->poolData = (uint8_t *)data;
+    shm->poolSize = poolSize;
+
+    shm->pool = wl_shm_create_pool(shm->shm, shm->poolFd, (int32_t)poolSize);
+    for (int bufferIndex = 0; bufferIndex < SHM_BUFFERS; ++bufferIndex) {
+        struct ShmBuffer * buffer = &shm->buffers[bufferIndex];
+        size_t offset = bufferSize * bufferIndex;
+        buffer->buffer = wl_shm_pool_create_buffer(shm->pool, (int32_t)offset, width, height, stride, WL_SHM_FORMAT_XRGB8888);
+        buffer->data = shm->poolData + offset;
+        wl_buffer_add_listener(buffer->buffer, &shmBufferListener, buffer);
+    }
+
+    shm->bufferWidth = width;
+    shm->bufferHeight = height;
+    shm->bufferStride = stride;
+    LOG_INFO("shm: %d buffers of %dx%d", SHM_BUFFERS, width, height);
+    return 1;
+}
+
+static struct ShmBuffer * shmFindFreeBuffer(struct Shm * shm)
+{
+    for (int bufferIndex = 0; bufferIndex < SHM_BUFFERS; ++bufferIndex) {
+        struct ShmBuffer * buffer = &shm->buffers[bufferIndex];
+        if (!atomic_load_explicit(&buffer->busy, memory_order_acquire)) {
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+// Formats the CPU converter reads; decoders with DMA-BUF only output are mapped like any other memory
+static GstCaps * shmCreateSinkCaps(void)
+{
+    return gst_caps_from_string("video/x-raw, format=(string){ NV12, NV21, P010_10LE }");
+}
+
+// Parses |caps| and picks conversion parameters; formatting and parsing caps allocates, so only when they change
+// returns non-zero if the current caps can be converted
+static int shmUpdateVideoInfo(struct Shm * shm, GstCaps * caps)
+{
+    if (shm->caps && gst_caps_is_equal(caps, shm->caps)) {
+        return shm->convertFormat >= 0;
+    }
+
+    gchar * capsString = gst_caps_to_string(caps);
+    LOG_INFO("shm: video caps: %s", capsString);
+    statsSetCaps(capsString);
+    g_free(capsString);
+
+    gst_caps_replace(&shm->caps, caps);
+    shm->convertFormat = -1;
+    if (!gst_video_info_from_caps(&shm->videoInfo, caps)) {
+        LOG_ERROR("shm: failed to get video info from caps");
+        return 0;
+    }
+
+    switch (GST_VIDEO_INFO_FORMAT(&shm->videoInfo)) {
+        case GST_VIDEO_FORMAT_NV12:
+            shm->convertFormat = CONVERT_FORMAT_NV12;
+            break;
+        case GST_VIDEO_FORMAT_NV21:
+            shm->convertFormat = CONVERT_FORMAT_NV21;
+            break;
+        case GST_VIDEO_FORMAT_P010_10LE:
+            shm->convertFormat = CONVERT_FORMAT_P010;
+            break;
+        default:
+            LOG_ERROR("shm: can't convert %s", gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&shm->videoInfo)));
+            return 0;
+    }
+
+    struct ConvertColorimetry colorimetry;
+    convertReadColorimetry(&GST_VIDEO_INFO_COLORIMETRY(&shm->videoInfo), &colorimetry);
+    convertInitParams(&shm->convertParams, &colorimetry, shm->convertFormat, CONVERT_OUTPUT_XRGB8888, CONVERT_ISA_BEST);
+    LOG_INFO("shm: converting with %s", convertIsaName(shm->convertParams.isa));
+    return 1;
+}
+
+// Scales the buffer to the largest size with the video's display aspect ratio that fits the surface
+static void shmUpdateDestination(struct Shm * shm, int width, int height)
+{
+    if (!shm->viewport) {
+        return;
+    }
+
+    int parN = (GST_VIDEO_INFO_PAR_N(&shm->videoInfo) > 0) ? GST_VIDEO_INFO_PAR_N(&shm->videoInfo) : 1;
+    int parD = (GST_VIDEO_INFO_PAR_D(&shm->videoInfo) > 0) ? GST_VIDEO_INFO_PAR_D(&shm->videoInfo) : 1;
+    double videoAspect = ((double)width * parN) / ((double)height * parD);
+    double surfaceAspect = (double)shm->surfaceWidth / (double)shm->surfaceHeight;
+
+    int destinationWidth = shm->surfaceWidth;
+    int destinationHeight = shm->surfaceHeight;
+    if (videoAspect > surfaceAspect) {
+        destinationHeight = (int)(((double)shm->surfaceWidth / videoAspect) + 0.5);
+    } else {
+        destinationWidth = (int)(((double)shm->surfaceHeight * videoAspect) + 0.5);
+    }
+    if (destinationWidth < 1) {
+        destinationWidth = 1;
+    }
+    if (destinationHeight < 1) {
+        destinationHeight = 1;
+    }
+
+    // Double buffered surface state, so only sent when it changes and applied by the next commit
+    if ((destinationWidth != shm->destinationWidth) || (destinationHeight != shm->destinationHeight)) {
+        wp_viewport_set_destination(shm->viewport, destinationWidth, destinationHeight);
+        shm->destinationWidth = destinationWidth;
+        shm->destinationHeight = destinationHeight;
+    }
+}
+
+struct Shm * shmCreate(struct wl_display * display,
+                       struct wl_shm * wlShm,
+                       struct wl_surface * surface,
+                       struct wp_viewport * viewport,
+                       int width,
+                       int height,
+                       struct Player * player,
+                       struct TaskPool * workers)
+{
+    struct Shm * shm = calloc(1, sizeof(struct Shm));
+    shm->display = display;
+    shm->shm = wlShm;
+    shm->surface = surface;
+    shm->viewport = viewport;
+    shm->player = player;
+    shm->workers = workers;
+    shm->surfaceWidth = width;
+    shm->surfaceHeight = height;
+    shm->poolFd = -1;
+    shm->convertFormat = -1;
+    shm->destinationWidth = -1;
+    shm->destinationHeight = -1;
+
+    if (!viewport) {
+        LOG_WARN("shm: no wp_viewporter, so frames are shown at their native size");
+    }
+
+    GstCaps * sinkCaps = shmCreateSinkCaps();
+    playerSetCaps(player, sinkCaps);
+    gst_caps_unref(sinkCaps);
+    return shm;
+}
+
+void shmDestroy(struct Shm * shm)
+{
+    if (!shm)
+        return;
+
+    if (shm->sample) {
+        playerReleaseSample(shm->player, shm->sample);
+    }
+    gst_caps_replace(&shm->caps, NULL);
+    shmDestroyBuffers(shm);
+    free(shm);
+}
+
+void shmResize(struct Shm * shm, int width, int height)
+{
+    shm->surfaceWidth = width;
+    shm->surfaceHeight = height;
+    if (shm->sample) {
+        shm->samplePending = 1; // re-present with the new destination
+    }
+}
+
+int shmRender(struct Shm * shm)
+{
+    uint64_t const frameStart = timeNowNs();
+
+    GstSample * sample = playerAdoptSample(shm->player);
+    if (sample) {
+        if (shm->sample) {
+            playerReleaseSample(shm->player, shm->sample);
+        }
+        shm->sample = sample;
+        shm->samplePending = 1;
+        shm->sampleUnreported = 1;
+    }
+    if (!shm->samplePending) {
+        return 0;
+    }
+
+    GstBuffer * gstBuffer = gst_sample_get_buffer(shm->sample);
+    if (!shmUpdateVideoInfo(shm, gst_sample_get_caps(shm->sample))) {
+        shm->samplePending = 0;
+        return 0;
+    }
+
+    // Only the visible region is converted; chroma is subsampled, so it has to start on an even pixel. Crop meta is
+    // relative to the coded size, which is the video meta's if the caps only have the visible one
+    gint videoWidth = GST_VIDEO_INFO_WIDTH(&shm->videoInfo);
+    gint videoHeight = GST_VIDEO_INFO_HEIGHT(&shm->videoInfo);
+    GstVideoMeta * videoMeta = gst_buffer_get_video_meta(gstBuffer);
+    if (videoMeta && (videoMeta->width > 0) && (videoMeta->height > 0)) {
+        videoWidth = (gint)videoMeta->width;
+        videoHeight = (gint)videoMeta->height;
+    }
+    gint cropX = 0;
+    gint cropY = 0;
+    gint cropWidth = videoWidth;
+    gint cropHeight = videoHeight;
+    GstVideoCropMeta * cropMeta = gst_buffer_get_video_crop_meta(gstBuffer);
+    if (cropMeta && (cropMeta->width > 0) && (cropMeta->height > 0) && ((gint)(cropMeta->x + cropMeta->width) <= videoWidth)
+        && ((gint)(cropMeta->y + cropMeta->height) <= videoHeight)) {
+        cropX = (gint)cropMeta->x & ~1;
+        cropY = (gint)cropMeta->y & ~1;
+        // Widened by what rounding the start down took off, so the right and bottom edges stay where they were
+        cropWidth = (gint)cropMeta->width + ((gint)cropMeta->x - cropX);
+        cropHeight = (gint)cropMeta->height + ((gint)cropMeta->y - cropY);
+        cropWidth = (cropWidth > videoWidth - cropX) ? (videoWidth - cropX) : cropWidth;
+        cropHeight = (cropHeight > videoHeight - cropY) ? (videoHeight - cropY) : cropHeight;
+    }
+
+    if (!shmEnsureBuffers(shm, cropWidth, cropHeight)) {
+        shm->samplePending = 0;
+        return 0;
+    }
+
+    // Try again on the next call rather than waiting for the compositor here
+    struct ShmBuffer * buffer = shmFindFreeBuffer(shm);
+    if (!buffer) {
+        if (sample) {
+            ++shm->framesBlocked;
+        }
+        return 0;
+    }
+
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, &shm->videoInfo, gstBuffer, GST_MAP_READ)) {
+        LOG_ERROR_EVERY(1000, "shm: failed to map video frame");
+        shm->samplePending = 0;
+        return 0;
+    }
+
+    int sampleBytes = (shm->convertFormat == CONVERT_FORMAT_P010) ? 2 : 1;
+    struct ConvertFrame convertFrame;
+    convertFrame.width = cropWidth;
+    convertFrame.height = cropHeight;
+    for (int plane = 0; plane < 2; ++plane) {
+        int stride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, plane);
+        int rows = (plane == 0) ? cropY : (cropY / 2);
+        convertFrame.planes[plane] = (const uint8_t *)GST_VIDEO_FRAME_PLANE_DATA(&frame, plane) + ((size_t)rows * stride) + (cropX * sampleBytes);
+        convertFrame.strides[plane] = stride;
+    }
+    convertFrameTiled(shm->workers, SHM_CONVERT_TILES, &shm->convertParams, &convertFrame, buffer->data, shm->bufferStride);
+    gst_video_frame_unmap(&frame);
+
+    shmUpdateDestination(shm, cropWidth, cropHeight);
+    atomic_store_explicit(&buffer->busy, 1, memory_order_relaxed);
+    wl_surface_attach(shm->surface, buffer->buffer, 0, 0);
+    wl_surface_damage_buffer(shm->surface, 0, 0, cropWidth, cropHeight);
+    wl_surface_commit(shm->surface);
+    wl_display_flush(shm->display); // nothing like eglSwapBuffers() does it for us
+
+    uint64_t const cpuNs = timeNowNs() - frameStart;
+    double const cpuMs = (double)cpuNs / 1000000.0;
+    statsObserve(STATS_LATENCY_RENDER, cpuNs);
+    shm->cpuFrameMs = (shm->cpuFrameMs > 0.0) ? ((shm->cpuFrameMs * 7.0) + cpuMs) / 8.0 : cpuMs;
+    ++shm->framesPresented;
+    shm->samplePending = 0;
+    if (shm->sampleUnreported) {
+        playerReportPresented(shm->player, shm->sample);
+        shm->sampleUnreported = 0;
+    }
+    return 1;
+}
+
+void shmGetStats(struct Shm * shm, struct ShmStats * stats)
+{
+    stats->framesPresented = shm->framesPresented;
+    stats->framesBlocked = shm->framesBlocked;
+    stats->cpuFrameMs = shm->cpuFrameMs;
+    stats->convertIsa = shm->convertParams.isa;
+}
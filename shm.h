@@ -0,0 +1,41 @@
+#ifndef VAAT_SHM_H
+#define VAAT_SHM_H
+
+struct wl_display;
+struct wl_shm;
+struct wl_surface;
+struct wp_viewport;
+struct Player;
+struct TaskPool;
+
+// Software presentation for when EGL isn't available: frames are converted on the CPU at their native size
+// into wl_shm buffers and scaled by the compositor through wp_viewporter.
+
+struct ShmStats
+{
+    unsigned long framesPresented;
+    unsigned long framesBlocked; // new frames that waited because every buffer was still held by the compositor
+    double cpuFrameMs; // smoothed conversion and commit time
+    int convertIsa; // enum ConvertIsa
+};
+
+// |workers| (optional) share the conversion with the render thread
+struct Shm * shmCreate(struct wl_display * display,
+                       struct wl_shm * shm,
+                       struct wl_surface * surface,
+                       struct wp_viewport * viewport,
+                       int width,
+                       int height,
+                       struct Player * player,
+                       struct TaskPool * workers);
+void shmDestroy(struct Shm * shm);
+
+void shmResize(struct Shm * shm, int width, int height);
+
+// converts and commits only if there is a new frame
+// returns non-zero if a frame was presented
+int shmRender(struct Shm * shm);
+
+void shmGetStats(struct Shm * shm, struct ShmStats * stats);
+
+#endif
@@ -0,0 +1,536 @@
+#include "stats.h"
+#include "log.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------------
+// Per-thread blocks: the owning thread is the only writer, whoever scrapes only reads
+
+#define STATS_BUCKET_COUNT 12 // the last one is +Inf
+#define STATS_CAPS_SIZE 1024
+
+// Upper bounds in microseconds, from well inside a frame to several frames at 30fps
+static const uint64_t statsBucketBoundsUs[STATS_BUCKET_COUNT - 1] = { 100, 250, 500, 1000, 2000, 4000, 8000, 16000, 33000, 66000, 133000 };
+
+struct StatsBlock
+{
+    struct StatsBlock * next;
+    atomic_uint_fast64_t counters[STATS_COUNTER_COUNT];
+    atomic_uint_fast64_t buckets[STATS_HISTOGRAM_COUNT][STATS_BUCKET_COUNT];
+    atomic_uint_fast64_t sumsNs[STATS_HISTOGRAM_COUNT];
+};
+
+static struct
+{
+    pthread_mutex_t blocksMutex; // guards the list, not the blocks' contents
+    struct StatsBlock * blocks;
+
+    atomic_int_fast64_t gauges[STATS_GAUGE_COUNT];
+    atomic_int disabled;
+
+    pthread_mutex_t capsMutex;
+    char caps[STATS_CAPS_SIZE];
+} statsState = {
+    .blocksMutex = PTHREAD_MUTEX_INITIALIZER,
+    .capsMutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct StatsBlock * statsThreadBlock;
+
+// The one allocation a thread makes for its metrics, on its first; kept after it exits so totals never go backwards
+static struct StatsBlock * statsRegisterThread(void)
+{
+    struct StatsBlock * block = calloc(1, sizeof(struct StatsBlock));
+    if (!block) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&statsState.blocksMutex);
+    block->next = statsState.blocks;
+    statsState.blocks = block;
+    pthread_mutex_unlock(&statsState.blocksMutex);
+
+    statsThreadBlock = block;
+    return block;
+}
+
+// A single writer needs no locked add, only a store the reader can't see torn
+static inline void statsBump(atomic_uint_fast64_t * value, uint64_t amount)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void statsSetEnabled(int enabled)
+{
+    atomic_store_explicit(&statsState.disabled, !enabled, memory_order_relaxed);
+}
+
+void statsAdd(int counter, uint64_t count)
+{
+    if (atomic_load_explicit(&statsState.disabled, memory_order_relaxed)) {
+        return;
+    }
+    struct StatsBlock * block = statsThreadBlock ? statsThreadBlock : statsRegisterThread();
+    if (block) {
+        statsBump(&block->counters[counter], count);
+    }
+}
+
+void statsObserve(int histogram, uint64_t ns)
+{
+    if (atomic_load_explicit(&statsState.disabled, memory_order_relaxed)) {
+        return;
+    }
+    struct StatsBlock * block = statsThreadBlock ? statsThreadBlock : statsRegisterThread();
+    if (!block) {
+        return;
+    }
+
+    int bucket = 0;
+    while ((bucket < STATS_BUCKET_COUNT - 1) && (ns > statsBucketBoundsUs[bucket] * 1000ull)) {
+        ++bucket;
+    }
+    statsBump(&block->buckets[histogram][bucket], 1);
+    statsBump(&block->sumsNs[histogram], ns);
+}
+
+void statsSetGauge(int gauge, int64_t value)
+{
+    atomic_store_explicit(&statsState.gauges[gauge], value, memory_order_relaxed);
+}
+
+void statsSetCaps(const char * caps)
+{
+    pthread_mutex_lock(&statsState.capsMutex);
+    snprintf(statsState.caps, sizeof(statsState.caps), "%s", caps ? caps : "");
+    pthread_mutex_unlock(&statsState.capsMutex);
+}
+
+// --------------------------------------------------------------------------------------
+// Snapshot
+
+struct StatsSnapshot
+{
+    uint64_t counters[STATS_COUNTER_COUNT];
+    uint64_t buckets[STATS_HISTOGRAM_COUNT][STATS_BUCKET_COUNT];
+    uint64_t sumsNs[STATS_HISTOGRAM_COUNT];
+    int64_t gauges[STATS_GAUGE_COUNT];
+    char caps[STATS_CAPS_SIZE];
+};
+
+static void statsTakeSnapshot(struct StatsSnapshot * snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    pthread_mutex_lock(&statsState.blocksMutex);
+    struct StatsBlock * blocks = statsState.blocks;
+    pthread_mutex_unlock(&statsState.blocksMutex);
+
+    // Blocks are only ever added at the head, so the snapshot stays valid while we walk it
+    for (struct StatsBlock * block = blocks; block; block = block->next) {
+        for (int counter = 0; counter < STATS_COUNTER_COUNT; ++counter) {
+            snapshot->counters[counter] += atomic_load_explicit(&block->counters[counter], memory_order_relaxed);
+        }
+        for (int histogram = 0; histogram < STATS_HISTOGRAM_COUNT; ++histogram) {
+            for (int bucket = 0; bucket < STATS_BUCKET_COUNT; ++bucket) {
+                snapshot->buckets[histogram][bucket] += atomic_load_explicit(&block->buckets[histogram][bucket], memory_order_relaxed);
+            }
+            snapshot->sumsNs[histogram] += atomic_load_explicit(&block->sumsNs[histogram], memory_order_relaxed);
+        }
+    }
+    for (int gauge = 0; gauge < STATS_GAUGE_COUNT; ++gauge) {
+        snapshot->gauges[gauge] = atomic_load_explicit(&statsState.gauges[gauge], memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&statsState.capsMutex);
+    memcpy(snapshot->caps, statsState.caps, sizeof(snapshot->caps));
+    pthread_mutex_unlock(&statsState.capsMutex);
+}
+
+// --------------------------------------------------------------------------------------
+// Formatting
+
+struct StatsMetricInfo
+{
+    const char * name;
+    const char * type;
+    const char * help;
+};
+
+static const struct StatsMetricInfo statsCounterInfo[STATS_COUNTER_COUNT] = {
+    { "frames_decoded", "counter", "Samples the decoder handed to the appsink" },
+    { "frames_adopted", "counter", "Samples taken by the renderer" },
+    { "frames_presented", "counter", "Samples presented" },
+    { "frames_dropped", "counter", "Samples decoded but replaced before the renderer got to them" },
+    { "frames_skipped", "counter", "Samples decoded on the way to a seek target and dropped unseen" },
+    { "import_cache_hits", "counter", "Samples whose dmabufs already had EGLImages" },
+    { "import_cache_misses", "counter", "Samples whose dmabufs had to be imported" },
+};
+
+static const struct StatsMetricInfo statsGaugeInfo[STATS_GAUGE_COUNT] = {
+    { "frames_dropped_upstream", "counter", "Frames the decoder reported dropping in QoS messages" },
+    { "decoder_buffers_held", "gauge", "Decoder buffers held by the player and renderer" },
+    { "decoder_pool_size", "gauge", "Buffers in the decoder's pool, 0 if unknown" },
+    { "render_quality", "gauge", "Render quality level, 0 is full" },
+};
+
+// Histograms share a metric and differ by a label
+static const struct
+{
+    const char * metric;
+    const char * label;
+    const char * value;
+} statsHistogramInfo[STATS_HISTOGRAM_COUNT] = {
+    { "stage_latency_seconds", "stage", "queue" },
+    { "stage_latency_seconds", "stage", "render" },
+    { "stage_latency_seconds", "stage", "swap" },
+    { "stage_latency_seconds", "stage", "present" },
+    { "gpu_pass_seconds", "pass", "convert" },
+    { "gpu_pass_seconds", "pass", "present" },
+};
+
+struct StatsText
+{
+    char * text;
+    size_t size;
+    size_t length;
+};
+
+static void statsAppend(struct StatsText * out, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+static void statsAppend(struct StatsText * out, const char * format, ...)
+{
+    if (out->length + 1 >= out->size) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int ret = vsnprintf(out->text + out->length, out->size - out->length, format, args);
+    va_end(args);
+    if (ret > 0) {
+        out->length += (size_t)ret;
+        if (out->length >= out->size) {
+            out->length = out->size - 1;
+        }
+    }
+}
+
+// Quotes |string| for a Prometheus label value or a JSON string; the rules overlap for what caps and thread names contain
+static void statsAppendQuoted(struct StatsText * out, const char * string)
+{
+    statsAppend(out, "\"");
+    for (; *string; ++string) {
+        if ((*string == '"') || (*string == '\\')) {
+            statsAppend(out, "\\%c", *string);
+        } else if (*string == '\n') {
+            statsAppend(out, "\\n");
+        } else if ((unsigned char)*string >= 0x20) {
+            statsAppend(out, "%c", *string);
+        }
+    }
+    statsAppend(out, "\"");
+}
+
+static double statsBucketBoundSeconds(int bucket)
+{
+    return (double)statsBucketBoundsUs[bucket] / 1000000.0;
+}
+
+// Calls |func| with each thread's name, id and CPU seconds from /proc
+typedef void (*StatsThreadFunc)(struct StatsText * out, const char * name, int tid, double cpuSeconds, int first);
+
+static void statsForEachThread(struct StatsText * out, StatsThreadFunc func)
+{
+    DIR * tasks = opendir("/proc/self/task");
+    if (!tasks) {
+        return;
+    }
+
+    double ticksPerSecond = (double)sysconf(_SC_CLK_TCK);
+    int first = 1;
+    struct dirent * entry;
+    while ((entry = readdir(tasks)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        char path[sizeof(entry->d_name) + 32];
+        char stat[512];
+        snprintf(path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name);
+        FILE * file = fopen(path, "r");
+        if (!file) {
+            continue; // exited meanwhile
+        }
+        size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+        fclose(file);
+        stat[length] = '\0';
+
+        // "tid (comm) state ..." where comm may hold anything, parentheses included
+        char * open = strchr(stat, '(');
+        char * close = strrchr(stat, ')');
+        unsigned long long utime, stime;
+        if (!open || !close || (close < open)
+            || (sscanf(close + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)) {
+            continue;
+        }
+        *close = '\0';
+
+        func(out, open + 1, atoi(entry->d_name), (double)(utime + stime) / ticksPerSecond, first);
+        first = 0;
+    }
+    closedir(tasks);
+}
+
+static void statsAppendPrometheusThread(struct StatsText * out, const char * name, int tid, double cpuSeconds, int first)
+{
+    if (first) {
+        statsAppend(out, "# HELP vaat_thread_cpu_seconds_total CPU time per thread\n");
+        statsAppend(out, "# TYPE vaat_thread_cpu_seconds_total counter\n");
+    }
+    statsAppend(out, "vaat_thread_cpu_seconds_total{thread=");
+    statsAppendQuoted(out, name);
+    statsAppend(out, ",tid=\"%d\"} %.2f\n", tid, cpuSeconds);
+}
+
+static void statsAppendJsonThread(struct StatsText * out, const char * name, int tid, double cpuSeconds, int first)
+{
+    statsAppend(out, "%s{\"tid\":%d,\"name\":", first ? "" : ",", tid);
+    statsAppendQuoted(out, name);
+    statsAppend(out, ",\"cpu_seconds\":%.2f}", cpuSeconds);
+}
+
+static void statsFormatPrometheus(const struct StatsSnapshot * snapshot, struct StatsText * out)
+{
+    for (int counter = 0; counter < STATS_COUNTER_COUNT; ++counter) {
+        const struct StatsMetricInfo * info = &statsCounterInfo[counter];
+        statsAppend(out, "# HELP vaat_%s_total %s\n# TYPE vaat_%s_total counter\n", info->name, info->help, info->name);
+        statsAppend(out, "vaat_%s_total %llu\n", info->name, (unsigned long long)snapshot->counters[counter]);
+    }
+    for (int gauge = 0; gauge < STATS_GAUGE_COUNT; ++gauge) {
+        const struct StatsMetricInfo * info = &statsGaugeInfo[gauge];
+        const char * suffix = strcmp(info->type, "counter") ? "" : "_total";
+        statsAppend(out, "# HELP vaat_%s%s %s\n# TYPE vaat_%s%s %s\n", info->name, suffix, info->help, info->name, suffix, info->type);
+        statsAppend(out, "vaat_%s%s %lld\n", info->name, suffix, (long long)snapshot->gauges[gauge]);
+    }
+
+    uint64_t imports = snapshot->counters[STATS_IMPORT_CACHE_HITS] + snapshot->counters[STATS_IMPORT_CACHE_MISSES];
+    statsAppend(out, "# HELP vaat_import_cache_hit_ratio Share of samples whose dmabufs already had EGLImages\n");
+    statsAppend(out, "# TYPE vaat_import_cache_hit_ratio gauge\n");
+    statsAppend(out, "vaat_import_cache_hit_ratio %.4f\n", imports ? (double)snapshot->counters[STATS_IMPORT_CACHE_HITS] / imports : NAN);
+
+    for (int histogram = 0; histogram < STATS_HISTOGRAM_COUNT; ++histogram) {
+        const char * metric = statsHistogramInfo[histogram].metric;
+        const char * label = statsHistogramInfo[histogram].label;
+        const char * value = statsHistogramInfo[histogram].value;
+        if ((histogram == 0) || strcmp(metric, statsHistogramInfo[histogram - 1].metric)) {
+            statsAppend(out, "# TYPE vaat_%s histogram\n", metric);
+        }
+
+        uint64_t cumulative = 0;
+        for (int bucket = 0; bucket < STATS_BUCKET_COUNT; ++bucket) {
+            cumulative += snapshot->buckets[histogram][bucket];
+            if (bucket < STATS_BUCKET_COUNT - 1) {
+                statsAppend(out, "vaat_%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", metric, label, value, statsBucketBoundSeconds(bucket), (unsigned long long)cumulative);
+            } else {
+                statsAppend(out, "vaat_%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", metric, label, value, (unsigned long long)cumulative);
+            }
+        }
+        statsAppend(out, "vaat_%s_sum{%s=\"%s\"} %.6f\n", metric, label, value, (double)snapshot->sumsNs[histogram] / 1000000000.0);
+        statsAppend(out, "vaat_%s_count{%s=\"%s\"} %llu\n", metric, label, value, (unsigned long long)cumulative);
+    }
+
+    statsForEachThread(out, statsAppendPrometheusThread);
+
+    statsAppend(out, "# HELP vaat_pipeline_info The caps currently negotiated with the decoder\n# TYPE vaat_pipeline_info gauge\n");
+    statsAppend(out, "vaat_pipeline_info{caps=");
+    statsAppendQuoted(out, snapshot->caps);
+    statsAppend(out, "} 1\n");
+}
+
+static void statsFormatJson(const struct StatsSnapshot * snapshot, struct StatsText * out)
+{
+    statsAppend(out, "{\"counters\":{");
+    for (int counter = 0; counter < STATS_COUNTER_COUNT; ++counter) {
+        statsAppend(out, "%s\"%s\":%llu", counter ? "," : "", statsCounterInfo[counter].name, (unsigned long long)snapshot->counters[counter]);
+    }
+    statsAppend(out, "},\"gauges\":{");
+    for (int gauge = 0; gauge < STATS_GAUGE_COUNT; ++gauge) {
+        statsAppend(out, "%s\"%s\":%lld", gauge ? "," : "", statsGaugeInfo[gauge].name, (long long)snapshot->gauges[gauge]);
+    }
+
+    uint64_t imports = snapshot->counters[STATS_IMPORT_CACHE_HITS] + snapshot->counters[STATS_IMPORT_CACHE_MISSES];
+    if (imports) {
+        statsAppend(out, "},\"import_cache_hit_ratio\":%.4f", (double)snapshot->counters[STATS_IMPORT_CACHE_HITS] / imports);
+    } else {
+        statsAppend(out, "},\"import_cache_hit_ratio\":null");
+    }
+
+    statsAppend(out, ",\"histograms\":[");
+    for (int histogram = 0; histogram < STATS_HISTOGRAM_COUNT; ++histogram) {
+        uint64_t count = 0;
+        statsAppend(out,
+                    "%s{\"metric\":\"%s\",\"%s\":\"%s\",\"buckets\":[",
+                    histogram ? "," : "",
+                    statsHistogramInfo[histogram].metric,
+                    statsHistogramInfo[histogram].label,
+                    statsHistogramInfo[histogram].value);
+        for (int bucket = 0; bucket < STATS_BUCKET_COUNT; ++bucket) {
+            count += snapshot->buckets[histogram][bucket];
+            if (bucket < STATS_BUCKET_COUNT - 1) {
+                statsAppend(out, "%s{\"le\":%g,\"count\":%llu}", bucket ? "," : "", statsBucketBoundSeconds(bucket), (unsigned long long)count);
+            } else {
+                statsAppend(out, ",{\"le\":null,\"count\":%llu}", (unsigned long long)count);
+            }
+        }
+        statsAppend(out, "],\"sum\":%.6f,\"count\":%llu}", (double)snapshot->sumsNs[histogram] / 1000000000.0, (unsigned long long)count);
+    }
+
+    statsAppend(out, "],\"threads\":[");
+    statsForEachThread(out, statsAppendJsonThread);
+    statsAppend(out, "],\"caps\":");
+    statsAppendQuoted(out, snapshot->caps);
+    statsAppend(out, "}\n");
+}
+
+size_t statsFormat(int format, char * text, size_t size)
+{
+    struct StatsSnapshot snapshot;
+    statsTakeSnapshot(&snapshot);
+
+    struct StatsText out = { text, size, 0 };
+    if (size > 0) {
+        text[0] = '\0';
+    }
+    if (format == STATS_FORMAT_JSON) {
+        statsFormatJson(&snapshot, &out);
+    } else {
+        statsFormatPrometheus(&snapshot, &out);
+    }
+    return out.length;
+}
+
+// --------------------------------------------------------------------------------------
+// Server: one connection at a time on its own thread, HTTP/1.0 so curl --unix-socket and Prometheus proxies work
+
+#define STATS_REQUEST_SIZE 1024
+#define STATS_RESPONSE_SIZE 131072
+#define STATS_REQUEST_TIMEOUT_MS 1000
+
+struct StatsServer
+{
+    struct SocketServer * socket;
+
+    char request[STATS_REQUEST_SIZE];
+    char response[STATS_RESPONSE_SIZE];
+};
+
+static void statsRespond(int fd, const char * status, const char * contentType, const char * body, size_t bodySize)
+{
+    char header[256];
+    int headerSize = snprintf(header,
+                              sizeof(header),
+                              "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                              status,
+                              contentType,
+                              bodySize);
+    socketSendAll(fd, header, (size_t)headerSize);
+    socketSendAll(fd, body, bodySize);
+}
+
+// returns 1 once the request's headers are in, or the buffer is full; 0 if they don't come, -1 if the server stops
+static int statsReadRequest(struct StatsServer * server, int fd, int stopFd)
+{
+    size_t length = 0;
+    while (length < sizeof(server->request) - 1) {
+        struct pollfd pollFds[2] = { { fd, POLLIN, 0 }, { stopFd, POLLIN, 0 } };
+        if (poll(pollFds, 2, STATS_REQUEST_TIMEOUT_MS) <= 0) {
+            return 0;
+        }
+        if (pollFds[1].revents) {
+            return -1;
+        }
+        ssize_t ret = recv(fd, server->request + length, sizeof(server->request) - 1 - length, 0);
+        if (ret <= 0) {
+            return 0;
+        }
+        length += (size_t)ret;
+        server->request[length] = '\0';
+        if (strstr(server->request, "\r\n\r\n") || strstr(server->request, "\n\n")) {
+            return 1;
+        }
+    }
+    return 1; // only the request line matters
+}
+
+// returns zero once the server stops
+static int statsServeConnection(struct StatsServer * server, int fd, int stopFd)
+{
+    int status = statsReadRequest(server, fd, stopFd);
+    if (status <= 0) {
+        return status == 0;
+    }
+
+    char method[8];
+    char target[256];
+    if (sscanf(server->request, "%7s %255s", method, target) != 2) {
+        static const char badRequest[] = "bad request\n";
+        statsRespond(fd, "400 Bad Request", "text/plain", badRequest, sizeof(badRequest) - 1);
+        return 1;
+    }
+    if (strcmp(method, "GET") != 0) {
+        static const char notAllowed[] = "only GET\n";
+        statsRespond(fd, "405 Method Not Allowed", "text/plain", notAllowed, sizeof(notAllowed) - 1);
+        return 1;
+    }
+
+    char * query = strchr(target, '?');
+    if (query) {
+        *query = '\0';
+    }
+    if (!strcmp(target, "/metrics")) {
+        size_t size = statsFormat(STATS_FORMAT_PROMETHEUS, server->response, sizeof(server->response));
+        statsRespond(fd, "200 OK", "text/plain; version=0.0.4", server->response, size);
+    } else if (!strcmp(target, "/metrics.json")) {
+        size_t size = statsFormat(STATS_FORMAT_JSON, server->response, sizeof(server->response));
+        statsRespond(fd, "200 OK", "application/json", server->response, size);
+    } else {
+        static const char notFound[] = "try /metrics or /metrics.json\n";
+        statsRespond(fd, "404 Not Found", "text/plain", notFound, sizeof(notFound) - 1);
+    }
+    return 1;
+}
+
+struct StatsServer * statsServerCreate(const char * path, const struct TaskConfig * config)
+{
+    struct StatsServer * server = calloc(1, sizeof(struct StatsServer));
+    struct TaskConfig serverConfig = config ? *config : (struct TaskConfig) { 0 };
+    serverConfig.name = "vaat-stats";
+    server->socket = socketServerCreate(path, "stats", &serverConfig, (SocketServeFunc)statsServeConnection, server);
+    if (!server->socket) {
+        free(server);
+        return NULL;
+    }
+    LOG_INFO("stats: serving /metrics and /metrics.json on %s", path);
+    return server;
+}
+
+void statsServerDestroy(struct StatsServer * server)
+{
+    if (!server)
+        return;
+
+    socketServerDestroy(server->socket);
+    free(server);
+}
@@ -0,0 +1,72 @@
+#ifndef VAAT_STATS_H
+#define VAAT_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct TaskConfig;
+
+// Runtime metrics. Every thread counts into a block of its own, so recording is a couple of plain stores and
+// never waits for a reader; the endpoint sums the blocks when it's scraped.
+
+enum StatsCounter
+{
+    STATS_FRAMES_DECODED, // samples the decoder handed to the appsink
+    STATS_FRAMES_ADOPTED, // taken by the renderer
+    STATS_FRAMES_PRESENTED,
+    STATS_FRAMES_DROPPED, // decoded but replaced before the renderer got to them
+    STATS_FRAMES_SKIPPED, // decoded on the way to a seek target, never shown
+    STATS_IMPORT_CACHE_HITS,
+    STATS_IMPORT_CACHE_MISSES,
+    STATS_COUNTER_COUNT
+};
+
+// Last value wins; for values that have a single writer anyway
+enum StatsGauge
+{
+    STATS_GAUGE_FRAMES_DROPPED_UPSTREAM, // from the decoder's QoS messages
+    STATS_GAUGE_DECODER_BUFFERS_HELD, // the decoder's buffers we hold on to: pending, adopted and on their way back
+    STATS_GAUGE_DECODER_POOL_SIZE, // the decoder's buffer pool, 0 if unknown
+    STATS_GAUGE_QUALITY, // enum GfxQuality
+    STATS_GAUGE_COUNT
+};
+
+// Latencies in nanoseconds
+enum StatsHistogram
+{
+    STATS_LATENCY_QUEUE, // decoded until adopted
+    STATS_LATENCY_RENDER, // the renderer's own work for a frame, up to the swap
+    STATS_LATENCY_SWAP,
+    STATS_LATENCY_PRESENT, // decoded until swapped
+    STATS_GPU_CONVERT, // YCbCr to the RGB intermediate
+    STATS_GPU_PRESENT, // everything drawn into the window
+    STATS_HISTOGRAM_COUNT
+};
+
+enum StatsFormat
+{
+    STATS_FORMAT_PROMETHEUS,
+    STATS_FORMAT_JSON,
+};
+
+// Counters and histograms stand still while disabled, gauges still follow; enabled from the start
+void statsSetEnabled(int enabled);
+
+// The first call on a thread makes its one allocation
+void statsAdd(int counter, uint64_t count);
+void statsObserve(int histogram, uint64_t ns);
+void statsSetGauge(int gauge, int64_t value);
+
+// the current pipeline caps, as text; only when they change, it takes a lock
+void statsSetCaps(const char * caps);
+
+// writes everything recorded so far, including per thread CPU time, NUL terminated
+// returns the length, truncated to |size| - 1
+size_t statsFormat(int format, char * text, size_t size);
+
+// Serves GET /metrics (Prometheus text) and GET /metrics.json over HTTP on a Unix domain socket at |path|
+// returns NULL if it can't listen there
+struct StatsServer * statsServerCreate(const char * path, const struct TaskConfig * config);
+void statsServerDestroy(struct StatsServer * server);
+
+#endif
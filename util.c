@@ -1,18 +1,39 @@
+#define _GNU_SOURCE // pthread_setname_np, pthread_setaffinity_np, accept4
+
 #include "util.h"
+#include "log.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 // --------------------------------------------------------------------------------------
 
 void fatal(const char * reason)
 {
+    logFlush(); // whatever led up to this is still sitting in the rings
     printf("FATAL: %s\n", reason);
+    fflush(stdout);
     exit(-1);
 }
 
+uint64_t timeNowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ull) + (uint64_t)now.tv_nsec;
+}
+
 // --------------------------------------------------------------------------------------
 // Task
 
@@ -22,25 +43,147 @@ struct Task
     pthread_t pthread;
     void * userData;
     int joined;
+
+    int configured;
+    struct TaskConfig config;
+    char name[16];
 };
 
+static int taskSchedPolicy(int policy)
+{
+    switch (policy) {
+        case TASK_POLICY_FIFO:
+            return SCHED_FIFO;
+        case TASK_POLICY_RR:
+            return SCHED_RR;
+        default:
+            return SCHED_OTHER;
+    }
+}
+
+int taskConfigureCurrent(const struct TaskConfig * config)
+{
+    int ok = 1;
+    pthread_t self = pthread_self();
+
+    if (config->name) {
+        char name[16];
+        snprintf(name, sizeof(name), "%s", config->name);
+        pthread_setname_np(self, name);
+    }
+
+    if (config->cpuMask) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; ++cpu) {
+            if (config->cpuMask & (1ull << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        int ret = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+        if (ret != 0) {
+            LOG_WARN("taskConfigureCurrent(%s): can't set CPU mask 0x%llx: %s",
+                     config->name ? config->name : "",
+                     (unsigned long long)config->cpuMask,
+                     strerror(ret));
+            ok = 0;
+        }
+    }
+
+    int currentPolicy;
+    struct sched_param param;
+    pthread_getschedparam(self, &currentPolicy, &param);
+    int policy = taskSchedPolicy(config->policy);
+    int priority = (policy == SCHED_OTHER) ? 0 : config->priority;
+    if ((policy != currentPolicy) || (priority != param.sched_priority)) {
+        param.sched_priority = priority;
+        int ret = pthread_setschedparam(self, policy, &param);
+        if (ret != 0) {
+            // Keep running at normal priority rather than refusing to start
+            LOG_WARN("taskConfigureCurrent(%s): can't set %s priority %d: %s",
+                     config->name ? config->name : "",
+                     (policy == SCHED_FIFO) ? "SCHED_FIFO" : ((policy == SCHED_RR) ? "SCHED_RR" : "SCHED_OTHER"),
+                     priority,
+                     strerror(ret));
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+int taskParseCpuList(const char * list, uint64_t * cpuMask)
+{
+    uint64_t mask = 0;
+    const char * cursor = list;
+    while (*cursor) {
+        char * end;
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+        if (end == cursor) {
+            return 0;
+        }
+        cursor = end;
+        if (*cursor == '-') {
+            ++cursor;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor) {
+                return 0;
+            }
+            cursor = end;
+        }
+        if ((first < 0) || (last > 63) || (first > last)) {
+            return 0;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            mask |= 1ull << cpu;
+        }
+        if (*cursor == ',') {
+            ++cursor;
+        } else if (*cursor) {
+            return 0;
+        }
+    }
+
+    *cpuMask = mask;
+    return (mask != 0);
+}
+
 static void * taskThreadProc(void * userData)
 {
     struct Task * task = (struct Task *)userData;
+    if (task->configured) {
+        taskConfigureCurrent(&task->config);
+    }
     task->func(task->userData);
     pthread_exit(NULL);
 }
 
-struct Task * taskCreate(TaskFunc func, void * userData)
+struct Task * taskCreateWithConfig(const struct TaskConfig * config, TaskFunc func, void * userData)
 {
     struct Task * task = calloc(1, sizeof(struct Task));
     task->func = func;
     task->userData = userData;
     task->joined = 0;
+
+    // The thread applies its own config, so a refused real-time policy doesn't stop it from starting
+    if (config) {
+        task->configured = 1;
+        task->config = *config;
+        if (config->name) {
+            snprintf(task->name, sizeof(task->name), "%s", config->name);
+            task->config.name = task->name;
+        }
+    }
+
     pthread_create(&task->pthread, NULL, taskThreadProc, task);
     return task;
 }
 
+struct Task * taskCreate(TaskFunc func, void * userData)
+{
+    return taskCreateWithConfig(NULL, func, userData);
+}
+
 void taskJoin(struct Task * task)
 {
     if (!task->joined) {
@@ -54,3 +197,245 @@ void taskDestroy(struct Task * task)
     taskJoin(task);
     free(task);
 }
+
+// --------------------------------------------------------------------------------------
+// TaskPool
+
+struct TaskJob
+{
+    TaskFunc func;
+    void * userData;
+};
+
+struct TaskPool
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t jobAvailable;
+    pthread_cond_t jobsDone;
+
+    // Preallocated ring, so submitting never allocates
+    struct TaskJob * jobs;
+    int queueSize;
+    int head; // next job to run
+    int count; // queued, not yet taken
+    int running; // taken, not yet finished
+    int stopping;
+
+    struct Task ** threads;
+    int threadCount;
+};
+
+static void taskPoolWorker(struct TaskPool * pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->count && !pool->stopping) {
+            pthread_cond_wait(&pool->jobAvailable, &pool->mutex);
+        }
+        if (!pool->count) {
+            break; // stopping, and everything queued has been taken
+        }
+
+        struct TaskJob job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->queueSize;
+        --pool->count;
+        ++pool->running;
+        pthread_mutex_unlock(&pool->mutex);
+
+        job.func(job.userData);
+
+        pthread_mutex_lock(&pool->mutex);
+        --pool->running;
+        if (!pool->count && !pool->running) {
+            pthread_cond_broadcast(&pool->jobsDone);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+struct TaskPool * taskPoolCreate(const struct TaskConfig * config, int threadCount, int queueSize)
+{
+    struct TaskPool * pool = calloc(1, sizeof(struct TaskPool));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->jobAvailable, NULL);
+    pthread_cond_init(&pool->jobsDone, NULL);
+
+    pool->queueSize = (queueSize > 0) ? queueSize : 64;
+    pool->jobs = calloc((size_t)pool->queueSize, sizeof(struct TaskJob));
+    pool->threadCount = (threadCount > 0) ? threadCount : 1;
+    pool->threads = calloc((size_t)pool->threadCount, sizeof(struct Task *));
+
+    for (int threadIndex = 0; threadIndex < pool->threadCount; ++threadIndex) {
+        // Workers share the config, numbered so they can be told apart in top / perf
+        struct TaskConfig workerConfig = config ? *config : (struct TaskConfig){ 0 };
+        char name[32];
+        snprintf(name, sizeof(name), "%.12s-%d", (config && config->name) ? config->name : "pool", threadIndex);
+        workerConfig.name = name;
+        pool->threads[threadIndex] = taskCreateWithConfig(&workerConfig, (TaskFunc)taskPoolWorker, pool);
+    }
+    return pool;
+}
+
+void taskPoolDestroy(struct TaskPool * pool)
+{
+    if (!pool)
+        return;
+
+    // Queued jobs still run; their userData may own resources
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->jobAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int threadIndex = 0; threadIndex < pool->threadCount; ++threadIndex) {
+        taskDestroy(pool->threads[threadIndex]);
+    }
+
+    pthread_cond_destroy(&pool->jobsDone);
+    pthread_cond_destroy(&pool->jobAvailable);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool->jobs);
+    free(pool);
+}
+
+int taskPoolSubmit(struct TaskPool * pool, TaskFunc func, void * userData)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if ((pool->count == pool->queueSize) || pool->stopping) {
+        pthread_mutex_unlock(&pool->mutex);
+        return 0;
+    }
+
+    struct TaskJob * job = &pool->jobs[(pool->head + pool->count) % pool->queueSize];
+    job->func = func;
+    job->userData = userData;
+    ++pool->count;
+    pthread_cond_signal(&pool->jobAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+    return 1;
+}
+
+void taskPoolWait(struct TaskPool * pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count || pool->running) {
+        pthread_cond_wait(&pool->jobsDone, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// --------------------------------------------------------------------------------------
+// Socket servers
+
+struct SocketServer
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char name[16];
+    int listenFd;
+    int stopFd; // eventfd, readable once the thread should exit
+    struct Task * task;
+    SocketServeFunc serve;
+    void * userData;
+};
+
+static void socketServerThread(struct SocketServer * server)
+{
+    struct pollfd pollFds[2] = { { server->listenFd, POLLIN, 0 }, { server->stopFd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(pollFds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("%s: poll() failed: %s", server->name, strerror(errno));
+            return;
+        }
+        if (pollFds[1].revents) {
+            return;
+        }
+
+        int fd = accept4(server->listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        int more = server->serve(server->userData, fd, server->stopFd);
+        close(fd);
+        if (!more) {
+            return;
+        }
+    }
+}
+
+struct SocketServer * socketServerCreate(const char * path, const char * name, const struct TaskConfig * config, SocketServeFunc serve, void * userData)
+{
+    struct SocketServer * server = calloc(1, sizeof(struct SocketServer));
+    snprintf(server->name, sizeof(server->name), "%s", name);
+    if (strlen(path) >= sizeof(server->path)) {
+        LOG_ERROR("%s: socket path too long: %s", name, path);
+        free(server);
+        return NULL;
+    }
+    snprintf(server->path, sizeof(server->path), "%s", path);
+    server->serve = serve;
+    server->userData = userData;
+
+    // A socket left behind by a previous run would make bind() fail; anything else there is left alone
+    struct stat existing;
+    if ((stat(path, &existing) == 0) && S_ISSOCK(existing.st_mode)) {
+        unlink(path);
+    }
+
+    struct sockaddr_un address = { 0 };
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    server->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((server->listenFd < 0) || (bind(server->listenFd, (struct sockaddr *)&address, sizeof(address)) != 0)
+        || (listen(server->listenFd, 4) != 0)) {
+        LOG_ERROR("%s: can't listen on %s: %s", name, path, strerror(errno));
+        if (server->listenFd >= 0) {
+            close(server->listenFd);
+        }
+        free(server);
+        return NULL;
+    }
+
+    server->stopFd = eventfd(0, EFD_CLOEXEC);
+    if (server->stopFd < 0) {
+        fatal("eventfd() failed");
+    }
+    server->task = taskCreateWithConfig(config, (TaskFunc)socketServerThread, server);
+    return server;
+}
+
+void socketServerDestroy(struct SocketServer * server)
+{
+    if (!server)
+        return;
+
+    uint64_t one = 1;
+    if (write(server->stopFd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_WARN("%s: can't signal the thread to stop", server->name);
+    }
+    taskDestroy(server->task);
+    close(server->stopFd);
+    close(server->listenFd);
+    unlink(server->path);
+    free(server);
+}
+
+void socketSendAll(int fd, const void * data, size_t size)
+{
+    const char * bytes = data;
+    while (size > 0) {
+        ssize_t ret = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        bytes += ret;
+        size -= (size_t)ret;
+    }
+}
@@ -1,12 +1,72 @@
 #ifndef VAAT_UTIL_H
 #define VAAT_UTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 void fatal(const char * reason);
 
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t timeNowNs(void);
+
 typedef void (*TaskFunc)(void * userData);
 
+enum TaskPolicy
+{
+    TASK_POLICY_DEFAULT, // SCHED_OTHER, priority ignored
+    TASK_POLICY_FIFO,
+    TASK_POLICY_RR
+};
+
+// How a thread should be scheduled; zeroed keeps the name and CPUs and runs SCHED_OTHER
+struct TaskConfig
+{
+    const char * name; // at most 15 characters are kept, NULL keeps the current name
+    uint64_t cpuMask; // bit N allows CPU N, 0 keeps the current CPUs
+    int policy; // enum TaskPolicy; new threads would otherwise inherit a real-time creator's
+    int priority; // 1-99 for the real-time policies
+};
+
 struct Task * taskCreate(TaskFunc func, void * userData);
+struct Task * taskCreateWithConfig(const struct TaskConfig * config, TaskFunc func, void * userData);
 void taskJoin(struct Task * task);
 void taskDestroy(struct Task * task);
 
+// applies |config| to the calling thread, e.g. the main thread once it starts rendering
+// returns non-zero if everything could be applied; real-time policies usually need CAP_SYS_NICE
+int taskConfigureCurrent(const struct TaskConfig * config);
+
+// parses "0,2-3" into a CPU mask
+// returns non-zero on success
+int taskParseCpuList(const char * list, uint64_t * cpuMask);
+
+// A fixed set of worker threads taking jobs from a bounded queue, for background work that
+// mustn't run on (or wait for) the render thread
+struct TaskPool * taskPoolCreate(const struct TaskConfig * config, int threadCount, int queueSize);
+void taskPoolDestroy(struct TaskPool * pool);
+
+// queues |func| without blocking
+// returns non-zero if queued, 0 if the queue is full
+int taskPoolSubmit(struct TaskPool * pool, TaskFunc func, void * userData);
+
+// blocks until every job submitted so far has finished
+void taskPoolWait(struct TaskPool * pool);
+
+// A Unix domain stream socket served by a thread of its own, one client at a time
+
+// Runs on the server's thread for each client; |stopFd| turns readable once the server is being destroyed, so
+// anything waiting on |fd| should poll it too
+// returns zero to stop accepting clients
+typedef int (*SocketServeFunc)(void * userData, int fd, int stopFd);
+
+// Listens on |path| and serves clients on a thread started with |config|; |name| prefixes its log lines
+// returns NULL if it can't listen there
+struct SocketServer * socketServerCreate(const char * path, const char * name, const struct TaskConfig * config, SocketServeFunc serve, void * userData);
+
+// Stops the thread, then closes and removes the socket
+void socketServerDestroy(struct SocketServer * server);
+
+// Sends all of |data|, blocking; gives up quietly once the client has gone, without a SIGPIPE
+void socketSendAll(int fd, const void * data, size_t size);
+
 #endif